@@ -0,0 +1,1157 @@
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "proj1.h"
+
+/* Maximum number of files (and directories) sent in a batch */
+#define BATCH_MAX_FILES     (1 << 20)
+/* Number of files opened ahead of the one being sent, at most */
+#define BATCH_AHEAD         64
+
+/* A file (or directory) of a batch being sent */
+struct batch_file {
+    char *name;                  /* name as matched on this side */
+    int base;                    /* start of the part of name sent to the peer */
+    int fd;                      /* open file, -1 if not opened (yet) or handed over */
+    struct stat st;              /* known from the start for a directory */
+    int err;                     /* errno of the stat/open which failed, 0 if none */
+    int ready;                   /* stat/open done */
+};
+
+/* Several files transferred in a single stream (see batch_request()).
+ * On the sending side, the files are opened by a pool of worker threads,
+ * ahead of the one being sent. */
+struct batch {
+    struct batch_file *files;    /* files to send, NULL on the receiving side */
+    int count;                   /* files to send, or announced by the sender */
+    int next_open;               /* next file to be opened by a worker */
+    int next_send;               /* next file to be sent */
+    int done;                    /* files sent or received */
+    uint64_t bytes;              /* bytes of the files sent or received */
+    int ended;                   /* the end of the batch was queued */
+    int stop;                    /* the workers have to stop */
+    pthread_mutex_t lock;        /* protects the fields above shared with the workers */
+    pthread_cond_t ready;        /* a file was opened */
+    pthread_cond_t room;         /* a file was taken to be sent */
+    pthread_t workers[MAX_BATCH_WORKERS];
+    int nworkers;
+    int sync;                    /* answer to a sync request (see sync_request()) */
+    char name[PATH_MAX];         /* file being received */
+    struct timespec mtime;       /* its modification time, set once it is complete */
+    struct batch_dir *dirs;      /* directories received, completed at the end */
+    int ndirs;
+};
+
+/* A directory received in a batch */
+struct batch_dir {
+    char *path;
+    mode_t mode;
+    struct timespec mtime;
+};
+
+/******* Global values *******/
+int batch_workers = 4;          /* threads opening the files of a batch being sent */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to allocate a batch
+ */
+static struct batch *batch_alloc()
+{
+    struct batch *b = NULL;
+
+    b = (struct batch *) malloc(sizeof(struct batch));
+    if (!b) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    bzero(b, sizeof(struct batch));
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->ready, NULL);
+    pthread_cond_init(&b->room, NULL);
+    return b;
+}
+
+/*
+ * Function to open a file of a batch to be sent (run by the workers).
+ * The file is opened without blocking, so a FIFO can't hold the worker,
+ * and its first blocks are read ahead while the files before it are
+ * sent.
+ */
+static void batch_open(struct batch_file *f)
+{
+    uint64_t ahead = (uint64_t)readahead_mb << 20;
+
+    /* only its name and metadata are sent */
+    if (S_ISDIR(f->st.st_mode))
+        return;
+
+    f->fd = open(f->name, O_RDONLY | O_NONBLOCK);
+    if (f->fd < 0) {
+        f->err = errno;
+        return;
+    }
+
+    if (fstat(f->fd, &f->st) < 0 || !S_ISREG(f->st.st_mode)) {
+        f->err = !f->st.st_mode ? errno : S_ISDIR(f->st.st_mode) ? EISDIR : EINVAL;
+        close(f->fd);
+        f->fd = -1;
+        return;
+    }
+
+    if (ahead && f->st.st_size)
+        posix_fadvise(f->fd, 0, f->st.st_size < ahead ? f->st.st_size : ahead,
+                POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Function run by a worker thread: the files of the batch are opened in
+ * turn, at most BATCH_AHEAD of them ahead of the one being sent
+ */
+static void *batch_worker(void *arg)
+{
+    struct batch *b = arg;
+    struct batch_file *f = NULL;
+
+    pthread_mutex_lock(&b->lock);
+    while (!b->stop && b->next_open < b->count) {
+        if (b->next_open - b->next_send >= BATCH_AHEAD) {
+            pthread_cond_wait(&b->room, &b->lock);
+            continue;
+        }
+
+        f = &b->files[b->next_open++];
+        pthread_mutex_unlock(&b->lock);
+
+        batch_open(f);
+
+        pthread_mutex_lock(&b->lock);
+        f->ready = 1;
+        pthread_cond_broadcast(&b->ready);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+/*
+ * Function to get the next file of a batch to send, once opened. If no
+ * worker took it yet (e.g. they could not be started), it is opened
+ * here.
+ *
+ * returns the file, NULL at the end of the batch
+ */
+static struct batch_file *batch_take(struct batch *b)
+{
+    struct batch_file *f = NULL;
+    int open_here = 0;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->next_send < b->count) {
+        f = &b->files[b->next_send];
+        if (b->next_open == b->next_send) {
+            b->next_open++;
+            open_here = 1;
+        }
+        while (!open_here && !f->ready)
+            pthread_cond_wait(&b->ready, &b->lock);
+        b->next_send++;
+        pthread_cond_broadcast(&b->room);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    if (open_here)
+        batch_open(f);
+    return f;
+}
+
+/*
+ * Function to add a file (or a directory) to a batch to be sent. name is
+ * taken over by the batch. st is the metadata of a directory, NULL for a
+ * file (it is known once opened).
+ *
+ * returns 0 on success, -1 if the batch is full
+ */
+static int batch_add_file(struct batch *b, char *name, int base, struct stat *st)
+{
+    struct batch_file *f = NULL;
+
+    if (b->count == BATCH_MAX_FILES || strlen(name + base) >= PATH_MAX) {
+        if (b->count < BATCH_MAX_FILES)
+            printf("Skipping '%s' in batch: name too long\n", name);
+        free(name);
+        return b->count == BATCH_MAX_FILES ? -1 : 0;
+    }
+
+    if (!(b->count % 1024)) {
+        b->files = (struct batch_file *) realloc(b->files,
+                (b->count + 1024) * sizeof(struct batch_file));
+        if (!b->files) {
+            printf("\nError in malloc\n");
+            exit(1);
+        }
+    }
+
+    f = &b->files[b->count++];
+    bzero(f, sizeof(struct batch_file));
+    f->name = name;
+    f->base = base;
+    f->fd = -1;
+    if (st && S_ISDIR(st->st_mode))
+        f->st = *st;
+    return 0;
+}
+
+/*
+ * Function to get where the name sent to the peer starts in path: its
+ * last component, or what is below it for a directory named '.' or '..'
+ * (or the root directory), whose contents are sent as they are
+ */
+int batch_name_base(char *path)
+{
+    char *last = strrchr(path, '/');
+
+    last = last ? last + 1 : path;
+    if (!*last || strcmp(last, ".") == 0 || strcmp(last, "..") == 0)
+        return strlen(path) + 1;
+    return last - path;
+}
+
+/*
+ * Function to add a directory and everything below it to a batch to be
+ * sent. The tree is listed by the workers of tree_walk(), the
+ * directories come first so the peer can create them, then the files in
+ * the order of their inodes.
+ *
+ * returns 0 on success, -1 if the batch is full
+ */
+static int batch_add_tree(struct batch *b, char *root)
+{
+    struct walk_entry *entries = NULL;
+    int i, n, errors = 0, base, rc = 0;
+    char *dir = strdup(root);
+
+    /* 'dir/' is sent as 'dir' */
+    for (i = strlen(dir) - 1; i > 0 && dir[i] == '/'; i--)
+        dir[i] = '\0';
+    base = batch_name_base(dir);
+
+    n = tree_walk(dir, batch_workers, &entries, &errors);
+    FREE(dir);
+    if (n < 0)
+        return 0;
+
+    if (errors)
+        printf("Could not read %d director%s under '%s'\n", errors,
+                errors > 1 ? "ies" : "y", root);
+
+    for (i = 0; i < n && rc == 0; i++) {
+        /* the directory itself, if only its contents are sent */
+        if (base > strlen(entries[i].path))
+            continue;
+
+        rc = batch_add_file(b, entries[i].path, base, &entries[i].st);
+        entries[i].path = NULL;
+    }
+
+    tree_walk_free(entries, n);
+    return rc;
+}
+
+/*
+ * Function to add the files matching a name to a batch to be sent, and
+ * the whole tree below the directories matching it.
+ * A name without wildcards which matches nothing is added as it is, to
+ * be reported as missing when its turn comes.
+ *
+ * returns 0 on success, -1 if the batch is full
+ */
+static int batch_add(struct batch *b, char *pattern)
+{
+    struct stat st;
+    glob_t g;
+    int i, rc = 0;
+
+    /* only a plain name is kept when nothing matches */
+    bzero(&g, sizeof(g));
+    if (glob(pattern, strpbrk(pattern, "*?[") ? 0 : GLOB_NOCHECK, NULL, &g) != 0) {
+        globfree(&g);
+        return 0;
+    }
+
+    for (i = 0; i < g.gl_pathc && rc == 0; i++) {
+        if (stat(g.gl_pathv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            rc = batch_add_tree(b, g.gl_pathv[i]);
+        else
+            rc = batch_add_file(b, strdup(g.gl_pathv[i]), batch_name_base(g.gl_pathv[i]), NULL);
+    }
+
+    globfree(&g);
+    return rc;
+}
+
+/*
+ * Function to start the workers opening the files of a batch to be
+ * sent. If none can be started, the files are opened as they are sent.
+ */
+static void batch_start_workers(struct batch *b)
+{
+    int i, rc, n = batch_workers < b->count ? batch_workers : b->count;
+
+    for (i = 0; i < n; i++) {
+        rc = pthread_create(&b->workers[i], NULL, batch_worker, b);
+        if (rc != 0) {
+            printf("Error starting batch worker: %s\n", strerror(rc));
+            break;
+        }
+        b->nworkers++;
+    }
+}
+
+/*
+ * Function to free a batch: the workers are stopped, and the files
+ * opened but not sent are closed
+ */
+static void batch_free(struct batch *b)
+{
+    int i;
+
+    pthread_mutex_lock(&b->lock);
+    b->stop = 1;
+    pthread_cond_broadcast(&b->room);
+    pthread_mutex_unlock(&b->lock);
+
+    for (i = 0; i < b->nworkers; i++)
+        pthread_join(b->workers[i], NULL);
+
+    for (i = 0; b->files && i < b->count; i++) {
+        if (b->files[i].fd >= 0)
+            close(b->files[i].fd);
+        FREE(b->files[i].name);
+    }
+    FREE(b->files);
+
+    for (i = 0; i < b->ndirs; i++)
+        FREE(b->dirs[i].path);
+    FREE(b->dirs);
+
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->ready);
+    pthread_cond_destroy(&b->room);
+    free(b);
+}
+
+/*
+ * Function to release the batch of a transfer context, if any
+ */
+void batch_release(struct file_transfer_context *ctx)
+{
+    if (!ctx->batch)
+        return;
+
+    batch_free(ctx->batch);
+    ctx->batch = NULL;
+}
+
+/*
+ * Function to check if a batch being sent has more to send once the
+ * current file is sent
+ */
+int batch_more(struct file_transfer_context *ctx)
+{
+    return ctx->batch && !ctx->batch->ended;
+}
+
+/*
+ * Function to get a transfer context ready for the files of a batch
+ * requested from a peer. sync is set when the batch answers a sync
+ * request.
+ */
+void batch_expect(struct file_transfer_context *ctx, int sync)
+{
+    ctx->batch = batch_alloc();
+    ctx->batch->sync = sync;
+}
+
+/*
+ * Function to request several files from a peer in a single transfer
+ * (BATCH command). The names may be glob patterns, matched by the peer.
+ * Message format:
+ * MSG_BATCH_REQUEST | flags | count | (name size | name) * count
+ * The response is handled by batch_response()
+ *
+ * returns 0 on success, -1 on failure
+ */
+int batch_request(int conn_id, char *names[], int count)
+{
+    struct connected_peer_node *node = NULL;
+    char *msg = NULL, *ptr = NULL, desc[255];
+    int i, msg_size, len;
+
+    node = lookup_peer_by_id(connected_peer_list_head, conn_id);
+    if (!node || conn_id == 1) {
+        printf("BATCH: Invalid connection ID %d\n", conn_id);
+        return -1;
+    }
+
+    if (node->ctx.status != idle) {
+        printf("BATCH: A transfer with %s is in progress, try again later\n",
+                node->hostname);
+        return -1;
+    }
+
+    if (count > MAX_BATCH_NAMES) {
+        printf("BATCH: At most %d names per batch\n", MAX_BATCH_NAMES);
+        return -1;
+    }
+
+    desc[0] = '\0';
+    msg_size = sizeof(uint16_t) + 2 * sizeof(uint32_t);
+    for (i = 0; i < count; i++) {
+        if (strlen(names[i]) >= sizeof(desc)) {
+            printf("BATCH: file name too long\n");
+            return -1;
+        }
+        msg_size += sizeof(uint16_t) + strlen(names[i]);
+
+        /* the batch is shown as the names it was asked with */
+        if (strlen(desc) + strlen(names[i]) + 1 < sizeof(desc))
+            sprintf(desc + strlen(desc), "%s%s", i ? " " : "", names[i]);
+    }
+
+    msg = (char *) malloc(msg_size);
+    if (!msg) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    ptr = msg;
+    *(uint16_t *)ptr = (uint16_t) MSG_BATCH_REQUEST;
+    ptr += sizeof(uint16_t);
+    *(uint32_t *)ptr = local_xfer_caps();
+    ptr += sizeof(uint32_t);
+    *(uint32_t *)ptr = count;
+    ptr += sizeof(uint32_t);
+    for (i = 0; i < count; i++) {
+        len = strlen(names[i]);
+        *(uint16_t *)ptr = len;
+        ptr += sizeof(uint16_t);
+        memcpy(ptr, names[i], len);
+        ptr += len;
+    }
+
+    if (send(node->fd, msg, msg_size, MSG_NOSIGNAL) < 0) {
+        printf("\nBATCH: error sending message to peer: %s\n", strerror(errno));
+        FREE(msg);
+        return -1;
+    }
+    FREE(msg);
+
+    node->ctx.status = requesting;
+    peer_timer_restart(node);
+    node->ctx.file_name = strdup(desc);
+    batch_expect(&node->ctx, 0);
+    return 0;
+}
+
+/*
+ * Function to answer a batch request (or the download request of a
+ * directory) with the files of batch b, and start sending them: for
+ * each file, a XFER_FRAME_FILE frame followed by its data, then a
+ * XFER_FRAME_END frame. The files are opened by the workers while the
+ * previous ones are sent; the files which can't be opened are skipped.
+ * Response format:
+ * MSG_BATCH_ACCEPT | count | flags
+ * or, if there is nothing to send (an empty batch still answers a sync
+ * request, the tree is up to date)
+ * MSG_BATCH_REJECT
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int batch_accept(struct connected_peer_node *node, struct batch *b, uint32_t flags,
+        char *desc)
+{
+    char msg[sizeof(uint16_t) + 2 * sizeof(uint32_t)], *ptr = NULL;
+    uint16_t msg_type;
+
+    if (!b->count && !b->sync) {
+        printf("No file matches the batch request of %s  :  %d\n", node->hostname, node->port);
+        batch_free(b);
+
+        msg_type = (uint16_t) MSG_BATCH_REJECT;
+        if (send(node->fd, &msg_type, sizeof(msg_type), MSG_NOSIGNAL) < 0) {
+            printf("\nError sending message to peer: %s\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    /* the same features as a download, but never striped nor handed over */
+    flags &= local_xfer_caps();
+
+    ptr = msg;
+    *(uint16_t *)ptr = (uint16_t) MSG_BATCH_ACCEPT;
+    ptr += sizeof(uint16_t);
+    *(uint32_t *)ptr = b->count;
+    ptr += sizeof(uint32_t);
+    *(uint32_t *)ptr = flags;
+
+    if (send(node->fd, msg, sizeof(msg), MSG_NOSIGNAL) < 0) {
+        printf("\nError sending message to peer: %s\n", strerror(errno));
+        batch_free(b);
+        return -1;
+    }
+
+    /* an empty sync is reported once complete */
+    if (b->sync && b->count) {
+        printf("\nSending %d new or changed file(s) of '%s'\nto : %s  :  %d\n", b->count,
+                desc, node->hostname, node->port);
+        print_prompt();
+    } else if (!b->sync) {
+        printf("\nSending %d file(s) matching '%s'\nto : %s  :  %d\n", b->count, desc,
+                node->hostname, node->port);
+        print_prompt();
+    }
+
+    batch_start_workers(b);
+
+    /* the first file is taken by send_next_block() */
+    node->ctx.status = sending;
+    peer_timer_restart(node);
+    node->ctx.batch = b;
+    node->ctx.file_fd = -1;
+    node->ctx.file_name = strdup(desc);
+    node->ctx.bytes_remaining = node->ctx.file_size = 0;
+    node->ctx.total_time = (struct timeval){0};
+    node->ctx.flags = flags;
+    rate_init_transfer(node);
+
+    FD_SET(node->fd, &writefds);
+    send_in_progress++;
+    return 0;
+}
+
+/*
+ * Function to handle a batch request from a peer (the message type has
+ * already been read). The names are matched, and the files are sent as
+ * a batch (see batch_accept()).
+ *
+ * returns 0 on success, -2 if the connection is closed (or the request
+ * is invalid), -1 on other failures
+ */
+int handle_batch_request(struct connected_peer_node *node)
+{
+    struct batch *b = NULL;
+    char name[255], desc[255];
+    uint32_t flags = 0, count = 0;
+    uint16_t len = 0;
+    int i;
+
+    if (read_full(node->fd, &flags, sizeof(flags)) <= 0 ||
+            read_full(node->fd, &count, sizeof(count)) <= 0 || count > MAX_BATCH_NAMES) {
+        printf("\nInvalid batch request received from peer\n");
+        return -2;
+    }
+
+    b = batch_alloc();
+    desc[0] = '\0';
+    for (i = 0; i < count; i++) {
+        if (read_full(node->fd, &len, sizeof(len)) <= 0 || len >= sizeof(name) ||
+                (len && read_full(node->fd, name, len) <= 0)) {
+            printf("\nInvalid batch request received from peer\n");
+            batch_free(b);
+            return -2;
+        }
+        name[len] = '\0';
+
+        /* only single shared files are served with sharedonly */
+        if (len && !shared_only && b->count < BATCH_MAX_FILES && batch_add(b, name) < 0)
+            printf("Batch limited to the first %d files\n", BATCH_MAX_FILES);
+
+        if (strlen(desc) + len + 1 < sizeof(desc))
+            sprintf(desc + strlen(desc), "%s%s", i ? " " : "", name);
+    }
+
+    return batch_accept(node, b, flags, desc);
+}
+
+/*
+ * Function to answer the download request of a directory: the whole
+ * tree below it is sent as a batch, the peer handles the response (see
+ * batch_response())
+ *
+ * returns 0 on success, -1 on failure
+ */
+int batch_send_dir(struct connected_peer_node *node, char *dir_name, uint32_t flags)
+{
+    struct batch *b = batch_alloc();
+
+    if (batch_add_tree(b, dir_name) < 0)
+        printf("Batch limited to the first %d files\n", BATCH_MAX_FILES);
+
+    return batch_accept(node, b, flags, dir_name);
+}
+
+/*
+ * Function to answer a sync request with the entries of the tree
+ * dir_name which the peer lacks, in the order of entries (see
+ * sync_compare()). The paths of entries are taken over.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int batch_send_entries(struct connected_peer_node *node, char *dir_name, uint32_t flags,
+        struct walk_entry *entries, int count)
+{
+    struct batch *b = batch_alloc();
+    int i, base = batch_name_base(dir_name), rc = 0;
+
+    b->sync = 1;
+    for (i = 0; i < count && rc == 0; i++) {
+        /* the directory itself, if only its contents are sent */
+        if (base > strlen(entries[i].path))
+            continue;
+
+        rc = batch_add_file(b, entries[i].path, base, &entries[i].st);
+        entries[i].path = NULL;
+    }
+    if (rc < 0)
+        printf("Batch limited to the first %d files\n", BATCH_MAX_FILES);
+
+    return batch_accept(node, b, flags, dir_name);
+}
+
+/*
+ * Function to offer a directory, and the whole tree below it, to a peer
+ * (UPLOAD of a directory). The files start being opened while the peer
+ * answers, they are sent from the event loop once it accepts (see
+ * handle_upload_response()).
+ * Message format:
+ * MSG_BATCH_OFFER | flags | count | name size | name
+ *
+ * returns 0 on success, -1 on failure
+ */
+int batch_offer(struct connected_peer_node *node, char *dir_name)
+{
+    char msg[sizeof(uint16_t) + 2 * sizeof(uint32_t) + sizeof(uint16_t) + 255], *ptr = NULL;
+    struct batch *b = batch_alloc();
+    int len = strlen(dir_name) < 255 ? strlen(dir_name) : 255;
+
+    if (batch_add_tree(b, dir_name) < 0)
+        printf("UPLOAD: Batch limited to the first %d files\n", BATCH_MAX_FILES);
+
+    if (!b->count) {
+        printf("UPLOAD: Nothing to send in '%s'\n", dir_name);
+        batch_free(b);
+        return -1;
+    }
+
+    ptr = msg;
+    *(uint16_t *)ptr = (uint16_t) MSG_BATCH_OFFER;
+    ptr += sizeof(uint16_t);
+    *(uint32_t *)ptr = local_xfer_caps();
+    ptr += sizeof(uint32_t);
+    *(uint32_t *)ptr = b->count;
+    ptr += sizeof(uint32_t);
+    *(uint16_t *)ptr = len;
+    ptr += sizeof(uint16_t);
+    memcpy(ptr, dir_name, len);
+    ptr += len;
+
+    if (send(node->fd, msg, ptr - msg, MSG_NOSIGNAL) < 0) {
+        printf("\nUPLOAD: error sending message to peer: %s\n", strerror(errno));
+        batch_free(b);
+        return -1;
+    }
+
+    batch_start_workers(b);
+
+    node->ctx.status = offering;
+    peer_timer_restart(node);
+    node->ctx.batch = b;
+    node->ctx.file_fd = -1;
+    node->ctx.file_name = strdup(dir_name);
+    node->ctx.bytes_remaining = node->ctx.file_size = 0;
+    node->ctx.total_time = (struct timeval){0};
+    return 0;
+}
+
+/*
+ * Function to handle the offer of a directory by a peer (the message
+ * type has already been read): it is received as a batch.
+ * Response format:
+ * MSG_UPLOAD_ACCEPT | flags
+ *
+ * returns 0 on success, -2 if the connection is closed (or the offer is
+ * invalid), -1 on other failures
+ */
+int handle_batch_offer(struct connected_peer_node *node)
+{
+    char name[256], msg[sizeof(uint16_t) + sizeof(uint32_t)];
+    uint32_t flags = 0, count = 0;
+    uint16_t len = 0;
+
+    if (read_full(node->fd, &flags, sizeof(flags)) <= 0 ||
+            read_full(node->fd, &count, sizeof(count)) <= 0 ||
+            read_full(node->fd, &len, sizeof(len)) <= 0 || len >= sizeof(name) ||
+            (len && read_full(node->fd, name, len) <= 0)) {
+        printf("\nInvalid upload request received from peer\n");
+        return -2;
+    }
+    name[len] = '\0';
+
+    flags &= local_xfer_caps();
+
+    *(uint16_t *)msg = (uint16_t) MSG_UPLOAD_ACCEPT;
+    *(uint32_t *)(msg + sizeof(uint16_t)) = flags;
+    if (send(node->fd, msg, sizeof(msg), MSG_NOSIGNAL) < 0) {
+        printf("\nError sending message to peer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    node->ctx.status = receiving;
+    peer_timer_restart(node);
+    node->ctx.batch = batch_alloc();
+    node->ctx.batch->count = count;
+    node->ctx.file_fd = -1;
+    node->ctx.file_name = strdup(name);
+    node->ctx.bytes_remaining = node->ctx.file_size = 0;
+    node->ctx.total_time = (struct timeval){0};
+    node->ctx.flags = flags;
+
+    recv_in_progress++;
+
+    printf("\nReceiving %d file(s) of '%s' from %s  :  %d..\n", count, name,
+            node->hostname, node->port);
+    print_prompt();
+    return 0;
+}
+
+/*
+ * Function to queue the frame announcing the next file (or directory)
+ * of a batch being sent, once the previous one is completely sent, or
+ * the end of the batch after the last one.
+ * XFER_FRAME_FILE payload:
+ * struct xfer_file_hdr | name
+ */
+void batch_next_file(struct connected_peer_node *node)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    struct batch *b = ctx->batch;
+    struct batch_file *f = NULL;
+    char payload[sizeof(struct xfer_file_hdr) + PATH_MAX];
+    struct xfer_file_hdr *fh = (struct xfer_file_hdr *)payload;
+    int len;
+
+    /* done with the previous file */
+    if (ctx->file_fd >= 0)
+        close(ctx->file_fd);
+    ctx->file_fd = -1;
+    map_release(ctx);
+    ctx->ra_started = 0;
+    ctx->ra_end = 0;
+    ctx->drop_off = 0;
+    ctx->data_end = 0;
+    ctx->offset = 0;
+
+    while ((f = batch_take(b)) != NULL) {
+        if (f->fd < 0 && !S_ISDIR(f->st.st_mode)) {
+            printf("Skipping '%s' in batch: %s\n", f->name, strerror(f->err));
+            continue;
+        }
+
+        /* the name is relative to the directory the batch was asked in */
+        len = strlen(f->name + f->base);
+        bzero(fh, sizeof(*fh));
+        fh->size = S_ISDIR(f->st.st_mode) ? 0 : f->st.st_size;
+        fh->mode = f->st.st_mode & (S_IFMT | 0777);
+        fh->mtime = f->st.st_mtim.tv_sec;
+        fh->mtime_nsec = f->st.st_mtim.tv_nsec;
+        memcpy(payload + sizeof(*fh), f->name + f->base, len);
+        xfer_queue_frame(node, XFER_FRAME_FILE, payload, sizeof(*fh) + len, sizeof(*fh) + len);
+
+        ctx->file_fd = f->fd;
+        f->fd = -1;
+        ctx->bytes_remaining = ctx->file_size = fh->size;
+        b->done++;
+        b->bytes += fh->size;
+        return;
+    }
+
+    /* the receiver checks it got all the files sent */
+    xfer_queue_frame(node, XFER_FRAME_END, NULL, 0, b->done);
+    b->ended = 1;
+}
+
+/*
+ * Function to print the summary of a batch completely sent
+ */
+void batch_print_summary(struct connected_peer_node *node)
+{
+    struct batch *b = node->ctx.batch;
+    double usecs = node->ctx.total_time.tv_sec * 1000000.0 + node->ctx.total_time.tv_usec;
+
+    if (b->sync && !b->done) {
+        printf("\n'%s' is up to date on %s  :  %d\n", node->ctx.file_name,
+                node->hostname, node->port);
+        return;
+    }
+
+    printf("\nSuccessfully sent %d file(s)!!\n", b->done);
+    printf("Tx(%s): %s -> %s,\nBatch Size: %" PRIu64
+            " Bytes,\nTime Taken: %ld.%06ld seconds, \nTx Rate: %f bits/second\n",
+            my_hostname, my_hostname, node->hostname, b->bytes,
+            node->ctx.total_time.tv_sec, node->ctx.total_time.tv_usec,
+            usecs > 0 ? b->bytes * 8 / usecs * 1000000 : 0.0);
+}
+
+/*
+ * Function to handle the response of a peer to a batch request, or to
+ * the download request of a directory (the message type has already
+ * been read)
+ * Response Format:
+ * MSG_BATCH_ACCEPT | count | flags
+ * or
+ * MSG_BATCH_REJECT
+ *
+ * returns 0 on success, -2 if the connection is closed, -1 on failure
+ */
+int batch_response(struct connected_peer_node *node, uint16_t msg_type)
+{
+    uint32_t count = 0, flags = 0;
+    int len;
+
+    if (msg_type == MSG_BATCH_REJECT) {
+        if (node->ctx.batch && node->ctx.batch->sync)
+            printf("\nSYNC: No directory '%s' on the peer\n", node->ctx.file_name);
+        else
+            printf("\nBATCH: No file matching '%s' on the peer\n", node->ctx.file_name);
+        print_prompt();
+        queue_finish(node, 0);
+        reset_transfer(node);
+        return -1;
+    }
+
+    if ((len = read_full(node->fd, &count, sizeof(count))) <= 0 ||
+            (len = read_full(node->fd, &flags, sizeof(flags))) <= 0)
+        return len ? -1 : -2;
+
+    /* a download turns out to be a directory */
+    if (!node->ctx.batch)
+        node->ctx.batch = batch_alloc();
+
+    node->ctx.status = receiving;
+    peer_timer_restart(node);
+    node->ctx.file_fd = -1;
+    node->ctx.bytes_remaining = node->ctx.file_size = 0;
+    node->ctx.total_time = (struct timeval){0};
+    node->ctx.flags = flags & local_xfer_caps();
+    node->ctx.batch->count = count;
+
+    recv_in_progress++;
+
+    /* an empty sync is reported once complete */
+    if (node->ctx.batch->sync && count)
+        printf("\nSynchronizing '%s': %d new or changed file(s)..\n", node->ctx.file_name, count);
+    else if (!node->ctx.batch->sync)
+        printf("\nReceiving %d file(s) matching '%s'..\n", count, node->ctx.file_name);
+    return 0;
+}
+
+/*
+ * Function to check that a name received in a batch stays below the
+ * current directory: relative, without '.' nor '..' components
+ *
+ * returns 0 if the name is fine, -1 otherwise
+ */
+static int batch_check_name(char *name)
+{
+    char *p = name, *end = NULL;
+    int len;
+
+    do {
+        end = strchr(p, '/');
+        len = end ? end - p : strlen(p);
+        if (!len || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+            return -1;
+        p = end + 1;
+    } while (end);
+
+    return 0;
+}
+
+/*
+ * Function to create the directories leading to a file received in a
+ * batch (its directory was not sent, or could not be created)
+ */
+static void batch_make_parents(char *name)
+{
+    char *p = name;
+
+    while ((p = strchr(p + 1, '/')) != NULL) {
+        *p = '\0';
+        mkdir(name, 0755);
+        *p = '/';
+    }
+}
+
+/*
+ * Function to complete the file being received in a batch: its
+ * modification time is set back to the one of the file sent
+ */
+static void batch_close_received(struct file_transfer_context *ctx)
+{
+    struct timespec times[2];
+
+    if (ctx->file_fd < 0)
+        return;
+
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = ctx->batch->mtime;
+    futimens(ctx->file_fd, times);
+
+    close(ctx->file_fd);
+    ctx->file_fd = -1;
+}
+
+/*
+ * Function to create a directory received in a batch. It is kept
+ * writable until the end of the batch, then gets the mode and the
+ * modification time it was sent with (see batch_finish_dirs()).
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int batch_make_dir(struct batch *b, struct xfer_file_hdr *fh)
+{
+    struct batch_dir *d = NULL;
+    struct stat st;
+
+    if (mkdir(b->name, (fh->mode & 0777) | S_IRWXU) < 0 && errno == ENOENT) {
+        batch_make_parents(b->name);
+        mkdir(b->name, (fh->mode & 0777) | S_IRWXU);
+    }
+
+    if (stat(b->name, &st) < 0) {
+        printf("\nBATCH: Error creating directory '%s': %s\n", b->name, strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        printf("\nBATCH: Error creating directory '%s': file exists\n", b->name);
+        return -1;
+    }
+
+    if (!(b->ndirs % 256)) {
+        b->dirs = (struct batch_dir *) realloc(b->dirs, (b->ndirs + 256) * sizeof(struct batch_dir));
+        if (!b->dirs) {
+            printf("\nError in malloc\n");
+            exit(1);
+        }
+    }
+
+    d = &b->dirs[b->ndirs++];
+    d->path = strdup(b->name);
+    d->mode = fh->mode & 0777;
+    d->mtime.tv_sec = fh->mtime;
+    d->mtime.tv_nsec = fh->mtime_nsec;
+    return 0;
+}
+
+/*
+ * Function to give the directories received in a batch their mode and
+ * modification time, once all the files are in them
+ */
+static void batch_finish_dirs(struct batch *b)
+{
+    struct timespec times[2];
+    int i;
+
+    /* the deepest first, so a directory is still writable while the
+     * ones below it are done */
+    for (i = b->ndirs - 1; i >= 0; i--) {
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1] = b->dirs[i].mtime;
+        utimensat(AT_FDCWD, b->dirs[i].path, times, 0);
+        chmod(b->dirs[i].path, b->dirs[i].mode);
+    }
+}
+
+/*
+ * Function to start receiving the file (or directory) announced by a
+ * XFER_FRAME_FILE frame of a batch. It is created below the current
+ * directory, under the name it was sent with.
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int batch_open_received(struct connected_peer_node *node)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    struct batch *b = ctx->batch;
+    struct xfer_file_hdr *fh = (struct xfer_file_hdr *)ctx->rx_buf;
+    int len = ctx->rx_hdr.wire_len - sizeof(*fh);
+    int flags = O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW;
+
+    if (ctx->bytes_remaining || len <= 0 || len >= sizeof(b->name) ||
+            (S_ISDIR(fh->mode) && fh->size)) {
+        printf("Corrupt frame received from peer\n");
+        return -1;
+    }
+
+    memcpy(b->name, ctx->rx_buf + sizeof(*fh), len);
+    b->name[len] = '\0';
+
+    if (batch_check_name(b->name) < 0) {
+        printf("Invalid file name '%s' received from peer\n", b->name);
+        return -1;
+    }
+
+    /* done with the previous file */
+    batch_close_received(ctx);
+    b->done++;
+
+    if (S_ISDIR(fh->mode))
+        return batch_make_dir(b, fh);
+
+    ctx->file_fd = open(b->name, flags, (fh->mode & 0777) | S_IRUSR | S_IWUSR);
+    if (ctx->file_fd < 0 && errno == ENOENT) {
+        batch_make_parents(b->name);
+        ctx->file_fd = open(b->name, flags, (fh->mode & 0777) | S_IRUSR | S_IWUSR);
+    }
+    if (ctx->file_fd < 0) {
+        printf("\nBATCH: Error creating file '%s': %s\n", b->name, strerror(errno));
+        return -1;
+    }
+
+    /* the mode of a file which was there already */
+    fchmod(ctx->file_fd, fh->mode & 0777);
+
+    if (xfer_prealloc(ctx->file_fd, fh->size) < 0) {
+        printf("\nBATCH: Can't receive '%s'\n", b->name);
+        return -1;
+    }
+
+    ctx->offset = 0;
+    ctx->bytes_remaining = ctx->file_size = fh->size;
+    ctx->wb_pending = ctx->wb_prev_off = ctx->wb_prev_len = 0;
+    b->mtime.tv_sec = fh->mtime;
+    b->mtime.tv_nsec = fh->mtime_nsec;
+    b->bytes += fh->size;
+    return 0;
+}
+
+/*
+ * Function to receive the next frame of a batch from a peer: the start
+ * of a file, its data, or the end of the batch. The data still in
+ * flight once the batch was aborted is dropped.
+ * Also prints the Rx summary once the batch is complete
+ *
+ * returns 0 on success,
+ *        -2 if the connection is closed, or can't be used any more,
+ *        -1 on other failures
+ */
+int batch_receive_block(struct connected_peer_node *node)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    struct batch *b = ctx->batch;
+    struct timeval start, end, diff;
+    int rc = 0, retval = 0, len = 0;
+    double usecs;
+
+    gettimeofday(&start, NULL);
+
+    rc = xfer_recv_frame(node);
+    if (rc <= 0) {
+        /* -2: connection to peer closed, -1: error already printed */
+        if (rc == 0)
+            return 0;
+        retval = rc;
+        goto cleanup;
+    }
+
+    switch (ctx->rx_hdr.type) {
+        case XFER_FRAME_CANCEL:
+            printf("\nBatch '%s' %s %s  :  %d\n", ctx->file_name,
+                    ctx->status == cancelling ? "aborted, from" : "cancelled by",
+                    node->hostname, node->port);
+            print_prompt();
+            goto cleanup;
+
+        case XFER_FRAME_END:
+            if (ctx->status == cancelling) {
+                printf("\nBatch '%s' aborted, from %s  :  %d\n", ctx->file_name,
+                        node->hostname, node->port);
+                print_prompt();
+                goto cleanup;
+            }
+            if (ctx->bytes_remaining || ctx->rx_hdr.raw_len != b->done) {
+                printf("Corrupt frame received from peer\n");
+                retval = -2;
+                goto cleanup;
+            }
+            batch_close_received(ctx);
+            batch_finish_dirs(b);
+            break;
+
+        case XFER_FRAME_FILE:
+            if (ctx->status != cancelling && batch_open_received(node) < 0) {
+                /* the peer is sending the file anyway */
+                retval = -2;
+                goto cleanup;
+            }
+            ctx->rx_hdr_len = 0;
+            ctx->rx_len = 0;
+            break;
+
+        default:
+            if (ctx->status != cancelling && ctx->rx_hdr.raw_len > ctx->bytes_remaining) {
+                printf("Corrupt frame received from peer\n");
+                retval = -2;
+                goto cleanup;
+            }
+            len = xfer_write_frame(node);
+            if (len < 0) {
+                retval = -2;
+                goto cleanup;
+            }
+            ctx->bytes_remaining -= (ctx->status == cancelling) ? 0 : len;
+            break;
+    }
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &diff);
+    timeradd(&ctx->total_time, &diff, &ctx->total_time);
+
+    if (ctx->rx_hdr.type != XFER_FRAME_END)
+        return 0;
+
+    /* all the files are in */
+    if (b->sync && !b->count) {
+        printf("\nSYNC: '%s' is up to date with %s  :  %d\n", ctx->file_name,
+                node->hostname, node->port);
+        print_prompt();
+        goto cleanup;
+    }
+
+    usecs = ctx->total_time.tv_sec * 1000000.0 + ctx->total_time.tv_usec;
+    printf("\nBatch '%s' \nfrom : %s  :  %d\nSuccessfully received %d of %d file(s)!!\n",
+            ctx->file_name, node->hostname, node->port, b->done, b->count);
+    printf("Rx (%s): %s -> %s,\nBatch Size: %" PRIu64
+            " Bytes,\nTime Taken: %ld.%06ld seconds, \nRx Rate: %f bits/second\n",
+            my_hostname, node->hostname, my_hostname, b->bytes,
+            ctx->total_time.tv_sec, ctx->total_time.tv_usec,
+            usecs > 0 ? b->bytes * 8 / usecs * 1000000 : 0.0);
+    print_prompt();
+
+cleanup:
+    recv_in_progress--;
+    queue_finish(node, retval == -2);
+    reset_transfer(node);
+    return retval;
+}
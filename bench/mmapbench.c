@@ -0,0 +1,221 @@
+/*
+ * Benchmark of the mmap option against the copy path of the file data.
+ *
+ * A file of <size> MB is sent over a Unix domain socket pair in blocks of
+ * XFER_BLOCK_SIZE bytes, by a child process, and received into a second
+ * file by the parent:
+ *  - copy: the blocks are read with pread() and sent from a buffer, and
+ *    received in a buffer and written with pwrite(),
+ *  - mmap: the blocks are sent from the windows of the mapped source and
+ *    received straight into the windows of the mapped destination
+ *    (map_window() of mmapio.c).
+ * The source file is in the page cache for both runs. The throughput is
+ * printed, and the received file is checked against the source.
+ *
+ * Usage: mmapbench [size in MB] [directory]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "../proj1.h"
+
+enum { COPY, MMAP };
+
+/*
+ * Function to send size bytes of the file file_fd on fd
+ */
+static void send_file(int fd, int file_fd, uint64_t size, int method)
+{
+    static char buf[XFER_BLOCK_SIZE];
+    struct file_transfer_context ctx;
+    uint64_t off = 0;
+    char *data = buf;
+    int len, sent, n;
+
+    bzero(&ctx, sizeof(ctx));
+    ctx.file_fd = file_fd;
+    ctx.file_name = "source";
+
+    while (off < size) {
+        len = size - off < XFER_BLOCK_SIZE ? size - off : XFER_BLOCK_SIZE;
+
+        if (method == MMAP) {
+            data = map_window(&ctx, off, len);
+            if (!data) {
+                fprintf(stderr, "map_window failed at %" PRIu64 "\n", off);
+                exit(1);
+            }
+        } else if (pread(file_fd, buf, len, off) != len) {
+            perror("pread");
+            exit(1);
+        }
+
+        for (sent = 0; sent < len; sent += n) {
+            n = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                perror("send");
+                exit(1);
+            }
+        }
+        off += len;
+    }
+    map_release(&ctx);
+}
+
+/*
+ * Function to receive size bytes on fd into the file file_fd
+ *
+ * returns the number of bytes received
+ */
+static uint64_t recv_file(int fd, int file_fd, uint64_t size, int method)
+{
+    static char buf[XFER_BLOCK_SIZE];
+    struct file_transfer_context ctx;
+    uint64_t off = 0;
+    char *data = buf;
+    int len;
+
+    bzero(&ctx, sizeof(ctx));
+    ctx.file_fd = file_fd;
+    ctx.file_name = "destination";
+    ctx.bytes_remaining = size;
+    mmap_enabled = (method == MMAP);
+    map_prepare(&ctx);
+
+    while (off < size) {
+        len = size - off < XFER_BLOCK_SIZE ? size - off : XFER_BLOCK_SIZE;
+
+        if (method == MMAP) {
+            data = map_window(&ctx, off, len);
+            if (!data) {
+                fprintf(stderr, "map_window failed at %" PRIu64 "\n", off);
+                exit(1);
+            }
+        }
+
+        len = recv(fd, data, len, 0);
+        if (len <= 0)
+            break;
+
+        if (method == COPY && pwrite(file_fd, buf, len, off) != len) {
+            perror("pwrite");
+            exit(1);
+        }
+        off += len;
+    }
+    map_release(&ctx);
+    return off;
+}
+
+/*
+ * Function to check that two files have the same first size bytes
+ */
+static int same_content(int fd1, int fd2, uint64_t size)
+{
+    static char buf1[1 << 20], buf2[1 << 20];
+    uint64_t off;
+    int len;
+
+    for (off = 0; off < size; off += len) {
+        len = size - off < sizeof(buf1) ? size - off : sizeof(buf1);
+        if (pread(fd1, buf1, len, off) != len || pread(fd2, buf2, len, off) != len ||
+                memcmp(buf1, buf2, len))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Function to run the benchmark for a method
+ */
+static void run_method(char *name, int method, int src_fd, char *dst_path, uint64_t size)
+{
+    struct timeval start, end, diff;
+    int sv[2], dst_fd;
+    uint64_t received;
+    double secs;
+    pid_t pid;
+
+    dst_fd = open(dst_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (dst_fd < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("open");
+        exit(1);
+    }
+
+    /* don't let the child print what is still buffered */
+    fflush(stdout);
+
+    gettimeofday(&start, NULL);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        /* sender */
+        close(sv[0]);
+        send_file(sv[1], src_fd, size, method);
+        exit(0);
+    }
+
+    /* receiver */
+    close(sv[1]);
+    received = recv_file(sv[0], dst_fd, size, method);
+    gettimeofday(&end, NULL);
+    waitpid(pid, NULL, 0);
+    close(sv[0]);
+
+    timersub(&end, &start, &diff);
+    secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+    printf("%s\t%10.1f\t%s\n", name, received / secs / (1 << 20),
+            received == size && same_content(src_fd, dst_fd, size) ? "ok" : "(corrupt)");
+
+    close(dst_fd);
+    unlink(dst_path);
+}
+
+int main(int argc, char *argv[])
+{
+    char src_path[PATH_MAX], dst_path[PATH_MAX], *dir = ".";
+    static char buf[1 << 20];
+    uint64_t size = 256, off;
+    int src_fd, i;
+
+    if (argc > 1)
+        size = strtoull(argv[1], NULL, 10);
+    if (argc > 2)
+        dir = argv[2];
+    size <<= 20;
+
+    snprintf(src_path, sizeof(src_path), "%s/mmapbench.src", dir);
+    snprintf(dst_path, sizeof(dst_path), "%s/mmapbench.dst", dir);
+
+    /* the source file, left in the page cache */
+    src_fd = open(src_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (src_fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    for (off = 0; off < size; off += sizeof(buf)) {
+        for (i = 0; i < sizeof(buf); i += sizeof(int))
+            *(int *)(buf + i) = rand();
+        if (write(src_fd, buf, sizeof(buf)) != sizeof(buf)) {
+            perror("write");
+            exit(1);
+        }
+    }
+
+    printf("Method\t    MB/sec\n");
+    printf("--------------------------\n");
+    run_method("copy", COPY, src_fd, dst_path, size);
+    run_method("mmap", MMAP, src_fd, dst_path, size);
+
+    close(src_fd);
+    unlink(src_path);
+    return 0;
+}
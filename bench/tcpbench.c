@@ -0,0 +1,145 @@
+/*
+ * Benchmark of the socket tuning profiles of tcptune.c on loopback.
+ *
+ * For every profile, a child process sends <size> MB in frames of
+ * XFER_BLOCK_SIZE bytes on a non-blocking socket, the same way the file
+ * data is sent to a peer, while the parent receives it. The throughput is
+ * printed along with the largest amount of data seen waiting in the
+ * kernel send queue (bounded by TCP_NOTSENT_LOWAT).
+ *
+ * Usage: tcpbench [size in MB]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <linux/sockios.h>
+
+#include "../proj1.h"
+
+/* listening socket, used by tcptune.c */
+int listen_fd = -1;
+
+/*
+ * Function to send size bytes on fd, without blocking
+ * returns the largest number of unsent bytes seen in the send queue
+ */
+static int send_bulk(int fd, uint64_t size)
+{
+    static char buf[XFER_BLOCK_SIZE];
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    int len, off = sizeof(buf), unsent, max_unsent = 0;
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    while (size || off < sizeof(buf)) {
+        if (off == sizeof(buf)) {
+            off = 0;
+            size -= size < sizeof(buf) ? size : sizeof(buf);
+        }
+
+        len = send(fd, buf + off, sizeof(buf) - off, MSG_NOSIGNAL);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("send");
+                exit(1);
+            }
+            if (ioctl(fd, SIOCOUTQNSD, &unsent) == 0 && unsent > max_unsent)
+                max_unsent = unsent;
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        off += len;
+    }
+    return max_unsent;
+}
+
+/*
+ * Function to run the benchmark for a profile
+ */
+static void run_profile(struct tcp_profile *p, uint64_t size)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    struct timeval start, end, diff;
+    static char buf[1 << 16];
+    int lfd, fd, pipefd[2], max_unsent = 0, len;
+    uint64_t received = 0;
+    double secs;
+    pid_t pid;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    tcp_apply_profile(lfd, p, NULL);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(lfd, 1) < 0 || getsockname(lfd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    /* don't let the child print what is still buffered */
+    fflush(stdout);
+
+    if (pipe(pipefd) < 0 || (pid = fork()) < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        /* sender */
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        tcp_apply_profile(fd, p, NULL);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            exit(1);
+        }
+        max_unsent = send_bulk(fd, size);
+        close(fd);
+        if (write(pipefd[1], &max_unsent, sizeof(max_unsent)) < 0)
+            exit(1);
+        exit(0);
+    }
+
+    /* receiver */
+    fd = accept(lfd, NULL, NULL);
+    gettimeofday(&start, NULL);
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        received += len;
+    gettimeofday(&end, NULL);
+
+    if (read(pipefd[0], &max_unsent, sizeof(max_unsent)) < 0)
+        max_unsent = -1;
+    waitpid(pid, NULL, 0);
+    close(fd);
+    close(lfd);
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    timersub(&end, &start, &diff);
+    secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+    printf("%s\t%10.1f\t%10d\t%s\n", p->name, received / secs / (1 << 20),
+            max_unsent / 1024, received == size ? "" : "(short)");
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t size = 256;
+    struct tcp_profile *p;
+    int i;
+
+    if (argc > 1)
+        size = strtoull(argv[1], NULL, 10);
+    size <<= 20;
+
+    printf("Profile\t    MB/sec\tmax unsent KB\n");
+    printf("-----------------------------------------\n");
+    for (i = 0; (p = tcp_profile_get(i)) != NULL; i++)
+        run_profile(p, size);
+
+    return 0;
+}
@@ -0,0 +1,350 @@
+#include <errno.h>
+#include <sys/time.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* Bits set per file name (the filter is sized for ~1% false positives) */
+#define BLOOM_PROBES            7
+/* Bits of filter per file name */
+#define BLOOM_BITS_PER_KEY      10
+/* Number of 64 bit words in a block (one cache line) */
+#define BLOOM_BLOCK_WORDS       (BLOOM_BLOCK_SIZE / sizeof(uint64_t))
+
+/* Bloom filter of the files shared by a peer, as received from the server */
+struct peer_filter {
+    struct in_addr ip;
+    unsigned short port;
+    uint32_t num_blocks;
+    uint64_t *bits;
+};
+
+/******* Global values *******/
+int bloom_interval = 10;                    /* min. seconds between two publications */
+
+static struct list_node *peer_filter_list_head = NULL;
+static int bloom_dirty = 0;                 /* shared files changed since last publication */
+static struct timeval bloom_last;           /* time of the last publication */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to get the block and the bit masks (one per word of the block)
+ * a key maps to.
+ * All the bits of a key are in the same block, so a lookup touches a
+ * single cache line.
+ */
+static uint32_t bloom_masks(char *key, uint32_t num_blocks, uint64_t mask[BLOOM_BLOCK_WORDS])
+{
+    uint64_t h = fnv1a_hash(key, strlen(key), FNV_OFFSET_BASIS);
+    uint64_t g;
+    int i, bit;
+
+    /* the lower half selects the block, a remix of the hash gives the
+     * 9 bit positions inside the 512 bit block */
+    g = (h ^ (h >> 31)) * 0x9e3779b97f4a7c15ULL;
+
+    for (i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        mask[i] = 0;
+
+    for (i = 0; i < BLOOM_PROBES; i++) {
+        bit = g & (BLOOM_BLOCK_SIZE * 8 - 1);
+        g >>= 9;
+        mask[bit / 64] |= 1ULL << (bit % 64);
+    }
+
+    return (uint32_t)h & (num_blocks - 1);
+}
+
+/*
+ * Function to check if a key may be in a filter
+ *
+ * returns 1 if it may be, 0 if it is definitely not
+ */
+static int bloom_test(uint64_t *bits, uint32_t num_blocks, char *key)
+{
+    uint64_t mask[BLOOM_BLOCK_WORDS], miss = 0;
+    uint64_t *block;
+    int i;
+
+    block = bits + bloom_masks(key, num_blocks, mask) * BLOOM_BLOCK_WORDS;
+
+    /* no early exit, the whole cache line is checked at once */
+    for (i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        miss |= mask[i] & ~block[i];
+
+    return miss == 0;
+}
+
+/*
+ * Function to get the number of blocks of a filter for count keys
+ * (a power of two, so that a block can be selected with a mask)
+ */
+static uint32_t bloom_num_blocks(int count)
+{
+    uint64_t bits = (uint64_t)count * BLOOM_BITS_PER_KEY;
+    uint32_t n = 1;
+
+    while ((uint64_t)n * BLOOM_BLOCK_SIZE * 8 < bits && n < BLOOM_MAX_BLOCKS)
+        n <<= 1;
+
+    return n;
+}
+
+/* filter being built by bloom_publish() */
+struct bloom_build {
+    uint64_t *bits;
+    uint32_t num_blocks;
+};
+
+/*
+ * Function to add a key to the filter being built
+ */
+static void bloom_add(char *key, void *arg)
+{
+    struct bloom_build *bb = arg;
+    uint64_t mask[BLOOM_BLOCK_WORDS], *block;
+    int i;
+
+    block = bb->bits + bloom_masks(key, bb->num_blocks, mask) * BLOOM_BLOCK_WORDS;
+    for (i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        block[i] |= mask[i];
+}
+
+/*
+ * Function to note that the list of shared files changed, so that
+ * a new filter is published
+ */
+void bloom_mark_dirty()
+{
+    bloom_dirty = 1;
+}
+
+/*
+ * Function to publish the filter of our shared files at once (the
+ * server we registered to has no filter from us yet)
+ */
+void bloom_republish()
+{
+    bloom_dirty = 1;
+    timerclear(&bloom_last);
+}
+
+/*
+ * Function to build the filter of our shared files and send it to the server
+ * Message format:
+ * MSG_BLOOM_FILTER | number of blocks | blocks
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int bloom_publish()
+{
+    struct bloom_build bb;
+    char hdr[sizeof(uint16_t) + sizeof(uint32_t)];
+    int rc = 0;
+
+    bb.num_blocks = bloom_num_blocks(shared_file_count);
+    bb.bits = (uint64_t *) calloc(bb.num_blocks, BLOOM_BLOCK_SIZE);
+    if (!bb.bits) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    for_each_shared_file(bloom_add, &bb);
+
+    *(uint16_t *)hdr = MSG_BLOOM_FILTER;
+    *(uint32_t *)(hdr + sizeof(uint16_t)) = bb.num_blocks;
+
+    if (send(server_fd, hdr, sizeof(hdr), MSG_NOSIGNAL | MSG_MORE) < 0 ||
+            send(server_fd, bb.bits, bb.num_blocks * BLOOM_BLOCK_SIZE, MSG_NOSIGNAL) < 0) {
+        printf("\nError sending file filter to server: %s\n", strerror(errno));
+        rc = -1;
+    }
+
+    FREE(bb.bits);
+    return rc;
+}
+
+/*
+ * Function called from the event loop to publish the filter of our
+ * shared files if it changed, at most once every bloom_interval seconds
+ */
+void bloom_periodic()
+{
+    struct timeval now, diff;
+
+    if (!bloom_dirty || !registered)
+        return;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &bloom_last, &diff);
+    if (diff.tv_sec < bloom_interval)
+        return;
+
+    bloom_last = now;
+    if (bloom_publish() == 0)
+        bloom_dirty = 0;
+}
+
+/*
+ * Function to get the seconds until the next filter is due to be published
+ * (used as the select timeout), -1 if none is pending
+ */
+int bloom_next_timeout()
+{
+    struct timeval now, diff;
+
+    if (!bloom_dirty || !registered)
+        return -1;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &bloom_last, &diff);
+    if (diff.tv_sec >= bloom_interval)
+        return 0;
+
+    return bloom_interval - diff.tv_sec;
+}
+
+/*
+ * Function to lookup the filter received for a peer
+ * Returns the filter if found, NULL otherwise
+ */
+static struct peer_filter *lookup_peer_filter(struct in_addr ip, unsigned short port)
+{
+    struct list_node *cur;
+    struct peer_filter *f;
+
+    for (cur = peer_filter_list_head; cur != NULL; cur = cur->next) {
+        f = (struct peer_filter *)(cur->container);
+        if (f->ip.s_addr == ip.s_addr && f->port == port)
+            return f;
+    }
+    /* Not found */
+    return NULL;
+}
+
+/*
+ * Function to receive the filter of a peer from the server
+ * (the message type has already been read)
+ * Message format:
+ * MSG_PEER_FILTER | ip | port | number of blocks | blocks
+ *
+ * returns 0 on success, -1 on failure, -2 if the connection is closed
+ */
+int recv_peer_filter()
+{
+    struct peer_filter *f;
+    struct in_addr ip;
+    uint16_t port;
+    uint32_t num_blocks;
+    uint64_t *bits;
+    int len;
+
+    if ((len = read_full(server_fd, &ip, sizeof(ip))) <= 0 ||
+            (len = read_full(server_fd, &port, sizeof(port))) <= 0 ||
+            (len = read_full(server_fd, &num_blocks, sizeof(num_blocks))) <= 0)
+        return len ? -1 : -2;
+
+    /* The number of blocks has to be a power of two */
+    if (num_blocks == 0 || num_blocks > BLOOM_MAX_BLOCKS ||
+            (num_blocks & (num_blocks - 1))) {
+        printf("\nInvalid file filter received from server\n");
+        return -1;
+    }
+
+    bits = (uint64_t *) malloc(num_blocks * BLOOM_BLOCK_SIZE);
+    if (!bits) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    len = read_full(server_fd, bits, num_blocks * BLOOM_BLOCK_SIZE);
+    if (len <= 0) {
+        FREE(bits);
+        return len ? -1 : -2;
+    }
+
+    f = lookup_peer_filter(ip, port);
+    if (!f) {
+        f = (struct peer_filter *) malloc(sizeof(struct peer_filter));
+        if (!f) {
+            printf("\nError in malloc\n");
+            exit(1);
+        }
+        bzero(f, sizeof(struct peer_filter));
+        f->ip = ip;
+        f->port = port;
+        add_to_list(&peer_filter_list_head, f);
+    }
+
+    FREE(f->bits);
+    f->bits = bits;
+    f->num_blocks = num_blocks;
+    return 0;
+}
+
+/*
+ * Function to drop the filters of the peers which are not registered
+ * to the server any more (called when the peer list is updated)
+ */
+void bloom_prune()
+{
+    struct list_node *cur, *next;
+    struct peer_filter *f;
+    int i;
+
+    for (cur = peer_filter_list_head; cur != NULL; cur = next) {
+        next = cur->next;
+        f = (struct peer_filter *)(cur->container);
+
+        for (i = 0; i < num_available_peers; i++) {
+            if (available_peers[i].ip.s_addr == f->ip.s_addr &&
+                    available_peers[i].port == f->port)
+                break;
+        }
+
+        if (i == num_available_peers) {
+            FREE(f->bits);
+            delete_from_list(&peer_filter_list_head, f);
+        }
+    }
+}
+
+/*
+ * Function to display the peers which may have a file (WHOHAS command),
+ * using only the filters received so far
+ *
+ * returns the number of candidate peers
+ */
+int bloom_whohas(char *file_name)
+{
+    struct list_node *cur;
+    struct peer_filter *f;
+    struct connected_peer_node *node;
+    int count = 0;
+
+    for (cur = peer_filter_list_head; cur != NULL; cur = cur->next) {
+        f = (struct peer_filter *)(cur->container);
+        if (!bloom_test(f->bits, f->num_blocks, file_name))
+            continue;
+
+        if (!count) {
+            printf("Peers which may have '%s':\n", file_name);
+            printf("IP\t\tport\tconnection id\n");
+            printf("-----------------------------------------\n");
+        }
+
+        node = lookup_peer_by_address(f->ip, f->port);
+        if (node)
+            printf("%s\t%d\t%d\n", inet_ntoa(f->ip), f->port, node->id);
+        else
+            printf("%s\t%d\t-\n", inet_ntoa(f->ip), f->port);
+        count++;
+    }
+
+    if (!count)
+        printf("No peer is sharing '%s'\n", file_name);
+
+    return count;
+}
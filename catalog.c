@@ -0,0 +1,464 @@
+#include <ctype.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* Initial number of buckets of the (owner, name) hash table */
+#define CATALOG_HASH_SIZE 1024
+
+/* Maximum length of a search term */
+#define MAX_TERM_LEN 255
+
+/* node of the prefix trie built over the terms of the shared file names.
+ * Each node keeps the list of entries having the term ending at it
+ * (the inverted index) */
+struct trie_node {
+    char ch;
+    struct trie_node *parent;
+    struct trie_node *child;        /* first child */
+    struct trie_node *sibling;      /* next child of the parent */
+    struct catalog_entry **postings;
+    int num_postings;
+    int max_postings;
+};
+
+/* A file shared by a client */
+struct catalog_entry {
+    char *name;                     /* file name as advertised */
+    char *lname;                    /* lower case copy, used for matching */
+    uint64_t size;
+    uint64_t hash;
+    struct client_node *owner;
+    struct catalog_entry *owner_next;   /* list of entries of the owner */
+    struct catalog_entry *owner_prev;
+    struct catalog_entry *hash_next;    /* (owner, name) hash table chain */
+    struct trie_node **terms;       /* trie nodes this entry is indexed under */
+    int *term_idx;                  /* position of this entry in their postings */
+    int num_terms;
+    unsigned int seen;              /* last search that returned this entry */
+};
+
+/******* Global values *******/
+static struct trie_node trie_root;              /* root of the term trie */
+static struct catalog_entry **hash_table = NULL;
+static int hash_size = 0;
+static int num_entries = 0;                     /* entries in the catalog */
+static unsigned int search_gen = 0;             /* generation of the last search */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to hash an (owner, name) pair
+ */
+static unsigned int entry_hash(struct client_node *owner, char *name)
+{
+    uint64_t h = fnv1a_hash(name, strlen(name), FNV_OFFSET_BASIS);
+
+    h = fnv1a_hash(&owner, sizeof(owner), h);
+    return (unsigned int)(h % hash_size);
+}
+
+/*
+ * Function to grow the hash table once it gets too loaded
+ */
+static void grow_hash_table()
+{
+    struct catalog_entry **old = hash_table, *e, *next;
+    int i, old_size = hash_size;
+    unsigned int h;
+
+    hash_size = old_size ? old_size * 2 : CATALOG_HASH_SIZE;
+    hash_table = (struct catalog_entry **) calloc(hash_size, sizeof(*hash_table));
+    if (!hash_table) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    for (i = 0; i < old_size; i++) {
+        for (e = old[i]; e != NULL; e = next) {
+            next = e->hash_next;
+            h = entry_hash(e->owner, e->name);
+            e->hash_next = hash_table[h];
+            hash_table[h] = e;
+        }
+    }
+    FREE(old);
+}
+
+/*
+ * Function to lookup the entry shared by owner with the given name
+ * Returns the entry if found, NULL otherwise
+ */
+static struct catalog_entry *lookup_entry(struct client_node *owner, char *name)
+{
+    struct catalog_entry *e;
+
+    if (!hash_size)
+        return NULL;
+
+    for (e = hash_table[entry_hash(owner, name)]; e != NULL; e = e->hash_next) {
+        if (e->owner == owner && strcmp(e->name, name) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * Function to find the trie node for a term
+ * If create is set, the missing nodes are added (lookups never add any)
+ * Returns the node, NULL if not found
+ */
+static struct trie_node *trie_find(char *term, int create)
+{
+    struct trie_node *node = &trie_root, *child;
+
+    for (; *term != '\0'; term++) {
+        for (child = node->child; child != NULL; child = child->sibling) {
+            if (child->ch == *term)
+                break;
+        }
+
+        if (!child) {
+            if (!create)
+                return NULL;
+
+            child = (struct trie_node *) malloc(sizeof(struct trie_node));
+            if (!child) {
+                printf("\nError in malloc\n");
+                exit(1);
+            }
+            bzero(child, sizeof(struct trie_node));
+            child->ch = *term;
+            child->parent = node;
+            child->sibling = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+    return node;
+}
+
+/*
+ * Function to free a trie node which no term ends at nor goes through
+ * any more, and the ancestors left the same way
+ */
+static void trie_prune(struct trie_node *node)
+{
+    struct trie_node *parent, **pp;
+
+    while (node != &trie_root && !node->child && !node->num_postings) {
+        parent = node->parent;
+        for (pp = &parent->child; *pp != node; pp = &(*pp)->sibling)
+            ;
+        *pp = node->sibling;
+
+        FREE(node->postings);
+        free(node);
+        node = parent;
+    }
+}
+
+/*
+ * Function to index an entry under a term
+ */
+static void index_term(struct catalog_entry *e, char *term)
+{
+    struct trie_node *node;
+    int i;
+
+    node = trie_find(term, 1);
+
+    /* The same term may appear twice in a name */
+    for (i = 0; i < e->num_terms; i++) {
+        if (e->terms[i] == node)
+            return;
+    }
+
+    if (node->num_postings == node->max_postings) {
+        node->max_postings = node->max_postings ? node->max_postings * 2 : 4;
+        node->postings = (struct catalog_entry **) realloc(node->postings,
+                node->max_postings * sizeof(*node->postings));
+        if (!node->postings) {
+            printf("\nError in malloc\n");
+            exit(1);
+        }
+    }
+
+    e->terms = (struct trie_node **) realloc(e->terms, (e->num_terms + 1) * sizeof(*e->terms));
+    e->term_idx = (int *) realloc(e->term_idx, (e->num_terms + 1) * sizeof(*e->term_idx));
+    if (!e->terms || !e->term_idx) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    e->terms[e->num_terms] = node;
+    e->term_idx[e->num_terms] = node->num_postings;
+    e->num_terms++;
+    node->postings[node->num_postings++] = e;
+}
+
+/*
+ * Function to remove an entry from the posting list of a trie node
+ * The last posting is moved into the freed position, and the node is
+ * freed once it is of no use
+ */
+static void unindex_term(struct catalog_entry *e, int t)
+{
+    struct trie_node *node = e->terms[t];
+    struct catalog_entry *moved;
+    int idx = e->term_idx[t], i;
+
+    moved = node->postings[--node->num_postings];
+    node->postings[idx] = moved;
+
+    /* update the position recorded in the moved entry */
+    for (i = 0; i < moved->num_terms; i++) {
+        if (moved->terms[i] == node) {
+            moved->term_idx[i] = idx;
+            break;
+        }
+    }
+
+    /* the other terms of e are not below node, or still hold e */
+    trie_prune(node);
+}
+
+/*
+ * Function to split a string into lower case alphanumeric terms
+ * Calls fn for every term found
+ */
+static void for_each_term(char *str, struct catalog_entry *e,
+        void (*fn)(struct catalog_entry *, char *))
+{
+    char term[MAX_TERM_LEN + 1];
+    int i = 0;
+
+    for (;; str++) {
+        if (*str != '\0' && isalnum((unsigned char)*str)) {
+            if (i < MAX_TERM_LEN)
+                term[i++] = tolower((unsigned char)*str);
+            continue;
+        }
+
+        if (i > 0) {
+            term[i] = '\0';
+            fn(e, term);
+            i = 0;
+        }
+
+        if (*str == '\0')
+            break;
+    }
+}
+
+/*
+ * Function to add (or update) a file shared by a client
+ */
+void catalog_add(struct client_node *owner, char *name, uint64_t size, uint64_t hash)
+{
+    struct catalog_entry *e;
+    unsigned int h;
+    int i;
+
+    e = lookup_entry(owner, name);
+    if (e) {
+        /* already known, only the metadata changed */
+        e->size = size;
+        e->hash = hash;
+        return;
+    }
+
+    if (num_entries >= hash_size)
+        grow_hash_table();
+
+    e = (struct catalog_entry *) malloc(sizeof(struct catalog_entry));
+    if (!e) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    bzero(e, sizeof(struct catalog_entry));
+
+    e->name = strdup(name);
+    e->lname = strdup(name);
+    if (!e->name || !e->lname) {
+        printf("Error in strdup()\n");
+        exit(1);
+    }
+    for (i = 0; e->lname[i] != '\0'; i++)
+        e->lname[i] = tolower((unsigned char)e->lname[i]);
+
+    e->size = size;
+    e->hash = hash;
+    e->owner = owner;
+
+    /* add to the owner list */
+    e->owner_next = owner->catalog;
+    if (owner->catalog)
+        owner->catalog->owner_prev = e;
+    owner->catalog = e;
+
+    /* add to the hash table */
+    h = entry_hash(owner, name);
+    e->hash_next = hash_table[h];
+    hash_table[h] = e;
+
+    /* index every term of the name, and the complete name so that
+     * prefixes spanning several terms also match */
+    for_each_term(name, e, index_term);
+    if (strlen(e->lname) <= MAX_TERM_LEN)
+        index_term(e, e->lname);
+
+    num_entries++;
+}
+
+/*
+ * Function to delete an entry from the catalog
+ */
+static void delete_entry(struct catalog_entry *e)
+{
+    struct catalog_entry **pp;
+    int i;
+
+    for (i = 0; i < e->num_terms; i++)
+        unindex_term(e, i);
+
+    /* remove from the hash table */
+    for (pp = &hash_table[entry_hash(e->owner, e->name)]; *pp != NULL; pp = &(*pp)->hash_next) {
+        if (*pp == e) {
+            *pp = e->hash_next;
+            break;
+        }
+    }
+
+    /* remove from the owner list */
+    if (e->owner_prev)
+        e->owner_prev->owner_next = e->owner_next;
+    else
+        e->owner->catalog = e->owner_next;
+    if (e->owner_next)
+        e->owner_next->owner_prev = e->owner_prev;
+
+    FREE(e->name);
+    FREE(e->lname);
+    FREE(e->terms);
+    FREE(e->term_idx);
+    free(e);
+    num_entries--;
+}
+
+/*
+ * Function to remove a file shared by a client
+ *
+ * returns 0 on success, -1 if the file was not in the catalog
+ */
+int catalog_remove(struct client_node *owner, char *name)
+{
+    struct catalog_entry *e;
+
+    e = lookup_entry(owner, name);
+    if (!e)
+        return -1;
+
+    delete_entry(e);
+    return 0;
+}
+
+/*
+ * Function to remove all the files shared by a client
+ * (called when the client goes away)
+ */
+void catalog_remove_owner(struct client_node *owner)
+{
+    while (owner->catalog)
+        delete_entry(owner->catalog);
+}
+
+/*
+ * Function to collect the entries indexed in a trie subtree
+ * Returns the number of results in the results array
+ */
+static int collect_entries(struct trie_node *node, char terms[][MAX_TERM_LEN + 1],
+        int num_terms, struct catalog_entry **results, int count, int max)
+{
+    struct trie_node *child;
+    struct catalog_entry *e;
+    int i, t;
+
+    for (i = 0; i < node->num_postings && count < max; i++) {
+        e = node->postings[i];
+        if (e->seen == search_gen)
+            continue;
+        e->seen = search_gen;
+
+        /* the other terms of the query have to be in the name too */
+        for (t = 1; t < num_terms; t++) {
+            if (!strstr(e->lname, terms[t]))
+                break;
+        }
+        if (t == num_terms)
+            results[count++] = e;
+    }
+
+    for (child = node->child; child != NULL && count < max; child = child->sibling)
+        count = collect_entries(child, terms, num_terms, results, count, max);
+
+    return count;
+}
+
+/* state used to split a query into terms with for_each_term() */
+static char (*query_terms)[MAX_TERM_LEN + 1];
+static int num_query_terms;
+
+static void add_query_term(struct catalog_entry *e, char *term)
+{
+    if (num_query_terms < MAX_SEARCH_TERMS)
+        strcpy(query_terms[num_query_terms++], term);
+}
+
+/*
+ * Function to search the catalog
+ * The first term of the query is matched as a prefix through the trie,
+ * the remaining terms have to appear in the file name.
+ *
+ * Returns the number of matches stored in results (at most max)
+ */
+int catalog_search(char *query, struct catalog_entry **results, int max)
+{
+    char terms[MAX_SEARCH_TERMS][MAX_TERM_LEN + 1];
+    struct trie_node *node;
+
+    query_terms = terms;
+    num_query_terms = 0;
+    for_each_term(query, NULL, add_query_term);
+
+    if (!num_query_terms)
+        return 0;
+
+    node = trie_find(terms[0], 0);
+    if (!node)
+        return 0;
+
+    search_gen++;
+    return collect_entries(node, terms, num_query_terms, results, 0, max);
+}
+
+/*
+ * Function to get the details of a search result
+ */
+void catalog_entry_info(struct catalog_entry *e, char **name, uint64_t *size,
+        uint64_t *hash, struct client_node **owner)
+{
+    *name = e->name;
+    *size = e->size;
+    *hash = e->hash;
+    *owner = e->owner;
+}
+
+/*
+ * Function to get the number of files in the catalog
+ */
+int catalog_count()
+{
+    return num_entries;
+}
@@ -19,8 +19,8 @@
 
 /********* Global Values ***********/
 int registered = 0;        /* Flag indicating if client is registered to server */
-static int recv_in_progress = 0;  /* Number of connections we are receiving files on */
-static int send_in_progress = 0;  /* Number of connections we are sending files to */
+int recv_in_progress = 0;  /* Number of connections we are receiving files on */
+int send_in_progress = 0;  /* Number of connections we are sending files to */
 
 struct list_node *connected_peer_list_head; /* Head of the linked list containing the
                                                details of connected peers */
@@ -37,16 +37,21 @@ int num_available_peers = 0;                        /* Number of available peers
 static char buff[BUFLEN];   /* global buffer for receiving message */
 
 /************ Forward declaration *************/
-int handle_upload_request(struct connected_peer_node *node);
+int handle_upload_request(struct connected_peer_node *node, int relay);
 int handle_download_request(struct connected_peer_node *node);
+static void abandon_transfer(struct connected_peer_node *node);
+static int handle_upload_response(struct connected_peer_node *node, uint16_t msg_type);
+static int handle_transfer_cancel(struct connected_peer_node *node);
 
 
 /************ Function definitions *************/
 
 /*
- * Function to add a connected peer to the linked list
+ * Function to allocate the node of a connection to a peer, and add it
+ * to the end of the linked list
  */
-void add_to_peer_list(struct sockaddr_in peer_addr, char *hostname, int fd, int port)
+static struct connected_peer_node *new_peer_node(struct sockaddr_in peer_addr,
+        char *hostname, int fd, int port)
 {
     struct connected_peer_node *node = NULL;
     node = (struct connected_peer_node*) malloc(sizeof(struct connected_peer_node));
@@ -56,8 +61,8 @@ void add_to_peer_list(struct sockaddr_in peer_addr, char *hostname, int fd, int
     }
 
     bzero(node,sizeof(struct connected_peer_node));
-    node->id = ++last_id;
     node->fd = fd;
+    node->ctx.file_fd = -1;
     node->addr = peer_addr;
     node->port = port;
     if (hostname)
@@ -65,7 +70,66 @@ void add_to_peer_list(struct sockaddr_in peer_addr, char *hostname, int fd, int
 
     /* Add to the end of the list */
     add_to_list_tail(&connected_peer_list_head, node);
+    return node;
+}
+
+/*
+ * Function to add a connected peer to the linked list
+ */
+void add_to_peer_list(struct sockaddr_in peer_addr, char *hostname, int fd, int port)
+{
+    struct connected_peer_node *node = NULL;
+
+    node = new_peer_node(peer_addr, hostname, fd, port);
+    node->id = ++last_id;
     connected_peer_count++;
+
+    /* watch the connections to peers (not the one to the server) */
+    if (fd != server_fd)
+        peer_timer_restart(node);
+
+    /* queued downloads may be waiting for this peer */
+    queue_wakeup();
+}
+
+/*
+ * Function to add an extra data connection of a striped download to the
+ * linked list. It has no connection id and does not count against
+ * MAX_CONN: it only lives for the transfer of its part of the file.
+ */
+struct connected_peer_node *add_stripe_to_peer_list(struct sockaddr_in peer_addr, char *hostname,
+        int fd, int port)
+{
+    struct connected_peer_node *node = NULL;
+
+    node = new_peer_node(peer_addr, hostname, fd, port);
+    node->stripe = 1;
+    peer_timer_restart(node);
+
+    FD_SET(fd, &readfds);
+    if (max_fd < fd) max_fd = fd;
+
+    return node;
+}
+
+/*
+ * Function to close an extra data connection of a striped download,
+ * once its part is over (the transfer accounting is done by the caller)
+ */
+void close_stripe(struct connected_peer_node *node)
+{
+    int fd = node->fd;
+
+    reset_transfer(node);
+
+    /* Remove from peer list */
+    timer_del(&node->timer);
+    delete_from_list(&connected_peer_list_head, node);
+
+    close(fd);
+    FD_CLR(fd, &readfds);
+    if(fd == max_fd)
+        update_maxfd();
 }
 
 /*
@@ -73,18 +137,24 @@ void add_to_peer_list(struct sockaddr_in peer_addr, char *hostname, int fd, int
  */
 void cleanup_peer(struct connected_peer_node *node)
 {
+    int fd = node->fd;
+
     printf("\nPeer %s:%d closed connection\n", 
             inet_ntoa(node->addr.sin_addr), node->port);
 
+    abandon_transfer(node);
+
     /* Remove from peer list */
+    timer_del(&node->timer);
+    if (!node->stripe)
+        connected_peer_count--;
     delete_from_list(&connected_peer_list_head, node);
-    connected_peer_count--;
 
-    close(node->fd);
+    close(fd);
 
     /* update the readfd set and max fd */
-    FD_CLR(node->fd, &readfds);
-    if(node->fd == max_fd)
+    FD_CLR(fd, &readfds);
+    if(fd == max_fd)
         update_maxfd();
 }
 
@@ -104,8 +174,15 @@ void print_peer_list()
     printf("-----------------------------------------------------------------------\n");
     for (tmp = connected_peer_list_head; tmp != NULL; tmp =  tmp->next) {
         node = (struct connected_peer_node *)tmp->container;
-        printf("%d:%s\t\t%s\t\t%d\n", node->id, node->hostname,
+        if (node->stripe)
+            continue;
+        printf("%d:%s\t\t%s\t\t%d", node->id, node->hostname,
                 inet_ntoa(node->addr.sin_addr), node->port);
+        if (node->local)
+            printf("\t(same host)");
+        if (node->ctx.stripes)
+            printf("\t(+%d data connections)", stripe_connections(node));
+        printf("\n");
     }
 }
 
@@ -163,6 +240,8 @@ int address_in_connected_peers(struct sockaddr_in addr)
     struct connected_peer_node *node = NULL;
     for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
         node = (struct connected_peer_node *)(cur->container);
+        if (node->stripe)
+            continue;
         printf("checking against: %s:%d\n", inet_ntoa(node->addr.sin_addr), node->port);
         if (addr.sin_addr.s_addr == node->addr.sin_addr.s_addr && 
                 addr.sin_port == htons(node->port)) {
@@ -201,7 +280,7 @@ struct connected_peer_node *lookup_peer_by_id(struct list_node *head, int id)
     struct connected_peer_node *node = NULL;
     for (cur = head; cur != NULL; cur = cur->next) {
         node = (struct connected_peer_node *)(cur->container);
-        if (node->id == id)
+        if (node->id == id && !node->stripe)
             return node;
     }
     /* Not found */
@@ -209,102 +288,270 @@ struct connected_peer_node *lookup_peer_by_id(struct list_node *head, int id)
 }
 
 /*
- * Function to send PACKET_SIZE amount of data from the file to a peer
- * Also prints the Tx summary if the file send is complete
- *
- * return 0 on success, -1 on failure
+ * Function to find the connection to a peer identified by its listening
+ * address and port
+ * Returns the node if found, NULL otherwise
  */
-int send_file_block(struct connected_peer_node *node)
+struct connected_peer_node *lookup_peer_by_address(struct in_addr ip, unsigned short port)
+{
+    struct list_node *cur;
+    struct connected_peer_node *node = NULL;
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+        node = (struct connected_peer_node *)(cur->container);
+        if (node->addr.sin_addr.s_addr == ip.s_addr && node->port == port &&
+                !node->stripe)
+            return node;
+    }
+    /* Not found */
+    return NULL;
+}
+
+/*
+ * Function to release the file transfer context of a peer
+ * (transfer complete, failed or connection closed)
+ */
+void reset_transfer(struct connected_peer_node *node)
+{
+    if (node->ctx.status == sending || node->ctx.status == relaying) {
+        /* remove from writefds */
+        FD_CLR(node->fd, &writefds);
+    }
+
+    if (node->ctx.fanout)
+        fanout_detach(node);
+    else if (node->ctx.file_fd > 0)
+        close(node->ctx.file_fd);
+    local_copy_stop(node);
+    relay_release(node);
+    sync_stop(node);
+
+    /* reset the file transfer context */
+    node->ctx.file_fd = -1;
+    node->ctx.status = idle;
+    FREE(node->ctx.file_name);
+    node->ctx.file_size = 0;
+    node->ctx.offset = 0;
+    node->ctx.relay_id = 0;
+    node->ctx.throttled = 0;
+    node->ctx.tb = (struct token_bucket){0};
+    xfer_reset(&node->ctx);
+
+    /* the peer is free for the next queued download */
+    queue_wakeup();
+}
+
+/*
+ * Function to stop the file transfer in progress with a peer whose
+ * connection is going away
+ */
+static void abandon_transfer(struct connected_peer_node *node)
+{
+    if (node->ctx.stripes) {
+        /* a part of a striped download */
+        stripe_part_done(node, -2);
+        return;
+    }
+
+    if (node->ctx.status == sending) {
+        send_in_progress--;
+    } else if (node->ctx.status == receiving) {
+        if (node->ctx.relay_id)
+            relay_finish(node, -1);
+        recv_in_progress--;
+        /* download it again once the peer is back */
+        queue_finish(node, 1);
+    } else if (node->ctx.status == cancelling) {
+        recv_in_progress--;
+    } else if (node->ctx.status == requesting) {
+        queue_finish(node, 1);
+    } else if (node->ctx.status != relaying && node->ctx.status != offering &&
+            node->ctx.status != hashing) {
+        return;
+    }
+
+    reset_transfer(node);
+}
+
+/*
+ * Function to print the Tx summary of a completed file send
+ */
+void print_tx_summary(struct connected_peer_node *node)
 {
-    int bytes_sent = 0, bytes_read = 0, retval = 0;
     double tx_rate = 0.0;
-    char buff[PACKET_SIZE];
-    struct timeval start, end, diff;
 
-    if(node->ctx.bytes_remaining) {
-        bzero(buff, PACKET_SIZE);
+    /* Calculate the Tx rate */
+    tx_rate = ((node->ctx.file_size * 8) / 
+               ((node->ctx.total_time.tv_sec * 1000000) + 
+                node->ctx.total_time.tv_usec));
 
-        /* Get the start time */
-        if (gettimeofday(&start, NULL) < 0) {
-            printf("Error getting time: %s\n", strerror(errno));
-            retval = -1;
-            goto cleanup;
-        }
+    tx_rate *= 1000000;
 
-        /* read PACKET_SIZE chunk of data from file */
-        bytes_read = read(node->ctx.file_fd, buff, PACKET_SIZE);
-        if (bytes_read < 0) {
-            printf("Error reading from file: %s\n", strerror(errno));
-            retval = -1;
-            goto cleanup;
-        }
+    printf("Tx(%s): %s -> %s,\nFile Size: %" PRIu64 
+            " Bytes,\nTime Taken: %ld.%06ld seconds, \nTx Rate: %f bits/second\n",
+            my_hostname,my_hostname,node->hostname, 
+            node->ctx.file_size, node->ctx.total_time.tv_sec, 
+            node->ctx.total_time.tv_usec, tx_rate);
+}
 
-        /* send the PACKET_SIZE chunk to peer */
-        bytes_sent = send(node->fd, buff, bytes_read, 0);
-        if (bytes_sent < bytes_read ) {
-            printf("Error sending data to peer: %s\n", strerror(errno));
-            retval = -1;
-            goto cleanup;
-        }
+/*
+ * Function to send the next block of the file to a peer, without blocking.
+ * A block which could not be sent completely is finished first.
+ *
+ * returns 1 if the complete file has been sent,
+ *         0 if there is more to send,
+ *        -1 on failure
+ */
+static int send_next_block(struct connected_peer_node *node)
+{
+    int bytes_read = 0, rc = 0, len = XFER_BLOCK_SIZE, hole = 0;
+    char buff[XFER_BLOCK_SIZE], *data = NULL;
+
+    /* the next file of a batch, once the previous one is sent */
+    if (node->ctx.batch && !xfer_tx_pending(&node->ctx) && !node->ctx.bytes_remaining)
+        batch_next_file(node);
+
+    if (!xfer_tx_pending(&node->ctx) && node->ctx.bytes_remaining) {
+        /* read XFER_BLOCK_SIZE chunk of data from file (or what is left
+         * of the range we send, for a part of a striped download) */
+        if (node->ctx.bytes_remaining < len)
+            len = node->ctx.bytes_remaining;
+
+        /* a large file is read around the page cache, from the start
+         * (unless it is in memory already) */
+        if (direct_mb && !node->ctx.dio && !node->ctx.ra_started && !node->ctx.hot &&
+                !node->ctx.batch)
+            direct_start(&node->ctx, 0);
+
+        /* only the size of the holes of a sparse file is sent */
+        if ((node->ctx.flags & XFER_CAP_SPARSE) && !node->ctx.dio)
+            hole = xfer_find_hole(&node->ctx, &len);
+
+        if (hole) {
+            bytes_read = hole;
+            xfer_queue_hole(node, hole);
+        } else {
+            /* a file served often is sent from memory (see hot_hold()) */
+            data = hot_get_block(node->ctx.hot, node->ctx.offset, len);
+
+            if (!data && node->ctx.dio) {
+                data = direct_read(&node->ctx, len);
+                if (!data)
+                    return -1;
+            } else if (!data && mmap_enabled) {
+                /* sent from the mapped file, without copying it first */
+                data = map_window(&node->ctx, node->ctx.offset, len);
+            }
 
-        /* Get the end time */
-        if (gettimeofday(&end, NULL) < 0) {
-            printf("Error getting time: %s\n", strerror(errno));
-            retval = -1;
-            goto cleanup;
+            if (data) {
+                if (map_queue_block(node, data, len, xfer_queue_mapped) < 0)
+                    return -1;
+                bytes_read = len;
+            } else {
+                bytes_read = pread(node->ctx.file_fd, buff, len, node->ctx.offset);
+                if (bytes_read <= 0) {
+                    printf("Error reading from file: %s\n",
+                            bytes_read ? strerror(errno) : "unexpected end of file");
+                    return -1;
+                }
+
+                /* frame the chunk for the peer (compressed if negotiated) */
+                xfer_queue_block(node, buff, bytes_read);
+            }
         }
-
-        /* Update the total_time */
-        timersub(&end, &start, &diff);
-        timeradd(&(node->ctx.total_time), &diff, &(node->ctx.total_time));
+        node->ctx.offset += bytes_read;
 
         if (node->ctx.bytes_remaining <= bytes_read)
             node->ctx.bytes_remaining = 0;
         else
             node->ctx.bytes_remaining -= bytes_read;
+
+        /* read ahead, and keep large files out of the page cache */
+        if (!node->ctx.dio && !hole)
+            xfer_read_advice(&node->ctx, bytes_read);
     }
-    /* Check if the complete file has been sent */
-    if (!node->ctx.bytes_remaining) {
-        printf("\nSuccessfully sent file!!\n");
 
-        /* Calculate the Tx rate */
-        tx_rate = ((node->ctx.file_size * 8) / 
-                   ((node->ctx.total_time.tv_sec * 1000000) + 
-                    node->ctx.total_time.tv_usec));
+    /* send as much of the frame as the socket takes */
+    rc = xfer_flush(node);
+    if (rc <= 0)
+        return rc;
 
-        tx_rate *= 1000000;
+    return (node->ctx.bytes_remaining == 0 && !batch_more(&node->ctx));
+}
 
-        printf("Tx(%s): %s -> %s,\nFile Size: %" PRIu64 
-                " Bytes,\nTime Taken: %ld.%06ld seconds, \nTx Rate: %f bits/second\n",
-                my_hostname,my_hostname,node->hostname, 
-                node->ctx.file_size, node->ctx.total_time.tv_sec, 
-                node->ctx.total_time.tv_usec, tx_rate);
+/*
+ * Function to send the next block of data from the file to a peer
+ * Also prints the Tx summary if the file send is complete
+ *
+ * return 0 on success, -1 on failure
+ */
+int send_file_block(struct connected_peer_node *node)
+{
+    int retval = 0, rc = 0;
+    struct timeval start, end, diff;
 
-        print_prompt();
-        retval = 0; /* success */
-    } else {
+    /* Before starting a new frame, wait for the rate limits */
+    if (!xfer_tx_pending(&node->ctx) && rate_throttle(node))
+        return 0;
+
+    /* Get the start time */
+    if (gettimeofday(&start, NULL) < 0) {
+        printf("Error getting time: %s\n", strerror(errno));
+        retval = -1;
+        goto cleanup;
+    }
+
+    if (node->ctx.fanout)
+        rc = fanout_send_block(node);
+    else
+        rc = send_next_block(node);
+
+    if (rc < 0) {
+        /* error already printed */
+        retval = -1;
+        goto cleanup;
+    }
+
+    /* Get the end time */
+    if (gettimeofday(&end, NULL) < 0) {
+        printf("Error getting time: %s\n", strerror(errno));
+        retval = -1;
+        goto cleanup;
+    }
+
+    /* Update the total_time */
+    timersub(&end, &start, &diff);
+    timeradd(&(node->ctx.total_time), &diff, &(node->ctx.total_time));
+
+    if (rc == 0) {
         /* continue sending the file */
         return 0;
     }
 
+    /* The complete file has been sent (the parts sent on the extra data
+     * connections of a striped download are accounted by the receiver) */
+    if (node->ctx.batch) {
+        batch_print_summary(node);
+        print_prompt();
+    } else if (!node->stripe) {
+        printf("\nSuccessfully sent file!!\n");
+        print_tx_summary(node);
+        print_prompt();
+    }
+
 cleanup:
     send_in_progress --;
-    /* remove from writefds */
-    FD_CLR(node->fd, &writefds);
-
-    close(node->ctx.file_fd);
+    reset_transfer(node);
 
-    /* reset the file transfer conetxt */
-    node->ctx.file_fd = -1;
-    node->ctx.status = idle;
-    FREE(node->ctx.file_name);
-    node->ctx.file_size = 0;
+    /* an extra data connection only carries one part */
+    if (node->stripe)
+        close_stripe(node);
 
     return retval;
 }
 
 /*
- * Function to receive PACKET_SIZE amount of data from a peer
+ * Function to receive a frame of data from a peer
  * and write it to fle.
  * Also prints the Rx summary if the file receive is complete
  *
@@ -314,14 +561,22 @@ cleanup:
  */
 int receive_file_block(struct connected_peer_node *node)
 {
-    int bytes_received = 0, bytes_written = 0, retval = 0;
+    int bytes_written = 0, retval = 0, rc = 0, cancelled = 0;
     double rx_rate = 0.0;
-    char buff[PACKET_SIZE];
     struct timeval start, end, diff;
 
-    if(node->ctx.bytes_remaining) {
-        bzero(buff, PACKET_SIZE);
+    /* handed over by a peer on the same host, nothing else comes on the
+     * connection (see local_receive_file()) */
+    if (node->ctx.flags & XFER_CAP_FDPASS) {
+        retval = local_receive_file(node);
+        if (!retval)
+            return 0;
+        if (retval > 0)
+            retval = 0;
+        goto cleanup;
+    }
 
+    if(node->ctx.bytes_remaining) {
         /* Get the start time */
         if (gettimeofday(&start, NULL) < 0) {
             printf("Error getting time: %s\n", strerror(errno));
@@ -329,27 +584,25 @@ int receive_file_block(struct connected_peer_node *node)
             goto cleanup;
         }
 
-
-        /* receive a PACKET_SIZE chunk from Peer */
-        bytes_received = read(node->fd, buff, PACKET_SIZE);
-        if (bytes_received < 0) {
-            printf("Error receiving data from peer: %s\n", strerror(errno));
-            retval = -1;
-            goto cleanup;
-        }
-
-        if (bytes_received == 0) {
-            /* connection to peer closed */
-            retval = -2;
+        /* receive (a part of) the next frame from Peer */
+        rc = xfer_recv_frame(node);
+        if (rc < 0) {
+            /* -2: connection to peer closed, -1: error already printed */
+            retval = rc;
             goto cleanup;
         }
 
-        /* write the PACKET_SIZE chunk of data to file */
-        bytes_written = write(node->ctx.file_fd, buff, bytes_received);
-        if (bytes_written < bytes_received) {
-            printf("Error writing to file: %s\n", strerror(errno));
-            retval = -1;
-            goto cleanup;
+        /* write the block of data to file, once the frame is complete */
+        if (rc == 1 && node->ctx.rx_hdr.type == XFER_FRAME_CANCEL) {
+            /* the sender stopped the transfer, nothing more will come */
+            cancelled = 1;
+        } else if (rc == 1) {
+            bytes_written = xfer_write_frame(node);
+            if (bytes_written < 0) {
+                /* error already printed in xfer_write_frame() */
+                retval = -1;
+                goto cleanup;
+            }
         }
 
         /* Get the end time */
@@ -363,11 +616,28 @@ int receive_file_block(struct connected_peer_node *node)
         timersub(&end, &start, &diff);
         timeradd(&(node->ctx.total_time), &diff, &(node->ctx.total_time));
 
-        if (node->ctx.bytes_remaining <= bytes_received)
+        if (node->ctx.bytes_remaining <= bytes_written)
             node->ctx.bytes_remaining = 0;
         else
-            node->ctx.bytes_remaining -= bytes_received;
+            node->ctx.bytes_remaining -= bytes_written;
+    }
+    /* Check if the transfer was stopped by either side */
+    if (cancelled || (node->ctx.status == cancelling && !node->ctx.bytes_remaining)) {
+        if (node->ctx.status == cancelling)
+            printf("\nAborted transfer of '%s' from %s  :  %d\n",
+                    node->ctx.file_name, node->hostname, node->port);
+        else
+            printf("\nTransfer of '%s' cancelled by %s  :  %d\n",
+                    node->ctx.file_name, node->hostname, node->port);
+        print_prompt();
+        goto cleanup;
     }
+
+    /* A part of a striped download: the summary is printed once all the
+     * parts are in */
+    if (!node->ctx.bytes_remaining && node->ctx.stripes)
+        goto cleanup;
+
     /* Check if the complete file has been received */
     if (!node->ctx.bytes_remaining) {
         printf("\nFile name : '%s' \nfrom : %s  :  %d\nSuccessfully received!!\n", 
@@ -393,21 +663,20 @@ int receive_file_block(struct connected_peer_node *node)
     }
 
 cleanup:
-    recv_in_progress--;
-    /* See if we are done downloading all file */
-    if (recv_in_progress <= 0) {
-        printf("\nAll downloads complete\n");
-        print_prompt();
-        /* start accepting commands again */
-        FD_SET(fileno(stdin), &readfds);
+    if (node->ctx.stripes) {
+        stripe_part_done(node, cancelled ? -1 : retval);
+        return retval;
     }
 
-    close(node->ctx.file_fd);
-    /* reset the file transfer sontext */
-    node->ctx.file_fd = -1;
-    node->ctx.status = idle;
-    FREE(node->ctx.file_name);
-    node->ctx.file_size = 0;
+    if (node->ctx.relay_id)
+        relay_finish(node, cancelled ? -1 : retval);
+
+    recv_in_progress--;
+
+    /* free the download slot (retried later if the connection closed) */
+    queue_finish(node, retval == -2);
+
+    reset_transfer(node);
     return retval;
 }
 
@@ -528,15 +797,22 @@ int register_to_server(char *address, unsigned short port)
     /* Add it to select list for peer updates */
     FD_SET(server_fd, &readfds);
     if (max_fd < server_fd) max_fd = server_fd;
+
+    /* and let the server know we are still there */
+    heartbeat_start();
     FREE(msg);
+
+    /* the server only knows the files shared while registered to it */
+    share_republish();
     return 0;
 }
 
 /* 
  * Function to receive the available peer list update from the
- * server and update the local copy
+ * server and update the local copy (or another message from the server)
  *
- * returns 0 on success, -1 otherwise
+ * returns 0 if the peer list was updated, 1 for other messages,
+ * -1 otherwise
  */
 int recv_update_from_server()
 {
@@ -546,7 +822,6 @@ int recv_update_from_server()
     int msglen = 0, len = 0, i = 0;
     struct available_peer_node n;
     struct connected_peer_node *node;
-    struct list_node *tmp;
 
     /* msg format:
      * MSG_PEER_LIST | number of peers | list of IP-port pairs
@@ -564,6 +839,22 @@ int recv_update_from_server()
         goto close;
     }
 
+    if (msg_type == MSG_SEARCH_RESULT) {
+        /* Results of an earlier SEARCH command */
+        len = recv_search_result();
+        if (len == -2)
+            goto close;
+        return (len < 0) ? -1 : 1;
+    }
+
+    if (msg_type == MSG_PEER_FILTER) {
+        /* Filter of the files shared by another peer */
+        len = recv_peer_filter();
+        if (len == -2)
+            goto close;
+        return (len < 0) ? -1 : 1;
+    }
+
     if (msg_type != MSG_PEER_LIST) {
         printf("\nUnknown message %x\n", msg_type);
         return -1;
@@ -580,8 +871,8 @@ int recv_update_from_server()
         goto close;
     }
 
-    /* Now allocate the required space */
-    msglen = UPDATE_MSG_SIZE(size);
+    /* Now allocate the required space (the header is already read) */
+    msglen = UPDATE_MSG_SIZE(size) - UPDATE_MSG_SIZE(0);
     buf = (char *) malloc (msglen);
 
     if (buf == NULL) {
@@ -589,8 +880,9 @@ int recv_update_from_server()
         exit(1);
     }
 
-    /* Now receive the entire message */
-    len = read(server_fd, buf, msglen);
+    /* Now receive the entire message, and nothing more as another
+     * message may follow it */
+    len = read_full(server_fd, buf, msglen);
     if (len < 0) {
         printf("\nError receiving update from server: %s\n", strerror(errno));
         return -1;
@@ -615,6 +907,9 @@ int recv_update_from_server()
 
     num_available_peers = size;
 
+    /* Forget the filters of the peers which went away */
+    bloom_prune();
+
     FREE(buf);
     return 0;
 
@@ -630,16 +925,12 @@ close:
     /* Mark as unregistered */
     registered = 0;
 
-    /* Terminate connections to all clients */
-    tmp = connected_peer_list_head;
-    while (tmp) {
-        node = (struct connected_peer_node *)tmp->container;
-        FD_CLR(node->fd, &readfds);
-        if(node->fd == max_fd) 
-            update_maxfd();
-        close(node->fd);
-        tmp = tmp->next;
-        delete_from_list(&connected_peer_list_head, node);
+    /* Terminate connections to all clients. Closing a peer may remove
+     * others from the list (the data connections of a striped download),
+     * so always start again from the head. */
+    while (connected_peer_list_head) {
+        node = (struct connected_peer_node *)connected_peer_list_head->container;
+        close_peer(node);
     }
   
     FREE(buf);
@@ -650,6 +941,7 @@ close:
  * Receive a connection request from a peer
  * 
  * Returns the listen port of the peer on success
+ * 0 for an extra data connection of a striped download
  * -1 on failure
  */
 int receive_peer_connect(int accept_fd, struct sockaddr_in accept_addr)
@@ -661,8 +953,9 @@ int receive_peer_connect(int accept_fd, struct sockaddr_in accept_addr)
 
     bzero(buff, BUFLEN);
     
-    /* receive the entire message */
-    len = read(accept_fd, buff, BUFLEN);
+    /* receive the entire message (and nothing more, the peer may send
+     * a request right after it) */
+    len = read(accept_fd, buff, sizeof(uint16_t) + sizeof(uint16_t));
     if (len < 0) {
         printf("\nError reading from socket: %s\n", strerror(errno));
         return -1;
@@ -673,19 +966,30 @@ int receive_peer_connect(int accept_fd, struct sockaddr_in accept_addr)
         return -1;
     }
 
-    /* see if we have reached the connection limit */
-    if (connected_peer_count == MAX_CONN) {
-        /* reject connection */
-        close(accept_fd);
-        return -1;
-    }
     /* Parse the message:
      * message format:
      * MSG_CONNECT_REQUEST | port
+     * or
+     * MSG_STRIPE_REQUEST | port | ... (see receive_stripe_request())
      */
     ptr = buff;
 
     msg_type =  *(uint16_t *)ptr;
+    ptr += sizeof(uint16_t);
+    port = *(uint16_t *)ptr;
+
+    /* an extra data connection of a striped download, not counted
+     * against the connection limit */
+    if (msg_type == MSG_STRIPE_REQUEST)
+        return receive_stripe_request(accept_fd, accept_addr, port);
+
+    /* see if we have reached the connection limit */
+    if (connected_peer_count == MAX_CONN) {
+        /* reject connection */
+        close(accept_fd);
+        return -1;
+    }
+
     if (msg_type != MSG_CONNECT_REQUEST) {
         printf("Unknown message from '%s'. Closing connection\n", 
                 inet_ntoa(accept_addr.sin_addr));
@@ -693,13 +997,13 @@ int receive_peer_connect(int accept_fd, struct sockaddr_in accept_addr)
         return -1;
     }
 
-    ptr += sizeof(uint16_t);
-    port = *(uint16_t *)ptr;
-
     /* Get the hostname of the peer */
     getnameinfo((struct sockaddr *) &accept_addr,
             sizeof(struct sockaddr_in), hostname, NI_MAXHOST, NULL, 0, 0);
 
+    /* the receive buffer comes from the listening socket */
+    tcp_tune_socket(accept_fd);
+
     add_to_peer_list(accept_addr, hostname, accept_fd, port);
 
     FD_SET(accept_fd, &readfds);
@@ -708,6 +1012,39 @@ int receive_peer_connect(int accept_fd, struct sockaddr_in accept_addr)
     return port;
 }
 
+/*
+ * Function to open a connection to the peer listening on peer_addr:
+ * over its Unix domain socket if it runs on the same host (local is then
+ * set), over TCP otherwise
+ *
+ * returns the connected socket, -1 on failure
+ */
+static int open_peer_socket(struct sockaddr_in *peer_addr, int *local)
+{
+    int fd = -1;
+
+    fd = local_connect(peer_addr->sin_addr, ntohs(peer_addr->sin_port));
+    if (fd >= 0) {
+        *local = 1;
+        return fd;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        printf("CONNECT: Error creating socket: %s\n", strerror(errno));
+        return -1;
+    }
+    tcp_tune_socket(fd);
+
+    if (connect(fd, (struct sockaddr *)peer_addr, sizeof(struct sockaddr_in)) < 0) {
+        close(fd);
+        printf("CONNECT: Error connecting to peer: %s\n", strerror(errno));
+        return -1;
+    }
+    *local = 0;
+    return fd;
+}
+
 /* 
  * Function to send a connect request to a peer on address:port
  * The peer must be in the available peer list sent by the server
@@ -716,7 +1053,7 @@ int receive_peer_connect(int accept_fd, struct sockaddr_in accept_addr)
  */
 int connect_to_peer(char *address, unsigned short port)
 {
-    int fd = -1, len = 0, rc  = 0, connected = 0, msg_size = 0;
+    int fd = -1, len = 0, rc  = 0, connected = 0, msg_size = 0, local = 0;
     struct sockaddr_in peer_addr;
     char *msg = NULL, *ptr = NULL, *hostname_ptr = NULL;
     struct addrinfo *result, *rp, hints;
@@ -724,6 +1061,7 @@ int connect_to_peer(char *address, unsigned short port)
 
 
     /* Check whether an IP address was entered or a host name */
+    bzero(hostname, sizeof(hostname));
     bzero(&peer_addr, sizeof(peer_addr));
     rc = inet_pton(AF_INET, address, &(peer_addr.sin_addr));
     if (rc == 1) {
@@ -756,15 +1094,9 @@ int connect_to_peer(char *address, unsigned short port)
         }
 
 
-        fd = socket(AF_INET, SOCK_STREAM, 0);
+        fd = open_peer_socket(&peer_addr, &local);
         if (fd < 0) {
-            printf("CONNECT: Error creating socket: %s\n", strerror(errno));
-            return -1;
-        }
-
-        if (connect(fd, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) < 0) {
-            close(fd);
-            printf("CONNECT: Error connecting to peer: %s\n", strerror(errno));
+            /* error already printed in open_peer_socket() */
             return -1;
         }
         hostname_ptr = hostname;
@@ -807,15 +1139,9 @@ int connect_to_peer(char *address, unsigned short port)
                 return -1;
             }
 
-            fd = socket(AF_INET, SOCK_STREAM, 0);
+            fd = open_peer_socket(&peer_addr, &local);
             if (fd < 0) {
-                printf("CONNECT: Error creating socket: %s\n", strerror(errno));
-                return -1;
-            }
-
-            if (connect(fd, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) < 0) {
-                close(fd);
-                printf("CONNECT: Error connecting to peer: %s\n", strerror(errno));
+                /* error already printed in open_peer_socket() */
                 return -1;
             }
 
@@ -832,13 +1158,21 @@ int connect_to_peer(char *address, unsigned short port)
     }
 
 
-    msg_size = sizeof(uint16_t) + sizeof(uint16_t);
+    /* Message format:
+     * MSG_CONNECT_REQUEST | port
+     * or, to a peer on the same host,
+     * MSG_LOCAL_CONNECT_REQUEST | port | IP address
+     */
+    msg_size = sizeof(uint16_t) + sizeof(uint16_t) + (local ? sizeof(struct in_addr) : 0);
     msg = (char *) malloc (msg_size);
     bzero(msg, msg_size);
     ptr = msg;
-    *ptr = (uint16_t) MSG_CONNECT_REQUEST;
+    *(uint16_t *)ptr = local ? MSG_LOCAL_CONNECT_REQUEST : MSG_CONNECT_REQUEST;
     ptr += sizeof(uint16_t);
-    *(int *)ptr = listen_port;
+    *(uint16_t *)ptr = listen_port;
+    ptr += sizeof(uint16_t);
+    if (local)
+        *(struct in_addr *)ptr = myip;
 
     len = send(fd, msg, msg_size, 0);
     if (len < 0) {
@@ -850,10 +1184,11 @@ int connect_to_peer(char *address, unsigned short port)
     }
 
     FREE(msg);
-    printf("Connected to peer %s : %d\n", address, port);
+    printf("Connected to peer %s : %d%s\n", address, port, local ? " (same host)" : "");
 
     /* Add it to select list for peer updates */
     add_to_peer_list(peer_addr, hostname_ptr, fd, ntohs(peer_addr.sin_port));
+    lookup_peer_by_fd(connected_peer_list_head, fd)->local = local;
     FD_SET(fd, &readfds);
     if (max_fd < fd) max_fd = fd;
     return 0;
@@ -870,6 +1205,10 @@ int handle_write(int fd)
 {
     struct connected_peer_node *node = NULL;
 
+    /* The transfer may have ended since select() returned */
+    if (!FD_ISSET(fd, &writefds))
+        return 0;
+
     /* Lookup the peer from the peer list */
     node = lookup_peer_by_fd(connected_peer_list_head, fd);
     if (!node) {
@@ -879,6 +1218,12 @@ int handle_write(int fd)
         return -1;
     }
 
+    node->last_tx = timer_now_ms();
+
+    /* the frames received from upstream, for the next hop of a relay */
+    if (node->ctx.status == relaying)
+        return relay_send_block(node);
+
     if (node->ctx.status != sending) {
         printf("Node not in sending mode\n");
         /* Remove from writefd set */
@@ -908,15 +1253,15 @@ int receive_data_from_peer(int fd)
         return -1;
     }
 
+    node->last_rx = timer_now_ms();
+
     /* Check if we are already sending/receiving and call
      * appropriate handlers */
-    if (node->ctx.status == receiving) {
-        rc = receive_file_block(node);
-        if (rc == -2) 
-            goto close;
-        return rc;
-    } else if (node->ctx.status == sending) {
-        rc = send_file_block(node);
+    if (node->ctx.status == receiving || node->ctx.status == cancelling) {
+        if (node->ctx.batch)
+            rc = batch_receive_block(node);
+        else
+            rc = receive_file_block(node);
         if (rc == -2) 
             goto close;
         return rc;
@@ -937,8 +1282,66 @@ int receive_data_from_peer(int fd)
         return handle_download_request(node);
     }
 
+    if (msg_type == MSG_BATCH_REQUEST) {
+        rc = handle_batch_request(node);
+        if (rc == -2)
+            goto close;
+        return rc;
+    }
+
+    if (msg_type == MSG_SYNC_REQUEST) {
+        rc = handle_sync_request(node);
+        if (rc == -2)
+            goto close;
+        return rc;
+    }
+
+    if (msg_type == MSG_BATCH_OFFER) {
+        rc = handle_batch_offer(node);
+        if (rc == -2)
+            goto close;
+        return rc;
+    }
+
     if (msg_type == MSG_UPLOAD_REQUEST) {
-        return handle_upload_request(node);
+        return handle_upload_request(node, 0);
+    }
+
+    if (msg_type == MSG_RELAY_REQUEST) {
+        return handle_upload_request(node, 1);
+    }
+
+    if (msg_type == MSG_TRANSFER_CANCEL) {
+        return handle_transfer_cancel(node);
+    }
+
+    if (msg_type == MSG_KEEPALIVE) {
+        /* nothing to do, the peer is alive */
+        return 0;
+    }
+
+    if ((msg_type == MSG_UPLOAD_ACCEPT || msg_type == MSG_UPLOAD_REJECT) &&
+            node->ctx.status == offering) {
+        rc = handle_upload_response(node, msg_type);
+        if (rc == -2)
+            goto close;
+        return rc;
+    }
+
+    if ((msg_type == MSG_BATCH_ACCEPT || msg_type == MSG_BATCH_REJECT) &&
+            node->ctx.status == requesting) {
+        rc = batch_response(node, msg_type);
+        if (rc == -2)
+            goto close;
+        return rc;
+    }
+
+    if ((msg_type == MSG_DOWNLOAD_ACCEPT || msg_type == MSG_DOWNLOAD_REJECT) &&
+            node->ctx.status == requesting) {
+        rc = queue_download_response(node, msg_type);
+        if (rc == -2)
+            goto close;
+        return rc;
     }
 
     printf("\nUnknown message received from peer: %s:%d\n", 
@@ -947,11 +1350,16 @@ int receive_data_from_peer(int fd)
 
 close:
     /* connection closed */
-    printf("\nPeer %s:%d closed connection\n", inet_ntoa(node->addr.sin_addr), node->port);
+    if (!node->stripe)
+        printf("\nPeer %s:%d closed connection\n", inet_ntoa(node->addr.sin_addr), node->port);
+
+    abandon_transfer(node);
 
     /* Remove from peer list */
+    timer_del(&node->timer);
+    if (!node->stripe)
+        connected_peer_count--;
     delete_from_list(&connected_peer_list_head, node);
-    connected_peer_count--;
 
     close(fd);
     FD_CLR(fd, &readfds);
@@ -960,44 +1368,94 @@ close:
     return -2;
 }
 
-/* 
- * Function to upload a file (file_name) to a peer identified by conn_id
- *
- * returns 0 on success, -1 on failure
+/*
+ * Function to start an upload once the upload request has been sent:
+ * the transfer context is ready, and the file is sent from the event
+ * loop when the peer accepts it (see handle_upload_response())
  */
+void start_upload(struct connected_peer_node *node, int file_fd, char *file_name,
+        uint64_t file_size)
+{
+    node->ctx.status = offering;
+    peer_timer_restart(node);
+    node->ctx.file_fd = file_fd;
+    node->ctx.file_name = strdup(file_name);
+    node->ctx.bytes_remaining = node->ctx.file_size = file_size;
+    node->ctx.total_time = (struct timeval){0};
+}
 
-int upload_to_peer(int conn_id, char *file_name)
+/*
+ * Function to handle the response of a peer to an upload request
+ * (the message type has already been read)
+ * Response Format:
+ * MSG_UPLOAD_ACCEPT | flags
+ * or
+ * MSG_UPLOAD_REJECT
+ *
+ * returns 0 on success, -2 if the connection is closed, -1 on failure
+ */
+static int handle_upload_response(struct connected_peer_node *node, uint16_t msg_type)
 {
-    struct connected_peer_node *node = NULL;
-    struct stat st;
-    int msg_size = 0, len = 0, bytes_read = 0, bytes_sent = 0, i = 0, file_fd = -1;
-    char *msg = NULL, *ptr = NULL;
-    uint64_t file_size = 0, bytes_remaining = 0;
-    char buff[PACKET_SIZE];
-    char *base_file_name = NULL, *file_name_dup =NULL;
-    struct timeval start, end, diff, total_time = (struct timeval){0};
-    double tx_rate = 0.0;
-    uint16_t msg_type;
+    uint32_t flags = 0;
+    int len;
 
-    /* Do not allow upload to server */
-    if (conn_id == 1) {
-        printf("UPLOAD to server not allowed\n");
-        return -1;
-    }
+    /* the next hop of a relay chain */
+    if (node->ctx.relayq)
+        return relay_response(node, msg_type);
 
-    node = lookup_peer_by_id(connected_peer_list_head, conn_id);
-    if (!node) {
-        printf("UPLOAD: Invalid connection ID\n");
+    if (msg_type == MSG_UPLOAD_REJECT) {
+        printf("\nUPLOAD: Peer %s:%d rejected upload of '%s'\n",
+                inet_ntoa(node->addr.sin_addr), node->port, node->ctx.file_name);
+        reset_transfer(node);
         return -1;
     }
 
-    if (stat(file_name, &st) < 0) {
-        printf("UPLOAD: Error accessing file: %s\n", strerror(errno));
-        return -1;
+    /* Get the flags the peer agreed to */
+    len = read_full(node->fd, &flags, sizeof(flags));
+    if (len <= 0)
+        return len ? -1 : -2;
+
+    /* the peer is on the same host: it gets the open file, and copies
+     * it itself (see local_receive_file()) */
+    if (flags & XFER_CAP_FDPASS) {
+        /* the peer waits for it: without it the connection can't be used */
+        if (local_send_fd(node->fd, node->ctx.file_fd) < 0)
+            return -2;
+        printf("\nHanded over file '%s' to %s  :  %d\n", node->ctx.file_name,
+                node->hostname, node->port);
+        print_prompt();
+        reset_transfer(node);
+        return 0;
     }
 
-    file_size = st.st_size;
-    
+    printf("\nSending file...\nfile name : '%s'\nto :  %s  :  %d \n",
+            node->ctx.file_name, node->hostname, node->port);
+    print_prompt();
+
+    node->ctx.status = sending;
+    peer_timer_restart(node);
+    node->ctx.flags = flags & local_xfer_caps();
+    rate_init_transfer(node);
+
+    FD_SET(node->fd, &writefds);
+    send_in_progress++;
+    return 0;
+}
+
+/*
+ * Function to send an upload request for file_name to a peer, asking for
+ * the transfer flags caps
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int send_upload_msg(struct connected_peer_node *node, char *file_name,
+        uint64_t file_size, struct available_peer_node *hops, int hop_count,
+        uint32_t caps)
+{
+    int msg_size = 0, len = 0;
+    char *msg = NULL, *ptr = NULL;
+    char *base_file_name = NULL, *file_name_dup =NULL;
+
     /* create a copy of the filename because basename may modify it */
     file_name_dup = strdup(file_name);
     if (!file_name_dup) {
@@ -1010,9 +1468,14 @@ int upload_to_peer(int conn_id, char *file_name)
 
     /* First send the upload command followed by the file size */
     /* Message format:
-     * MSG_UPLOAD_REQUEST | filesize | filename size | filename 
+     * MSG_UPLOAD_REQUEST | filesize | flags | filename size | filename 
+     * or, if the file has to be relayed further down a chain of peers
+     * MSG_RELAY_REQUEST | filesize | flags | hop count | hops | filename size | filename 
      */
-    msg_size = sizeof(uint16_t) + sizeof(uint64_t) + sizeof(uint64_t) + strlen(base_file_name);
+    msg_size = sizeof(uint16_t) + sizeof(uint64_t) + sizeof(uint32_t) +
+        sizeof(uint64_t) + strlen(base_file_name);
+    if (hop_count)
+        msg_size += sizeof(uint8_t) + hop_count * sizeof(struct available_peer_node);
     msg = (char *) malloc (msg_size);
     if (!msg) {
         printf("Error in malloc\n");
@@ -1021,114 +1484,133 @@ int upload_to_peer(int conn_id, char *file_name)
 
     bzero(msg, msg_size);
     ptr = msg;
-    *ptr = (uint16_t) MSG_UPLOAD_REQUEST;
+    *(uint16_t *)ptr = (uint16_t) (hop_count ? MSG_RELAY_REQUEST : MSG_UPLOAD_REQUEST);
     ptr += sizeof(uint16_t);
 
-    *(int *)ptr = file_size;
+    *(uint64_t *)ptr = file_size;
     ptr += sizeof(uint64_t);
 
-    *(int *)ptr = strlen(base_file_name);
+    *(uint32_t *)ptr = caps;
+    ptr += sizeof(uint32_t);
+
+    if (hop_count) {
+        *(uint8_t *)ptr = hop_count;
+        ptr += sizeof(uint8_t);
+        memcpy(ptr, hops, hop_count * sizeof(struct available_peer_node));
+        ptr += hop_count * sizeof(struct available_peer_node);
+    }
+
+    *(uint64_t *)ptr = strlen(base_file_name);
     ptr += sizeof(uint64_t);
 
-   for (i = 0; i< strlen(file_name); ++i) {
-      *ptr++ = base_file_name[i];
-   } 
+    memcpy(ptr, base_file_name, strlen(base_file_name));
 
     len = send(node->fd, msg, msg_size, 0);
     if (len < 0) {
         printf("\nUPLOAD: error sending message to peer: %s\n", strerror(errno));
         FREE(msg);
+        FREE(file_name_dup);
         return -1;
     }
 
     FREE(msg);
     FREE(file_name_dup);
+    return 0;
+}
 
-    /* Get the response MSG_UPLOAD_ACCEPT or MSG_UPLOAD_REJECT */
-    len = read(node->fd, (uint16_t *)&msg_type, sizeof(uint16_t));
-    if (len < 0) {
-        printf("\nUPLOAD: Error receiving data from peer: %s\n", strerror(errno));
+/*
+ * Function to send an upload request for file_name to a peer, without
+ * waiting for the response
+ * A peer on the same host may take the open file instead (unless the file
+ * is relayed further, which needs the data)
+ *
+ * returns 0 on success, -1 on failure
+ */
+int send_upload_offer(struct connected_peer_node *node, char *file_name,
+        uint64_t file_size, struct available_peer_node *hops, int hop_count)
+{
+    uint32_t caps = local_xfer_caps();
+
+    if (node->local && fdpass_enabled && !hop_count)
+        caps |= XFER_CAP_FDPASS;
+
+    return send_upload_msg(node, file_name, file_size, hops, hop_count, caps);
+}
+
+/*
+ * Function to send the request to relay file_name to the next peer of a
+ * chain, without waiting for the response (see relay_response())
+ * The blocks are sent as they come from upstream, so the file is never
+ * handed over
+ *
+ * returns 0 on success, -1 on failure
+ */
+int send_upload_request(struct connected_peer_node *node, char *file_name,
+        uint64_t file_size, struct available_peer_node *hops, int hop_count)
+{
+    return send_upload_msg(node, file_name, file_size, hops, hop_count, local_xfer_caps());
+}
+
+/* 
+ * Function to upload a file (file_name) to a peer identified by conn_id
+ *
+ * returns 0 on success, -1 on failure
+ */
+
+int upload_to_peer(int conn_id, char *file_name)
+{
+    struct connected_peer_node *node = NULL;
+    struct stat st;
+    int file_fd = -1;
+
+    /* Do not allow upload to server */
+    if (conn_id == 1) {
+        printf("UPLOAD to server not allowed\n");
+        return -1;
+    }
+
+    node = lookup_peer_by_id(connected_peer_list_head, conn_id);
+    if (!node) {
+        printf("UPLOAD: Invalid connection ID\n");
         return -1;
     }
 
-    if (len == 0)  {
-        cleanup_peer(node);
+    if (node->ctx.status != idle) {
+        printf("UPLOAD: A file transfer is already in progress with %s\n",
+                node->hostname);
         return -1;
     }
 
-    if (msg_type != MSG_UPLOAD_ACCEPT) {
-        printf("\nUPLOAD: Peer %s rejected upload request\n", node->hostname);
+    if (stat(file_name, &st) < 0) {
+        printf("UPLOAD: Error accessing file: %s\n", strerror(errno));
         return -1;
     }
 
-    /* Now start sending the file in chunks */
+    /* a directory is offered with everything below it, as a batch */
+    if (S_ISDIR(st.st_mode))
+        return batch_offer(node, file_name);
+
+    if (!S_ISREG(st.st_mode)) {
+        printf("UPLOAD: '%s' not a regular file\n", file_name);
+        return -1;
+    }
 
     /* Open the file for reading */
     file_fd = open(file_name, O_RDONLY);
-
     if (file_fd < 0) {
         printf("UPLOAD: Error opening file '%s': %s\n", file_name, strerror(errno));
         return -1;
     }
 
-    printf("\nSending file...\nfile name : '%s'\nto :  %s  :  %d \n", file_name, node->hostname, node->port);
-
-    bytes_remaining = file_size;
-    while(bytes_remaining) {
-        bzero(buff, PACKET_SIZE);
-        /* Get the start time */
-        if (gettimeofday(&start, NULL) < 0) {
-            printf("UPLOAD: Error getting time: %s\n", strerror(errno));
-            close(file_fd);
-            return -1;
-        }
-
-        /* read PACKET_SIZE chunk of data from file */
-        bytes_read = read(file_fd, buff, PACKET_SIZE);
-        if (bytes_read < 0) {
-            printf("UPLOAD: Error reading from file: %s\n", strerror(errno));
-            close(file_fd);
-            return -1;
-        }
-
-        /* Send the chunk to Peer */
-        bytes_sent = send(node->fd, buff, bytes_read, 0);
-        if (bytes_sent < bytes_read) {
-            printf("UPLOAD: Error sending data to peer: %s\n", strerror(errno));
-            close(file_fd);
-            return -1;
-        }
-
-        /* Get the end time */
-        if (gettimeofday(&end, NULL) < 0) {
-            printf("UPLOAD: Error getting time: %s\n", strerror(errno));
-            close(file_fd);
-            return -1;
-        }
-
-        timersub(&end, &start, &diff);
-        timeradd(&total_time, &diff, &total_time);
-
-        if (bytes_remaining <= bytes_sent)
-            bytes_remaining = 0;
-        else
-            bytes_remaining -= bytes_sent;
+    if (send_upload_offer(node, file_name, st.st_size, NULL, 0) < 0) {
+        /* error already printed in send_upload_offer() */
+        close(file_fd);
+        return -1;
     }
 
-    close(file_fd);
-    printf("Successfully uploaded file!!\n");
-
-    /* Calculate the Tx rate */
-    tx_rate = ((file_size * 8) / 
-            ((total_time.tv_sec * 1000000) + total_time.tv_usec));
-
-    tx_rate *= 1000000;
-
-    printf("\nTx (%s): %s -> %s, \nFile Size: %" PRIu64 
-            " Bytes, \nTime Taken: %ld.%06ld seconds,\nTx Rate: %f bits/second\n",
-            my_hostname, my_hostname, node->hostname, 
-            file_size, total_time.tv_sec, total_time.tv_usec, tx_rate);
-
+    /* create the file transfer context for the node, the file is sent
+     * from the event loop once the peer accepts it */
+    start_upload(node, file_fd, file_name, st.st_size);
     return 0;
 }
 
@@ -1141,7 +1623,7 @@ int upload_to_peer(int conn_id, char *file_name)
  *
  * returns 0 on success, -1 on failure
  */
-int handle_upload_request(struct connected_peer_node *node)
+int handle_upload_request(struct connected_peer_node *node, int relay)
 {
     int len = 0;
     char *ptr = NULL;
@@ -1153,15 +1635,22 @@ int handle_upload_request(struct connected_peer_node *node)
     mode_t mode;
     int rc = 0;
     uint16_t msg_type;
+    uint32_t flags = 0;
+    uint8_t hop_count = 0;
+    int fdpass = 0;
+    struct available_peer_node hops[MAX_RELAY_HOPS];
+    struct connected_peer_node *downstream = NULL;
 
     /* 
      * Message format:
-     * MSG_UPLOAD_REQUEST | file size | file name size | file name
+     * MSG_UPLOAD_REQUEST | file size | flags | file name size | file name
+     * or
+     * MSG_RELAY_REQUEST | file size | flags | hop count | hops | file name size | file name
      */
 
     /* we have already received the msg type, now receive the file size
-     * and file name size */
-    len = read(node->fd, &buff, sizeof(uint64_t) + sizeof(uint64_t));
+     * and flags */
+    len = read(node->fd, &buff, sizeof(uint64_t) + sizeof(uint32_t));
     if (len < 0) {
         printf("\nError receiving data from peer\n");
         return -1;
@@ -1175,7 +1664,57 @@ int handle_upload_request(struct connected_peer_node *node)
 
     file_size = *(uint64_t *)ptr;
     ptr+= sizeof(uint64_t);
-    file_name_len = *(uint64_t *)ptr;
+    flags = *(uint32_t *)ptr;
+
+    /* a peer on the same host may hand over its open file */
+    fdpass = (flags & XFER_CAP_FDPASS) && node->local && fdpass_enabled && !relay;
+    flags = (flags & local_xfer_caps()) | (fdpass ? XFER_CAP_FDPASS : 0);
+
+    /* the blocks are forwarded along a relay chain as they come, holes
+     * can't be */
+    if (relay)
+        flags &= ~XFER_CAP_SPARSE;
+
+    if (relay) {
+        /* receive the rest of the chain this file has to be relayed to */
+        len = read(node->fd, &hop_count, sizeof(uint8_t));
+        if (len == 0) {
+            goto close;
+        }
+
+        if (len < 0 || hop_count > MAX_RELAY_HOPS) {
+            printf("\nError receiving data from peer\n");
+            return -1;
+        }
+
+        if (hop_count) {
+            len = read(node->fd, hops, hop_count * sizeof(struct available_peer_node));
+            if (len < 0) {
+                printf("\nError receiving data from peer\n");
+                return -1;
+            }
+
+            if (len == 0) {
+                goto close;
+            }
+        }
+    }
+
+    /* and the file name size */
+    len = read(node->fd, &file_name_len, sizeof(uint64_t));
+    if (len < 0) {
+        printf("\nError receiving data from peer\n");
+        return -1;
+    }
+
+    if (len == 0) {
+        goto close;
+    }
+
+    if (file_name_len >= sizeof(file_name)) {
+        printf("\nInvalid file name received from peer\n");
+        goto close;
+    }
 
     /* Now receive the file name */
     len = read(node->fd, &file_name, file_name_len);
@@ -1192,7 +1731,7 @@ int handle_upload_request(struct connected_peer_node *node)
 
     /* Open the file for creating */
     mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-    file_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    file_fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, mode);
 
     if (file_fd < 0) {
         printf("\nError creating file: %s\n", strerror(errno));
@@ -1206,9 +1745,35 @@ int handle_upload_request(struct connected_peer_node *node)
         return -1;
     }
 
-    /* Everything fine so far - Send the UPLOAD_ACCEPT message */
-    msg_type = (uint16_t) MSG_UPLOAD_ACCEPT;
-    len = send(node->fd, (char *)&msg_type, sizeof(msg_type), 0);
+    /* reserve the space for the whole file (unless it is copied from the
+     * peer's file) */
+    if (!fdpass && xfer_prealloc(file_fd, file_size) < 0) {
+        close(file_fd);
+        msg_type = (uint16_t) MSG_UPLOAD_REJECT;
+        if (send(node->fd, (char *)&msg_type, sizeof(msg_type), 0) < 0)
+            printf("\nError sending message to peer\n");
+        return -1;
+    }
+
+    /* Set up the next hop of the chain before accepting, so the blocks
+     * can be forwarded as soon as they arrive */
+    if (hop_count) {
+        downstream = relay_open_downstream(node, hops, hop_count, file_name, file_size);
+        if (!downstream) {
+            printf("\nRELAY: could not relay '%s' to %s:%d, receiving it locally only\n",
+                    file_name, inet_ntoa(hops[0].ip), hops[0].port);
+        }
+    }
+
+    /* Everything fine so far - Send the UPLOAD_ACCEPT message
+     * Message format:
+     * MSG_UPLOAD_ACCEPT | flags
+     */
+    ptr = buff;
+    *(uint16_t *)ptr = (uint16_t) MSG_UPLOAD_ACCEPT;
+    ptr += sizeof(uint16_t);
+    *(uint32_t *)ptr = flags;
+    len = send(node->fd, buff, sizeof(uint16_t) + sizeof(uint32_t), 0);
     if (len < 0) {
         printf("\nError sending message to peer\n");
         return -1;
@@ -1219,10 +1784,24 @@ int handle_upload_request(struct connected_peer_node *node)
 
     /* Add to the file transfer context for the node */
     node->ctx.status = receiving;
+    peer_timer_restart(node);
     node->ctx.file_fd = file_fd;
     node->ctx.file_name = strdup(file_name);
     node->ctx.bytes_remaining = node->ctx.file_size = file_size;
     node->ctx.total_time = (struct timeval){0};
+    node->ctx.flags = flags;
+    node->ctx.relay_id = downstream ? downstream->id : 0;
+    file_fd = -1;
+
+    recv_in_progress++;
+
+    /* copied from the open file of the peer, once the peer has handed
+     * it over (see receive_file_block()) */
+    if (fdpass)
+        return 0;
+
+    direct_start(&node->ctx, 1);
+    map_prepare(&node->ctx);
 
     rc = receive_file_block(node);
     if (rc == -2) {
@@ -1239,146 +1818,6 @@ close:
     return -1;
 }
 
-/*
- * Function to send download file request to peers (called as a result 
- * of DOWNLOAD command)
- * This function sends the MSG_DOWNLOAD_REQUEST to all the requested peers and
- * receives the response.
- * If accpeted, it adds the fd to write fd set to send the data
- * If rejected, it prints a message and skips
- *
- * returns 0 on success, -1 on failure
- */
-int download_from_peer(int conn_id[], char file_name[][255], int count)
-{
-    int i, j, len, success = 0;
-    uint16_t msg_type;
-    struct connected_peer_node *node;
-    uint64_t file_size;
-    mode_t mode;
-    int msg_size;
-    char *msg = NULL, *ptr = NULL;
-
-    mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-
-    for (i = 0; i < count; ++i) {
-        if (conn_id[i] == 1) {
-            printf("DOWLOAD from server not allowed , Please type HELP,\nskipping..\n");
-            continue;
-        }
-        node = lookup_peer_by_id(connected_peer_list_head, conn_id[i]);
-        if (!node) {
-            printf("DOWNLOAD: Invalid connection ID %d\n", conn_id[i]);
-            continue;
-        }
-
-        /* First send the upload command followed by the file name */
-        /* Message format:
-         * MSG_DOWNLOAD | filename size | filename 
-         */
-        msg_size = sizeof(uint16_t) + sizeof(uint64_t) + strlen(file_name[i]);
-        msg = (char *) malloc (msg_size);
-
-        if (!msg) {
-            printf("Error in malloc\n");
-            exit(1);
-        }
-
-        bzero(msg, msg_size);
-        ptr = msg;
-        *ptr = (uint16_t) MSG_DOWNLOAD_REQUEST;
-        ptr += sizeof(uint16_t);
-
-        *(int *)ptr = strlen(file_name[i]);
-        ptr += sizeof(uint64_t);
-
-        for (j = 0; j< strlen(file_name[i]); ++j) {
-            *ptr++ = file_name[i][j];
-        } 
-
-        len = send(node->fd, msg, msg_size, 0);
-        if (len < 0) {
-            printf("\nDOWNLOAD: error sending message to peer: %s\n",
-                    strerror(errno));
-            FREE(msg);
-            continue;
-        }
-        FREE(msg);
-
-        /* Now receive the response */
-        /* Response Format:
-         * MSG_DOWNLOAD_ACCEPT | filesize
-         * or
-         * MSG_DOWNLAOD_REJECT
-         */
-
-        /* First receive the message type */
-        len = read(node->fd, (uint16_t *)&msg_type, sizeof(uint16_t));
-        if (len < 0) {
-            printf("\nDOWNLOAD: Error receiving update from server: %s\n",
-                    strerror(errno));
-            continue;
-        }
-
-        if (len == 0) {
-            cleanup_peer(node);
-            continue;
-        }
-
-        if (msg_type == MSG_DOWNLOAD_REJECT) {
-            /* Peer rejected the download */
-            printf("DOWNLOAD: Download requested rejected by Peer\n");
-            continue;
-        }
-        if (msg_type != MSG_DOWNLOAD_ACCEPT) {
-            printf("Unknown message\n");
-            continue;
-        }
-
-        /* We have received an MSG_DOWNLOAD_ACCEPT message */
-
-        /* Now receive the size of the file */
-        len = read(node->fd, (char *)&file_size, sizeof(uint64_t));
-        if (len < 0) {
-            printf("DOWNLOAD: Error receiving data from peer\n");
-            continue;
-        }
-       
-        if (len == 0) {
-            cleanup_peer(node);
-            continue;
-        }
-
-        /* create the file to be downloaded */
-        node->ctx.file_fd = open(file_name[i], O_WRONLY | O_CREAT | O_TRUNC, mode);
-
-        if (node->ctx.file_fd < 0) {
-            printf("DOWNLOAD: Error creating file: %s\n", strerror(errno));
-            continue;
-        }
-
-        /* create the file transfer context for the node */
-        node->ctx.status = receiving;
-        node->ctx.file_name = strdup(file_name[i]);
-        node->ctx.bytes_remaining = node->ctx.file_size = file_size;
-        node->ctx.total_time = (struct timeval){0};
-
-        recv_in_progress++;
-        printf("\nReceiving file..\n");
-        success = 1;
-        node = NULL;
-    }
-    if (!success) {
-        /* none of the files could be downloaded */
-        printf("DOWNLOAD: No files could be downloaded\n");
-        return -1;
-    }
-    /* remove the stdin from select FD set, until all the downloads are complete */
-    FD_CLR(fileno(stdin), &readfds);
-
-    return 0;
-}
-
 /*
  * Function to receive and process the download request from peer
  * This function receives the request and sends the response
@@ -1392,11 +1831,28 @@ int download_from_peer(int conn_id[], char file_name[][255], int count)
 int handle_download_request(struct connected_peer_node *node)
 {
     int len = 0, msg_size = 0;
-    char *ptr = NULL, *msg = NULL;
-    uint64_t file_size = 0, file_name_len = 0;
+    char *ptr = NULL, *msg = NULL, *path = NULL;
+    uint64_t file_size = 0, file_name_len = 0, offset = 0, part_len = 0;
     char file_name[255];
     struct stat st;
     uint16_t msg_type;
+    uint32_t flags = 0, stripes = 0;
+    int fdpass = 0;
+
+    /* Message format:
+     * MSG_DOWNLOAD | flags | filename size | filename
+     */
+
+    /* receive the requested flags */
+    len = read(node->fd, &flags, sizeof(uint32_t));
+    if (len < 0) {
+        printf("\nError receiving data from peer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (len == 0) {
+        goto close;
+    }
 
     /* receive the file name size */
     len = read(node->fd, &file_name_len, sizeof(uint64_t));
@@ -1409,6 +1865,11 @@ int handle_download_request(struct connected_peer_node *node)
         goto close;
     }
 
+    if (file_name_len >= sizeof(file_name)) {
+        printf("\nInvalid file name received from peer\n");
+        goto close;
+    }
+
     /* Now receive the file name */
     len = read(node->fd, &file_name, file_name_len);
     if (len < 0) {
@@ -1422,45 +1883,78 @@ int handle_download_request(struct connected_peer_node *node)
 
     file_name[file_name_len] = '\0';
 
-    /* Check if the file exists, and readable
-     * if no, send MSG_DOWNLOAD_REJECT
-     * else send MSG_DOWNLOAD_ACCEPT along with the file size */
-
-    /* Check if the file exists and we have read permission on the file */
-    if (access(file_name, R_OK) < 0){
-        printf("File not found OR No read permission on requested file '%s'\n", file_name);
-        goto reject;
-    }
-    if (stat(file_name, &st) < 0) {
-        printf("Error accessing file: %s\n", strerror(errno));
+    /* a shared file is served from the directory it was shared from */
+    path = share_resolve(file_name);
+    if (!path) {
+        printf("Requested file '%s' is not shared\n", file_name);
         goto reject;
     }
+    if (path != file_name)
+        strcpy(file_name, path);
 
-    file_size = st.st_size;
-    /* Check if this is a regular file */
-    if (!S_ISREG(st.st_mode)) {
-        printf("Reqested file '%s' not a regular file\n", file_name);
-        goto reject;
-    }
+    /* A file served recently is still open, and known to be fine */
+    node->ctx.file_fd = hot_lookup(file_name, &st);
+    if (node->ctx.file_fd < 0) {
+        /* Check if the file exists, and readable
+         * if no, send MSG_DOWNLOAD_REJECT
+         * else send MSG_DOWNLOAD_ACCEPT along with the file size */
+
+        /* Check if the file exists and we have read permission on the file */
+        if (access(file_name, R_OK) < 0){
+            printf("File not found OR No read permission on requested file '%s'\n", file_name);
+            goto reject;
+        }
+        if (stat(file_name, &st) < 0) {
+            printf("Error accessing file: %s\n", strerror(errno));
+            goto reject;
+        }
 
-    /* open the file to be sent */
-    node->ctx.file_fd = open(file_name, O_RDONLY);
+        /* a directory is sent with everything below it, as a batch */
+        if (S_ISDIR(st.st_mode))
+            return batch_send_dir(node, file_name, flags);
 
-    if (node->ctx.file_fd < 0) {
-        printf("Error opening requested file '%s': %s\n", 
-                file_name, strerror(errno));
-        goto reject;
+        /* Check if this is a regular file */
+        if (!S_ISREG(st.st_mode)) {
+            printf("Reqested file '%s' not a regular file\n", file_name);
+            goto reject;
+        }
+
+        /* open the file to be sent */
+        node->ctx.file_fd = open(file_name, O_RDONLY);
+
+        if (node->ctx.file_fd < 0) {
+            printf("Error opening requested file '%s': %s\n", 
+                    file_name, strerror(errno));
+            goto reject;
+        }
+
+        /* kept open for the next downloads */
+        hot_insert(file_name, node->ctx.file_fd, &st);
     }
+    file_size = st.st_size;
+
+    /* Only use the features both sides support, and split a large file
+     * in (at most) as many parts as asked for */
+    stripes = node->local ? 0 : stripe_grant(flags, file_size);
+    fdpass = (flags & XFER_CAP_FDPASS) && node->local && fdpass_enabled;
+    flags = (flags & local_xfer_caps()) | (stripes << XFER_STRIPES_SHIFT) |
+        (fdpass ? XFER_CAP_FDPASS : 0);
 
-    /* Now send the MSG_DOWNLOAD_ACCEPT response */
-    msg_size = sizeof(uint16_t) + sizeof(uint64_t);
+    /* Now send the MSG_DOWNLOAD_ACCEPT response
+     * Message format:
+     * MSG_DOWNLOAD_ACCEPT | filesize | flags
+     */
+    msg_size = sizeof(uint16_t) + sizeof(uint64_t) + sizeof(uint32_t);
     msg = (char *) malloc (msg_size);
     bzero(msg, msg_size);
     ptr = msg;
-    *ptr = (uint16_t) MSG_DOWNLOAD_ACCEPT;
+    *(uint16_t *)ptr = (uint16_t) MSG_DOWNLOAD_ACCEPT;
     ptr += sizeof(uint16_t);
 
     *(uint64_t *)ptr = file_size;
+    ptr += sizeof(uint64_t);
+
+    *(uint32_t *)ptr = flags;
 
     len = send(node->fd, msg, msg_size, 0);
     if (len < 0) {
@@ -1470,16 +1964,43 @@ int handle_download_request(struct connected_peer_node *node)
         return -1;
     }
 
+    FREE(msg);
+
+    /* the peer is on the same host: it gets the open file, and copies
+     * it itself (see local_receive_file()) */
+    if (fdpass) {
+        /* the peer waits for it: without it the connection can't be used */
+        if (local_send_fd(node->fd, node->ctx.file_fd) < 0)
+            goto close;
+        printf("\nHanded over file '%s' to %s  :  %d\n", file_name,
+                node->hostname, node->port);
+        print_prompt();
+        close(node->ctx.file_fd);
+        node->ctx.file_fd = -1;
+        return 0;
+    }
+
     printf("\nSending file...\nfile name : '%s' \nto : %s  :  %d\n", file_name, node->hostname, node->port);
+    if (stripes)
+        printf("in %d parts, the first one on this connection\n", stripes + 1);
     print_prompt();
 
+    /* the other parts of a striped download are sent on the extra data
+     * connections the peer opens (see receive_stripe_request()) */
+    part_len = file_size;
+    if (stripes)
+        stripe_range(file_size, stripes + 1, 0, &offset, &part_len);
+
     /* create the file transfer context for the node */
     node->ctx.status = sending;
+    peer_timer_restart(node);
     node->ctx.file_name = strdup(file_name);
-    node->ctx.bytes_remaining = node->ctx.file_size = file_size;
+    node->ctx.bytes_remaining = node->ctx.file_size = part_len;
     node->ctx.total_time = (struct timeval){0};
+    node->ctx.flags = flags & local_xfer_caps();
+    node->ctx.hot = hot_hold(file_name);
+    rate_init_transfer(node);
 
-    FREE(msg);
     /* Now add the socket to write fd set */
     FD_SET(node->fd, &writefds);
     send_in_progress++;
@@ -1520,16 +2041,161 @@ int terminate_connection(int conn_id)
 
     printf("Terminated connection to %s  :  %d\n", inet_ntoa(node->addr.sin_addr), node->port);
 
+    close_peer(node);
+    return 0;
+}
+
+/*
+ * Function to close the connection to a peer, stopping the transfer in
+ * progress, and remove it from the peer list
+ */
+void close_peer(struct connected_peer_node *node)
+{
+    abandon_transfer(node);
+
     close(node->fd);
     FD_CLR(node->fd, &readfds);
     if(node->fd == max_fd) 
         update_maxfd();
 
     /* Remove from peer list */
+    timer_del(&node->timer);
+    if (!node->stripe)
+        connected_peer_count--;
     delete_from_list(&connected_peer_list_head, node);
-    connected_peer_count--;
+}
+
+/*
+ * Function to stop the upload to a peer, telling it with a cancel frame
+ * so that the connection can be kept
+ *
+ * returns 0 on success, -1 on failure (the connection is then closed)
+ */
+static int cancel_upload(struct connected_peer_node *node)
+{
+    int rc = 0;
+
+    rc = xfer_send_cancel(node);
+
+    send_in_progress--;
+    reset_transfer(node);
 
+    if (rc < 0) {
+        /* the peer can't find the end of the transfer any more */
+        terminate_connection(node->id);
+        return -1;
+    }
     return 0;
 }
 
+/*
+ * Function to handle the request of a peer to stop the transfer
+ * it is receiving from us (the message type has already been read)
+ * Message format:
+ * MSG_TRANSFER_CANCEL
+ *
+ * A request which arrives once the last block has been sent is ignored,
+ * the peer gets the complete file anyway.
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int handle_transfer_cancel(struct connected_peer_node *node)
+{
+    if (node->ctx.status == relaying) {
+        relay_cancel(node);
+        print_prompt();
+        return 0;
+    }
+
+    if (node->ctx.status != sending ||
+            (!node->ctx.bytes_remaining && !batch_more(&node->ctx)))
+        return 0;
+
+    printf("\nUpload of '%s' cancelled by %s  :  %d\n",
+            node->ctx.file_name, node->hostname, node->port);
+    print_prompt();
+
+    return cancel_upload(node);
+}
+
+/*
+ * Function to abort the file transfer in progress with a peer identified
+ * by conn_id, keeping the connection open for the next transfer.
+ * An upload is stopped with a cancel frame. For a download, the peer is
+ * asked to stop and the data already in flight is dropped until its
+ * cancel frame arrives.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int abort_transfer(int conn_id)
+{
+    struct connected_peer_node *node = NULL;
+    uint16_t msg_type = MSG_TRANSFER_CANCEL;
+
+    /* Lookup the peer from the peer list */
+    node = lookup_peer_by_id(connected_peer_list_head, conn_id);
+    if (!node || conn_id == 1) {
+        printf("ABORT: Invalid connection ID , Please type HELP\n");
+        return -1;
+    }
+
+    switch (node->ctx.status) {
+        case sending:
+            if (!node->ctx.bytes_remaining && !batch_more(&node->ctx)) {
+                printf("ABORT: The upload of '%s' is about to complete\n",
+                        node->ctx.file_name);
+                return -1;
+            }
+            printf("Aborted upload of '%s' to %s  :  %d\n",
+                    node->ctx.file_name, node->hostname, node->port);
+            return cancel_upload(node);
+
+        case relaying:
+            relay_cancel(node);
+            return 0;
+
+        case receiving:
+        case striping:
+            /* all the parts of a striped download are stopped together */
+            if (node->ctx.stripes)
+                return stripe_abort(node);
+
+            if (send(node->fd, &msg_type, sizeof(msg_type), MSG_NOSIGNAL) < 0) {
+                printf("ABORT: Error sending cancel request: %s\n", strerror(errno));
+                return -1;
+            }
+            printf("Aborting download of '%s' from %s  :  %d\n",
+                    node->ctx.file_name, node->hostname, node->port);
+
+            /* stop forwarding it, and let the queue go on */
+            if (node->ctx.relay_id)
+                relay_finish(node, -1);
+            queue_finish(node, 0);
+
+            /* nothing more is written to the file */
+            close(node->ctx.file_fd);
+            node->ctx.file_fd = -1;
+            node->ctx.status = cancelling;
+            return 0;
+
+        case cancelling:
+            printf("ABORT: The transfer of '%s' is already being aborted\n",
+                    node->ctx.file_name);
+            return -1;
+
+        case requesting:
+        case offering:
+            printf("ABORT: Waiting for %s to answer, the transfer has not started yet\n",
+                    node->hostname);
+            return -1;
+
+        case hashing:
+            printf("ABORT: Hashing the files of '%s', the sync has not started yet\n",
+                    node->ctx.file_name);
+            return -1;
 
+        default:
+            printf("ABORT: No transfer in progress with %s\n", node->hostname);
+            return -1;
+    }
+}
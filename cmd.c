@@ -18,9 +18,21 @@ int handle_cmd_help()
         printf("CONNECT <peer address> <port>:\t\t\tConnect to a peer\n");
         printf("LIST:\t\t\t\t\t\tDisplay a list of currently connected peers\n");
         printf("TERMINATE <connection id>:\t\t\tTerminate the connection from a peer identified by connection id\n");
+        printf("ABORT <connection id>:\t\t\t\tStop the file transfer with a peer, keeping the connection\n");
         printf("EXIT:\t\t\t\t\t\tTermiate all connections and exit the program\n");
-        printf("UPLOAD <conn id> <file>:\t\t\tUpload file to a peer identified by connection id\n");
-        printf("DOWNLOAD <conn id> <file> <conn id> <file> ...:\tDownload files from one or more peers\n");
+        printf("UPLOAD <conn id>[,<conn id>...] <file|dir>:\tUpload a file or directory to one or more peers identified by connection id\n");
+        printf("DOWNLOAD [high|low] <conn id> <file|dir> ...:\tQueue the download of files or directories from one or more peers\n");
+        printf("QUEUE [remove <id> | clear]:\t\t\tDisplay or edit the download queue\n");
+        printf("BATCH <conn id> <file|pattern> ...:\t\tDownload many files from a peer in a single transfer\n");
+        printf("SYNC <conn id> <dir>:\t\t\t\tGet the new and changed files of a directory of a peer\n");
+        printf("RELAY <conn id> <file> <ip>:<port> ...:\tUpload file to a peer, which forwards it down the chain of peers\n");
+        printf("SET [<setting> <value>]:\t\t\tDisplay or change a transfer setting\n");
+        printf("SHARE [<file>]:\t\t\t\t\tAdvertise a file to the server, or list the shared files\n");
+        printf("UNSHARE <file>:\t\t\t\t\tStop advertising a file\n");
+        printf("SEARCH <query>:\t\t\t\t\tSearch the files shared by all the peers\n");
+        printf("WHOHAS <file>:\t\t\t\t\tList the peers which may be sharing a file\n");
+        printf("LIMIT [global|transfer|peer <conn id>] <rate>:\tLimit the upload rate (bytes/s, K/M/G suffix, 0 for none)\n");
+        printf("TCP [<profile> | cc <algorithm>]:\t\tDisplay or change the socket tuning of new peer connections\n");
         printf("CREATOR:\t\t\t\t\tDisplay author information\n");
     } else {
         printf("HELP:\t\tPrint this help information\n");
@@ -128,6 +140,32 @@ int handle_cmd_terminate(char *cmd_ptr, int cmd_len)
     return terminate_connection(conn_id);
 }
 
+/*
+ * Function to handle the ABORT command
+ */
+int handle_cmd_abort(char *cmd_ptr, int cmd_len)
+{
+    int conn_id;
+    char *ptr = cmd_ptr, *end = NULL;
+
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+
+    conn_id = strtol(ptr, &end, 10);
+    if (end == ptr || conn_id <= 0) {
+        printf("Invalid connection ID\n");
+        return -1;
+    }
+
+    while (*end == ' ' || *end == '\t') end++;
+    if (*end != '\0') {
+        printf("Invalid command: unknown parameter ,Please type HELP\n");
+        return -1;
+    }
+
+    return abort_transfer(conn_id);
+}
+
 /*
  * Function to handle the REGISTER command
  */
@@ -245,13 +283,15 @@ int handle_cmd_connect (char cmd_buff[], int cmd_len)
 
 /*
  * Function to handle the UPLOAD command
+ * More than one connection ID can be given, separated by ',' to send
+ * the file to several peers at once
  */
 int handle_cmd_upload(char *cmd_ptr, int cmd_len)
 {
     char file_name[255], id_str[255];
-    int i = 0;
-    int conn_id;
-    char *ptr = cmd_ptr;
+    int i = 0, count = 0;
+    int conn_id[MAX_CONN];
+    char *ptr = cmd_ptr, *id_ptr = NULL, *end = NULL;
 
     if (!registered) {
         printf("Please register to server before connecting to peers\n");
@@ -266,8 +306,8 @@ int handle_cmd_upload(char *cmd_ptr, int cmd_len)
     /* Strip leading spaces */
     while (*ptr == ' ' || *ptr == '\t') ptr++;
 
-    /* Get the id */
-    while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t') {
+    /* Get the id(s) */
+    while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(id_str) - 1) {
         id_str[i++] = *ptr;
         ptr++;
     }
@@ -278,10 +318,23 @@ int handle_cmd_upload(char *cmd_ptr, int cmd_len)
     }
     id_str[i] = '\0';
 
-    conn_id = strtol(id_str, NULL, 10);
-    if (conn_id <= 0 ) {
-        printf("Invalid connection ID\n");
-        return -1;
+    id_ptr = id_str;
+    while (1) {
+        if (count == MAX_CONN) {
+            printf("Invalid command: too many connection IDs\n");
+            return -1;
+        }
+
+        conn_id[count] = strtol(id_ptr, &end, 10);
+        if (conn_id[count] <= 0 || (*end != ',' && *end != '\0')) {
+            printf("Invalid connection ID\n");
+            return -1;
+        }
+        count++;
+
+        if (*end == '\0')
+            break;
+        id_ptr = end + 1;
     }
 
     /* Get the filename*/
@@ -299,8 +352,11 @@ int handle_cmd_upload(char *cmd_ptr, int cmd_len)
     }
     file_name[i] = '\0';
 
-    /* Send the file Peer */
-    return upload_to_peer(conn_id, file_name);
+    /* Send the file to the Peer(s) */
+    if (count == 1)
+        return upload_to_peer(conn_id[0], file_name);
+
+    return upload_to_peers(conn_id, count, file_name);
 }
 
 /*
@@ -308,9 +364,9 @@ int handle_cmd_upload(char *cmd_ptr, int cmd_len)
  */
 int handle_cmd_download(char *cmd_ptr, int cmd_len)
 {
-    char file_name[3][255], id_str[255];
-    int i = 0, count = 0;
-    int conn_id[3];
+    char file_name[255], id_str[255];
+    int i = 0, count = 0, prio = PRIO_NORMAL;
+    int conn_id;
     char *ptr = cmd_ptr;
 
     if (!registered) {
@@ -323,57 +379,539 @@ int handle_cmd_download(char *cmd_ptr, int cmd_len)
         return -1;
     }
 
-    while (1) {
-        bzero(id_str, sizeof(id_str));
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
 
+    /* Get the priority class, if given */
+    i = 0;
+    while(ptr[i] != '\0' && ptr[i] != ' ' && ptr[i] != '\t' && i < sizeof(id_str) - 1) {
+        id_str[i] = ptr[i];
+        i++;
+    }
+    id_str[i] = '\0';
+    if (queue_prio_from_name(id_str) >= 0) {
+        prio = queue_prio_from_name(id_str);
+        ptr += i;
+    }
+
+    while (1) {
         /* Strip leading spaces */
         while (*ptr == ' ' || *ptr == '\t') ptr++;
 
+        if (*ptr == '\0')
+            break;
+
         /* Get the id */
         i = 0;
-        while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t') {
+        while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(id_str) - 1) {
             id_str[i++] = *ptr;
             ptr++;
         }
 
         if (*ptr == '\0') {
             printf("Invalid command: file name missing\n");
-            return -1;
+            break;
         }
         id_str[i] = '\0';
 
-        conn_id[count] = strtol(id_str, NULL, 10);
-        if (conn_id[count] <= 0 ) {
-            printf("Invalid connection ID\n");
+        conn_id = strtol(id_str, NULL, 10);
+
+        /* Get the filename*/
+        /* Strip leading spaces */
+        while (*ptr == ' ' || *ptr == '\t') ptr++;
+        i = 0;
+        while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(file_name) - 1) {
+            file_name[i++] = *(ptr++);
+        }
+        file_name[i] = '\0';
+
+        if (conn_id <= 0 ) {
+            printf("Invalid connection ID '%s', skipping..\n", id_str);
+            continue;
+        }
+
+        /* add it to the download queue */
+        if (queue_download(conn_id, file_name, prio) == 0)
+            count++;
+    }
+
+    if (!count) {
+        /* none of the files could be queued */
+        printf("DOWNLOAD: No files could be downloaded\n");
+        return -1;
+    }
+
+    printf("%d download(s) queued\n", count);
+    return 0;
+}
+
+/*
+ * Function to handle the SYNC command
+ * SYNC <conn id> <dir>   brings the directory of the same name here up to
+ * date with the one of the peer
+ *
+ * returns 0 on success, -1 on failure
+ */
+int handle_cmd_sync(char *cmd_ptr, int cmd_len)
+{
+    char id_str[255], *ptr = cmd_ptr, *end = NULL;
+    int i = 0, conn_id;
+
+    if (!registered) {
+        printf("Please register to server before connecting to peers\n");
+        return -1;
+    }
+
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+
+    /* Get the id */
+    i = 0;
+    while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(id_str) - 1) {
+        id_str[i++] = *(ptr++);
+    }
+    id_str[i] = '\0';
+
+    conn_id = strtol(id_str, NULL, 10);
+    if (conn_id <= 0) {
+        printf("Invalid connection ID '%s', Please type HELP\n", id_str);
+        return -1;
+    }
+
+    /* the rest of the line is the directory name */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+    end = ptr + strlen(ptr);
+    while (end > ptr && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n'))
+        *(--end) = '\0';
+
+    if (*ptr == '\0') {
+        printf("Invalid command: directory name missing\n");
+        return -1;
+    }
+
+    return sync_request(conn_id, ptr);
+}
+
+/*
+ * Function to handle the BATCH command
+ * BATCH <conn id> <file> ...   gets the files (or the files matching the
+ *                              patterns) from a peer in a single transfer
+ */
+int handle_cmd_batch(char *cmd_ptr, int cmd_len)
+{
+    char id_str[255], *names[MAX_BATCH_NAMES], *ptr = cmd_ptr;
+    int i = 0, count = 0, conn_id;
+
+    if (!registered) {
+        printf("Please register to server before connecting to peers\n");
+        return -1;
+    }
+
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+
+    /* Get the id */
+    i = 0;
+    while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(id_str) - 1) {
+        id_str[i++] = *(ptr++);
+    }
+    id_str[i] = '\0';
+
+    conn_id = strtol(id_str, NULL, 10);
+    if (conn_id <= 0) {
+        printf("Invalid connection ID '%s', Please type HELP\n", id_str);
+        return -1;
+    }
+
+    /* the names are split in place */
+    while (count < MAX_BATCH_NAMES) {
+        while (*ptr == ' ' || *ptr == '\t') ptr++;
+        if (*ptr == '\0')
+            break;
+
+        names[count++] = ptr;
+        while (*ptr != '\0' && *ptr != ' ' && *ptr != '\t') ptr++;
+        if (*ptr != '\0')
+            *(ptr++) = '\0';
+    }
+
+    if (!count) {
+        printf("Invalid command: file name missing\n");
+        return -1;
+    }
+
+    return batch_request(conn_id, names, count);
+}
+
+/*
+ * Function to handle the QUEUE command
+ * QUEUE                    displays the download queue
+ * QUEUE remove <id>        removes a pending download
+ * QUEUE clear              removes all the pending downloads
+ */
+int handle_cmd_queue(char *cmd_ptr, int cmd_len)
+{
+    char action[255];
+    int i = 0;
+    char *ptr = cmd_ptr, *end = NULL;
+    unsigned long long seq;
+
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+
+    if (*ptr == '\0') {
+        print_queue();
+        return 0;
+    }
+
+    /* Get the action */
+    while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(action) - 1) {
+        action[i++] = *(ptr++);
+    }
+    action[i] = '\0';
+
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+
+    if (strcasecmp(action, "clear") == 0 && *ptr == '\0')
+        return queue_remove(0);
+
+    if (strcasecmp(action, "remove") == 0) {
+        seq = strtoull(ptr, &end, 10);
+        if (*ptr == '\0' || *end != '\0' || seq == 0) {
+            printf("Invalid command: QUEUE remove <id>\n");
             return -1;
         }
+        return queue_remove(seq);
+    }
 
-        /* Get the filename*/
-        bzero(file_name[count], sizeof(file_name[count]));
+    printf("Invalid command: QUEUE [remove <id> | clear]\n");
+    return -1;
+}
+
+/*
+ * Function to handle the RELAY command
+ * RELAY <conn id> <file> <ip>:<port> [<ip>:<port> ...]
+ */
+int handle_cmd_relay(char *cmd_ptr, int cmd_len)
+{
+    char file_name[255], id_str[255], hop_str[255];
+    struct available_peer_node hops[MAX_RELAY_HOPS];
+    int i = 0, count = 0, port = 0;
+    int conn_id;
+    char *ptr = cmd_ptr, *port_ptr = NULL;
+
+    if (!registered) {
+        printf("Please register to server before connecting to peers\n");
+        return -1;
+    }
+
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+
+    /* Get the id */
+    while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(id_str) - 1) {
+        id_str[i++] = *ptr;
+        ptr++;
+    }
+    id_str[i] = '\0';
+
+    conn_id = strtol(id_str, NULL, 10);
+    if (conn_id <= 0 ) {
+        printf("Invalid connection ID\n");
+        return -1;
+    }
+
+    /* Get the filename*/
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+    i = 0;
+    while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(file_name) - 1) {
+        file_name[i++] = *(ptr++);
+    }
+    file_name[i] = '\0';
+
+    /* Get the chain of peers */
+    while (1) {
         /* Strip leading spaces */
         while (*ptr == ' ' || *ptr == '\t') ptr++;
+        if (*ptr == '\0')
+            break;
+
+        if (count == MAX_RELAY_HOPS) {
+            printf("Invalid command: at most %d peers can be relayed to\n", MAX_RELAY_HOPS);
+            return -1;
+        }
+
         i = 0;
-        while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t') {
-            file_name[count][i++] = *(ptr++);
+        while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(hop_str) - 1) {
+            hop_str[i++] = *(ptr++);
+        }
+        hop_str[i] = '\0';
+
+        port_ptr = strchr(hop_str, ':');
+        if (!port_ptr) {
+            printf("Invalid peer '%s', should be <ip>:<port>\n", hop_str);
+            return -1;
         }
-        file_name[count][i] = '\0';
+        *port_ptr++ = '\0';
 
+        port = strtol(port_ptr, NULL, 10);
+        if (port <= 0 || port > 65535 || inet_pton(AF_INET, hop_str, &hops[count].ip) != 1) {
+            printf("Invalid peer '%s:%s'\n", hop_str, port_ptr);
+            return -1;
+        }
+        hops[count].port = port;
         count++;
+    }
 
-        /* break if we have got three  hosts, or end of input */
-        if (count == 3 || *ptr == '\0') {
-            break;
+    if (file_name[0] == '\0' || count == 0) {
+        printf("Invalid command: file name or peers missing\n");
+        return -1;
+    }
+
+    return relay_upload(conn_id, file_name, hops, count);
+}
+
+/*
+ * Function to handle the SET command
+ * Without arguments, it displays the current settings
+ */
+int handle_cmd_set(char *cmd_ptr, int cmd_len)
+{
+    char name[255], value[255];
+    int i = 0;
+    char *ptr = cmd_ptr;
+
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+
+    if (*ptr == '\0') {
+        print_options();
+        return 0;
+    }
+
+    /* Get the setting name */
+    while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(name) - 1) {
+        name[i++] = *ptr;
+        ptr++;
+    }
+    name[i] = '\0';
+
+    if (*ptr == '\0') {
+        printf("Invalid command: value missing\n");
+        return -1;
+    }
+
+    /* Get the value */
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+    i = 0;
+    while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(value) - 1) {
+        value[i++] = *(ptr++);
+    }
+
+    if (*ptr != '\0') {
+        /* there is more argument, flag as invalid */
+        printf("Invalid command: extra arguments %s\n", ptr);
+        return -1;
+    }
+    value[i] = '\0';
+
+    return set_option(name, value);
+}
+
+/*
+ * Function to handle the SHARE and UNSHARE commands
+ * SHARE without arguments lists the shared files
+ */
+int handle_cmd_share(char *cmd_ptr, int cmd_len, int share)
+{
+    char file_name[255];
+    int i = 0;
+    char *ptr = cmd_ptr;
+
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+
+    if (*ptr == '\0') {
+        if (!share) {
+            printf("Invalid command: file name missing\n");
+            return -1;
         }
+        print_shared_files();
+        return 0;
     }
 
+    if (!registered) {
+        printf("Please register to server before sharing files\n");
+        return -1;
+    }
+
+    /* Get the filename*/
+    while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(file_name) - 1) {
+        file_name[i++] = *(ptr++);
+    }
+    file_name[i] = '\0';
+
     if (*ptr != '\0') {
         /* there is more argument, flag as invalid */
         printf("Invalid command: extra arguments %s\n", ptr);
         return -1;
     }
 
-    /* request file from Peer */
-    return download_from_peer(conn_id, file_name, count);
+    return share ? share_file(file_name) : unshare_file(file_name);
+}
+
+/*
+ * Function to handle the SEARCH command
+ * SEARCH <query>, the query may contain several words
+ */
+int handle_cmd_search(char *cmd_ptr, int cmd_len)
+{
+    char *ptr = cmd_ptr;
+
+    if (!registered) {
+        printf("Please register to server before searching files\n");
+        return -1;
+    }
+
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+
+    if (*ptr == '\0') {
+        printf("Invalid command: query missing\n");
+        return -1;
+    }
+
+    return search_catalog(ptr);
+}
+
+/*
+ * Function to handle the WHOHAS command
+ * The peers are picked using the filters received from the server,
+ * without asking anybody
+ */
+int handle_cmd_whohas(char *cmd_ptr, int cmd_len)
+{
+    char *ptr = cmd_ptr;
+
+    /* Strip leading spaces */
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+
+    if (*ptr == '\0') {
+        printf("Invalid command: file name missing\n");
+        return -1;
+    }
+
+    bloom_whohas(ptr);
+    return 0;
+}
+
+/*
+ * Function to handle the LIMIT command
+ * LIMIT                            displays the limits
+ * LIMIT global <rate>              limits everything sent
+ * LIMIT transfer <rate>            limits every single transfer
+ * LIMIT peer <conn id> <rate>      limits everything sent to a peer
+ */
+int handle_cmd_limit(char *cmd_ptr, int cmd_len)
+{
+    char args[3][255];
+    int i, count = 0, conn_id = 0;
+    char *ptr = cmd_ptr;
+
+    /* Split the arguments */
+    while (1) {
+        /* Strip leading spaces */
+        while (*ptr == ' ' || *ptr == '\t') ptr++;
+        if (*ptr == '\0')
+            break;
+
+        if (count == 3) {
+            printf("Invalid command: extra arguments %s\n", ptr);
+            return -1;
+        }
+
+        i = 0;
+        while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(args[0]) - 1) {
+            args[count][i++] = *(ptr++);
+        }
+        args[count][i] = '\0';
+        count++;
+    }
+
+    if (count == 0) {
+        print_rate_limits();
+        return 0;
+    }
+
+    if (strcasecmp(args[0], "peer") == 0) {
+        if (count != 3) {
+            printf("Invalid command: LIMIT peer <conn id> <rate>\n");
+            return -1;
+        }
+        conn_id = strtol(args[1], NULL, 10);
+        return set_rate_limit(args[0], conn_id, args[2]);
+    }
+
+    if (count != 2) {
+        printf("Invalid command: LIMIT global|transfer <rate>\n");
+        return -1;
+    }
+    return set_rate_limit(args[0], 0, args[1]);
+}
+
+/*
+ * Function to handle the TCP command
+ * TCP                              displays the socket tuning profiles
+ * TCP <profile>                    selects the profile of new connections
+ * TCP cc <algorithm>|default       selects their congestion control
+ */
+int handle_cmd_tcp(char *cmd_ptr, int cmd_len)
+{
+    char args[2][255];
+    int i, count = 0;
+    char *ptr = cmd_ptr;
+
+    /* Split the arguments */
+    while (1) {
+        /* Strip leading spaces */
+        while (*ptr == ' ' || *ptr == '\t') ptr++;
+        if (*ptr == '\0')
+            break;
+
+        if (count == 2) {
+            printf("Invalid command: extra arguments %s\n", ptr);
+            return -1;
+        }
+
+        i = 0;
+        while(*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && i < sizeof(args[0]) - 1) {
+            args[count][i++] = *(ptr++);
+        }
+        args[count][i] = '\0';
+        count++;
+    }
+
+    if (count == 0) {
+        print_tcp_profiles();
+        return 0;
+    }
+
+    if (strcasecmp(args[0], "cc") == 0) {
+        if (count != 2) {
+            printf("Invalid command: TCP cc <algorithm>|default\n");
+            return -1;
+        }
+        return set_tcp_profile(NULL, args[1]);
+    }
+
+    if (count != 1) {
+        printf("Invalid command: TCP <profile>\n");
+        return -1;
+    }
+    return set_tcp_profile(args[0], NULL);
 }
 
 /*
@@ -497,6 +1035,15 @@ int handle_cmd (char cmd_buff[], int cmd_len)
         return handle_cmd_terminate(cmd_ptr, cmd_len);
     }
 
+    /* ABORT Command */
+    if (strcasecmp(cmd, CMD_ABORT) == 0) {
+        if (mode == server_mode) {
+            printf("ABORT command not available when running in server mode\n");
+            return -1;
+        }
+        return handle_cmd_abort(cmd_ptr, cmd_len);
+    }
+
     /* EXIT Command */
     if (strcasecmp(cmd, CMD_EXIT) == 0) {
         /* This command does not take any argument */
@@ -526,6 +1073,97 @@ int handle_cmd (char cmd_buff[], int cmd_len)
         return handle_cmd_download(cmd_ptr, cmd_len);
     }
 
+    /* RELAY Command */
+    if (strcasecmp(cmd, CMD_RELAY) == 0) {
+        if (mode == server_mode) {
+            printf("RELAY command not available when running in server mode\n");
+            return -1;
+        }
+        return handle_cmd_relay(cmd_ptr, cmd_len);
+    }
+
+    /* SET Command */
+    if (strcasecmp(cmd, CMD_SET) == 0) {
+        if (mode == server_mode) {
+            printf("SET command not available when running in server mode\n");
+            return -1;
+        }
+        return handle_cmd_set(cmd_ptr, cmd_len);
+    }
+
+    /* SHARE/UNSHARE Commands */
+    if (strcasecmp(cmd, CMD_SHARE) == 0 || strcasecmp(cmd, CMD_UNSHARE) == 0) {
+        if (mode == server_mode) {
+            printf("%s command not available when running in server mode\n",
+                    strcasecmp(cmd, CMD_SHARE) ? "UNSHARE" : "SHARE");
+            return -1;
+        }
+        return handle_cmd_share(cmd_ptr, cmd_len, strcasecmp(cmd, CMD_SHARE) == 0);
+    }
+
+    /* SEARCH Command */
+    if (strcasecmp(cmd, CMD_SEARCH) == 0) {
+        if (mode == server_mode) {
+            printf("SEARCH command not available when running in server mode\n");
+            return -1;
+        }
+        return handle_cmd_search(cmd_ptr, cmd_len);
+    }
+
+    /* WHOHAS Command */
+    if (strcasecmp(cmd, CMD_WHOHAS) == 0) {
+        if (mode == server_mode) {
+            printf("WHOHAS command not available when running in server mode\n");
+            return -1;
+        }
+        return handle_cmd_whohas(cmd_ptr, cmd_len);
+    }
+
+    /* LIMIT Command */
+    if (strcasecmp(cmd, CMD_LIMIT) == 0) {
+        if (mode == server_mode) {
+            printf("LIMIT command not available when running in server mode\n");
+            return -1;
+        }
+        return handle_cmd_limit(cmd_ptr, cmd_len);
+    }
+
+    /* TCP Command */
+    if (strcasecmp(cmd, CMD_TCP) == 0) {
+        if (mode == server_mode) {
+            printf("TCP command not available when running in server mode\n");
+            return -1;
+        }
+        return handle_cmd_tcp(cmd_ptr, cmd_len);
+    }
+
+    /* SYNC Command */
+    if (strcasecmp(cmd, CMD_SYNC) == 0) {
+        if (mode == server_mode) {
+            printf("SYNC command not available when running in server mode\n");
+            return -1;
+        }
+        return handle_cmd_sync(cmd_ptr, cmd_len);
+    }
+
+    /* BATCH Command */
+    if (strcasecmp(cmd, CMD_BATCH) == 0) {
+        if (mode == server_mode) {
+            printf("BATCH command not available when running in server mode\n");
+            return -1;
+        }
+        return handle_cmd_batch(cmd_ptr, cmd_len);
+    }
+
+    /* QUEUE Command */
+    if (strcasecmp(cmd, CMD_QUEUE) == 0) {
+        if (mode == server_mode) {
+            printf("QUEUE command not available when running in server mode\n");
+            return -1;
+        }
+        return handle_cmd_queue(cmd_ptr, cmd_len);
+    }
+
     /* CREATOR Command */
     if (strcasecmp(cmd, CMD_CREATOR) == 0) {
         /* This command does not take any argument */
@@ -1,3 +1,5 @@
+#include <errno.h>
+
 #include "list.h"
 #include "proj1.h"
 
@@ -73,6 +75,46 @@ struct sockaddr_in getmyip()
     return myaddr;
 }
 
+/*
+ * Function to compute the 64 bit FNV-1a hash of a buffer
+ * hash is the running value: FNV_OFFSET_BASIS for a new hash
+ */
+uint64_t fnv1a_hash(const void *buf, size_t len, uint64_t hash)
+{
+    const unsigned char *ptr = (const unsigned char *)buf;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= ptr[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Function to read exactly len bytes from a socket
+ * (for small messages that may arrive in several parts)
+ *
+ * returns len on success, 0 if the connection is closed, -1 on failure
+ */
+int read_full(int fd, void *buf, int len)
+{
+    int rc = 0, total = 0;
+
+    while (total < len) {
+        rc = read(fd, (char *)buf + total, len - total);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rc == 0)
+            return 0;
+        total += rc;
+    }
+    return total;
+}
+
 /*
  * Function to terminate all connection and cleanly exit
  */
@@ -96,6 +138,9 @@ int handle_exit()
             /* Close socket */
             close(node->fd);
         }
+
+        /* and stop listening for the peers on this host */
+        local_close();
     }
     /* Close the listening socket and exit */
     close(listen_fd);
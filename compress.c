@@ -0,0 +1,106 @@
+#include <math.h>
+#include <zlib.h>
+
+#include "proj1.h"
+
+/* Blocks with a sampled entropy above this (bits per byte) are considered
+ * already compressed (JPEG, archives, ...) and are sent as is */
+#define ENTROPY_THRESHOLD   7.2
+
+/* Number of bytes of a block looked at when estimating its entropy */
+#define ENTROPY_SAMPLE_SIZE 4096
+
+/******* Global values *******/
+int compress_enabled = 1;  /* Whether we offer/accept compressed transfers */
+int compress_level = 1;    /* deflate level used for compressed blocks */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to estimate the entropy of a block of data (in bits per byte)
+ * from an evenly spread sample of at most ENTROPY_SAMPLE_SIZE bytes
+ */
+static double block_entropy(const unsigned char *data, int len)
+{
+    unsigned int count[256];
+    int i, stride, samples = 0;
+    double entropy = 0.0, p;
+
+    if (len <= 0)
+        return 0.0;
+
+    bzero(count, sizeof(count));
+
+    stride = len / ENTROPY_SAMPLE_SIZE;
+    if (stride < 1) stride = 1;
+
+    for (i = 0; i < len; i += stride) {
+        count[data[i]]++;
+        samples++;
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (!count[i])
+            continue;
+        p = (double)count[i] / samples;
+        entropy -= p * log2(p);
+    }
+
+    return entropy;
+}
+
+/*
+ * Function to decide if a block is worth compressing
+ *
+ * returns 1 if the block looks compressible, 0 otherwise
+ */
+int block_is_compressible(const unsigned char *data, int len)
+{
+    return block_entropy(data, len) < ENTROPY_THRESHOLD;
+}
+
+/*
+ * Function to get the worst case size of a compressed block of len bytes
+ */
+int compress_bound(int len)
+{
+    return compressBound(len);
+}
+
+/*
+ * Function to compress a block of data
+ *
+ * returns the compressed size on success,
+ *         -1 on failure or if the block did not get smaller
+ */
+int compress_block(const char *in, int in_len, char *out, int out_size)
+{
+    uLongf out_len = out_size;
+
+    if (compress2((Bytef *)out, &out_len, (const Bytef *)in, in_len,
+                compress_level) != Z_OK) {
+        return -1;
+    }
+
+    if (out_len >= in_len)
+        return -1;
+
+    return out_len;
+}
+
+/*
+ * Function to decompress a block of data
+ *
+ * returns the decompressed size on success, -1 on failure
+ */
+int decompress_block(const char *in, int in_len, char *out, int out_size)
+{
+    uLongf out_len = out_size;
+
+    if (uncompress((Bytef *)out, &out_len, (const Bytef *)in, in_len) != Z_OK) {
+        return -1;
+    }
+
+    return out_len;
+}
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE    /* for O_DIRECT */
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+
+#include "proj1.h"
+
+/* Alignment of the buffers, offsets and lengths of O_DIRECT I/O */
+#define DIRECT_ALIGN        4096
+/* Size of a buffer, a multiple of XFER_BLOCK_SIZE so a block is never
+ * split between two buffers */
+#define DIRECT_BUF_SIZE     (1 << 20)
+/* Number of buffers, and of I/Os in flight, of a transfer */
+#define DIRECT_DEPTH        4
+/* Number of free buffers kept for the next transfers */
+#define DIRECT_POOL_MAX     32
+
+/* buffer of a transfer bypassing the page cache */
+struct direct_buf {
+    char *data;                  /* DIRECT_BUF_SIZE bytes, aligned on DIRECT_ALIGN */
+    uint64_t off;                /* offset in the file of data */
+    int len;                     /* bytes of data filled, to be written */
+    int busy;                    /* I/O in progress */
+    long res;                    /* result of the last I/O */
+    struct iocb cb;
+};
+
+/* I/O state of a transfer bypassing the page cache (see direct_start()) */
+struct direct_io {
+    int fd;                      /* the file, opened again with O_DIRECT */
+    aio_context_t aio;           /* kernel AIO context */
+    uint64_t end;                /* end of the range of the file transferred */
+    uint64_t next_off;           /* offset of the next read to submit */
+    int head;                    /* oldest buffer in use */
+    int count;                   /* number of buffers in use */
+    struct direct_buf buf[DIRECT_DEPTH];
+};
+
+/******* Global values *******/
+int direct_mb = 0;      /* size in MB from which transfers bypass the page cache (0: never) */
+
+static char *direct_pool[DIRECT_POOL_MAX];     /* free buffers */
+static int direct_pool_count = 0;
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to get an aligned buffer from the pool (allocated if the pool
+ * is empty)
+ */
+static char *direct_buf_get()
+{
+    void *data = NULL;
+
+    if (direct_pool_count)
+        return direct_pool[--direct_pool_count];
+
+    if (posix_memalign(&data, DIRECT_ALIGN, DIRECT_BUF_SIZE) != 0) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    return data;
+}
+
+/*
+ * Function to give a buffer back to the pool
+ */
+static void direct_buf_put(char *data)
+{
+    if (direct_pool_count < DIRECT_POOL_MAX)
+        direct_pool[direct_pool_count++] = data;
+    else
+        free(data);
+}
+
+/*
+ * Function to start reading or writing the buffer i at its offset
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int direct_submit(struct direct_io *d, int i, int write, int len)
+{
+    struct direct_buf *b = &d->buf[i];
+    struct iocb *cbs[1] = { &b->cb };
+
+    bzero(&b->cb, sizeof(b->cb));
+    b->cb.aio_data = i;
+    b->cb.aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+    b->cb.aio_fildes = d->fd;
+    b->cb.aio_buf = (uintptr_t)b->data;
+    b->cb.aio_nbytes = len;
+    b->cb.aio_offset = b->off;
+
+    if (syscall(SYS_io_submit, d->aio, 1, cbs) != 1) {
+        printf("Error submitting I/O: %s\n", strerror(errno));
+        return -1;
+    }
+    b->busy = 1;
+    return 0;
+}
+
+/*
+ * Function to wait for the I/O of the buffer i to complete (the other
+ * completions seen meanwhile are recorded too)
+ *
+ * returns 0 on success, -1 if the I/O failed
+ */
+static int direct_wait(struct direct_io *d, int i)
+{
+    struct io_event events[DIRECT_DEPTH];
+    int n, j;
+
+    while (d->buf[i].busy) {
+        n = syscall(SYS_io_getevents, d->aio, 1, DIRECT_DEPTH, events, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("Error waiting for I/O: %s\n", strerror(errno));
+            return -1;
+        }
+        for (j = 0; j < n; j++) {
+            d->buf[events[j].data].busy = 0;
+            d->buf[events[j].data].res = events[j].res;
+        }
+    }
+
+    if (d->buf[i].res < 0) {
+        printf("Error in file I/O: %s\n", strerror(-d->buf[i].res));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to set up a transfer of at least direct_mb to bypass the page
+ * cache: the file is opened again with O_DIRECT and goes through
+ * DIRECT_DEPTH aligned buffers, with that many reads (or writes) in
+ * flight at once to keep the disk busy.
+ * write is set for a file being received. The range transferred is
+ * [ctx->offset, ctx->offset + ctx->bytes_remaining).
+ * If the file can't be used this way (e.g. the filesystem does not
+ * support O_DIRECT), the transfer goes through the page cache.
+ */
+void direct_start(struct file_transfer_context *ctx, int write)
+{
+    struct direct_io *d = NULL;
+    char path[64];
+    int fd, i;
+
+    if (!direct_mb || ctx->dio || ctx->file_fd < 0 ||
+            ctx->file_size < ((uint64_t)direct_mb << 20) || ctx->offset % DIRECT_ALIGN)
+        return;
+
+    /* a new open file, so the other users of the file are not affected */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", ctx->file_fd);
+    fd = open(path, (write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+    if (fd < 0) {
+        printf("O_DIRECT not available for '%s': %s, using the page cache\n",
+                ctx->file_name, strerror(errno));
+        return;
+    }
+
+    d = (struct direct_io *) malloc(sizeof(struct direct_io));
+    if (!d) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    bzero(d, sizeof(struct direct_io));
+
+    if (syscall(SYS_io_setup, DIRECT_DEPTH, &d->aio) < 0) {
+        printf("AIO not available for '%s': %s, using the page cache\n",
+                ctx->file_name, strerror(errno));
+        close(fd);
+        free(d);
+        return;
+    }
+
+    d->fd = fd;
+    d->end = d->next_off = ctx->offset;
+    d->end += ctx->bytes_remaining;
+    for (i = 0; i < DIRECT_DEPTH; i++)
+        d->buf[i].data = direct_buf_get();
+
+    ctx->dio = d;
+}
+
+/*
+ * Function to get the len bytes of the file at ctx->offset, for a file
+ * sent bypassing the page cache. The reads of the next buffers are
+ * submitted first, then the one holding the block is waited for.
+ * The block stays in its buffer until the next call.
+ *
+ * returns a pointer to the block, NULL on failure
+ */
+char *direct_read(struct file_transfer_context *ctx, int len)
+{
+    struct direct_io *d = ctx->dio;
+    struct direct_buf *b = &d->buf[d->head];
+    uint64_t size;
+    int i;
+
+    /* the oldest buffer has been sent, it can be read again */
+    if (d->count && ctx->offset >= b->off + DIRECT_BUF_SIZE) {
+        d->head = (d->head + 1) % DIRECT_DEPTH;
+        d->count--;
+    }
+
+    while (d->count < DIRECT_DEPTH && d->next_off < d->end) {
+        i = (d->head + d->count) % DIRECT_DEPTH;
+        /* the end of the file is read as a whole aligned block,
+         * the read stops at the end of the file */
+        size = d->end - d->next_off;
+        if (size > DIRECT_BUF_SIZE)
+            size = DIRECT_BUF_SIZE;
+        size = (size + DIRECT_ALIGN - 1) & ~((uint64_t)DIRECT_ALIGN - 1);
+
+        d->buf[i].off = d->next_off;
+        if (direct_submit(d, i, 0, size) < 0)
+            return NULL;
+        d->next_off += DIRECT_BUF_SIZE;
+        d->count++;
+    }
+
+    b = &d->buf[d->head];
+    if (!d->count || direct_wait(d, d->head) < 0)
+        return NULL;
+
+    if (ctx->offset + len > b->off + b->res) {
+        printf("Error reading from file: unexpected end of file\n");
+        return NULL;
+    }
+    return b->data + (ctx->offset - b->off);
+}
+
+/*
+ * Function to write len bytes at ctx->offset of a file received
+ * bypassing the page cache. The data is copied in the current buffer,
+ * which is written once full. A buffer is waited for only when all of
+ * them are in flight.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int direct_write(struct file_transfer_context *ctx, char *data, int len)
+{
+    struct direct_io *d = ctx->dio;
+    struct direct_buf *b = NULL;
+    uint64_t off = ctx->offset;
+    int i, n, size;
+
+    while (len > 0) {
+        i = (d->head + d->count - 1) % DIRECT_DEPTH;
+        b = d->count ? &d->buf[i] : NULL;
+
+        /* a hole was skipped (sparse file): the buffer is written as it
+         * is, padded with zeros which fall in the hole */
+        if (b && !b->busy && b->len && b->off + b->len != off) {
+            size = (b->len + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+            bzero(b->data + b->len, size - b->len);
+            if (direct_submit(d, i, 1, size) < 0)
+                return -1;
+        }
+
+        if (!b || b->busy || b->len == DIRECT_BUF_SIZE) {
+            if (d->count == DIRECT_DEPTH) {
+                if (direct_wait(d, d->head) < 0)
+                    return -1;
+                d->head = (d->head + 1) % DIRECT_DEPTH;
+                d->count--;
+            }
+            i = (d->head + d->count) % DIRECT_DEPTH;
+            b = &d->buf[i];
+            b->off = off;
+            b->len = 0;
+            d->count++;
+        }
+
+        n = DIRECT_BUF_SIZE - b->len < len ? DIRECT_BUF_SIZE - b->len : len;
+        memcpy(b->data + b->len, data, n);
+        b->len += n;
+        data += n;
+        len -= n;
+        off += n;
+
+        if (b->len == DIRECT_BUF_SIZE &&
+                direct_submit(d, (d->head + d->count - 1) % DIRECT_DEPTH, 1, b->len) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to complete a file received bypassing the page cache: the
+ * last buffer is written, padded to an aligned size (the file is cut
+ * back to its size afterwards), and all the writes are waited for.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int direct_finish(struct file_transfer_context *ctx)
+{
+    struct direct_io *d = ctx->dio;
+    struct direct_buf *b = NULL;
+    int i, size, rc = 0, padded = 0;
+
+    if (d->count) {
+        i = (d->head + d->count - 1) % DIRECT_DEPTH;
+        b = &d->buf[i];
+        if (!b->busy && b->len && b->len < DIRECT_BUF_SIZE) {
+            size = (b->len + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+            bzero(b->data + b->len, size - b->len);
+            padded = (size != b->len);
+            if (direct_submit(d, i, 1, size) < 0)
+                rc = -1;
+        }
+    }
+
+    /* every buffer is waited for, even after a failure */
+    while (d->count) {
+        if (d->buf[d->head].busy && direct_wait(d, d->head) < 0)
+            rc = -1;
+        d->head = (d->head + 1) % DIRECT_DEPTH;
+        d->count--;
+    }
+
+    if (padded && ftruncate(ctx->file_fd, d->end) < 0) {
+        printf("Error writing to file: %s\n", strerror(errno));
+        rc = -1;
+    }
+    return rc;
+}
+
+/*
+ * Function to release the I/O state of a transfer bypassing the page
+ * cache. The I/Os still in flight are waited for, before the buffers go
+ * back to the pool.
+ */
+void direct_release(struct file_transfer_context *ctx)
+{
+    struct direct_io *d = ctx->dio;
+    int i;
+
+    if (!d)
+        return;
+
+    /* blocks until the I/Os in flight are done */
+    syscall(SYS_io_destroy, d->aio);
+    close(d->fd);
+
+    for (i = 0; i < DIRECT_DEPTH; i++)
+        direct_buf_put(d->buf[i].data);
+
+    free(d);
+    ctx->dio = NULL;
+}
@@ -0,0 +1,289 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* Number of blocks held in the shared ring buffer.
+ * This bounds how far the fastest peer can get ahead of the slowest one */
+#define FANOUT_SLOTS 64
+
+/* structure shared by all the peers a file is uploaded to in one go.
+ * The file is read only once into the ring, and every peer sends from
+ * it at its own pace (ctx.fan_pos) */
+struct fanout {
+    int file_fd;                    /* fd of the file being uploaded */
+    uint64_t total_blocks;          /* number of blocks in the file */
+    uint64_t blocks_read;           /* number of blocks read into the ring so far */
+    char *ring;                     /* FANOUT_SLOTS blocks of XFER_BLOCK_SIZE */
+    int slot_len[FANOUT_SLOTS];     /* bytes of data in each slot */
+    int refcount;                   /* number of peers still using the ring */
+};
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to get the position of the slowest peer sending from the ring
+ */
+static uint64_t fanout_min_pos(struct fanout *f)
+{
+    struct list_node *cur;
+    struct connected_peer_node *node;
+    uint64_t min = f->blocks_read;
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+        node = (struct connected_peer_node *)(cur->container);
+        if (node->ctx.fanout == f && node->ctx.fan_pos < min)
+            min = node->ctx.fan_pos;
+    }
+    return min;
+}
+
+/*
+ * Function to resume the peers which were waiting for the slowest
+ * peer to free up space in the ring
+ */
+static void fanout_wake(struct fanout *f)
+{
+    struct list_node *cur;
+    struct connected_peer_node *node;
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+        node = (struct connected_peer_node *)(cur->container);
+        if (node->ctx.fanout == f && node->ctx.fan_waiting) {
+            node->ctx.fan_waiting = 0;
+            FD_SET(node->fd, &writefds);
+        }
+    }
+}
+
+/*
+ * Function to send the next block of the ring to a peer, without blocking.
+ * The peer furthest ahead reads the next block of the file into the ring,
+ * as long as that does not overwrite a block the slowest peer still needs.
+ *
+ * returns 1 if the complete file has been sent to this peer,
+ *         0 if there is more to send,
+ *        -1 on failure
+ */
+int fanout_send_block(struct connected_peer_node *node)
+{
+    struct fanout *f = node->ctx.fanout;
+    int rc = 0, slot = 0, len = 0, was_slowest = 0;
+    uint64_t min;
+
+    /* finish the block which could not be sent completely, first */
+    if (xfer_tx_pending(&node->ctx)) {
+        rc = xfer_flush(node);
+        if (rc <= 0)
+            return rc;
+    }
+
+    if (node->ctx.fan_pos == f->total_blocks)
+        return 1;
+
+    min = fanout_min_pos(f);
+
+    if (node->ctx.fan_pos == f->blocks_read) {
+        /* We are the fastest peer, get the next block from the file */
+        if (f->blocks_read - min >= FANOUT_SLOTS) {
+            /* The ring is full: wait for the slowest peer to catch up */
+            node->ctx.fan_waiting = 1;
+            FD_CLR(node->fd, &writefds);
+            return 0;
+        }
+
+        slot = f->blocks_read % FANOUT_SLOTS;
+        len = pread(f->file_fd, f->ring + slot * XFER_BLOCK_SIZE,
+                XFER_BLOCK_SIZE, f->blocks_read * XFER_BLOCK_SIZE);
+        if (len <= 0) {
+            printf("Error reading from file: %s\n",
+                    len ? strerror(errno) : "unexpected end of file");
+            return -1;
+        }
+        f->slot_len[slot] = len;
+        f->blocks_read++;
+    }
+
+    was_slowest = (node->ctx.fan_pos == min);
+
+    /* frame the block for this peer */
+    slot = node->ctx.fan_pos % FANOUT_SLOTS;
+    xfer_queue_block(node, f->ring + slot * XFER_BLOCK_SIZE, f->slot_len[slot]);
+    node->ctx.fan_pos++;
+
+    if (node->ctx.bytes_remaining <= f->slot_len[slot])
+        node->ctx.bytes_remaining = 0;
+    else
+        node->ctx.bytes_remaining -= f->slot_len[slot];
+
+    /* The slot is copied into the frame, so if we were holding back the
+     * ring, the peers waiting for it can go on */
+    if (was_slowest)
+        fanout_wake(f);
+
+    rc = xfer_flush(node);
+    if (rc <= 0)
+        return rc;
+
+    return (node->ctx.fan_pos == f->total_blocks);
+}
+
+/*
+ * Function to stop a peer from using the shared ring (transfer complete
+ * or failed). The ring and the file are released with the last peer.
+ */
+void fanout_detach(struct connected_peer_node *node)
+{
+    struct fanout *f = node->ctx.fanout;
+
+    if (!f)
+        return;
+
+    node->ctx.fanout = NULL;
+    node->ctx.fan_waiting = 0;
+
+    /* this peer may have been the one holding back the others */
+    fanout_wake(f);
+
+    if (--f->refcount > 0)
+        return;
+
+    close(f->file_fd);
+    FREE(f->ring);
+    free(f);
+}
+
+/*
+ * Function to upload a directory to several peers: each peer gets its
+ * own batch, sent at its own pace
+ *
+ * returns 0 on success, -1 if no peer could be offered the directory
+ */
+static int upload_dir_to_peers(int conn_id[], int count, char *dir_name)
+{
+    struct connected_peer_node *node = NULL;
+    int i, offered = 0;
+
+    for (i = 0; i < count; ++i) {
+        if (conn_id[i] == 1) {
+            printf("UPLOAD to server not allowed, skipping..\n");
+            continue;
+        }
+
+        node = lookup_peer_by_id(connected_peer_list_head, conn_id[i]);
+        if (!node) {
+            printf("UPLOAD: Invalid connection ID %d\n", conn_id[i]);
+            continue;
+        }
+
+        if (node->ctx.status != idle) {
+            printf("UPLOAD: A file transfer is already in progress with %s, skipping..\n",
+                    node->hostname);
+            continue;
+        }
+
+        if (batch_offer(node, dir_name) == 0)
+            offered++;
+    }
+
+    if (!offered) {
+        printf("UPLOAD: Directory could not be uploaded to any peer\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to upload a file to several peers at once (called as a result
+ * of UPLOAD command with more than one connection ID)
+ * The upload request is sent to all the peers, and the file is sent from
+ * the event loop to the peers which accept it.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int upload_to_peers(int conn_id[], int count, char *file_name)
+{
+    struct connected_peer_node *node = NULL;
+    struct fanout *f = NULL;
+    struct stat st;
+    int i, file_fd = -1;
+
+    if (stat(file_name, &st) < 0) {
+        printf("UPLOAD: Error accessing file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode))
+        return upload_dir_to_peers(conn_id, count, file_name);
+
+    if (!S_ISREG(st.st_mode)) {
+        printf("UPLOAD: '%s' not a regular file\n", file_name);
+        return -1;
+    }
+
+    /* Open the file for reading */
+    file_fd = open(file_name, O_RDONLY);
+    if (file_fd < 0) {
+        printf("UPLOAD: Error opening file '%s': %s\n", file_name, strerror(errno));
+        return -1;
+    }
+
+    f = (struct fanout *) malloc(sizeof(struct fanout));
+    if (!f) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    bzero(f, sizeof(struct fanout));
+
+    f->ring = (char *) malloc(FANOUT_SLOTS * XFER_BLOCK_SIZE);
+    if (!f->ring) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    f->file_fd = file_fd;
+    f->total_blocks = (st.st_size + XFER_BLOCK_SIZE - 1) / XFER_BLOCK_SIZE;
+
+    for (i = 0; i < count; ++i) {
+        if (conn_id[i] == 1) {
+            printf("UPLOAD to server not allowed, skipping..\n");
+            continue;
+        }
+
+        node = lookup_peer_by_id(connected_peer_list_head, conn_id[i]);
+        if (!node) {
+            printf("UPLOAD: Invalid connection ID %d\n", conn_id[i]);
+            continue;
+        }
+
+        if (node->ctx.status != idle) {
+            printf("UPLOAD: A file transfer is already in progress with %s, skipping..\n",
+                    node->hostname);
+            continue;
+        }
+
+        if (send_upload_offer(node, file_name, st.st_size, NULL, 0) < 0) {
+            /* error already printed in send_upload_offer() */
+            continue;
+        }
+
+        /* create the file transfer context for the node, the file is
+         * sent from the event loop once the peer accepts it */
+        start_upload(node, file_fd, file_name, st.st_size);
+        node->ctx.fanout = f;
+        node->ctx.fan_pos = 0;
+        f->refcount++;
+    }
+
+    if (!f->refcount) {
+        printf("UPLOAD: File could not be uploaded to any peer\n");
+        close(file_fd);
+        FREE(f->ring);
+        free(f);
+        return -1;
+    }
+
+    return 0;
+}
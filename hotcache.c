@@ -0,0 +1,347 @@
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "proj1.h"
+
+/* Events on a cached file which make its entry stale */
+#define HOT_WATCH_EVENTS    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                             IN_MOVE_SELF | IN_DELETE_SELF)
+
+/* A file served recently (see hot_lookup()) */
+struct hot_file {
+    char *path;                  /* name the file was requested with */
+    int fd;                      /* open file, dup()ed for each transfer */
+    struct stat st;              /* metadata when it was opened */
+    int wd;                      /* inotify watch, -1 if none */
+    char *pin;                   /* start of the file mapped and locked in memory */
+    uint64_t pin_len;
+    int refs;                    /* transfers using pin */
+    int changed;                 /* the file changed: nothing is sent from pin any more */
+    int cached;                  /* still in the cache (not evicted nor stale) */
+    struct hot_file *prev;       /* LRU list, most recently used first */
+    struct hot_file *next;
+};
+
+/******* Global values *******/
+int hot_cache_files = 32;       /* files kept open for the next downloads (0: none) */
+int hot_pin_mb = 0;             /* MB of the files served again locked in memory */
+int hot_inotify_fd = -1;        /* watches the cached files, -1 if not available */
+
+static struct hot_file *hot_head = NULL, *hot_tail = NULL;
+static int hot_count = 0;
+static uint64_t hot_pinned = 0;  /* bytes locked in memory */
+static int hot_inotify_tried = 0;
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to free an entry which is out of the cache, once no transfer
+ * uses it any more
+ */
+static void hot_free(struct hot_file *h)
+{
+    if (h->cached || h->refs)
+        return;
+
+    if (h->pin) {
+        munmap(h->pin, h->pin_len);
+        hot_pinned -= h->pin_len;
+    }
+    close(h->fd);
+    FREE(h->path);
+    free(h);
+}
+
+/*
+ * Function to take an entry out of the cache (evicted, or the file
+ * changed). The transfers still using it keep it until they are done.
+ */
+static void hot_remove(struct hot_file *h)
+{
+    struct hot_file *cur;
+
+    if (h->prev)
+        h->prev->next = h->next;
+    else
+        hot_head = h->next;
+    if (h->next)
+        h->next->prev = h->prev;
+    else
+        hot_tail = h->prev;
+    h->prev = h->next = NULL;
+
+    /* the watch is shared by the names of the same file */
+    for (cur = hot_head; cur != NULL && h->wd >= 0; cur = cur->next) {
+        if (cur->wd == h->wd)
+            h->wd = -1;
+    }
+    if (h->wd >= 0)
+        inotify_rm_watch(hot_inotify_fd, h->wd);
+    h->wd = -1;
+
+    hot_count--;
+    h->cached = 0;
+    hot_free(h);
+}
+
+/*
+ * Function to move an entry to the head of the LRU list
+ */
+static void hot_touch(struct hot_file *h)
+{
+    if (h == hot_head)
+        return;
+
+    h->prev->next = h->next;
+    if (h->next)
+        h->next->prev = h->prev;
+    else
+        hot_tail = h->prev;
+
+    h->prev = NULL;
+    h->next = hot_head;
+    hot_head->prev = h;
+    hot_head = h;
+}
+
+/*
+ * Function to start watching the cached files for changes. Without
+ * inotify, the metadata of a cached file is checked on every lookup.
+ */
+static void hot_inotify_init()
+{
+    hot_inotify_tried = 1;
+
+    hot_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (hot_inotify_fd < 0) {
+        printf("inotify not available: %s, checking the cached files on each download\n",
+                strerror(errno));
+        return;
+    }
+
+    FD_SET(hot_inotify_fd, &readfds);
+    if (max_fd < hot_inotify_fd) max_fd = hot_inotify_fd;
+}
+
+/*
+ * Function to lock the start of a file served again in memory, within
+ * the hot_pin_mb budget shared by the cached files, so the next
+ * downloads are sent from memory. If the pages can't be locked (e.g.
+ * RLIMIT_MEMLOCK), the file stays mapped without being locked.
+ */
+static void hot_pin(struct hot_file *h)
+{
+    uint64_t budget = (uint64_t)hot_pin_mb << 20;
+    uint64_t len = h->st.st_size;
+    void *addr;
+
+    if (h->pin || !len || hot_pinned >= budget)
+        return;
+
+    if (len > budget - hot_pinned)
+        len = budget - hot_pinned;
+
+    addr = mmap(NULL, len, PROT_READ, MAP_SHARED, h->fd, 0);
+    if (addr == MAP_FAILED)
+        return;
+
+    madvise(addr, len, MADV_WILLNEED);
+    if (mlock(addr, len) < 0)
+        printf("Could not lock '%s' in memory: %s\n", h->path, strerror(errno));
+
+    h->pin = addr;
+    h->pin_len = len;
+    hot_pinned += len;
+}
+
+/*
+ * Function to find a file in the cache
+ */
+static struct hot_file *hot_find(const char *path)
+{
+    struct hot_file *cur;
+
+    for (cur = hot_head; cur != NULL; cur = cur->next) {
+        if (strcmp(cur->path, path) == 0)
+            break;
+    }
+    return cur;
+}
+
+/*
+ * Function to find a file in the cache of the files served recently.
+ * A cached file needs no access(), stat() nor open(): its metadata is
+ * given in st and a new descriptor of the open file is returned (to be
+ * closed by the caller). The entry is kept up to date by inotify, or by
+ * comparing the size and modification time of the file if it is not
+ * available. The changes reported by inotify but not handled yet are
+ * handled first, so a file which changed is not served from memory.
+ *
+ * returns the file descriptor, -1 if the file is not cached
+ */
+int hot_lookup(const char *path, struct stat *st)
+{
+    struct hot_file *cur = NULL;
+    struct stat now;
+    int fd;
+
+    if (hot_inotify_fd >= 0)
+        hot_cache_events();
+
+    cur = hot_find(path);
+    if (!cur)
+        return -1;
+
+    /* changes not reported by inotify */
+    if (cur->wd < 0 && (stat(path, &now) < 0 || now.st_ino != cur->st.st_ino ||
+                now.st_size != cur->st.st_size || now.st_mtime != cur->st.st_mtime ||
+                now.st_mtim.tv_nsec != cur->st.st_mtim.tv_nsec)) {
+        cur->changed = 1;
+        hot_remove(cur);
+        return -1;
+    }
+
+    fd = dup(cur->fd);
+    if (fd < 0)
+        return -1;
+
+    hot_touch(cur);
+    *st = cur->st;
+
+    /* served again: worth keeping in memory */
+    if (hot_pin_mb)
+        hot_pin(cur);
+
+    return fd;
+}
+
+/*
+ * Function to get the entry of a cached file whose start is locked in
+ * memory, for a transfer to send it from there (see hot_get_block()).
+ * It is released with hot_put() when the transfer is done.
+ *
+ * returns the entry, NULL if the file is not cached or not in memory
+ */
+struct hot_file *hot_hold(const char *path)
+{
+    struct hot_file *cur = hot_find(path);
+
+    if (!cur || !cur->pin)
+        return NULL;
+
+    cur->refs++;
+    return cur;
+}
+
+/*
+ * Function to add a file just opened to be sent to the cache (it keeps
+ * its own descriptor of the open file). The least recently used file is
+ * evicted if the cache is full.
+ */
+void hot_insert(const char *path, int fd, struct stat *st)
+{
+    struct hot_file *h = NULL;
+
+    if (!hot_cache_files)
+        return;
+
+    if (!hot_inotify_tried)
+        hot_inotify_init();
+
+    h = (struct hot_file *) malloc(sizeof(struct hot_file));
+    if (!h) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    bzero(h, sizeof(struct hot_file));
+
+    h->fd = dup(fd);
+    if (h->fd < 0) {
+        free(h);
+        return;
+    }
+    h->path = strdup(path);
+    h->st = *st;
+    h->cached = 1;
+    h->wd = -1;
+    if (hot_inotify_fd >= 0)
+        h->wd = inotify_add_watch(hot_inotify_fd, path, HOT_WATCH_EVENTS);
+
+    h->next = hot_head;
+    if (hot_head)
+        hot_head->prev = h;
+    hot_head = h;
+    if (!hot_tail)
+        hot_tail = h;
+    hot_count++;
+
+    while (hot_count > hot_cache_files)
+        hot_remove(hot_tail);
+}
+
+/*
+ * Function to get a block of a file locked in memory. Once the file is
+ * known to have changed, the rest of it is read from the file instead, as
+ * the pages past a new end of the file can't be accessed (the blocks got
+ * before are read under a SIGBUS handler, see map_queue_block()).
+ *
+ * returns a pointer to the len bytes at off, NULL if they are not in the
+ * locked part of the file
+ */
+char *hot_get_block(struct hot_file *h, uint64_t off, int len)
+{
+    if (!h || h->changed || off + len > h->pin_len)
+        return NULL;
+    return h->pin + off;
+}
+
+/*
+ * Function to release an entry got from hot_lookup(), when the transfer
+ * is done
+ */
+void hot_put(struct hot_file *h)
+{
+    if (!h)
+        return;
+    h->refs--;
+    hot_free(h);
+}
+
+/*
+ * Function to drop the cached files which changed, as reported by
+ * inotify (called when hot_inotify_fd is readable)
+ */
+void hot_cache_events()
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct hot_file *cur, *next;
+    int len, off;
+
+    while ((len = read(hot_inotify_fd, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < len; off += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)(buf + off);
+            for (cur = hot_head; cur != NULL; cur = next) {
+                next = cur->next;
+                if (cur->wd == ev->wd) {
+                    cur->changed = 1;
+                    hot_remove(cur);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Function to evict the least recently used files, after the size of
+ * the cache was reduced (hotfiles option)
+ */
+void hot_cache_resize()
+{
+    while (hot_count > hot_cache_files)
+        hot_remove(hot_tail);
+}
@@ -0,0 +1,520 @@
+#define _GNU_SOURCE    /* for copy_file_range() and struct ucred */
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/fs.h>   /* for FICLONE */
+#include <errno.h>
+#include <inttypes.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* Directory of the Unix domain sockets the clients listen on, private
+ * to the user (/tmp/proj1-<uid>). The name of a socket is made of the
+ * address and port the client listens on, so a peer on the same host can
+ * be found from the address the server gives */
+#define LOCAL_SOCKET_DIR    "/tmp/proj1"
+
+/* Bytes of a file handed over copied at a time, the other peers are
+ * served in between */
+#define LOCAL_COPY_CHUNK    (8 * 1024 * 1024)
+
+/* Copy of a file handed over by a peer on the same host */
+struct local_copy {
+    int src_fd;                 /* file of the peer */
+    uint64_t done;              /* bytes copied so far */
+    char *method;               /* way the file is copied */
+    struct timeval start;       /* time the copy started */
+};
+
+/******* Global values *******/
+int local_enabled = 1;          /* use Unix domain sockets to peers on the same host */
+int local_listen_fd = -1;       /* listening Unix domain socket, -1 if none */
+int fdpass_enabled = 1;         /* hand over open files to peers on the same host */
+
+static struct sockaddr_un local_addr;   /* address local_listen_fd is bound to */
+static int local_copies = 0;            /* files handed over being copied */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to get the address of the Unix domain socket of the client
+ * listening on ip:port
+ */
+static void local_socket_addr(struct in_addr ip, int port, struct sockaddr_un *addr)
+{
+    bzero(addr, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s-%u/%s-%d.sock",
+            LOCAL_SOCKET_DIR, (unsigned) getuid(), inet_ntoa(ip), port);
+}
+
+/*
+ * Function to create the directory of our Unix domain sockets, or check
+ * the one found is ours and can't be used by other users: anyone could
+ * have created it before us to put their own sockets there.
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int local_socket_dir()
+{
+    char dir[sizeof(local_addr.sun_path)];
+    struct stat st;
+
+    snprintf(dir, sizeof(dir), "%s-%u", LOCAL_SOCKET_DIR, (unsigned) getuid());
+
+    if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) {
+        printf("Error creating '%s': %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    if (lstat(dir, &st) < 0) {
+        printf("Error creating '%s': %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+            (st.st_mode & (S_IRWXG | S_IRWXO))) {
+        printf("'%s' is not a directory private to this user, not listening on it\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to check the process at the other end of a Unix domain socket
+ * runs as the same user as we do
+ *
+ * returns 0 if it does, -1 otherwise
+ */
+static int local_check_peer(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+            cred.uid != getuid())
+        return -1;
+    return 0;
+}
+
+/*
+ * Function to start listening for the peers on the same host (client mode)
+ * Without it the peers on this host connect over TCP, so an error is only
+ * printed.
+ */
+void local_listen()
+{
+    local_socket_addr(myip, listen_port, &local_addr);
+
+    if (local_socket_dir() < 0)
+        return;
+
+    local_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (local_listen_fd < 0) {
+        printf("Error in creating local socket: %s\n", strerror(errno));
+        return;
+    }
+
+    /* left behind by a previous run which did not exit cleanly */
+    unlink(local_addr.sun_path);
+
+    if (bind(local_listen_fd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0 ||
+            listen(local_listen_fd, 10) < 0) {
+        printf("Error in listening on '%s': %s\n", local_addr.sun_path, strerror(errno));
+        close(local_listen_fd);
+        local_listen_fd = -1;
+        return;
+    }
+
+    FD_SET(local_listen_fd, &readfds);
+    if (max_fd < local_listen_fd) max_fd = local_listen_fd;
+}
+
+/*
+ * Function to stop listening for the peers on the same host (on exit)
+ */
+void local_close()
+{
+    if (local_listen_fd < 0)
+        return;
+
+    close(local_listen_fd);
+    unlink(local_addr.sun_path);
+    local_listen_fd = -1;
+}
+
+/*
+ * Function to connect to the peer listening on ip:port over its Unix
+ * domain socket, if it runs on the same host
+ *
+ * returns the connected socket, -1 if the peer can't be reached this way
+ */
+int local_connect(struct in_addr ip, int port)
+{
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    if (!local_enabled)
+        return -1;
+
+    local_socket_addr(ip, port, &addr);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    /* fails at once if there is no such socket on this host */
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            local_check_peer(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Receive a connection request from a peer on the same host, on a
+ * connection accepted on the Unix domain socket
+ * Message format:
+ * MSG_LOCAL_CONNECT_REQUEST | port | IP address
+ *
+ * Returns the listen port of the peer on success
+ * -1 on failure
+ */
+int receive_local_connect(int accept_fd)
+{
+    struct connected_peer_node *node = NULL;
+    struct sockaddr_in addr;
+    struct in_addr ip;
+    uint16_t msg_type, port;
+    char hostname[NI_MAXHOST];
+
+    /* the files of a peer on this host are handed over to it: only
+     * another client run by the same user is served this way */
+    if (local_check_peer(accept_fd) < 0) {
+        printf("\nLocal connection from another user. Closing connection\n");
+        close(accept_fd);
+        return -1;
+    }
+
+    if (read_full(accept_fd, &msg_type, sizeof(msg_type)) <= 0 ||
+            read_full(accept_fd, &port, sizeof(port)) <= 0 ||
+            read_full(accept_fd, &ip, sizeof(ip)) <= 0) {
+        close(accept_fd);
+        return -1;
+    }
+
+    /* see if we have reached the connection limit */
+    if (connected_peer_count == MAX_CONN) {
+        /* reject connection */
+        close(accept_fd);
+        return -1;
+    }
+
+    if (msg_type != MSG_LOCAL_CONNECT_REQUEST) {
+        printf("Unknown message on local connection. Closing connection\n");
+        close(accept_fd);
+        return -1;
+    }
+
+    /* the peer is known by the address it listens on */
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = ip;
+    addr.sin_port = htons(port);
+
+    /* Get the hostname of the peer */
+    bzero(hostname, sizeof(hostname));
+    getnameinfo((struct sockaddr *) &addr,
+            sizeof(struct sockaddr_in), hostname, NI_MAXHOST, NULL, 0, 0);
+
+    add_to_peer_list(addr, hostname, accept_fd, port);
+    node = lookup_peer_by_fd(connected_peer_list_head, accept_fd);
+    node->local = 1;
+
+    FD_SET(accept_fd, &readfds);
+    if (max_fd < accept_fd) max_fd = accept_fd;
+
+    printf("\nPeer %s:%d connected (same host)\n", inet_ntoa(ip), port);
+    return port;
+}
+
+/*
+ * Function to hand over an open file to a peer on the same host
+ * Message format:
+ * one byte, carrying the file descriptor (SCM_RIGHTS)
+ *
+ * returns 0 on success, -1 on failure
+ */
+int local_send_fd(int fd, int file_fd)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char byte = 0;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    bzero(&msg, sizeof(msg));
+    bzero(&control, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = sizeof(byte);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &file_fd, sizeof(int));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        printf("\nError passing the file to peer: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to receive an open file handed over by a peer on the same host
+ * (see local_send_fd()), without waiting for it
+ *
+ * returns 1 with the file descriptor in file_fd,
+ *         0 if it has not come yet,
+ *        -2 if the connection is closed,
+ *        -1 on other failures
+ */
+static int local_recv_fd(int fd, int *file_fd)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char byte;
+    int len = 0;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = sizeof(byte);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    len = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        printf("\nError receiving the file from peer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (len == 0)
+        return -2;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        /* the stream is out of step with the peer */
+        printf("\nNo file received from peer\n");
+        return -2;
+    }
+
+    memcpy(file_fd, CMSG_DATA(cmsg), sizeof(int));
+    return 1;
+}
+
+/*
+ * Function to copy the next part of a file handed over, without going
+ * through user space when the filesystems allow it: the blocks are copied
+ * in the kernel with copy_file_range(), and read and written as a last
+ * resort. At most LOCAL_COPY_CHUNK bytes are copied per call.
+ *
+ * returns 1 once the whole file is copied, 0 if there is more to copy,
+ *        -1 on failure
+ */
+static int local_copy_chunk(struct local_copy *c, int dst_fd, uint64_t size)
+{
+    static char buff[XFER_BLOCK_SIZE];
+    loff_t off_in = c->done, off_out = c->done;
+    uint64_t end = c->done + LOCAL_COPY_CHUNK;
+    ssize_t len = 0;
+
+    if (end > size)
+        end = size;
+
+    if (strcmp(c->method, "copy_file_range") == 0) {
+        while (off_out < end) {
+            len = copy_file_range(c->src_fd, &off_in, dst_fd, &off_out, end - off_out, 0);
+            if (len <= 0)
+                break;
+        }
+        c->done = off_out;
+
+        if (off_out == end)
+            return (end == size);
+
+        if (len < 0 && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP &&
+                errno != EINVAL) {
+            printf("Error copying file: %s\n", strerror(errno));
+            return -1;
+        }
+
+        /* not supported between these files: finish the copy by hand */
+        c->method = "read/write";
+    }
+
+    while (off_out < end) {
+        len = pread(c->src_fd, buff, sizeof(buff), off_in);
+        if (len <= 0) {
+            printf("Error reading from file: %s\n",
+                    len ? strerror(errno) : "unexpected end of file");
+            return -1;
+        }
+        if (pwrite(dst_fd, buff, len, off_out) < len) {
+            printf("Error writing to file: %s\n", strerror(errno));
+            return -1;
+        }
+        off_in += len;
+        off_out += len;
+    }
+    c->done = off_out;
+
+    return (end == size);
+}
+
+/*
+ * Function to receive a file handed over by a peer on the same host
+ * instead of being sent (the transfer context of node is set up, with
+ * file_fd the file to write). Called when the connection is readable,
+ * until the file has come, then from the event loop (see local_periodic())
+ * until it is copied.
+ * The blocks of the file are shared (reflink) on a filesystem supporting
+ * it. Otherwise the file is copied a part at a time, and the connection
+ * is not read meanwhile.
+ *
+ * returns 1 once the file is received,
+ *         0 if it has not come yet, or is not completely copied,
+ *        -2 if the connection can't be used any more,
+ *        -1 on other failures
+ */
+int local_receive_file(struct connected_peer_node *node)
+{
+    struct local_copy *c = node->ctx.copy;
+    struct timeval end, diff;
+    int src_fd = -1, rc = 0;
+
+    if (!c) {
+        rc = local_recv_fd(node->fd, &src_fd);
+        if (rc <= 0)
+            return rc;
+
+        c = (struct local_copy *) malloc(sizeof(struct local_copy));
+        if (!c) {
+            printf("\nError in malloc\n");
+            exit(1);
+        }
+        bzero(c, sizeof(struct local_copy));
+        c->src_fd = src_fd;
+        c->method = "reflink";
+        gettimeofday(&c->start, NULL);
+        node->ctx.copy = c;
+        local_copies++;
+
+        /* nothing else comes from the peer until the file is copied */
+        FD_CLR(node->fd, &readfds);
+    }
+
+    /* aborted while the peer was handing it over */
+    if (node->ctx.status == cancelling) {
+        printf("\nAborted transfer of '%s' from %s  :  %d\n",
+                node->ctx.file_name, node->hostname, node->port);
+        print_prompt();
+        return -1;
+    }
+
+    if (!c->done && strcmp(c->method, "reflink") == 0) {
+        if (ioctl(node->ctx.file_fd, FICLONE, c->src_fd) == 0)
+            c->done = node->ctx.file_size;
+        else
+            c->method = "copy_file_range";
+    }
+
+    if (c->done < node->ctx.file_size) {
+        rc = local_copy_chunk(c, node->ctx.file_fd, node->ctx.file_size);
+        if (rc <= 0)
+            return rc;
+    }
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &c->start, &diff);
+    printf("\nFile name : '%s' \nfrom : %s  :  %d\nSuccessfully received!!\n",
+            node->ctx.file_name, node->hostname, node->port);
+    printf("Copied %" PRIu64 " Bytes from the file of the peer (%s),\nTime Taken: %ld.%06ld seconds\n",
+            node->ctx.file_size, c->method, diff.tv_sec, diff.tv_usec);
+    print_prompt();
+    return 1;
+}
+
+/*
+ * Function to release the copy of a file handed over (when its transfer
+ * is over), and read the connection again
+ */
+void local_copy_stop(struct connected_peer_node *node)
+{
+    if (!node->ctx.copy)
+        return;
+
+    close(node->ctx.copy->src_fd);
+    FREE(node->ctx.copy);
+    local_copies--;
+
+    FD_SET(node->fd, &readfds);
+    if (max_fd < node->fd) max_fd = node->fd;
+}
+
+/*
+ * Function to get select() to return at once while files handed over
+ * are being copied
+ */
+void local_next_timeout(struct timeval *tv)
+{
+    if (local_copies)
+        timerclear(tv);
+}
+
+/*
+ * Function called from the event loop to copy the next part of the files
+ * handed over by the peers on the same host
+ */
+void local_periodic()
+{
+    struct list_node *cur, *next;
+    struct connected_peer_node *node;
+
+    if (!local_copies)
+        return;
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = next) {
+        next = cur->next;
+        node = (struct connected_peer_node *)(cur->container);
+        if (!node->ctx.copy)
+            continue;
+
+        /* the copy is the progress of the transfer */
+        node->last_rx = timer_now_ms();
+
+        /* errors already printed in local_receive_file(), and the
+         * transfer is over then */
+        receive_file_block(node);
+    }
+}
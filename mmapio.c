@@ -0,0 +1,181 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <signal.h>
+#include <setjmp.h>
+
+#include "proj1.h"
+
+/******* Global values *******/
+int mmap_enabled = 0;   /* send and receive the files through memory mappings */
+
+/* Reading a page of a mapped file which was truncated raises SIGBUS:
+ * while a mapped block is read (see map_queue_block()), the handler jumps
+ * back there so that the transfer fails instead of the process */
+static sigjmp_buf map_fault_env;
+static volatile sig_atomic_t map_fault_armed = 0;
+static int map_fault_handled = 0;
+
+
+/************ Function definitions **************/
+
+/*
+ * SIGBUS handler: a fault outside of a mapped block being read is not
+ * ours to handle, the default action is restored for it
+ */
+static void map_sigbus(int signo)
+{
+    if (map_fault_armed) {
+        map_fault_armed = 0;
+        siglongjmp(map_fault_env, 1);
+    }
+    signal(SIGBUS, SIG_DFL);
+}
+
+/*
+ * Function to frame a block of a file being sent from memory with queue
+ * (xfer_queue_mapped()), which reads it if the block is compressed.
+ * If the file was truncated under the mapping, the transfer fails
+ * instead of the process getting SIGBUS.
+ *
+ * returns 0 on success, -1 if the block can't be read any more
+ */
+int map_queue_block(struct connected_peer_node *node, char *data, int len,
+        void (*queue)(struct connected_peer_node *node, char *data, int len))
+{
+    if (!map_fault_handled) {
+        if (signal(SIGBUS, map_sigbus) == SIG_ERR)
+            printf("\nError registering signal handler\n");
+        map_fault_handled = 1;
+    }
+
+    if (sigsetjmp(map_fault_env, 1)) {
+        printf("Error reading from file: '%s' was truncated while it was sent\n",
+                node->ctx.file_name);
+        return -1;
+    }
+
+    map_fault_armed = 1;
+    queue(node, data, len);
+    map_fault_armed = 0;
+    return 0;
+}
+
+/*
+ * Function to unmap the window of a file mapped for a transfer
+ */
+static void map_unmap(struct file_map *map)
+{
+    if (map->addr)
+        munmap(map->addr, map->len);
+    map->addr = NULL;
+    map->off = map->len = 0;
+}
+
+/*
+ * Function to get the file data of a transfer at [off, off + len) in
+ * memory, mapping the file in windows of MAP_WINDOW_SIZE bytes.
+ * The window moves forward with the transfer: the previous one is
+ * unmapped when a block falls outside of it. A window starts on a huge
+ * page boundary of the file, so the kernel can back it with huge pages
+ * where the filesystem supports them.
+ * The file to send is mapped read only and read ahead aggressively, the
+ * file to receive (see map_prepare()) is mapped writable. The size of the
+ * file to send is checked again for every window, so no page past its
+ * current end is mapped.
+ *
+ * returns a pointer to the data, NULL if it can't be mapped (the caller
+ * then reads or writes the file instead)
+ */
+char *map_window(struct file_transfer_context *ctx, uint64_t off, uint64_t len)
+{
+    struct file_map *map = &ctx->map;
+    struct stat st;
+    uint64_t start;
+    void *addr;
+
+    if (map->addr && off >= map->off && off + len <= map->off + map->len)
+        return map->addr + (off - map->off);
+
+    if (map->failed || ctx->file_fd < 0)
+        return NULL;
+
+    /* a file being sent is mapped as it is now: it may have been
+     * truncated since the previous window */
+    if (!map->write) {
+        if (fstat(ctx->file_fd, &st) < 0) {
+            map->failed = 1;
+            return NULL;
+        }
+        map->size = st.st_size;
+    }
+
+    /* pages past the end of the file can't be accessed */
+    if (off + len > map->size)
+        return NULL;
+
+    map_unmap(map);
+
+    start = off & ~((uint64_t)MAP_WINDOW_ALIGN - 1);
+    map->len = map->size - start < MAP_WINDOW_SIZE ? map->size - start : MAP_WINDOW_SIZE;
+    if (off + len > start + map->len) {
+        map->len = 0;
+        return NULL;
+    }
+
+    addr = mmap(NULL, map->len, map->write ? PROT_READ | PROT_WRITE : PROT_READ,
+            MAP_SHARED, ctx->file_fd, start);
+    if (addr == MAP_FAILED) {
+        printf("Error mapping '%s': %s, using reads and writes\n", ctx->file_name,
+                strerror(errno));
+        map->len = 0;
+        map->failed = 1;
+        return NULL;
+    }
+
+    map->addr = addr;
+    map->off = start;
+
+    /* only hints, the transfer works without them */
+    madvise(map->addr, map->len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map->addr, map->len, MADV_HUGEPAGE);
+#endif
+
+    return map->addr + (off - map->off);
+}
+
+/*
+ * Function to get a file about to be received ready to be mapped
+ * (mmap option): the file is extended to the end of the range to be
+ * received, as a mapping can't grow a file. If it fails, the file is
+ * written the usual way.
+ */
+void map_prepare(struct file_transfer_context *ctx)
+{
+    struct file_map *map = &ctx->map;
+    uint64_t end = ctx->offset + ctx->bytes_remaining;
+    struct stat st;
+
+    if (!mmap_enabled || ctx->dio || !ctx->bytes_remaining)
+        return;
+
+    if (fstat(ctx->file_fd, &st) < 0 ||
+            (st.st_size < end && ftruncate(ctx->file_fd, end) < 0)) {
+        printf("Error extending '%s': %s, not mapping it\n", ctx->file_name,
+                strerror(errno));
+        return;
+    }
+
+    map->write = 1;
+    map->size = st.st_size < end ? end : st.st_size;
+}
+
+/*
+ * Function to release the mapping of a transfer context
+ */
+void map_release(struct file_transfer_context *ctx)
+{
+    map_unmap(&ctx->map);
+    ctx->map = (struct file_map){0};
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include "proj1.h"
+
+/* structure describing a setting that can be changed with the SET command */
+struct option_node {
+    char *name;
+    int *value;
+    int min;
+    int max;
+    char *help;
+    void (*changed)();          /* called after the value is changed, if set */
+};
+
+/* Table of the available settings */
+static struct option_node options[] = {
+    { "compress", &compress_enabled, 0, 1, "Offer/accept compressed transfers (0/1)" },
+    { "zlevel",   &compress_level,   1, 9, "deflate level used for compressed transfers" },
+    { "slots",    &max_downloads,    1, 64, "Number of queued downloads running at the same time" },
+    { "bloom",    &bloom_interval,   0, 3600, "Min. seconds between two publications of the shared file filter" },
+    { "timeout",  &transfer_timeout, 5, 3600, "Seconds without progress before a transfer is dropped",
+        peer_timer_restart_all },
+    { "handshake", &handshake_timeout, 1, 600, "Seconds to wait for a peer to answer a request",
+        peer_timer_restart_all },
+    { "keepalive", &keepalive_interval, 0, 3600, "Seconds between probes on an idle connection (0 to disable)",
+        peer_timer_restart_all },
+    { "local",    &local_enabled,    0, 1, "Connect to peers on the same host over a Unix domain socket (0/1)" },
+    { "fdpass",   &fdpass_enabled,   0, 1, "Hand over open files to peers on the same host instead of sending them (0/1)" },
+    { "writebehind", &write_behind_mb, 0, 1024, "MB received between two flushes to disk (0 to leave it to the kernel)" },
+    { "stripes",  &stripe_count,     0, MAX_STRIPES, "Extra data connections used to download a large file (0 to disable)" },
+    { "mmap",     &mmap_enabled,     0, 1, "Send and receive files through memory mappings instead of copies (0/1)" },
+    { "readahead", &readahead_mb,    0, 1024, "MB of a file being sent read ahead of what is sent (0 to leave it to the kernel)" },
+    { "dropcache", &drop_behind_mb,  0, 1 << 20, "Size in MB from which a file is dropped from the page cache once sent (0: never)" },
+    { "direct",   &direct_mb,        0, 1 << 20, "Size in MB from which a transfer bypasses the page cache (O_DIRECT, 0: never)" },
+    { "hotfiles", &hot_cache_files,  0, 4096, "Files served recently kept open for the next downloads (0 to disable)",
+        hot_cache_resize },
+    { "hotpin",   &hot_pin_mb,       0, 1 << 20, "MB of the files served again locked in memory (0 to disable)" },
+    { "sparse",   &sparse_enabled,   0, 1, "Send only the data of sparse files, and recreate their holes (0/1)" },
+    { "batchworkers", &batch_workers, 1, MAX_BATCH_WORKERS, "Threads opening the files of a batch ahead of the one being sent" },
+    { "sharedonly", &shared_only,    0, 1, "Serve only the files advertised with SHARE, by their shared name (0/1)" },
+};
+
+#define NUM_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to print all the settings along with their current value
+ */
+void print_options()
+{
+    int i;
+
+    printf("Setting\t\tValue\t\tDescription\n");
+    printf("-----------------------------------------------------------------------\n");
+    for (i = 0; i < NUM_OPTIONS; i++) {
+        printf("%s\t\t%d\t\t%s\n", options[i].name, *options[i].value,
+                options[i].help);
+    }
+}
+
+/*
+ * Function to change a setting
+ *
+ * returns 0 on success, -1 on failure
+ */
+int set_option(char *name, char *value)
+{
+    int i, val;
+    char *end = NULL;
+
+    for (i = 0; i < NUM_OPTIONS; i++) {
+        if (strcasecmp(options[i].name, name) != 0)
+            continue;
+
+        val = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' ||
+                val < options[i].min || val > options[i].max) {
+            printf("SET: invalid value for '%s', should be %d-%d\n",
+                    options[i].name, options[i].min, options[i].max);
+            return -1;
+        }
+
+        *options[i].value = val;
+        printf("%s set to %d\n", options[i].name, val);
+
+        if (options[i].changed)
+            options[i].changed();
+        return 0;
+    }
+
+    printf("SET: Unknown setting '%s'\n", name);
+    return -1;
+}
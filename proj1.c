@@ -51,11 +51,69 @@ void print_prompt ()
     fflush(stdout);
 }
 
+/* Function to read the commands typed by the user.
+ * It is called when stdin is readable, and reads only what is available,
+ * so the transfers go on while a command is being typed. A partial line
+ * is kept until the rest of it arrives, and every complete line is
+ * handled as a command.
+ *
+ * returns 0 on success, -1 if stdin is closed */
+int read_commands(int fd)
+{
+    static char line[BUFLEN];   /* command line being received */
+    static int line_len = 0;
+    static int discard = 0;     /* skipping the rest of a line too long */
+    char buf[BUFLEN];
+    int len, i;
+
+    len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+        if (len < 0 && errno == EINTR)
+            return 0;
+        printf("\nError reading command: %s\n", len ? strerror(errno) : "end of input");
+        return -1;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] != '\n') {
+            if (discard)
+                continue;
+            if (line_len == sizeof(line) - 1) {
+                printf("\nCommand too long, ignored\n");
+                discard = 1;
+                line_len = 0;
+                continue;
+            }
+            line[line_len++] = buf[i];
+            continue;
+        }
+
+        /* We have got a complete line */
+        if (discard) {
+            discard = 0;
+            print_prompt();
+            continue;
+        }
+
+        /* strip the trailing '\r' if any */
+        if (line_len && line[line_len - 1] == '\r')
+            line_len--;
+        line[line_len] = '\0';
+
+        /* handle the command if it is non-empty */
+        if (strspn(line, " \t") != line_len)
+            handle_cmd(line, line_len);
+        line_len = 0;
+        print_prompt();
+    }
+
+    return 0;
+}
+
 int main (int argc, char *argv[])
 {
-    int i, rc, len;
+    int i, rc;
     struct timeval tv;
-    char cmd_buff[BUFLEN];
     fd_set temp_rfds, temp_wfds;
     int stdin_fd = fileno(stdin);
     int accept_fd, client_port, sockopt;
@@ -117,6 +175,11 @@ int main (int argc, char *argv[])
         exit(1);
     }
 
+    /* The connections accepted from peers inherit the buffer sizes
+     * of the listening socket */
+    if (mode == client_mode)
+        tcp_tune_socket(listen_fd);
+
     /* bind the socket to the given port */
     if (bind(listen_fd, (struct sockaddr *)&listen_addr, 
                 sizeof(listen_addr)) < 0) {
@@ -142,6 +205,14 @@ int main (int argc, char *argv[])
 
     max_fd = listen_fd;
 
+    /* the peers on this host connect over a Unix domain socket */
+    if (mode == client_mode)
+        local_listen();
+
+    /* Get back the downloads queued by the previous run */
+    if (mode == client_mode)
+        queue_load();
+
     print_prompt();
 
     while (1) {
@@ -155,6 +226,26 @@ int main (int argc, char *argv[])
         tv.tv_sec = 5;
         tv.tv_usec = 0;
 
+        /* wake up in time to publish the filter of our shared files */
+        if (mode == client_mode) {
+            rc = bloom_next_timeout();
+            if (rc >= 0 && rc < tv.tv_sec)
+                tv.tv_sec = rc;
+
+            /* and in time to resume the transfers held back by the rate limits */
+            rate_next_timeout(&tv);
+
+            /* or at once, to go on with the copy of the files handed over */
+            local_next_timeout(&tv);
+
+            /* or with the hashing of the files of a sync, or to share */
+            sync_next_timeout(&tv);
+            share_next_timeout(&tv);
+        }
+
+        /* and for the first timer */
+        timer_next_timeout(&tv);
+
         rc = select(max_fd + 1, &temp_rfds, &temp_wfds, NULL, &tv);
 
         if (rc < 0) {
@@ -167,27 +258,28 @@ int main (int argc, char *argv[])
         } else {
             /* Go through the fds to see if anything is ready to read */
             for (i = 0; i <= max_fd; i++) {
-                if (FD_ISSET(i, &temp_rfds)) {
+                /* skip the connections closed since select() returned */
+                if (FD_ISSET(i, &temp_rfds) && FD_ISSET(i, &readfds)) {
 
                     /* Check a command was entered */
                     if (i == stdin_fd) {
-                        /* Read command */
-                        len = read(stdin_fd, cmd_buff, sizeof(cmd_buff));
-                        if (len > 0) {
-                            /* NULL terminate the string */
-                            cmd_buff[len] = '\0';
-                            /* strip the trainling '\n' if any */
-                            if (cmd_buff[len-1] == '\n') {
-                                cmd_buff[len-1] = '\0';
-                                len--;
-                            }
-
-                            /* handle the command if it is non-empty */
-                            if (cmd_buff[0] != '\0') {
-                                handle_cmd(cmd_buff, len);
-                            }
+                        /* Read (a part of) a command */
+                        if (read_commands(stdin_fd) < 0) {
+                            /* no more commands, keep serving the peers */
+                            FD_CLR(stdin_fd, &readfds);
+                        }
+                    } else if (i == hot_inotify_fd) {
+                        /* files served recently were changed */
+                        hot_cache_events();
+                    } else if (i == local_listen_fd) {
+                        /* accept a connection from a peer on this host */
+                        accept_fd = accept(local_listen_fd, NULL, NULL);
+                        if (accept_fd < 0) {
+                            printf("\nError accepting new connection: %s\n",
+                                    strerror(errno));
                         } else {
-                            printf("Error reading command\n");
+                            /* errors already printed in receive_local_connect() */
+                            receive_local_connect(accept_fd);
                         }
                         print_prompt();
                     } else if (i == listen_fd) {
@@ -214,9 +306,10 @@ int main (int argc, char *argv[])
                                     add_server_ip(accept_addr, client_port, accept_fd);
 
                                     /* Send updates to all clients */
-                                    if (send_ip_list_to_client() < 0) {
-                                        printf("\nError sending server IP List to clients\n");
-                                    }
+                                    peer_list_changed();
+
+                                    /* and what the other clients are sharing */
+                                    send_filters_to_client(accept_fd);
                                 } else {
                                     /* error already printed in receive_client_connect() */
                                 }
@@ -234,9 +327,10 @@ int main (int argc, char *argv[])
                         }
                     } else if(mode == client_mode && i == server_fd) {
                         /* Client received an update from the server */
-                        if (recv_update_from_server() < 0 ) {
+                        rc = recv_update_from_server();
+                        if (rc < 0 ) {
                             /* Error already printed recv_update_from_server()*/
-                        } else {
+                        } else if (rc == 0) {
                             /* Display the updated list */
                             display_available_peers();
                         }
@@ -266,6 +360,16 @@ int main (int argc, char *argv[])
                 }
             } /* end of for (i = 0; i <= max_fd; i++) */
         } /* end of rc > 0 */
+
+        if (mode == client_mode) {
+            bloom_periodic();
+            rate_refill();
+            queue_periodic();
+            local_periodic();
+            sync_periodic();
+            share_periodic();
+        }
+        timer_run();
     } /* end of while (1) */
 }
 
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <sys/types.h> 
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -32,21 +33,126 @@
 #define CMD_UPLOAD      "upload"
 #define CMD_DOWNLOAD    "download"
 #define CMD_CREATOR     "creator"
+#define CMD_SET         "set"
+#define CMD_RELAY       "relay"
+#define CMD_SHARE       "share"
+#define CMD_UNSHARE     "unshare"
+#define CMD_SEARCH      "search"
+#define CMD_WHOHAS      "whohas"
+#define CMD_LIMIT       "limit"
+#define CMD_QUEUE       "queue"
+#define CMD_ABORT       "abort"
+#define CMD_TCP         "tcp"
+#define CMD_BATCH       "batch"
+#define CMD_SYNC        "sync"
 
 /* Message types */
 #define MSG_MYPORT              0x11 /* Used by client to send its port information */
 #define MSG_PEER_LIST           0x12 /* Used by server to send the IP list */
+#define MSG_CATALOG_ADD         0x13 /* Used by client to advertise a shared file */
+#define MSG_CATALOG_REMOVE      0x14 /* Used by client to withdraw a shared file */
+#define MSG_SEARCH_REQUEST      0x15 /* Used by client to search the server catalog */
+#define MSG_SEARCH_RESULT       0x16 /* Used by server to send the search results */
+#define MSG_BLOOM_FILTER        0x17 /* Used by client to publish the filter of its shared files */
+#define MSG_PEER_FILTER         0x18 /* Used by server to pass on the filter of a client */
+#define MSG_HEARTBEAT           0x19 /* Used by client to show the server it is still there */
+
+/* Seconds between two heartbeats of a client, and number of heartbeats
+ * missed before the server drops the client */
+#define HEARTBEAT_INTERVAL      5
+#define HEARTBEAT_MISSES        3
 
 #define MSG_CONNECT_REQUEST     0x21 /* Used by client to connect to peer */
+#define MSG_STRIPE_REQUEST      0x22 /* Used by client to open an extra data connection
+                                        for a part of a striped download */
+#define MSG_LOCAL_CONNECT_REQUEST 0x23 /* Used by client to connect to a peer on the same host,
+                                          over its Unix domain socket */
 
 #define MSG_DOWNLOAD_REQUEST    0x31 /* Used by client to request a file from peer */
 #define MSG_DOWNLOAD_ACCEPT     0x32 /* Used by client to accept the download request from peer */
 #define MSG_DOWNLOAD_REJECT     0x33 /* Used by client to reject the download request from peer*/
+#define MSG_BATCH_REQUEST       0x34 /* Used by client to request several files in one transfer */
+#define MSG_BATCH_ACCEPT        0x35 /* Used by client to start sending the files of a batch */
+#define MSG_BATCH_REJECT        0x36 /* Used by client when no file matches a batch request */
+#define MSG_BATCH_OFFER         0x37 /* Used by client to upload a directory as a batch */
+#define MSG_SYNC_REQUEST        0x38 /* Used by client to get what changed in a directory of peer */
 
 #define MSG_UPLOAD_REQUEST      0x41 /* Used by client to send an upload request to peer */
 #define MSG_UPLOAD_ACCEPT       0x42 /* Used by client to accept an upload request from peer*/
 #define MSG_UPLOAD_REJECT       0x43 /* Used by client to reject an upload request from peer*/
+#define MSG_RELAY_REQUEST       0x44 /* Used by client to upload a file that has to be forwarded
+                                        down a chain of peers (answered as an upload request) */
+
+#define MSG_TRANSFER_CANCEL     0x51 /* Used by the receiver of a file to stop the transfer, the
+                                        sender answers with a XFER_FRAME_CANCEL frame */
+#define MSG_KEEPALIVE           0x52 /* Sent by client on an idle connection to show it is alive */
+
+/* Maximum number of peers a file can be relayed to after the first one */
+#define MAX_RELAY_HOPS          32
+
+/* Transfer capability flags.
+ * The requester sends the flags it would like to use in the request, the
+ * other side answers with the subset it supports in the accept message */
+#define XFER_CAP_COMPRESS       0x0001 /* data blocks may be deflate compressed */
+#define XFER_CAP_FDPASS         0x0002 /* the open file is handed over instead of being
+                                          sent (peer on the same host) */
+#define XFER_CAP_SPARSE         0x0004 /* the holes of a sparse file are sent as
+                                          XFER_FRAME_HOLE frames */
+
+/* Number of extra data connections of a striped download, in the top
+ * bits of the flags: asked for in the download request, and granted
+ * (possibly fewer, 0 for a small file) in the accept message */
+#define XFER_STRIPES_SHIFT      24
+#define XFER_STRIPES(flags)     (((flags) >> XFER_STRIPES_SHIFT) & 0xff)
+
+/* Maximum number of extra data connections of a striped download */
+#define MAX_STRIPES             8
+/* Minimum size of a part of a striped download */
+#define STRIPE_MIN_PART         (4 << 20)
+
+/* Maximum number of threads opening the files of a batch */
+#define MAX_BATCH_WORKERS       32
+/* Maximum number of names (or patterns) in a batch request */
+#define MAX_BATCH_NAMES         64
+
+/* Frame types used on the data stream of a file transfer.
+ * Every block of file data is preceded by a struct xfer_frame_hdr */
+#define XFER_FRAME_DATA         0x01 /* payload is raw file data */
+#define XFER_FRAME_ZDATA        0x02 /* payload is a deflate compressed block */
+#define XFER_FRAME_CANCEL       0x03 /* no payload, the sender stopped the transfer */
+#define XFER_FRAME_HOLE         0x04 /* no payload, raw_len bytes of the file are a hole */
+#define XFER_FRAME_FILE         0x05 /* payload is a struct xfer_file_hdr and the name of the
+                                        next file of a batch, its data follows */
+#define XFER_FRAME_END          0x06 /* no payload, end of a batch of raw_len files */
+
+/* Largest hole described by a single frame */
+#define XFER_HOLE_MAX           (1 << 30)
+
+/* Size of the file blocks read and sent in a single frame */
+#define XFER_BLOCK_SIZE         32768
+
+/* Size of the windows of a file mapped at once (mmap option), and the
+ * alignment of their offset in the file (a huge page) */
+#define MAP_WINDOW_SIZE         (64 << 20)
+#define MAP_WINDOW_ALIGN        (2 << 20)
+
+
+/* Maximum number of files returned for a SEARCH */
+#define MAX_SEARCH_RESULTS      100
+/* Maximum number of terms considered in a SEARCH query */
+#define MAX_SEARCH_TERMS        8
+
+/* Size of a block of the shared file Bloom filters (one cache line) */
+#define BLOOM_BLOCK_SIZE        64
+/* Maximum number of blocks in a filter (4MB) */
+#define BLOOM_MAX_BLOCKS        (1 << 16)
+
+/* 64 bit FNV-1a hash parameters */
+#define FNV_OFFSET_BASIS        0xcbf29ce484222325ULL
+#define FNV_PRIME               0x100000001b3ULL
 
+/* Size of the digest of the contents of a file (SHA-256) */
+#define FILE_DIGEST_SIZE        32
 
 /* macro to safely free a pointer */
 #define FREE(ptr)  { \
@@ -65,21 +171,101 @@ typedef enum {
     server_mode
 } prog_mode_t;
 
+struct catalog_entry;
+
+/* Timer of the event loop (see timer.c) */
+struct timer {
+    struct timer *next;          /* next timer in the same slot of the wheel */
+    struct timer **pprev;        /* link pointing to this timer, NULL if not armed */
+    uint64_t expires;            /* tick at which the timer expires */
+    void (*fn)(void *arg);       /* function called on expiry */
+    void *arg;
+};
+
 /* structure to be used by server to maintain a list of available clients */
 struct client_node {
     struct sockaddr_in clientaddr;
     unsigned short port;
     char hostname[NI_MAXHOST];
     int fd;
+    struct catalog_entry *catalog;  /* files shared by this client */
+    uint32_t bloom_blocks;          /* size of the filter of its files, in blocks */
+    char *bloom;                    /* filter of its files, as published */
+    struct timer timer;             /* evicts the client when its heartbeats stop */
+    uint64_t last_rx;               /* time something was last received from it (ms) */
 };
 
 /* File transfer status for a peer */
 typedef enum {
     idle,
     sending,
-    receiving
+    receiving,
+    relaying,      /* forwarding the blocks received from another peer */
+    requesting,    /* download requested, waiting for the response */
+    offering,      /* upload requested, waiting for the response */
+    cancelling,    /* download aborted, dropping the data still in flight */
+    striping,      /* our part of a striped download is done, the others are not */
+    hashing        /* hashing the files of a sync, before requesting or answering it */
 } status_t;
 
+/* Priority classes of the download queue */
+#define PRIO_HIGH       0
+#define PRIO_NORMAL     1
+#define PRIO_LOW        2
+#define NUM_PRIO        3
+
+struct queued_download;
+
+struct fanout;
+
+struct stripe_set;
+struct direct_io;
+struct hot_file;
+struct batch;
+struct local_copy;
+struct relay_queue;
+struct sync_job;
+
+/* Token bucket used to limit the rate at which data is sent */
+struct token_bucket {
+    uint64_t rate;               /* bytes per second, 0 if unlimited */
+    uint64_t burst;              /* maximum number of tokens */
+    double tokens;               /* bytes that may be sent now (negative when in debt) */
+    struct timeval last;         /* time of the last refill */
+};
+
+/* Window of a file mapped in memory (mmap option) */
+struct file_map {
+    char *addr;                  /* start of the window, NULL if none is mapped */
+    uint64_t off;                /* offset of the window in the file */
+    uint64_t len;                /* size of the window */
+    uint64_t size;               /* size of the file, 0 until known */
+    int write;                   /* mapped to receive the file */
+    int failed;                  /* mapping failed, read and write the file instead */
+};
+
+/* Header sent in front of every block of a file transfer */
+struct xfer_frame_hdr {
+    uint16_t type;               /* XFER_FRAME_* */
+    uint16_t reserved;
+    uint32_t wire_len;           /* size of the payload following this header */
+    uint64_t raw_len;            /* bytes of file data represented by the payload */
+};
+
+/* Payload of a XFER_FRAME_FILE frame, followed by the name of the file */
+struct xfer_file_hdr {
+    uint64_t size;               /* size of the file, 0 for a directory */
+    int64_t mtime;               /* modification time */
+    uint32_t mtime_nsec;
+    uint32_t mode;               /* file type and permission bits */
+};
+
+/* A file or directory found by tree_walk() */
+struct walk_entry {
+    char *path;
+    struct stat st;
+};
+
 /* structure to maintain the information required for file transfer with a peer */
 struct file_transfer_context {
     status_t status;             /* Flag to indicated if we sending/receiving file from this peer */
@@ -88,6 +274,40 @@ struct file_transfer_context {
     struct timeval total_time;   /* total time spent in the transfer so far */
     uint64_t file_size;          /* size of the file being transferred */
     uint64_t bytes_remaining;    /* size of the file still remaining to be transferred */
+    uint32_t flags;              /* XFER_CAP_* flags negotiated for this transfer */
+    int zskip;                   /* blocks to send raw before sampling entropy again */
+    struct xfer_frame_hdr rx_hdr;/* header of the frame being received */
+    int rx_hdr_len;              /* bytes of rx_hdr received so far */
+    char *rx_buf;                /* payload of the frame being received */
+    char *rx_dst;                /* where the payload is received (rx_buf, or the mapped file) */
+    uint32_t rx_len;             /* bytes of the payload received so far */
+    char *tx_buf;                /* frame being sent */
+    char *tx_data;               /* its payload (in tx_buf, or in the mapped file) */
+    int tx_len;                  /* size of the frame */
+    int tx_off;                  /* bytes of the frame sent so far */
+    struct fanout *fanout;       /* shared ring, if this is a fan-out upload */
+    uint64_t fan_pos;            /* next block of the ring to send to this peer */
+    int fan_waiting;             /* waiting for the slowest peer to free the ring */
+    int relay_id;                /* connection the received blocks are forwarded to */
+    struct token_bucket tb;      /* rate limit of this transfer */
+    int throttled;               /* waiting for tokens (not in writefds) */
+    struct queued_download *qentry; /* queue entry, if this is a queued download */
+    uint64_t offset;             /* position in the file of the next block */
+    uint64_t wb_pending;         /* bytes written since the last writeback was started */
+    uint64_t wb_prev_off;        /* batch whose writeback was started last */
+    uint64_t wb_prev_len;
+    struct stripe_set *stripes;  /* parts of the download, if it is striped */
+    struct file_map map;         /* window of the file mapped in memory */
+    int ra_started;              /* the sequential read of the file was announced */
+    uint64_t ra_end;             /* end of the range of the file being read ahead */
+    uint64_t drop_off;           /* start of the range sent but not dropped from the cache */
+    uint64_t data_end;           /* end of the data extent being sent (sparse file) */
+    struct direct_io *dio;       /* I/O state, if the file bypasses the page cache */
+    struct hot_file *hot;        /* cached file, if it is sent from memory */
+    struct batch *batch;         /* files of the transfer, if it is a batch */
+    struct local_copy *copy;     /* file handed over being copied, if any */
+    struct relay_queue *relayq;  /* frames waiting to be forwarded, on the next hop of a relay */
+    struct sync_job *sync;       /* files of a sync being hashed, if any */
 };
 
 /* structure to be used by client to maintain a list of connected peers */
@@ -97,9 +317,31 @@ struct connected_peer_node {
     struct sockaddr_in addr;
     unsigned short port;
     int fd;
+    struct token_bucket tb;      /* rate limit of everything sent to this peer */
+    struct timer timer;          /* idle, keepalive and handshake timeouts */
+    uint64_t last_rx;            /* time something was last received from the peer (ms) */
+    uint64_t last_tx;            /* time something was last sent to the peer (ms) */
+    int local;                   /* connected over a Unix domain socket (same host) */
+    int main_id;                 /* sending a part of a striped download: connection
+                                    of the download (its peer limit applies) */
+    int stripe;                  /* extra data connection of a striped download
+                                    (no id, not listed) */
     struct file_transfer_context ctx;
 };
 
+/* Maximum length of the name of a congestion control algorithm */
+#define TCP_CC_NAME_MAX         16
+
+/* Socket options applied to the connections to peers */
+struct tcp_profile {
+    char *name;
+    int sndbuf;                  /* SO_SNDBUF in bytes, 0 to let the kernel autotune it */
+    int rcvbuf;                  /* SO_RCVBUF in bytes, 0 to let the kernel autotune it */
+    int notsent_lowat;           /* TCP_NOTSENT_LOWAT in bytes, 0 for the system default */
+    int nodelay;                 /* TCP_NODELAY */
+    char *help;
+};
+
 /* structure to be used by client to maintain a list of available peers */
 struct available_peer_node {
     struct in_addr ip;
@@ -126,6 +368,32 @@ extern int server_ip_count;
 
 extern struct list_node *connected_peer_list_head;
 extern int connected_peer_count;
+extern int send_in_progress;
+extern int recv_in_progress;
+extern int max_downloads;
+
+extern int compress_enabled;
+extern int compress_level;
+extern int shared_file_count;
+extern int shared_only;
+extern int bloom_interval;
+extern int transfer_timeout;
+extern int handshake_timeout;
+extern int keepalive_interval;
+extern int stripe_count;
+extern int local_enabled;
+extern int local_listen_fd;
+extern int fdpass_enabled;
+extern int write_behind_mb;
+extern int mmap_enabled;
+extern int readahead_mb;
+extern int drop_behind_mb;
+extern int direct_mb;
+extern int sparse_enabled;
+extern int hot_cache_files;
+extern int hot_pin_mb;
+extern int hot_inotify_fd;
+extern int batch_workers;
 
 
 /********* function prototypes ************/
@@ -139,6 +407,8 @@ int handle_exit();
 void add_server_ip(struct sockaddr_in addr, int port, int fd);
 int receive_client_connect(int accept_fd);
 int send_ip_list_to_client();
+void peer_list_changed();
+void send_filters_to_client(int fd);
 void print_client_list();
 void display_available_peers();
 
@@ -150,11 +420,219 @@ int register_to_server(char *address, unsigned short port);
 int connect_to_peer(char *address, unsigned short port);
 void print_peer_list();
 int upload_to_peer(int conn_id, char *file_name);
+int send_upload_offer(struct connected_peer_node *node, char *file_name,
+        uint64_t file_size, struct available_peer_node *hops, int hop_count);
+void start_upload(struct connected_peer_node *node, int file_fd, char *file_name,
+        uint64_t file_size);
+int send_upload_request(struct connected_peer_node *node, char *file_name,
+        uint64_t file_size, struct available_peer_node *hops, int hop_count);
+struct connected_peer_node *lookup_peer_by_fd(struct list_node *head, int fd);
+struct connected_peer_node *lookup_peer_by_id(struct list_node *head, int id);
+struct connected_peer_node *lookup_peer_by_address(struct in_addr ip, unsigned short port);
+void add_to_peer_list(struct sockaddr_in peer_addr, char *hostname, int fd, int port);
+struct connected_peer_node *add_stripe_to_peer_list(struct sockaddr_in peer_addr, char *hostname,
+        int fd, int port);
+void close_stripe(struct connected_peer_node *node);
+void print_tx_summary(struct connected_peer_node *node);
+void reset_transfer(struct connected_peer_node *node);
 int terminate_connection(int conn_id);
+void close_peer(struct connected_peer_node *node);
+int abort_transfer(int conn_id);
 int receive_from_client(int fd);
 int receive_data_from_peer(int fd);
-int download_from_peer(int conn_id[], char file_name[][255], int count);
+int receive_file_block(struct connected_peer_node *node);
 int handle_write(int fd);
 
+uint64_t fnv1a_hash(const void *buf, size_t len, uint64_t hash);
+int read_full(int fd, void *buf, int len);
+
+/* transfer.c */
+uint32_t local_xfer_caps();
+void xfer_queue_block(struct connected_peer_node *node, char *data, int len);
+void xfer_queue_mapped(struct connected_peer_node *node, char *data, int len);
+void xfer_queue_wire(struct connected_peer_node *node, struct xfer_frame_hdr *hdr,
+        char *payload);
+void xfer_queue_hole(struct connected_peer_node *node, int len);
+int xfer_find_hole(struct file_transfer_context *ctx, int *len);
+void xfer_queue_frame(struct connected_peer_node *node, int type, char *payload, int len,
+        uint64_t raw_len);
+int xfer_flush(struct connected_peer_node *node);
+int xfer_tx_pending(struct file_transfer_context *ctx);
+int xfer_send_cancel(struct connected_peer_node *node);
+int xfer_recv_frame(struct connected_peer_node *node);
+int xfer_write_frame(struct connected_peer_node *node);
+int xfer_prealloc(int file_fd, uint64_t file_size);
+void xfer_write_behind(struct file_transfer_context *ctx);
+void xfer_read_advice(struct file_transfer_context *ctx, int len);
+void xfer_reset(struct file_transfer_context *ctx);
+
+/* fanout.c */
+int upload_to_peers(int conn_id[], int count, char *file_name);
+int fanout_send_block(struct connected_peer_node *node);
+void fanout_detach(struct connected_peer_node *node);
+
+/* relay.c */
+int relay_upload(int conn_id, char *file_name, struct available_peer_node *hops, int hop_count);
+struct connected_peer_node *relay_open_downstream(struct connected_peer_node *upstream,
+        struct available_peer_node *hops, int hop_count, char *file_name, uint64_t file_size);
+int relay_response(struct connected_peer_node *down, uint16_t msg_type);
+void relay_forward_frame(struct connected_peer_node *node, char *data, int len);
+int relay_send_block(struct connected_peer_node *down);
+void relay_release(struct connected_peer_node *down);
+void relay_finish(struct connected_peer_node *node, int status);
+void relay_cancel(struct connected_peer_node *down);
+
+/* queue.c */
+int queue_prio_from_name(char *name);
+int queue_download(int conn_id, char *file_name, int prio);
+void queue_wakeup();
+void queue_periodic();
+void queue_finish(struct connected_peer_node *node, int requeue);
+int queue_download_response(struct connected_peer_node *node, uint16_t msg_type);
+int queue_remove(uint64_t seq);
+void print_queue();
+void queue_load();
+
+/* ratelimit.c */
+void rate_init_transfer(struct connected_peer_node *node);
+void rate_charge(struct connected_peer_node *node, int len);
+int rate_throttle(struct connected_peer_node *node);
+void rate_refill();
+void rate_next_timeout(struct timeval *tv);
+void print_rate_limits();
+int set_rate_limit(char *level, int conn_id, char *value);
+
+/* compress.c */
+int block_is_compressible(const unsigned char *data, int len);
+int compress_block(const char *in, int in_len, char *out, int out_size);
+int decompress_block(const char *in, int in_len, char *out, int out_size);
+int compress_bound(int len);
+
+/* catalog.c */
+void catalog_add(struct client_node *owner, char *name, uint64_t size, uint64_t hash);
+int catalog_remove(struct client_node *owner, char *name);
+void catalog_remove_owner(struct client_node *owner);
+int catalog_search(char *query, struct catalog_entry **results, int max);
+void catalog_entry_info(struct catalog_entry *e, char **name, uint64_t *size,
+        uint64_t *hash, struct client_node **owner);
+int catalog_count();
+
+/* share.c */
+int share_file(char *file_name);
+int unshare_file(char *file_name);
+void print_shared_files();
+int search_catalog(char *query);
+int recv_search_result();
+void for_each_shared_file(void (*fn)(char *name, void *arg), void *arg);
+char *share_resolve(char *name);
+void share_republish();
+void share_next_timeout(struct timeval *tv);
+void share_periodic();
+
+/* bloom.c */
+void bloom_mark_dirty();
+void bloom_republish();
+void bloom_periodic();
+int bloom_next_timeout();
+int recv_peer_filter();
+void bloom_prune();
+int bloom_whohas(char *file_name);
+
+/* timer.c */
+uint64_t timer_now_ms();
+void timer_init(struct timer *t, void (*fn)(void *arg), void *arg);
+int timer_pending(struct timer *t);
+void timer_add(struct timer *t, uint64_t ms);
+void timer_del(struct timer *t);
+void timer_run();
+void timer_next_timeout(struct timeval *tv);
+
+/* timeout.c */
+void peer_timer_restart(struct connected_peer_node *node);
+void peer_timer_restart_all();
+void heartbeat_start();
+
+/* tcptune.c */
+struct tcp_profile *tcp_profile_get(int i);
+int tcp_apply_profile(int fd, struct tcp_profile *p, const char *cc);
+int tcp_tune_socket(int fd);
+void print_tcp_profiles();
+int set_tcp_profile(char *name, char *cc);
+
+/* stripe.c */
+void stripe_range(uint64_t file_size, int parts, int i, uint64_t *offset, uint64_t *len);
+uint32_t stripe_grant(uint32_t flags, uint64_t file_size);
+int stripe_start(struct connected_peer_node *node, int parts);
+int receive_stripe_request(int fd, struct sockaddr_in addr, int port);
+void stripe_part_done(struct connected_peer_node *node, int status);
+int stripe_abort(struct connected_peer_node *node);
+int stripe_connections(struct connected_peer_node *node);
+
+/* local.c */
+void local_listen();
+void local_close();
+int local_connect(struct in_addr ip, int port);
+int receive_local_connect(int accept_fd);
+int local_send_fd(int fd, int file_fd);
+int local_receive_file(struct connected_peer_node *node);
+void local_copy_stop(struct connected_peer_node *node);
+void local_next_timeout(struct timeval *tv);
+void local_periodic();
+
+/* mmapio.c */
+char *map_window(struct file_transfer_context *ctx, uint64_t off, uint64_t len);
+int map_queue_block(struct connected_peer_node *node, char *data, int len,
+        void (*queue)(struct connected_peer_node *node, char *data, int len));
+void map_prepare(struct file_transfer_context *ctx);
+void map_release(struct file_transfer_context *ctx);
+
+/* direct.c */
+void direct_start(struct file_transfer_context *ctx, int write);
+char *direct_read(struct file_transfer_context *ctx, int len);
+int direct_write(struct file_transfer_context *ctx, char *data, int len);
+int direct_finish(struct file_transfer_context *ctx);
+void direct_release(struct file_transfer_context *ctx);
+
+/* hotcache.c */
+int hot_lookup(const char *path, struct stat *st);
+struct hot_file *hot_hold(const char *path);
+void hot_insert(const char *path, int fd, struct stat *st);
+char *hot_get_block(struct hot_file *h, uint64_t off, int len);
+void hot_put(struct hot_file *h);
+void hot_cache_events();
+void hot_cache_resize();
+
+/* batch.c */
+int batch_request(int conn_id, char *names[], int count);
+int handle_batch_request(struct connected_peer_node *node);
+int batch_response(struct connected_peer_node *node, uint16_t msg_type);
+void batch_next_file(struct connected_peer_node *node);
+int batch_more(struct file_transfer_context *ctx);
+int batch_receive_block(struct connected_peer_node *node);
+void batch_print_summary(struct connected_peer_node *node);
+void batch_release(struct file_transfer_context *ctx);
+int batch_send_dir(struct connected_peer_node *node, char *dir_name, uint32_t flags);
+int batch_offer(struct connected_peer_node *node, char *dir_name);
+int handle_batch_offer(struct connected_peer_node *node);
+int batch_name_base(char *path);
+void batch_expect(struct file_transfer_context *ctx, int sync);
+int batch_send_entries(struct connected_peer_node *node, char *dir_name, uint32_t flags,
+        struct walk_entry *entries, int count);
+
+/* walk.c */
+int tree_walk(char *root, int threads, struct walk_entry **entries, int *errors);
+void tree_walk_free(struct walk_entry *entries, int count);
+
+/* sync.c */
+int sync_request(int conn_id, char *dir_name);
+int handle_sync_request(struct connected_peer_node *node);
+void sync_stop(struct connected_peer_node *node);
+void sync_next_timeout(struct timeval *tv);
+void sync_periodic();
+
+/* options.c */
+int set_option(char *name, char *value);
+void print_options();
+
 
 #endif
@@ -0,0 +1,610 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* File the download queue is saved to, in the current directory.
+ * It is a journal of added (+) and finished (-) downloads */
+#define QUEUE_FILE          ".download_queue"
+
+/* Number of pending downloads listed by the QUEUE command */
+#define QUEUE_LIST_MAX      50
+
+/* A download waiting in the queue (or in progress) */
+struct queued_download {
+    uint64_t seq;                   /* unique id, in the order of queueing */
+    int prio;                       /* PRIO_* */
+    struct in_addr ip;              /* listening address of the peer */
+    unsigned short port;
+    char file_name[255];
+    struct queued_download *next;
+};
+
+static char *prio_names[NUM_PRIO] = { "high", "normal", "low" };
+
+/******* Global values *******/
+int max_downloads = 3;                          /* downloads running at the same time */
+
+static struct queued_download *q_head[NUM_PRIO];   /* pending downloads per class */
+static struct queued_download *q_tail[NUM_PRIO];
+static int num_pending = 0;
+static int num_active = 0;                      /* requested or being received */
+static uint64_t next_seq = 1;
+static int schedule_needed = 0;                 /* a slot or a peer became available */
+
+static FILE *journal = NULL;
+static int journal_lines = 0;                   /* lines in the journal file */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to get the priority class from its name
+ * returns PRIO_*, -1 if unknown
+ */
+int queue_prio_from_name(char *name)
+{
+    int i;
+
+    for (i = 0; i < NUM_PRIO; i++) {
+        if (strcasecmp(prio_names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Function to append a line to the journal
+ */
+static void journal_add(struct queued_download *d)
+{
+    if (!journal)
+        return;
+
+    fprintf(journal, "+ %" PRIu64 " %d %s %d %s\n", d->seq, d->prio,
+            inet_ntoa(d->ip), d->port, d->file_name);
+    fflush(journal);
+    journal_lines++;
+}
+
+/*
+ * Function to rewrite the journal with only the downloads still queued
+ * (active ones included), once it has grown with finished ones
+ */
+static void journal_compact()
+{
+    struct list_node *cur;
+    struct connected_peer_node *node;
+    struct queued_download *d;
+    int i;
+
+    if (!journal)
+        return;
+
+    fclose(journal);
+    journal = fopen(QUEUE_FILE ".tmp", "w");
+    if (!journal) {
+        printf("\nError saving the download queue: %s\n", strerror(errno));
+        return;
+    }
+    journal_lines = 0;
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+        node = (struct connected_peer_node *)(cur->container);
+        if (node->ctx.qentry)
+            journal_add(node->ctx.qentry);
+    }
+
+    for (i = 0; i < NUM_PRIO; i++) {
+        for (d = q_head[i]; d != NULL; d = d->next)
+            journal_add(d);
+    }
+
+    fclose(journal);
+    if (rename(QUEUE_FILE ".tmp", QUEUE_FILE) < 0)
+        printf("\nError saving the download queue: %s\n", strerror(errno));
+
+    journal = fopen(QUEUE_FILE, "a");
+}
+
+/*
+ * Function to record in the journal that a download left the queue
+ */
+static void journal_remove(struct queued_download *d)
+{
+    if (!journal)
+        return;
+
+    /* don't let the journal grow much beyond what is queued */
+    if (journal_lines > 2 * (num_pending + num_active) + 64) {
+        journal_compact();
+        return;
+    }
+
+    fprintf(journal, "- %" PRIu64 "\n", d->seq);
+    fflush(journal);
+    journal_lines++;
+}
+
+/*
+ * Function to add a download at the end of its priority class
+ */
+static void enqueue(struct queued_download *d)
+{
+    d->next = NULL;
+    if (q_tail[d->prio])
+        q_tail[d->prio]->next = d;
+    else
+        q_head[d->prio] = d;
+    q_tail[d->prio] = d;
+    num_pending++;
+}
+
+/*
+ * Function to put a download back at the front of its priority class
+ */
+static void enqueue_front(struct queued_download *d)
+{
+    d->next = q_head[d->prio];
+    q_head[d->prio] = d;
+    if (!q_tail[d->prio])
+        q_tail[d->prio] = d;
+    num_pending++;
+}
+
+/*
+ * Function to take a download out of its priority class
+ * prev is the entry before it in the class, NULL if first
+ */
+static void dequeue(struct queued_download *d, struct queued_download *prev)
+{
+    if (prev)
+        prev->next = d->next;
+    else
+        q_head[d->prio] = d->next;
+    if (q_tail[d->prio] == d)
+        q_tail[d->prio] = prev;
+    d->next = NULL;
+    num_pending--;
+}
+
+/*
+ * Function to queue the download of file_name from the peer identified
+ * by conn_id (called as a result of DOWNLOAD command)
+ *
+ * returns 0 on success, -1 on failure
+ */
+int queue_download(int conn_id, char *file_name, int prio)
+{
+    struct connected_peer_node *node;
+    struct queued_download *d;
+
+    if (conn_id == 1) {
+        printf("DOWLOAD from server not allowed , Please type HELP,\nskipping..\n");
+        return -1;
+    }
+
+    node = lookup_peer_by_id(connected_peer_list_head, conn_id);
+    if (!node) {
+        printf("DOWNLOAD: Invalid connection ID %d\n", conn_id);
+        return -1;
+    }
+
+    if (strlen(file_name) >= sizeof(d->file_name)) {
+        printf("DOWNLOAD: file name too long\n");
+        return -1;
+    }
+
+    d = (struct queued_download *) malloc(sizeof(struct queued_download));
+    if (!d) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    bzero(d, sizeof(struct queued_download));
+
+    d->seq = next_seq++;
+    d->prio = prio;
+    d->ip = node->addr.sin_addr;
+    d->port = node->port;
+    strcpy(d->file_name, file_name);
+
+    enqueue(d);
+    journal_add(d);
+    schedule_needed = 1;
+    return 0;
+}
+
+/*
+ * Function to send the download request for a queued file to a peer
+ * The response is handled by queue_download_response()
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int send_download_request(struct connected_peer_node *node, struct queued_download *d)
+{
+    int msg_size;
+    char *msg = NULL, *ptr = NULL;
+
+    /* Message format:
+     * MSG_DOWNLOAD | flags | filename size | filename
+     */
+    msg_size = sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint64_t) + strlen(d->file_name);
+    msg = (char *) malloc (msg_size);
+    if (!msg) {
+        printf("Error in malloc\n");
+        exit(1);
+    }
+
+    ptr = msg;
+    *(uint16_t *)ptr = (uint16_t) MSG_DOWNLOAD_REQUEST;
+    ptr += sizeof(uint16_t);
+
+    /* and the number of extra data connections we would like to use,
+     * or to get the file itself from a peer on the same host */
+    *(uint32_t *)ptr = local_xfer_caps() | (stripe_count << XFER_STRIPES_SHIFT) |
+        (node->local && fdpass_enabled ? XFER_CAP_FDPASS : 0);
+    ptr += sizeof(uint32_t);
+
+    *(uint64_t *)ptr = strlen(d->file_name);
+    ptr += sizeof(uint64_t);
+
+    memcpy(ptr, d->file_name, strlen(d->file_name));
+
+    if (send(node->fd, msg, msg_size, MSG_NOSIGNAL) < 0) {
+        printf("\nDOWNLOAD: error sending message to peer: %s\n",
+                strerror(errno));
+        FREE(msg);
+        return -1;
+    }
+    FREE(msg);
+
+    node->ctx.status = requesting;
+    peer_timer_restart(node);
+    node->ctx.qentry = d;
+    node->ctx.file_name = strdup(d->file_name);
+    num_active++;
+    return 0;
+}
+
+/*
+ * Function to start queued downloads while there are free slots.
+ * The classes are served in priority order, and within a class in the
+ * order the downloads were queued. A download waits if its peer is not
+ * connected, or busy with another transfer.
+ */
+static void queue_schedule()
+{
+    struct connected_peer_node *node;
+    struct queued_download *d, *prev, *next;
+    int i;
+
+    for (i = 0; i < NUM_PRIO && num_active < max_downloads; i++) {
+        prev = NULL;
+        for (d = q_head[i]; d != NULL && num_active < max_downloads; d = next) {
+            next = d->next;
+
+            node = lookup_peer_by_address(d->ip, d->port);
+            if (!node || node->ctx.status != idle) {
+                prev = d;
+                continue;
+            }
+
+            dequeue(d, prev);
+            if (send_download_request(node, d) < 0) {
+                /* try again later */
+                enqueue_front(d);
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Function to note that a download slot, or a peer, may have become
+ * available
+ */
+void queue_wakeup()
+{
+    schedule_needed = 1;
+}
+
+/*
+ * Function called from the event loop to start the next downloads
+ */
+void queue_periodic()
+{
+    if (!schedule_needed)
+        return;
+
+    schedule_needed = 0;
+    queue_schedule();
+}
+
+/*
+ * Function to release the queue entry of a download which is over
+ * If requeue is set, the download is put back in the queue (its peer
+ * went away), otherwise it is dropped
+ */
+void queue_finish(struct connected_peer_node *node, int requeue)
+{
+    struct queued_download *d = node->ctx.qentry;
+
+    if (!d)
+        return;
+
+    node->ctx.qentry = NULL;
+    num_active--;
+    schedule_needed = 1;
+
+    if (requeue) {
+        enqueue_front(d);
+        return;
+    }
+
+    journal_remove(d);
+    free(d);
+
+    if (!num_active && !num_pending) {
+        printf("\nAll downloads complete\n");
+        print_prompt();
+    }
+}
+
+/*
+ * Function to handle the response of a peer to a download request
+ * (the message type has already been read)
+ * Response Format:
+ * MSG_DOWNLOAD_ACCEPT | filesize | flags
+ * or
+ * MSG_DOWNLAOD_REJECT
+ *
+ * returns 0 on success, -2 if the connection is closed, -1 on failure
+ */
+int queue_download_response(struct connected_peer_node *node, uint16_t msg_type)
+{
+    uint64_t file_size;
+    uint32_t flags = 0;
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    int len, file_fd;
+
+    if (msg_type == MSG_DOWNLOAD_REJECT) {
+        /* Peer rejected the download */
+        printf("\nDOWNLOAD: Download of '%s' rejected by Peer\n", node->ctx.file_name);
+        queue_finish(node, 0);
+        reset_transfer(node);
+        return -1;
+    }
+
+    /* We have received an MSG_DOWNLOAD_ACCEPT message,
+     * now receive the size of the file and the flags the peer agreed to */
+    if ((len = read_full(node->fd, &file_size, sizeof(file_size))) <= 0 ||
+            (len = read_full(node->fd, &flags, sizeof(flags))) <= 0)
+        return len ? -1 : -2;
+
+    /* create the file to be downloaded */
+    file_fd = open(node->ctx.file_name, O_RDWR | O_CREAT | O_TRUNC, mode);
+    if (file_fd < 0) {
+        /* The peer is sending the file anyway, the connection can't be used */
+        printf("\nDOWNLOAD: Error creating file: %s\n", strerror(errno));
+        queue_finish(node, 0);
+        return -2;
+    }
+
+    /* create the file transfer context for the node */
+    node->ctx.status = receiving;
+    peer_timer_restart(node);
+    node->ctx.file_fd = file_fd;
+    node->ctx.bytes_remaining = node->ctx.file_size = file_size;
+    node->ctx.total_time = (struct timeval){0};
+    node->ctx.flags = flags & (local_xfer_caps() | XFER_CAP_FDPASS);
+
+    recv_in_progress++;
+
+    /* a peer on the same host hands over its open file instead, which
+     * comes next on the connection (see receive_file_block()) */
+    if (flags & XFER_CAP_FDPASS) {
+        printf("\nReceiving file '%s' from the same host..\n", node->ctx.file_name);
+        return 0;
+    }
+
+    /* reserve the space for the whole file */
+    if (xfer_prealloc(file_fd, file_size) < 0) {
+        /* The peer is sending the file anyway, the connection can't be used */
+        printf("\nDOWNLOAD: Can't receive '%s'\n", node->ctx.file_name);
+        queue_finish(node, 0);
+        return -2;
+    }
+    direct_start(&node->ctx, 1);
+    map_prepare(&node->ctx);
+
+    /* the peer sends the first part, the others are requested on extra
+     * data connections */
+    if (XFER_STRIPES(flags))
+        return stripe_start(node, XFER_STRIPES(flags) + 1);
+
+    printf("\nReceiving file '%s'..\n", node->ctx.file_name);
+
+    /* an empty file is complete already */
+    if (!file_size)
+        return receive_file_block(node);
+
+    return 0;
+}
+
+/*
+ * Function to remove pending downloads (QUEUE remove/clear commands)
+ * seq is the id of the download to remove, 0 to remove all of them
+ *
+ * returns 0 on success, -1 if not found
+ */
+int queue_remove(uint64_t seq)
+{
+    struct queued_download *d, *prev, *next;
+    int i, found = 0;
+
+    for (i = 0; i < NUM_PRIO; i++) {
+        prev = NULL;
+        for (d = q_head[i]; d != NULL; d = next) {
+            next = d->next;
+            if (seq && d->seq != seq) {
+                prev = d;
+                continue;
+            }
+
+            dequeue(d, prev);
+            journal_remove(d);
+            free(d);
+            found++;
+        }
+    }
+
+    if (!found) {
+        printf("QUEUE: No such download pending\n");
+        return -1;
+    }
+
+    printf("%d download(s) removed from the queue\n", found);
+    return 0;
+}
+
+/*
+ * Function to display the downloads in progress and the pending ones
+ */
+void print_queue()
+{
+    struct list_node *cur;
+    struct connected_peer_node *node;
+    struct queued_download *d;
+    int i, shown = 0;
+
+    printf("Downloads: %d active, %d pending, %d slots\n",
+            num_active, num_pending, max_downloads);
+    if (!num_active && !num_pending)
+        return;
+
+    printf("Id\tPriority\tPeer\t\t\tStatus\t\tFile\n");
+    printf("-----------------------------------------------------------------------\n");
+    for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+        node = (struct connected_peer_node *)(cur->container);
+        d = node->ctx.qentry;
+        if (!d)
+            continue;
+        printf("%" PRIu64 "\t%s\t\t%s:%d\t\t%s\t%s\n", d->seq, prio_names[d->prio],
+                inet_ntoa(d->ip), d->port,
+                node->ctx.status == requesting ? "requested" : "receiving",
+                d->file_name);
+    }
+
+    for (i = 0; i < NUM_PRIO; i++) {
+        for (d = q_head[i]; d != NULL && shown < QUEUE_LIST_MAX; d = d->next, shown++) {
+            printf("%" PRIu64 "\t%s\t\t%s:%d\t\t%s\t\t%s\n", d->seq, prio_names[d->prio],
+                    inet_ntoa(d->ip), d->port,
+                    lookup_peer_by_address(d->ip, d->port) ? "pending" : "no peer",
+                    d->file_name);
+        }
+    }
+
+    if (num_pending > shown)
+        printf("... and %d more\n", num_pending - shown);
+}
+
+/*
+ * Function to compare two loaded entries by sequence number (for qsort/bsearch)
+ */
+static int cmp_seq(const void *a, const void *b)
+{
+    uint64_t sa = (*(struct queued_download **)a)->seq;
+    uint64_t sb = (*(struct queued_download **)b)->seq;
+
+    return (sa > sb) - (sa < sb);
+}
+
+/*
+ * Function to load the download queue saved by a previous run, and open
+ * the journal for this one.
+ * The downloads which were in progress are queued again.
+ */
+void queue_load()
+{
+    struct queued_download **loaded = NULL, **found, key, *kp = &key, *d;
+    int count = 0, max = 0, i, prio, port, n;
+    char line[512], ip[64], name[255];
+    unsigned long long seq;
+    FILE *fp;
+
+    fp = fopen(QUEUE_FILE, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (line[0] == '-' && sscanf(line, "- %llu", &seq) == 1) {
+                /* entries are added in sequence order, look it up */
+                key.seq = seq;
+                found = count ? bsearch(&kp, loaded, count, sizeof(*loaded), cmp_seq) : NULL;
+                if (found)
+                    (*found)->prio = -1;
+                continue;
+            }
+
+            n = 0;
+            if (sscanf(line, "+ %llu %d %63s %d %n", &seq, &prio, ip, &port, &n) < 4 || !n ||
+                    prio < 0 || prio >= NUM_PRIO)
+                continue;
+
+            line[strcspn(line, "\n")] = '\0';
+            if (strlen(line + n) == 0 || strlen(line + n) >= sizeof(name))
+                continue;
+
+            d = (struct queued_download *) malloc(sizeof(struct queued_download));
+            if (!d) {
+                printf("\nError in malloc\n");
+                exit(1);
+            }
+            bzero(d, sizeof(struct queued_download));
+            d->seq = seq;
+            d->prio = prio;
+            d->port = port;
+            strcpy(d->file_name, line + n);
+            if (inet_pton(AF_INET, ip, &d->ip) != 1 ||
+                    (count && loaded[count - 1]->seq >= d->seq)) {
+                free(d);
+                continue;
+            }
+
+            if (count == max) {
+                max = max ? max * 2 : 64;
+                loaded = realloc(loaded, max * sizeof(*loaded));
+                if (!loaded) {
+                    printf("\nError in malloc\n");
+                    exit(1);
+                }
+            }
+            loaded[count++] = d;
+        }
+        fclose(fp);
+    }
+
+    for (i = 0; i < count; i++) {
+        d = loaded[i];
+        if (d->prio < 0) {
+            free(d);
+            continue;
+        }
+        enqueue(d);
+        next_seq = d->seq + 1;
+    }
+    FREE(loaded);
+
+    if (num_pending)
+        printf("%d download(s) restored from the queue\n", num_pending);
+
+    /* start the journal of this run with what is left */
+    journal = fopen(QUEUE_FILE, "a");
+    if (!journal) {
+        printf("Error opening '%s', the download queue won't be saved: %s\n",
+                QUEUE_FILE, strerror(errno));
+        return;
+    }
+    journal_compact();
+}
@@ -0,0 +1,325 @@
+#include <errno.h>
+#include <sys/time.h>
+#include <inttypes.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* Smallest burst allowed for a bucket, so that a full frame can go out */
+#define RATE_MIN_BURST      (2 * XFER_BLOCK_SIZE)
+/* Shortest time to wait for tokens (avoids spinning on select) */
+#define RATE_MIN_WAIT_USEC  1000
+
+/******* Global values *******/
+static struct token_bucket global_tb;       /* limit on everything we send */
+uint64_t transfer_rate_limit = 0;           /* default limit of a single transfer */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to add the tokens earned since the last refill to a bucket
+ */
+static void tb_refill(struct token_bucket *tb, struct timeval *now)
+{
+    struct timeval diff;
+
+    if (!tb->rate)
+        return;
+
+    timersub(now, &tb->last, &diff);
+    tb->last = *now;
+
+    tb->tokens += (diff.tv_sec + diff.tv_usec / 1000000.0) * tb->rate;
+    if (tb->tokens > tb->burst)
+        tb->tokens = tb->burst;
+}
+
+/*
+ * Function to change the rate of a bucket (0 to remove the limit)
+ * A bucket which was not limited starts full, otherwise it keeps its
+ * tokens (up to the new burst), so that repeating a limit grants no
+ * extra burst
+ */
+static void tb_set_rate(struct token_bucket *tb, uint64_t rate)
+{
+    struct timeval now;
+    int limited = tb->rate != 0;
+
+    /* tokens earned at the old rate */
+    gettimeofday(&now, NULL);
+    tb_refill(tb, &now);
+    tb->last = now;
+
+    tb->rate = rate;
+    tb->burst = rate / 4;
+    if (tb->burst < RATE_MIN_BURST)
+        tb->burst = RATE_MIN_BURST;
+    if (!limited || tb->tokens > tb->burst)
+        tb->tokens = tb->burst;
+}
+
+/*
+ * Function to check if a bucket is out of tokens
+ */
+static int tb_empty(struct token_bucket *tb)
+{
+    return tb->rate && tb->tokens <= 0;
+}
+
+/*
+ * Function to get the microseconds until an empty bucket has tokens again
+ */
+static long tb_wait_usec(struct token_bucket *tb)
+{
+    if (!tb_empty(tb))
+        return 0;
+
+    return (long)((1 - tb->tokens) * 1000000.0 / tb->rate) + 1;
+}
+
+/*
+ * Function to get the bucket limiting what is sent to the peer of a
+ * connection: the extra data connections of a striped download share
+ * the one of the connection of the download
+ */
+static struct token_bucket *rate_peer_tb(struct connected_peer_node *node)
+{
+    struct connected_peer_node *main = NULL;
+
+    if (node->main_id)
+        main = lookup_peer_by_id(connected_peer_list_head, node->main_id);
+    return main ? &main->tb : &node->tb;
+}
+
+/*
+ * Function to set up the buckets of a new transfer
+ */
+void rate_init_transfer(struct connected_peer_node *node)
+{
+    /* a new transfer starts with a full bucket */
+    node->ctx.tb.rate = 0;
+    tb_set_rate(&node->ctx.tb, transfer_rate_limit);
+    node->ctx.throttled = 0;
+}
+
+/*
+ * Function to account for bytes sent to a peer at all the levels
+ * (global, peer and transfer). The buckets may go in debt, which
+ * holds back the following frames.
+ */
+void rate_charge(struct connected_peer_node *node, int len)
+{
+    struct token_bucket *peer_tb = rate_peer_tb(node);
+
+    if (global_tb.rate)
+        global_tb.tokens -= len;
+    if (peer_tb->rate)
+        peer_tb->tokens -= len;
+    if (node->ctx.tb.rate)
+        node->ctx.tb.tokens -= len;
+}
+
+/*
+ * Function to check if a peer may send the next frame of its transfer.
+ * If not, the socket is taken out of the write set until the
+ * buckets have been refilled by rate_refill()
+ *
+ * returns 1 if the transfer has to wait, 0 if it may go on
+ */
+int rate_throttle(struct connected_peer_node *node)
+{
+    struct token_bucket *peer_tb = rate_peer_tb(node);
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    tb_refill(&global_tb, &now);
+    tb_refill(peer_tb, &now);
+    tb_refill(&node->ctx.tb, &now);
+
+    if (!tb_empty(&global_tb) && !tb_empty(peer_tb) && !tb_empty(&node->ctx.tb))
+        return 0;
+
+    node->ctx.throttled = 1;
+    FD_CLR(node->fd, &writefds);
+    return 1;
+}
+
+/*
+ * Function called from the event loop to refill the buckets, and resume
+ * the transfers which have tokens again at all the levels
+ */
+void rate_refill()
+{
+    struct list_node *cur;
+    struct connected_peer_node *node;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    tb_refill(&global_tb, &now);
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+        node = (struct connected_peer_node *)(cur->container);
+        tb_refill(&node->tb, &now);
+        tb_refill(&node->ctx.tb, &now);
+
+        if (!node->ctx.throttled || tb_empty(&global_tb) ||
+                tb_empty(rate_peer_tb(node)) || tb_empty(&node->ctx.tb))
+            continue;
+
+        node->ctx.throttled = 0;
+        if ((node->ctx.status == sending && !node->ctx.fan_waiting) ||
+                node->ctx.status == relaying)
+            FD_SET(node->fd, &writefds);
+    }
+}
+
+/*
+ * Function to shorten the select timeout tv to the time the first
+ * throttled transfer can go on
+ */
+void rate_next_timeout(struct timeval *tv)
+{
+    struct list_node *cur;
+    struct connected_peer_node *node;
+    long wait, min = -1;
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+        node = (struct connected_peer_node *)(cur->container);
+        if (!node->ctx.throttled)
+            continue;
+
+        /* the transfer resumes once all its levels have tokens */
+        wait = tb_wait_usec(&global_tb);
+        if (tb_wait_usec(rate_peer_tb(node)) > wait)
+            wait = tb_wait_usec(rate_peer_tb(node));
+        if (tb_wait_usec(&node->ctx.tb) > wait)
+            wait = tb_wait_usec(&node->ctx.tb);
+
+        if (min < 0 || wait < min)
+            min = wait;
+    }
+
+    if (min < 0)
+        return;
+
+    if (min < RATE_MIN_WAIT_USEC)
+        min = RATE_MIN_WAIT_USEC;
+
+    if (min < tv->tv_sec * 1000000L + tv->tv_usec) {
+        tv->tv_sec = min / 1000000;
+        tv->tv_usec = min % 1000000;
+    }
+}
+
+/*
+ * Function to parse a rate: bytes per second with an optional
+ * K, M or G suffix (powers of 1024)
+ *
+ * returns 0 on success, -1 if invalid
+ */
+static int parse_rate(char *str, uint64_t *rate)
+{
+    char *end = NULL;
+    unsigned long long val;
+
+    if (*str == '\0' || *str == '-')
+        return -1;
+
+    val = strtoull(str, &end, 10);
+    switch (*end) {
+        case 'k': case 'K':
+            val <<= 10; end++;
+            break;
+        case 'm': case 'M':
+            val <<= 20; end++;
+            break;
+        case 'g': case 'G':
+            val <<= 30; end++;
+            break;
+    }
+
+    if (*end != '\0')
+        return -1;
+
+    *rate = val;
+    return 0;
+}
+
+/*
+ * Function to display a rate limit
+ */
+static void print_rate(char *what, uint64_t rate)
+{
+    if (rate)
+        printf("%s\t%" PRIu64 " bytes/second\n", what, rate);
+    else
+        printf("%s\tunlimited\n", what);
+}
+
+/*
+ * Function to display all the rate limits
+ */
+void print_rate_limits()
+{
+    struct list_node *cur;
+    struct connected_peer_node *node;
+    char what[64];
+
+    print_rate("global\t", global_tb.rate);
+    print_rate("transfer", transfer_rate_limit);
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+        node = (struct connected_peer_node *)(cur->container);
+        if (!node->tb.rate)
+            continue;
+        snprintf(what, sizeof(what), "peer %d\t", node->id);
+        print_rate(what, node->tb.rate);
+    }
+}
+
+/*
+ * Function to change a rate limit (LIMIT command)
+ * level is "global", "transfer" or "peer" (conn_id is used for the latter)
+ * The new transfer limit also applies to the transfers in progress
+ *
+ * returns 0 on success, -1 on failure
+ */
+int set_rate_limit(char *level, int conn_id, char *value)
+{
+    struct list_node *cur;
+    struct connected_peer_node *node;
+    uint64_t rate;
+
+    if (parse_rate(value, &rate) < 0) {
+        printf("LIMIT: invalid rate '%s'\n", value);
+        return -1;
+    }
+
+    if (strcasecmp(level, "global") == 0) {
+        tb_set_rate(&global_tb, rate);
+    } else if (strcasecmp(level, "transfer") == 0) {
+        transfer_rate_limit = rate;
+        for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+            node = (struct connected_peer_node *)(cur->container);
+            if (node->ctx.status == sending || node->ctx.status == relaying)
+                tb_set_rate(&node->ctx.tb, rate);
+        }
+    } else if (strcasecmp(level, "peer") == 0) {
+        node = lookup_peer_by_id(connected_peer_list_head, conn_id);
+        if (!node || conn_id == 1) {
+            printf("LIMIT: Invalid connection ID\n");
+            return -1;
+        }
+        tb_set_rate(&node->tb, rate);
+    } else {
+        printf("LIMIT: Unknown level '%s'\n", level);
+        return -1;
+    }
+
+    /* a limit may have been lifted */
+    rate_refill();
+
+    print_rate_limits();
+    return 0;
+}
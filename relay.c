@@ -0,0 +1,517 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* Number of frames a peer of a relay chain keeps for the next hop. When
+ * they are all waiting to be sent, nothing more is read from upstream
+ * until the next hop takes some */
+#define RELAY_SLOTS 16
+
+/* Size of a slot: a frame of a block, compressed or not */
+#define RELAY_SLOT_SIZE (sizeof(struct xfer_frame_hdr) + compress_bound(XFER_BLOCK_SIZE))
+
+/* structure holding the frames received from upstream, until they are
+ * sent to the next hop of the chain (kept in the context of the next hop) */
+struct relay_queue {
+    char *slots;                /* RELAY_SLOTS frames: header, then payload */
+    int head;                   /* slot of the frame being sent */
+    int count;                  /* slots in use */
+    int reframe;                /* the hops use different transfer flags: the slots
+                                   hold the raw blocks, framed again when sent */
+    int source_id;              /* connection the frames come from */
+    int upstream_id;            /* connection not read while the slots are full
+                                   (0 if none) */
+    int done;                   /* the upstream transfer is complete */
+    int failed;                 /* the upstream transfer failed before the next
+                                   hop answered */
+};
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to check the chain of peers a file is relayed to after the
+ * peer at prev_ip:prev_port: a chain going back to us, or through the
+ * same peer twice, would never complete
+ *
+ * returns 0 if the chain is valid, -1 otherwise
+ */
+static int relay_check_hops(struct in_addr prev_ip, unsigned short prev_port,
+        struct available_peer_node *hops, int hop_count)
+{
+    int i, j;
+
+    for (i = 0; i < hop_count; i++) {
+        if ((hops[i].ip.s_addr == myip.s_addr && hops[i].port == listen_port) ||
+                (hops[i].ip.s_addr == prev_ip.s_addr && hops[i].port == prev_port))
+            break;
+
+        for (j = 0; j < i; j++) {
+            if (hops[j].ip.s_addr == hops[i].ip.s_addr && hops[j].port == hops[i].port)
+                break;
+        }
+        if (j < i)
+            break;
+    }
+
+    if (i < hop_count) {
+        printf("\nRELAY: invalid chain, %s:%d would get the file twice\n",
+                inet_ntoa(hops[i].ip), hops[i].port);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to set up the next hop of a relay chain: connects to the first
+ * peer of hops (if not already connected), and sends it a relay request
+ * for the rest of the chain. The blocks received from upstream are queued
+ * until it answers (see relay_response()).
+ *
+ * Returns the connection the received blocks have to be forwarded to,
+ * NULL if the chain could not be extended
+ */
+struct connected_peer_node *relay_open_downstream(struct connected_peer_node *upstream,
+        struct available_peer_node *hops, int hop_count, char *file_name, uint64_t file_size)
+{
+    struct connected_peer_node *node = NULL;
+    struct relay_queue *q;
+
+    /* Don't send the file back where it came from, or to ourselves */
+    if (relay_check_hops(upstream->addr.sin_addr, upstream->port, hops, hop_count) < 0)
+        return NULL;
+
+    node = lookup_peer_by_address(hops[0].ip, hops[0].port);
+    if (!node) {
+        if (connected_peer_count == MAX_CONN) {
+            printf("\nRELAY: maximum connection limit reached\n");
+            return NULL;
+        }
+
+        if (connect_to_peer(inet_ntoa(hops[0].ip), hops[0].port) < 0) {
+            /* error already printed in connect_to_peer() */
+            return NULL;
+        }
+
+        node = lookup_peer_by_address(hops[0].ip, hops[0].port);
+        if (!node)
+            return NULL;
+    }
+
+    if (node->ctx.status != idle) {
+        printf("\nRELAY: A file transfer is already in progress with %s\n",
+                node->hostname);
+        return NULL;
+    }
+
+    if (send_upload_request(node, file_name, file_size, hops + 1, hop_count - 1) < 0) {
+        /* error already printed in send_upload_request() */
+        return NULL;
+    }
+
+    q = (struct relay_queue *) malloc(sizeof(struct relay_queue));
+    if (!q) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    bzero(q, sizeof(struct relay_queue));
+    q->slots = (char *) malloc(RELAY_SLOTS * RELAY_SLOT_SIZE);
+    if (!q->slots) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    q->source_id = upstream->id;
+
+    node->ctx.relayq = q;
+    node->ctx.status = offering;
+    peer_timer_restart(node);
+    node->ctx.file_name = strdup(file_name);
+    node->ctx.bytes_remaining = node->ctx.file_size = file_size;
+    node->ctx.total_time = (struct timeval){0};
+
+    return node;
+}
+
+/*
+ * Function to handle the response of the next hop of a relay chain to
+ * the relay request (the message type has already been read): the frames
+ * received from upstream meanwhile are sent once it accepts
+ * Response format:
+ * MSG_UPLOAD_ACCEPT | flags
+ * or
+ * MSG_UPLOAD_REJECT
+ *
+ * returns 0 on success, -2 if the connection is closed, -1 on failure
+ */
+int relay_response(struct connected_peer_node *down, uint16_t msg_type)
+{
+    struct relay_queue *q = down->ctx.relayq;
+    struct connected_peer_node *up = NULL;
+    uint32_t flags = 0;
+    int len;
+
+    if (msg_type == MSG_UPLOAD_REJECT) {
+        printf("\nRELAY: %s  :  %d rejected '%s', receiving it locally only\n",
+                down->hostname, down->port, down->ctx.file_name);
+        print_prompt();
+        reset_transfer(down);
+        return -1;
+    }
+
+    /* Get the flags the peer agreed to */
+    len = read_full(down->fd, &flags, sizeof(flags));
+    if (len <= 0)
+        return len ? -1 : -2;
+
+    down->ctx.status = relaying;
+    peer_timer_restart(down);
+    down->ctx.flags = flags & local_xfer_caps();
+    rate_init_transfer(down);
+
+    /* The next peer can't get the complete file any more, tell it
+     * so it does not wait for it */
+    if (q->failed) {
+        printf("\nRELAY: upstream transfer failed\n");
+        if (xfer_send_cancel(down) < 0) {
+            terminate_connection(down->id);
+            return -1;
+        }
+        reset_transfer(down);
+        return 0;
+    }
+
+    printf("\nRelaying file '%s' to %s  :  %d\n", down->ctx.file_name, down->hostname,
+            down->port);
+    print_prompt();
+
+    /* the frames queued so far hold the raw blocks, which can be framed
+     * for any flags: from now on, frames are forwarded as they are
+     * received if both hops use the same flags */
+    up = lookup_peer_by_id(connected_peer_list_head, q->source_id);
+    q->reframe = !up || up->ctx.relay_id != down->id || up->ctx.flags != down->ctx.flags;
+
+    if (q->count) {
+        FD_SET(down->fd, &writefds);
+        if (max_fd < down->fd) max_fd = down->fd;
+    } else if (q->done) {
+        /* an empty file */
+        printf("\nSuccessfully relayed file!!\n");
+        print_tx_summary(down);
+        reset_transfer(down);
+        print_prompt();
+    }
+    return 0;
+}
+
+/*
+ * Function to read the upstream connection again, if it was held back
+ * because the frames for the next hop were piling up
+ */
+static void relay_resume_upstream(struct relay_queue *q)
+{
+    struct connected_peer_node *up = NULL;
+
+    if (!q->upstream_id)
+        return;
+
+    up = lookup_peer_by_id(connected_peer_list_head, q->upstream_id);
+    q->upstream_id = 0;
+    if (!up)
+        return;
+
+    FD_SET(up->fd, &readfds);
+    if (max_fd < up->fd) max_fd = up->fd;
+}
+
+/*
+ * Function to forward a block received from upstream to the next peer
+ * of the chain: the frame is queued for the next hop, and sent from the
+ * event loop when the connection is writable (see relay_send_block()).
+ * If both hops use the same transfer flags, the received frame is
+ * forwarded as is, otherwise the block (data, len) is framed again for
+ * the next peer.
+ * Once all the slots are in use, the upstream connection is not read
+ * until the next hop has taken some.
+ */
+void relay_forward_frame(struct connected_peer_node *node, char *data, int len)
+{
+    struct connected_peer_node *down = NULL;
+    struct xfer_frame_hdr *hdr;
+    struct relay_queue *q;
+    char *slot;
+
+    down = lookup_peer_by_id(connected_peer_list_head, node->ctx.relay_id);
+    if (!down || !down->ctx.relayq ||
+            (down->ctx.status != relaying && down->ctx.status != offering)) {
+        /* next hop went away */
+        node->ctx.relay_id = 0;
+        return;
+    }
+    q = down->ctx.relayq;
+
+    /* there is a free slot: upstream is not read while they are full */
+    slot = q->slots + ((q->head + q->count) % RELAY_SLOTS) * RELAY_SLOT_SIZE;
+    hdr = (struct xfer_frame_hdr *)slot;
+
+    /* the flags of the next hop are not known before it answers */
+    if (q->reframe || down->ctx.status == offering) {
+        /* framed for the next hop when it is sent */
+        bzero(hdr, sizeof(*hdr));
+        hdr->type = XFER_FRAME_DATA;
+        hdr->raw_len = len;
+        hdr->wire_len = len;
+        memcpy(slot + sizeof(*hdr), data, len);
+    } else {
+        /* cut-through: the frame exactly as we received it */
+        memcpy(hdr, &node->ctx.rx_hdr, sizeof(*hdr));
+        memcpy(slot + sizeof(*hdr), node->ctx.rx_buf, hdr->wire_len);
+    }
+
+    /* the next hop only waited for upstream so far (unless it waits
+     * for the rate limits, see rate_refill(), or has not answered yet) */
+    if (!q->count && down->ctx.status == relaying) {
+        down->last_tx = timer_now_ms();
+        if (!down->ctx.throttled)
+            FD_SET(down->fd, &writefds);
+    }
+    q->count++;
+
+    if (q->count == RELAY_SLOTS) {
+        q->upstream_id = node->id;
+        FD_CLR(node->fd, &readfds);
+    }
+}
+
+/*
+ * Function to send the frames queued for the next hop of a relay chain,
+ * without blocking (called when the connection to it is writable).
+ * If the next peer fails, the file is still received locally.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int relay_send_block(struct connected_peer_node *down)
+{
+    struct relay_queue *q = down->ctx.relayq;
+    struct timeval start, end, diff;
+    struct xfer_frame_hdr *hdr;
+    char *slot;
+    int rc = 0;
+
+    if (!q || (!q->count && !xfer_tx_pending(&down->ctx))) {
+        /* nothing to send until the next block comes from upstream */
+        FD_CLR(down->fd, &writefds);
+        return 0;
+    }
+
+    /* Before starting a new frame, wait for the rate limits (the global
+     * one, the one of the next hop and the one of this transfer) */
+    if (!xfer_tx_pending(&down->ctx) && rate_throttle(down))
+        return 0;
+
+    gettimeofday(&start, NULL);
+
+    slot = q->slots + q->head * RELAY_SLOT_SIZE;
+    hdr = (struct xfer_frame_hdr *)slot;
+
+    if (!xfer_tx_pending(&down->ctx)) {
+        if (q->reframe)
+            xfer_queue_block(down, slot + sizeof(*hdr), hdr->raw_len);
+        else
+            xfer_queue_wire(down, hdr, slot + sizeof(*hdr));
+    }
+
+    /* send as much of the frame as the socket takes */
+    rc = xfer_flush(down);
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &diff);
+    timeradd(&(down->ctx.total_time), &diff, &(down->ctx.total_time));
+
+    if (rc < 0) {
+        printf("\nRELAY: forwarding to %s failed, receiving locally only\n", down->hostname);
+        reset_transfer(down);
+        return -1;
+    }
+
+    if (rc == 0)
+        return 0;
+
+    /* the frame is sent: its slot can take the next one */
+    if (down->ctx.bytes_remaining <= hdr->raw_len)
+        down->ctx.bytes_remaining = 0;
+    else
+        down->ctx.bytes_remaining -= hdr->raw_len;
+
+    q->head = (q->head + 1) % RELAY_SLOTS;
+    q->count--;
+    relay_resume_upstream(q);
+
+    if (q->count)
+        return 0;
+
+    FD_CLR(down->fd, &writefds);
+
+    /* the last frame of the file */
+    if (q->done) {
+        printf("\nSuccessfully relayed file!!\n");
+        print_tx_summary(down);
+        reset_transfer(down);
+        print_prompt();
+    }
+    return 0;
+}
+
+/*
+ * Function to release the frames queued for the next hop of a relay
+ * chain (when the transfer to it is over): the blocks received from
+ * upstream are not forwarded any more, and the upstream connection is
+ * read again if it was held back
+ */
+void relay_release(struct connected_peer_node *down)
+{
+    struct relay_queue *q = down->ctx.relayq;
+    struct list_node *cur;
+    struct connected_peer_node *node;
+
+    if (!q)
+        return;
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+        node = (struct connected_peer_node *)(cur->container);
+        if (node->ctx.relay_id == down->id)
+            node->ctx.relay_id = 0;
+    }
+
+    relay_resume_upstream(q);
+    FREE(q->slots);
+    FREE(down->ctx.relayq);
+}
+
+/*
+ * Function to finish relaying once the upstream transfer is over
+ * status is the result of the upstream transfer (0 on success)
+ */
+void relay_finish(struct connected_peer_node *node, int status)
+{
+    struct connected_peer_node *down = NULL;
+
+    down = lookup_peer_by_id(connected_peer_list_head, node->ctx.relay_id);
+    node->ctx.relay_id = 0;
+
+    if (!down || !down->ctx.relayq ||
+            (down->ctx.status != relaying && down->ctx.status != offering))
+        return;
+
+    if (status == 0 && (down->ctx.status == offering || down->ctx.relayq->count)) {
+        /* completed once the frames still queued are sent */
+        down->ctx.relayq->done = 1;
+        return;
+    }
+
+    if (down->ctx.status == offering) {
+        /* told once it answers (see relay_response()) */
+        down->ctx.relayq->failed = 1;
+        return;
+    }
+
+    if (status == 0 && down->ctx.bytes_remaining == 0) {
+        printf("\nSuccessfully relayed file!!\n");
+        print_tx_summary(down);
+        reset_transfer(down);
+        return;
+    }
+
+    /* The next peer can't get the complete file any more, tell it
+     * so it does not wait for it */
+    printf("\nRELAY: upstream transfer failed\n");
+    if (xfer_send_cancel(down) < 0) {
+        terminate_connection(down->id);
+        return;
+    }
+    reset_transfer(down);
+}
+
+/*
+ * Function to stop relaying to the next peer of a chain (it asked for it,
+ * or ABORT command). The file is still received locally.
+ */
+void relay_cancel(struct connected_peer_node *down)
+{
+    printf("\nStopped relaying '%s' to %s  :  %d\n", down->ctx.file_name,
+            down->hostname, down->port);
+
+    if (xfer_send_cancel(down) < 0) {
+        terminate_connection(down->id);
+        return;
+    }
+    reset_transfer(down);
+}
+
+/*
+ * Function to send a file down a chain of peers (called as a result of
+ * the RELAY command)
+ * The file is uploaded to the peer identified by conn_id, which forwards
+ * every block to the first peer of hops as soon as it arrives, and so on.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int relay_upload(int conn_id, char *file_name, struct available_peer_node *hops, int hop_count)
+{
+    struct connected_peer_node *node = NULL;
+    struct stat st;
+    int file_fd = -1;
+
+    if (conn_id == 1) {
+        printf("RELAY to server not allowed\n");
+        return -1;
+    }
+
+    node = lookup_peer_by_id(connected_peer_list_head, conn_id);
+    if (!node) {
+        printf("RELAY: Invalid connection ID\n");
+        return -1;
+    }
+
+    if (node->ctx.status != idle) {
+        printf("RELAY: A file transfer is already in progress with %s\n",
+                node->hostname);
+        return -1;
+    }
+
+    if (relay_check_hops(node->addr.sin_addr, node->port, hops, hop_count) < 0)
+        return -1;
+
+    if (stat(file_name, &st) < 0) {
+        printf("RELAY: Error accessing file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        printf("RELAY: '%s' not a regular file\n", file_name);
+        return -1;
+    }
+
+    file_fd = open(file_name, O_RDONLY);
+    if (file_fd < 0) {
+        printf("RELAY: Error opening file '%s': %s\n", file_name, strerror(errno));
+        return -1;
+    }
+
+    if (send_upload_offer(node, file_name, st.st_size, hops, hop_count) < 0) {
+        /* error already printed in send_upload_offer() */
+        close(file_fd);
+        return -1;
+    }
+
+    printf("\nRelay request for '%s' sent to %s  :  %d (relayed to %d more peers)\n",
+            file_name, node->hostname, node->port, hop_count);
+
+    /* create the file transfer context for the node,
+     * the file is sent from the event loop once the peer accepts it */
+    start_upload(node, file_fd, file_name, st.st_size);
+    return 0;
+}
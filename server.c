@@ -5,12 +5,19 @@
 
 #define BUFLEN 1024
 
+/* Milliseconds during which the changes to the list of clients are
+ * gathered into a single peer list update */
+#define PEER_LIST_BATCH_MS  200
+
 /***** Global Values *******/
 struct list_node *server_ip_list_head;    /* head of the linked list containing
                                              the list of clients registered to this
                                              server */
 int server_ip_count = 0;                  /* number of clients registered to this
                                              server */
+static struct timer peer_list_timer;      /* sends the pending peer list update */
+
+static void client_timeout(void *arg);
 
 
 /************ Function definitions **************/
@@ -31,6 +38,11 @@ void add_server_ip(struct sockaddr_in addr, int port, int fd)
     node->port = port;
     node->fd = fd;
 
+    /* Drop the client if it stops sending heartbeats */
+    timer_init(&node->timer, client_timeout, node);
+    node->last_rx = timer_now_ms();
+    timer_add(&node->timer, HEARTBEAT_INTERVAL * HEARTBEAT_MISSES * 1000);
+
     /* Get the hostname */
     getnameinfo((struct sockaddr *) &addr,
             sizeof(struct sockaddr_in), node->hostname, NI_MAXHOST, NULL, 0, 0);
@@ -136,7 +148,7 @@ int send_ip_list_to_client()
     for (tmp = server_ip_list_head; tmp != NULL; tmp =  tmp->next) {
         node = (struct client_node *)tmp->container;
 
-        len = send(node->fd, msg, size, 0);
+        len = send(node->fd, msg, size, MSG_NOSIGNAL);
         if (len < 0) {
             printf("\nError sending server IP list to %s:%d\n", 
                     inet_ntoa(node->clientaddr.sin_addr), node->port);
@@ -147,6 +159,30 @@ int send_ip_list_to_client()
     return 0;
 }
 
+/*
+ * Function called when the batch of peer list changes is over
+ */
+static void peer_list_flush(void *arg)
+{
+    if (send_ip_list_to_client() < 0) {
+        printf("\nError sending server IP List to clients\n");
+    }
+}
+
+/*
+ * Function to note that the list of clients changed. The update is sent
+ * to the clients a bit later, so that clients joining or leaving at
+ * about the same time are sent a single list.
+ */
+void peer_list_changed()
+{
+    if (!peer_list_timer.fn)
+        timer_init(&peer_list_timer, peer_list_flush, NULL);
+
+    if (!timer_pending(&peer_list_timer))
+        timer_add(&peer_list_timer, PEER_LIST_BATCH_MS);
+}
+
 
 /*
  * Function to handle incoming register request from client
@@ -162,7 +198,8 @@ int receive_client_connect(int accept_fd)
     char *ptr;
 
     bzero(buff, BUFLEN);
-    len = read(accept_fd, buff, BUFLEN);
+    /* read only the port message, the client may send more right after it */
+    len = read_full(accept_fd, buff, sizeof(uint16_t) + sizeof(uint16_t));
     if (len < 0) {
         printf("\nError reading from socket: %s\n", strerror(errno));
         return -1;
@@ -188,12 +225,272 @@ int receive_client_connect(int accept_fd)
 
 }
 
+/*
+ * Function to read a length prefixed (uint16_t) string sent by a client
+ * into buf (of size BUFLEN), and NULL terminate it
+ *
+ * returns the length on success, 0 if the connection is closed, -1 on failure
+ */
+static int read_string(int fd, char *buf)
+{
+    uint16_t str_len = 0;
+    int len;
+
+    len = read_full(fd, &str_len, sizeof(uint16_t));
+    if (len <= 0)
+        return len;
+
+    if (str_len == 0 || str_len >= BUFLEN) {
+        printf("\nInvalid message received from client\n");
+        return -1;
+    }
+
+    len = read_full(fd, buf, str_len);
+    if (len <= 0)
+        return len;
+
+    buf[str_len] = '\0';
+    return str_len;
+}
+
+/*
+ * Function to handle a MSG_CATALOG_ADD / MSG_CATALOG_REMOVE from a client
+ * Message format:
+ * MSG_CATALOG_ADD | file size | file hash | name length | name
+ * MSG_CATALOG_REMOVE | name length | name
+ *
+ * returns 0 on success, -1 on failure, -2 if the connection is closed
+ */
+static int recv_catalog_update(struct client_node *node, uint16_t msg_type)
+{
+    char name[BUFLEN];
+    uint64_t info[2];   /* size, hash */
+    int len;
+
+    if (msg_type == MSG_CATALOG_ADD) {
+        len = read_full(node->fd, info, sizeof(info));
+        if (len <= 0)
+            return len ? -1 : -2;
+    }
+
+    len = read_string(node->fd, name);
+    if (len <= 0)
+        return len ? -1 : -2;
+
+    if (msg_type == MSG_CATALOG_ADD)
+        catalog_add(node, name, info[0], info[1]);
+    else
+        catalog_remove(node, name);
+
+    return 0;
+}
+
+/*
+ * Function to handle a MSG_SEARCH_REQUEST from a client and send back
+ * the matching files
+ * Message format:
+ * MSG_SEARCH_REQUEST | query length | query
+ * Response format:
+ * MSG_SEARCH_RESULT | count | (ip | port | size | hash | name length | name) ...
+ *
+ * returns 0 on success, -1 on failure, -2 if the connection is closed
+ */
+static int handle_search_request(struct client_node *node)
+{
+    struct catalog_entry *results[MAX_SEARCH_RESULTS];
+    struct client_node *owner;
+    char query[BUFLEN];
+    char *msg, *ptr, *name;
+    uint64_t size, hash;
+    int len, count, i, msg_size;
+
+    len = read_string(node->fd, query);
+    if (len <= 0)
+        return len ? -1 : -2;
+
+    count = catalog_search(query, results, MAX_SEARCH_RESULTS);
+
+    /* Find out the size of the response */
+    msg_size = sizeof(uint16_t) + sizeof(uint16_t);
+    for (i = 0; i < count; i++) {
+        catalog_entry_info(results[i], &name, &size, &hash, &owner);
+        msg_size += sizeof(struct in_addr) + sizeof(uint16_t) + 2 * sizeof(uint64_t) +
+            sizeof(uint16_t) + strlen(name);
+    }
+
+    msg = (char *) malloc(msg_size);
+    if (!msg) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    ptr = msg;
+    *(uint16_t *)ptr = MSG_SEARCH_RESULT;
+    ptr += sizeof(uint16_t);
+    *(uint16_t *)ptr = count;
+    ptr += sizeof(uint16_t);
+
+    for (i = 0; i < count; i++) {
+        catalog_entry_info(results[i], &name, &size, &hash, &owner);
+        *(struct in_addr *)ptr = owner->clientaddr.sin_addr;
+        ptr += sizeof(struct in_addr);
+        *(uint16_t *)ptr = owner->port;
+        ptr += sizeof(uint16_t);
+        *(uint64_t *)ptr = size;
+        ptr += sizeof(uint64_t);
+        *(uint64_t *)ptr = hash;
+        ptr += sizeof(uint64_t);
+        *(uint16_t *)ptr = strlen(name);
+        ptr += sizeof(uint16_t);
+        memcpy(ptr, name, strlen(name));
+        ptr += strlen(name);
+    }
+
+    len = send(node->fd, msg, msg_size, MSG_NOSIGNAL);
+    if (len < 0) {
+        printf("\nError sending search results to %s:%d\n",
+                inet_ntoa(node->clientaddr.sin_addr), node->port);
+    }
+
+    FREE(msg);
+    return 0;
+}
+
+/*
+ * Function to pass on the filter of the files shared by a client to
+ * another client
+ * Message format:
+ * MSG_PEER_FILTER | ip | port | number of blocks | blocks
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int send_filter(struct client_node *to, struct client_node *from)
+{
+    char hdr[sizeof(uint16_t) + sizeof(struct in_addr) + sizeof(uint16_t) + sizeof(uint32_t)];
+    char *ptr = hdr;
+
+    *(uint16_t *)ptr = MSG_PEER_FILTER;
+    ptr += sizeof(uint16_t);
+    *(struct in_addr *)ptr = from->clientaddr.sin_addr;
+    ptr += sizeof(struct in_addr);
+    *(uint16_t *)ptr = from->port;
+    ptr += sizeof(uint16_t);
+    *(uint32_t *)ptr = from->bloom_blocks;
+
+    if (send(to->fd, hdr, sizeof(hdr), MSG_NOSIGNAL | MSG_MORE) < 0 ||
+            send(to->fd, from->bloom, from->bloom_blocks * BLOOM_BLOCK_SIZE,
+                MSG_NOSIGNAL) < 0) {
+        printf("\nError sending file filter to %s:%d\n",
+                inet_ntoa(to->clientaddr.sin_addr), to->port);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to send the filters published so far to a newly registered client
+ */
+void send_filters_to_client(int fd)
+{
+    struct list_node *tmp;
+    struct client_node *node, *to;
+
+    to = lookup_client_by_fd(server_ip_list_head, fd);
+    if (!to)
+        return;
+
+    for (tmp = server_ip_list_head; tmp != NULL; tmp =  tmp->next) {
+        node = (struct client_node *)tmp->container;
+        if (node != to && node->bloom)
+            send_filter(to, node);
+    }
+}
+
+/*
+ * Function to receive the filter of the files shared by a client and
+ * pass it on to all the other clients
+ * Message format:
+ * MSG_BLOOM_FILTER | number of blocks | blocks
+ *
+ * returns 0 on success, -1 on failure, -2 if the connection is closed
+ */
+static int recv_bloom_filter(struct client_node *node)
+{
+    struct list_node *tmp;
+    struct client_node *to;
+    uint32_t num_blocks;
+    char *bloom;
+    int len;
+
+    len = read_full(node->fd, &num_blocks, sizeof(num_blocks));
+    if (len <= 0)
+        return len ? -1 : -2;
+
+    /* The number of blocks has to be a power of two */
+    if (num_blocks == 0 || num_blocks > BLOOM_MAX_BLOCKS ||
+            (num_blocks & (num_blocks - 1))) {
+        printf("\nInvalid file filter received from %s:%d\n",
+                inet_ntoa(node->clientaddr.sin_addr), node->port);
+        return -1;
+    }
+
+    bloom = (char *) malloc(num_blocks * BLOOM_BLOCK_SIZE);
+    if (!bloom) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    len = read_full(node->fd, bloom, num_blocks * BLOOM_BLOCK_SIZE);
+    if (len <= 0) {
+        FREE(bloom);
+        return len ? -1 : -2;
+    }
+
+    FREE(node->bloom);
+    node->bloom = bloom;
+    node->bloom_blocks = num_blocks;
+
+    for (tmp = server_ip_list_head; tmp != NULL; tmp =  tmp->next) {
+        to = (struct client_node *)tmp->container;
+        if (to != node)
+            send_filter(to, node);
+    }
+    return 0;
+}
+
+/*
+ * Function to remove a client which closed its connection or stopped
+ * sending heartbeats, and to let the other clients know
+ */
+static void remove_client(struct client_node *node)
+{
+    int fd = node->fd;
+
+    /* Forget about the files it was sharing */
+    catalog_remove_owner(node);
+    FREE(node->bloom);
+    timer_del(&node->timer);
+
+    /* Remove from peer list */
+    delete_from_list(&server_ip_list_head, node);
+    server_ip_count --;
+
+    close(fd);
+    FD_CLR(fd, &readfds);
+    if(fd == max_fd)
+        update_maxfd();
+
+    /* send the updated peer list to the registered clients */
+    peer_list_changed();
+}
+
 /*
  * Function to receive from client
- * We don't actually expect anything to be received from the client.
- * But the select() may return this socket as ready to be read if the 
+ * The clients send updates for the file catalog, the filter of their
+ * files and search requests.
+ * The select() may also return this socket as ready to be read if the 
  * connection closes. This function handles that.
- * If any actual data is received, it is ignored
+ * Any unknown data received is ignored
  *
  * returns 0 on success, -1 on failure
  */
@@ -218,25 +515,64 @@ int receive_from_client(int fd)
         return -1;
     }
 
-    if (len == 0) {
-        /* Client closed connection */
-        printf("\nClient %s:%d closed connection\n", inet_ntoa(node->clientaddr.sin_addr), node->port);
+    if (len == 0)
+        goto close;
+
+    node->last_rx = timer_now_ms();
+
+    switch (msg_type) {
+        case MSG_HEARTBEAT:
+            /* nothing to do, the client is still there */
+            len = 0;
+            break;
+        case MSG_CATALOG_ADD:
+        case MSG_CATALOG_REMOVE:
+            len = recv_catalog_update(node, msg_type);
+            break;
+        case MSG_SEARCH_REQUEST:
+            len = handle_search_request(node);
+            break;
+        case MSG_BLOOM_FILTER:
+            len = recv_bloom_filter(node);
+            break;
+        default:
+            /* We don't expect any other data from client, so just discard the data */
+            len = 0;
+            break;
+    }
 
-        /* Remove from peer list */
-        delete_from_list(&server_ip_list_head, node);
-        server_ip_count --;
+    if (len == -2)
+        goto close;
 
-        close(fd);
-        FD_CLR(fd, &readfds);
-        if(fd == max_fd)
-            update_maxfd();
+    return len;
 
-        /* send the updated peer list to the registered client */
-        send_ip_list_to_client();
-        return -1;
-    }
+close:
+    /* Client closed connection */
+    printf("\nClient %s:%d closed connection\n", inet_ntoa(node->clientaddr.sin_addr), node->port);
 
-    /* We don't expect any data from client, so just discard the data */
-    return 0;
+    remove_client(node);
+    return -1;
 }
 
+/*
+ * Function called when nothing was received from a client for
+ * HEARTBEAT_MISSES heartbeat intervals: the client is gone without
+ * closing the connection (crash, network partition...), so it must not
+ * be advertised to the other clients any more
+ */
+static void client_timeout(void *arg)
+{
+    struct client_node *node = arg;
+    uint64_t now = timer_now_ms();
+    uint64_t limit = HEARTBEAT_INTERVAL * HEARTBEAT_MISSES * 1000;
+
+    if (now - node->last_rx < limit) {
+        timer_add(&node->timer, node->last_rx + limit - now);
+        return;
+    }
+
+    printf("\nClient %s:%d stopped sending heartbeats, dropping it\n",
+            inet_ntoa(node->clientaddr.sin_addr), node->port);
+    remove_client(node);
+    print_prompt();
+}
@@ -0,0 +1,460 @@
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h> /* for basename */
+#include <inttypes.h>
+#include <openssl/evp.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* structure to be used by client to maintain the list of files it
+ * advertises to the server */
+struct shared_file {
+    char path[255];         /* path of the file */
+    char name[255];         /* name advertised (base name) */
+    uint64_t size;
+    uint64_t hash;          /* start of the SHA-256 digest of the file contents */
+};
+
+/* structure to be used by client to hash a file before it is shared
+ * (see share_periodic()) */
+struct share_pending {
+    char path[255];         /* path of the file */
+    uint64_t size;
+    int fd;
+    EVP_MD_CTX *md;         /* digest of the contents read so far */
+};
+
+/* Bytes of a file hashed per round of the event loop */
+#define SHARE_HASH_CHUNK    (8 << 20)
+
+/******* Global values *******/
+struct list_node *shared_file_list_head = NULL;  /* files advertised to the server */
+int shared_file_count = 0;                       /* number of files advertised */
+int shared_only = 0;                             /* serve only the files shared */
+static struct list_node *share_pending_list_head = NULL; /* files being hashed */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to lookup a shared file by its advertised name
+ * Returns the node if found, NULL otherwise
+ */
+static struct shared_file *lookup_shared_file(char *name)
+{
+    struct list_node *cur;
+    struct shared_file *node;
+
+    for (cur = shared_file_list_head; cur != NULL; cur = cur->next) {
+        node = (struct shared_file *)(cur->container);
+        if (strcmp(node->name, name) == 0)
+            return node;
+    }
+    /* Not found */
+    return NULL;
+}
+
+/*
+ * Function to lookup a file being hashed by the name it is to be
+ * advertised with
+ * Returns the node if found, NULL otherwise
+ */
+static struct share_pending *lookup_pending_file(char *name)
+{
+    struct list_node *cur;
+    struct share_pending *node;
+    char *path;
+
+    for (cur = share_pending_list_head; cur != NULL; cur = cur->next) {
+        node = (struct share_pending *)(cur->container);
+        path = strrchr(node->path, '/');
+        if (strcmp(path ? path + 1 : node->path, name) == 0)
+            return node;
+    }
+    /* Not found */
+    return NULL;
+}
+
+/*
+ * Function to stop hashing a file
+ */
+static void drop_pending_file(struct share_pending *node)
+{
+    close(node->fd);
+    EVP_MD_CTX_free(node->md);
+    delete_from_list(&share_pending_list_head, node);
+}
+
+/*
+ * Function to send a message with a length prefixed string to the server
+ * Message format:
+ * msg_type | [ data ] | string length | string
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int send_to_server(uint16_t msg_type, void *data, int data_len, char *str)
+{
+    char msg[BUFSIZ];
+    char *ptr = msg;
+    int msg_size;
+
+    msg_size = sizeof(uint16_t) + data_len + sizeof(uint16_t) + strlen(str);
+    if (msg_size > sizeof(msg)) {
+        printf("Name too long\n");
+        return -1;
+    }
+
+    *(uint16_t *)ptr = msg_type;
+    ptr += sizeof(uint16_t);
+    memcpy(ptr, data, data_len);
+    ptr += data_len;
+    *(uint16_t *)ptr = strlen(str);
+    ptr += sizeof(uint16_t);
+    memcpy(ptr, str, strlen(str));
+
+    if (send(server_fd, msg, msg_size, MSG_NOSIGNAL) < 0) {
+        printf("Error sending message to server: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to get the file to serve for a name requested by a peer. A
+ * shared file is requested by the name it is advertised with, and served
+ * from wherever it was shared from. Other names are files relative to
+ * the current directory, unless only the shared files are served
+ * (sharedonly setting).
+ *
+ * returns the path of the file to serve, NULL if it is not served
+ */
+char *share_resolve(char *name)
+{
+    struct shared_file *node = lookup_shared_file(name);
+
+    if (node)
+        return node->path;
+    return shared_only ? NULL : name;
+}
+
+/*
+ * Function to advertise a file to the server, once it is hashed
+ * Sharing an already shared file updates its size and hash
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int share_publish(char *file_name, uint64_t size, unsigned char *digest)
+{
+    struct shared_file *node;
+    uint64_t info[2];   /* size, hash */
+    uint64_t hash;
+    char *name_dup, *name;
+    int i;
+
+    /* the catalog identifies the contents by the first 64 bits of
+     * their digest */
+    for (i = 0, hash = 0; i < sizeof(hash); i++)
+        hash = (hash << 8) | digest[i];
+
+    /* The file is advertised (and downloaded) by its base name */
+    name_dup = strdup(file_name);
+    if (!name_dup) {
+        printf("Error in strdup()\n");
+        exit(1);
+    }
+    name = basename(name_dup);
+
+    node = lookup_shared_file(name);
+    if (!node) {
+        node = (struct shared_file *) malloc(sizeof(struct shared_file));
+        if (!node) {
+            printf("\nError in malloc\n");
+            exit(1);
+        }
+        bzero(node, sizeof(struct shared_file));
+        strcpy(node->name, name);
+        add_to_list_tail(&shared_file_list_head, node);
+        shared_file_count++;
+    }
+    FREE(name_dup);
+
+    strcpy(node->path, file_name);
+    node->size = size;
+    node->hash = hash;
+
+    info[0] = node->size;
+    info[1] = node->hash;
+    if (send_to_server(MSG_CATALOG_ADD, info, sizeof(info), node->name) < 0)
+        return -1;
+
+    bloom_mark_dirty();
+    printf("Shared '%s' (%" PRIu64 " bytes, hash %016" PRIx64 ")\n",
+            node->name, node->size, node->hash);
+    return 0;
+}
+
+/*
+ * Function to share a file (SHARE command): it is advertised to the
+ * server once its contents are hashed, a part at a time from the event
+ * loop (see share_periodic()). Sharing a file being hashed starts over.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int share_file(char *file_name)
+{
+    struct share_pending *node;
+    struct stat st;
+    char *name;
+    int fd;
+
+    if (stat(file_name, &st) < 0) {
+        printf("SHARE: Error accessing file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        printf("SHARE: '%s' not a regular file\n", file_name);
+        return -1;
+    }
+
+    if (strlen(file_name) >= sizeof(node->path)) {
+        printf("SHARE: file name too long\n");
+        return -1;
+    }
+
+    /* a file which can't be read leaves the list (and what the server
+     * knows of it) as it was */
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        printf("SHARE: Error reading file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    name = strrchr(file_name, '/');
+    node = lookup_pending_file(name ? name + 1 : file_name);
+    if (node)
+        drop_pending_file(node);
+
+    node = (struct share_pending *) malloc(sizeof(struct share_pending));
+    if (!node) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    bzero(node, sizeof(struct share_pending));
+    strcpy(node->path, file_name);
+    node->size = st.st_size;
+    node->fd = fd;
+    node->md = EVP_MD_CTX_new();
+    if (!node->md) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    EVP_DigestInit_ex(node->md, EVP_sha256(), NULL);
+    add_to_list_tail(&share_pending_list_head, node);
+
+    printf("Hashing '%s' before sharing it\n", file_name);
+    return 0;
+}
+
+/*
+ * Function to get select() to return at once while files to share are
+ * being hashed
+ */
+void share_next_timeout(struct timeval *tv)
+{
+    if (share_pending_list_head)
+        timerclear(tv);
+}
+
+/*
+ * Function called from the event loop to hash the next part of the files
+ * to share (at most SHARE_HASH_CHUNK bytes of each), and to advertise
+ * those which are hashed
+ */
+void share_periodic()
+{
+    static char buff[XFER_BLOCK_SIZE];
+    unsigned char digest[FILE_DIGEST_SIZE];
+    struct list_node *cur, *next;
+    struct share_pending *node;
+    uint64_t left;
+    ssize_t len = 0;
+
+    for (cur = share_pending_list_head; cur != NULL; cur = next) {
+        next = cur->next;
+        node = (struct share_pending *)(cur->container);
+
+        left = SHARE_HASH_CHUNK;
+        while (left && (len = read(node->fd, buff, sizeof(buff))) > 0) {
+            EVP_DigestUpdate(node->md, buff, len);
+            left = left > len ? left - len : 0;
+        }
+        if (!left)
+            continue;
+
+        if (len < 0) {
+            printf("\nSHARE: Error reading file '%s': %s\n", node->path, strerror(errno));
+        } else {
+            EVP_DigestFinal_ex(node->md, digest, NULL);
+            printf("\n");
+            share_publish(node->path, node->size, digest);
+        }
+        print_prompt();
+        drop_pending_file(node);
+    }
+}
+
+/*
+ * Function to advertise all the shared files again, to the server we
+ * just registered to (it may have restarted, or be another one)
+ */
+void share_republish()
+{
+    struct list_node *cur;
+    struct shared_file *node;
+    uint64_t info[2];   /* size, hash */
+
+    for (cur = shared_file_list_head; cur != NULL; cur = cur->next) {
+        node = (struct shared_file *)(cur->container);
+        info[0] = node->size;
+        info[1] = node->hash;
+        if (send_to_server(MSG_CATALOG_ADD, info, sizeof(info), node->name) < 0)
+            return;
+    }
+
+    bloom_republish();
+}
+
+/*
+ * Function to withdraw a file from the server catalog (UNSHARE command)
+ *
+ * returns 0 on success, -1 on failure
+ */
+int unshare_file(char *file_name)
+{
+    struct shared_file *node;
+    struct share_pending *pending;
+
+    /* not advertised yet */
+    pending = lookup_pending_file(file_name);
+    if (pending) {
+        drop_pending_file(pending);
+        if (!lookup_shared_file(file_name)) {
+            printf("'%s' is not shared anymore\n", file_name);
+            return 0;
+        }
+    }
+
+    node = lookup_shared_file(file_name);
+    if (!node) {
+        printf("UNSHARE: '%s' is not shared\n", file_name);
+        return -1;
+    }
+
+    if (send_to_server(MSG_CATALOG_REMOVE, NULL, 0, node->name) < 0)
+        return -1;
+
+    printf("'%s' is not shared anymore\n", node->name);
+    delete_from_list(&shared_file_list_head, node);
+    shared_file_count--;
+    bloom_mark_dirty();
+    return 0;
+}
+
+/*
+ * Function to call fn for the name of every shared file
+ */
+void for_each_shared_file(void (*fn)(char *name, void *arg), void *arg)
+{
+    struct list_node *cur;
+
+    for (cur = shared_file_list_head; cur != NULL; cur = cur->next)
+        fn(((struct shared_file *)(cur->container))->name, arg);
+}
+
+/*
+ * Function to display the list of files advertised to the server
+ */
+void print_shared_files()
+{
+    struct list_node *tmp;
+    struct shared_file *node;
+
+    if (shared_file_list_head == NULL) {
+        printf("No files shared\n");
+        return;
+    }
+
+    printf("Name\t\t\tSize\t\tHash\t\t\tPath\n");
+    printf("-----------------------------------------------------------------------\n");
+    for (tmp = shared_file_list_head; tmp != NULL; tmp = tmp->next) {
+        node = (struct shared_file *)tmp->container;
+        printf("%s\t\t%" PRIu64 "\t\t%016" PRIx64 "\t%s\n", node->name,
+                node->size, node->hash, node->path);
+    }
+}
+
+/*
+ * Function to send a search query to the server (SEARCH command)
+ * The results are displayed when they are received
+ *
+ * returns 0 on success, -1 on failure
+ */
+int search_catalog(char *query)
+{
+    return send_to_server(MSG_SEARCH_REQUEST, NULL, 0, query);
+}
+
+/*
+ * Function to receive and display the results of a search
+ * (the message type has already been read)
+ * Message format:
+ * MSG_SEARCH_RESULT | count | (ip | port | size | hash | name length | name) ...
+ *
+ * returns 0 on success, -1 on failure, -2 if the connection is closed
+ */
+int recv_search_result()
+{
+    struct in_addr ip;
+    uint16_t count, port, name_len;
+    uint64_t info[2];   /* size, hash */
+    char name[BUFSIZ];
+    int i, len;
+
+    len = read_full(server_fd, &count, sizeof(uint16_t));
+    if (len <= 0)
+        return len ? -1 : -2;
+
+    if (!count) {
+        printf("\nNo matching files found\n");
+        return 0;
+    }
+
+    printf("\nMatching files:\n");
+    printf("Name\t\t\tSize\t\tHash\t\t\tPeer\n");
+    printf("-----------------------------------------------------------------------\n");
+    for (i = 0; i < count; i++) {
+        if ((len = read_full(server_fd, &ip, sizeof(ip))) <= 0 ||
+                (len = read_full(server_fd, &port, sizeof(port))) <= 0 ||
+                (len = read_full(server_fd, info, sizeof(info))) <= 0 ||
+                (len = read_full(server_fd, &name_len, sizeof(name_len))) <= 0)
+            return len ? -1 : -2;
+
+        if (name_len >= sizeof(name)) {
+            printf("\nInvalid search result received from server\n");
+            return -1;
+        }
+
+        len = read_full(server_fd, name, name_len);
+        if (len <= 0)
+            return len ? -1 : -2;
+        name[name_len] = '\0';
+
+        printf("%s\t\t%" PRIu64 "\t\t%016" PRIx64 "\t%s:%d\n", name,
+                info[0], info[1], inet_ntoa(ip), port);
+    }
+    return 0;
+}
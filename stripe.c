@@ -0,0 +1,493 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <inttypes.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* The parts of a striped download (shared by the connections receiving
+ * them). The first part comes on the connection the download was
+ * requested on, the others on extra data connections to the same peer. */
+struct stripe_set {
+    struct connected_peer_node *main;   /* connection of the download, NULL once closed */
+    struct connected_peer_node *part[MAX_STRIPES + 1]; /* connection receiving each part,
+                                                          NULL once the part is over */
+    int parts;                          /* number of parts */
+    int failed;                         /* a part failed, or the download was aborted */
+    int requeue;                        /* a connection was lost: download it again */
+    uint64_t file_size;
+    struct timeval start;               /* time the download was accepted */
+};
+
+/******* Global values *******/
+int stripe_count = 0;           /* extra data connections asked for a download (0: none) */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to get the range of the file carried by part i of a download
+ * split in parts. The parts are made of whole blocks, so the frames of
+ * each part are the same as for a single connection.
+ */
+void stripe_range(uint64_t file_size, int parts, int i, uint64_t *offset, uint64_t *len)
+{
+    uint64_t blocks = (file_size + XFER_BLOCK_SIZE - 1) / XFER_BLOCK_SIZE;
+    uint64_t per_part = blocks / parts, extra = blocks % parts;
+
+    /* the first parts get one more block if they don't divide evenly */
+    *offset = (i * per_part + (i < extra ? i : extra)) * XFER_BLOCK_SIZE;
+    *len = (per_part + (i < extra)) * XFER_BLOCK_SIZE;
+
+    if (*offset >= file_size)
+        *offset = *len = 0;
+    else if (*offset + *len > file_size)
+        *len = file_size - *offset;
+}
+
+/*
+ * Function to choose the number of extra data connections granted for a
+ * download request: at most what the peer asked for in flags, and few
+ * enough for every part to be at least STRIPE_MIN_PART long
+ */
+uint32_t stripe_grant(uint32_t flags, uint64_t file_size)
+{
+    uint64_t stripes = XFER_STRIPES(flags);
+
+    if (stripes > MAX_STRIPES)
+        stripes = MAX_STRIPES;
+
+    if (file_size / STRIPE_MIN_PART < stripes + 1)
+        stripes = file_size / STRIPE_MIN_PART ? file_size / STRIPE_MIN_PART - 1 : 0;
+
+    return stripes;
+}
+
+/*
+ * Function to get the number of extra data connections still receiving
+ * a part of the download of a connection (for LIST)
+ */
+int stripe_connections(struct connected_peer_node *node)
+{
+    struct stripe_set *set = node->ctx.stripes;
+    int i, count = 0;
+
+    for (i = 1; i < set->parts; i++) {
+        if (set->part[i])
+            count++;
+    }
+    return count;
+}
+
+/*
+ * Function to open the extra data connection for part i of the striped
+ * download of main, and to request the part on it
+ * Message format:
+ * MSG_STRIPE_REQUEST | port | part | number of parts | flags |
+ * filename size | filename
+ *
+ * returns the connection on success, NULL on failure
+ */
+static struct connected_peer_node *stripe_open(struct connected_peer_node *main, int i)
+{
+    struct stripe_set *set = main->ctx.stripes;
+    struct connected_peer_node *node = NULL;
+    struct sockaddr_in addr;
+    int fd = -1, file_fd = -1, msg_size = 0;
+    uint64_t offset, len, name_len = strlen(main->ctx.file_name);
+    char *msg = NULL, *ptr = NULL;
+
+    /* the peer's listening address (main may be a connection it opened) */
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = main->addr.sin_addr;
+    addr.sin_port = htons(main->port);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        printf("\nDOWNLOAD: Error creating socket: %s\n", strerror(errno));
+        return NULL;
+    }
+    tcp_tune_socket(fd);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        printf("\nDOWNLOAD: Error opening data connection to %s  :  %d: %s\n",
+                main->hostname, main->port, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    msg_size = 2 * sizeof(uint16_t) + 2 * sizeof(uint8_t) + sizeof(uint32_t) +
+        sizeof(uint64_t) + name_len;
+    msg = (char *) malloc (msg_size);
+    if (!msg) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    ptr = msg;
+    *(uint16_t *)ptr = (uint16_t) MSG_STRIPE_REQUEST;
+    ptr += sizeof(uint16_t);
+
+    *(uint16_t *)ptr = (uint16_t) listen_port;
+    ptr += sizeof(uint16_t);
+
+    *(uint8_t *)ptr = i;
+    ptr += sizeof(uint8_t);
+
+    *(uint8_t *)ptr = set->parts;
+    ptr += sizeof(uint8_t);
+
+    *(uint32_t *)ptr = main->ctx.flags;
+    ptr += sizeof(uint32_t);
+
+    *(uint64_t *)ptr = name_len;
+    ptr += sizeof(uint64_t);
+
+    memcpy(ptr, main->ctx.file_name, name_len);
+
+    if (send(fd, msg, msg_size, MSG_NOSIGNAL) < 0) {
+        printf("\nDOWNLOAD: error sending message to peer: %s\n", strerror(errno));
+        FREE(msg);
+        close(fd);
+        return NULL;
+    }
+    FREE(msg);
+
+    file_fd = open(main->ctx.file_name, O_RDWR);
+    if (file_fd < 0) {
+        printf("\nDOWNLOAD: Error opening file: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    node = add_stripe_to_peer_list(addr, main->hostname, fd, main->port);
+
+    /* create the file transfer context of the part */
+    stripe_range(set->file_size, set->parts, i, &offset, &len);
+    node->ctx.status = receiving;
+    peer_timer_restart(node);
+    node->ctx.file_fd = file_fd;
+    node->ctx.file_name = strdup(main->ctx.file_name);
+    node->ctx.offset = offset;
+    node->ctx.bytes_remaining = node->ctx.file_size = len;
+    node->ctx.total_time = (struct timeval){0};
+    node->ctx.flags = main->ctx.flags;
+    node->ctx.stripes = set;
+    direct_start(&node->ctx, 1);
+    map_prepare(&node->ctx);
+
+    return node;
+}
+
+/*
+ * Function to stop all the parts of a striped download still in progress.
+ * The extra data connections are closed, the peer is asked to stop
+ * sending the first part, and the data in flight is dropped until its
+ * cancel frame arrives (as for the ABORT of a download).
+ */
+static void stripe_stop(struct stripe_set *set)
+{
+    struct connected_peer_node *node;
+    uint16_t msg_type = MSG_TRANSFER_CANCEL;
+    int i;
+
+    set->failed = 1;
+
+    for (i = 1; i < set->parts; i++) {
+        node = set->part[i];
+        if (!node)
+            continue;
+        set->part[i] = NULL;
+        node->ctx.stripes = NULL;
+        close_stripe(node);
+    }
+
+    node = set->part[0];
+    if (node && node->ctx.status == receiving) {
+        if (send(node->fd, &msg_type, sizeof(msg_type), MSG_NOSIGNAL) < 0)
+            printf("\nError sending cancel request: %s\n", strerror(errno));
+
+        /* nothing more is written to the file */
+        close(node->ctx.file_fd);
+        node->ctx.file_fd = -1;
+        node->ctx.status = cancelling;
+    }
+}
+
+/*
+ * Function to complete a striped download once all its parts are over:
+ * prints the Rx summary of the whole file, and releases the download
+ * slot and the connection of the download
+ */
+static void stripe_finish(struct stripe_set *set)
+{
+    struct connected_peer_node *node = set->main;
+    struct timeval end, diff;
+    double rx_rate = 0.0;
+    int i;
+
+    for (i = 0; i < set->parts; i++) {
+        if (set->part[i])
+            return;
+    }
+
+    if (node) {
+        if (!set->failed) {
+            gettimeofday(&end, NULL);
+            timersub(&end, &set->start, &diff);
+
+            rx_rate = ((set->file_size * 8) /
+                       ((diff.tv_sec * 1000000) + diff.tv_usec + 1));
+
+            rx_rate *= 1000000;
+            printf("\nFile name : '%s' \nfrom : %s  :  %d\nSuccessfully received!!\n",
+                    node->ctx.file_name, node->hostname, node->port);
+            printf("Rx (%s): %s -> %s,\nFile Size: %" PRIu64
+                    " Bytes,\nConnections: %d,\nTime Taken: %ld.%06ld seconds, \nRx Rate: %f bits/second\n",
+                    my_hostname, node->hostname, my_hostname, set->file_size,
+                    set->parts, diff.tv_sec, diff.tv_usec, rx_rate);
+            print_prompt();
+        }
+
+        recv_in_progress--;
+        queue_finish(node, set->requeue);
+
+        node->ctx.stripes = NULL;
+        reset_transfer(node);
+    }
+
+    FREE(set);
+}
+
+/*
+ * Function to start a striped download: called once the peer accepted
+ * the download of main in parts, the context of main being set up for
+ * the whole file. main receives the first part, and an extra data
+ * connection is opened for each of the others.
+ *
+ * returns 0 on success, -2 if the connection can't be used any more
+ */
+int stripe_start(struct connected_peer_node *node, int parts)
+{
+    struct stripe_set *set = NULL;
+    uint64_t offset, len;
+    int i;
+
+    if (parts > MAX_STRIPES + 1 || parts > stripe_count + 1 ||
+            node->ctx.file_size / STRIPE_MIN_PART < parts) {
+        /* The peer is sending the first part anyway */
+        printf("\nDOWNLOAD: Invalid number of parts from peer\n");
+        queue_finish(node, 0);
+        return -2;
+    }
+
+    /* the parts are written in place */
+    if (ftruncate(node->ctx.file_fd, node->ctx.file_size) < 0) {
+        printf("\nDOWNLOAD: Error creating file: %s\n", strerror(errno));
+        queue_finish(node, 0);
+        return -2;
+    }
+
+    set = (struct stripe_set *) malloc(sizeof(struct stripe_set));
+    if (!set) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    bzero(set, sizeof(struct stripe_set));
+    set->main = node;
+    set->parts = parts;
+    set->file_size = node->ctx.file_size;
+    gettimeofday(&set->start, NULL);
+
+    stripe_range(set->file_size, parts, 0, &offset, &len);
+    node->ctx.bytes_remaining = node->ctx.file_size = len;
+    node->ctx.stripes = set;
+    set->part[0] = node;
+
+    printf("\nReceiving file '%s' over %d connections..\n", node->ctx.file_name, parts);
+
+    for (i = 1; i < parts; i++) {
+        set->part[i] = stripe_open(node, i);
+        if (!set->part[i]) {
+            /* error already printed in stripe_open() */
+            stripe_stop(set);
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function called when a part of a striped download is over, on the
+ * connection receiving it
+ * status is 0 if the part was received, -2 if the connection is going
+ * away (it is closed by the caller), -1 on other failures
+ * A failed part stops the other ones: the download is requeued if a
+ * connection was lost, dropped otherwise.
+ */
+void stripe_part_done(struct connected_peer_node *node, int status)
+{
+    struct stripe_set *set = node->ctx.stripes;
+    int i;
+
+    for (i = 0; i < set->parts; i++) {
+        if (set->part[i] == node)
+            set->part[i] = NULL;
+    }
+
+    if (status < 0 && !set->failed) {
+        printf("\nDOWNLOAD: A part of '%s' from %s  :  %d failed, stopping the download\n",
+                node->ctx.file_name, node->hostname, node->port);
+        print_prompt();
+    }
+
+    if (status == -2)
+        set->requeue = 1;
+
+    if (node != set->main) {
+        node->ctx.stripes = NULL;
+        if (status == -2)
+            reset_transfer(node);
+        else
+            close_stripe(node);
+    } else if (status == -2) {
+        /* the connection the download was requested on is going away */
+        set->main = NULL;
+        recv_in_progress--;
+        queue_finish(node, 1);
+        node->ctx.stripes = NULL;
+        reset_transfer(node);
+    } else if (node->ctx.file_fd >= 0) {
+        /* our part is written, wait for the others */
+        close(node->ctx.file_fd);
+        node->ctx.file_fd = -1;
+        node->ctx.status = striping;
+    }
+
+    if (status < 0 && !set->failed)
+        stripe_stop(set);
+
+    stripe_finish(set);
+}
+
+/*
+ * Function to abort a striped download (ABORT on its connection)
+ *
+ * returns 0 on success
+ */
+int stripe_abort(struct connected_peer_node *node)
+{
+    struct stripe_set *set = node->ctx.stripes;
+
+    printf("Aborting download of '%s' from %s  :  %d\n",
+            node->ctx.file_name, node->hostname, node->port);
+
+    /* let the queue go on */
+    queue_finish(node, 0);
+
+    stripe_stop(set);
+    stripe_finish(set);
+    return 0;
+}
+
+/*
+ * Function to handle a request for a part of a striped download, received
+ * on a new connection (the message type and port have already been read)
+ * Message format:
+ * MSG_STRIPE_REQUEST | port | part | number of parts | flags |
+ * filename size | filename
+ *
+ * The part is sent like a download, and the connection closed once it is
+ * sent. The request is only served to a peer we are connected to.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int receive_stripe_request(int fd, struct sockaddr_in addr, int port)
+{
+    struct connected_peer_node *main = NULL, *node = NULL;
+    uint8_t part = 0, parts = 0;
+    uint32_t flags = 0;
+    uint64_t file_name_len = 0, offset = 0, len = 0;
+    char file_name[255], *path = NULL;
+    struct stat st;
+    int file_fd = -1;
+
+    if (read_full(fd, &part, sizeof(part)) <= 0 ||
+            read_full(fd, &parts, sizeof(parts)) <= 0 ||
+            read_full(fd, &flags, sizeof(flags)) <= 0 ||
+            read_full(fd, &file_name_len, sizeof(file_name_len)) <= 0)
+        goto close;
+
+    if (file_name_len == 0 || file_name_len >= sizeof(file_name) ||
+            read_full(fd, file_name, file_name_len) <= 0)
+        goto close;
+    file_name[file_name_len] = '\0';
+
+    main = lookup_peer_by_address(addr.sin_addr, port);
+    if (!main) {
+        printf("\nData connection from unknown peer '%s'. Closing connection\n",
+                inet_ntoa(addr.sin_addr));
+        goto close;
+    }
+
+    if (parts < 2 || parts > MAX_STRIPES + 1 || part == 0 || part >= parts) {
+        printf("\nInvalid part requested by %s  :  %d\n", main->hostname, main->port);
+        goto close;
+    }
+
+    /* the name the download was requested with (see share_resolve()) */
+    path = share_resolve(file_name);
+    if (!path) {
+        printf("\nRequested file '%s' is not shared\n", file_name);
+        goto close;
+    }
+    if (path != file_name)
+        strcpy(file_name, path);
+
+    file_fd = hot_lookup(file_name, &st);
+    if (file_fd < 0) {
+        file_fd = open(file_name, O_RDONLY);
+        if (file_fd < 0 || fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            printf("\nError opening requested file '%s'\n", file_name);
+            goto close;
+        }
+        hot_insert(file_name, file_fd, &st);
+    }
+
+    stripe_range(st.st_size, parts, part, &offset, &len);
+    if (!len) {
+        printf("\nInvalid part requested by %s  :  %d\n", main->hostname, main->port);
+        goto close;
+    }
+
+    tcp_tune_socket(fd);
+    node = add_stripe_to_peer_list(addr, main->hostname, fd, port);
+    node->main_id = main->id;
+
+    /* create the file transfer context of the part */
+    node->ctx.status = sending;
+    peer_timer_restart(node);
+    node->ctx.file_fd = file_fd;
+    node->ctx.file_name = strdup(file_name);
+    node->ctx.offset = offset;
+    node->ctx.bytes_remaining = node->ctx.file_size = len;
+    node->ctx.total_time = (struct timeval){0};
+    node->ctx.flags = flags & local_xfer_caps();
+    node->ctx.hot = hot_hold(file_name);
+    rate_init_transfer(node);
+
+    /* Now add the socket to write fd set */
+    FD_SET(fd, &writefds);
+    send_in_progress++;
+    return 0;
+
+close:
+    if (file_fd >= 0)
+        close(file_fd);
+    close(fd);
+    return -1;
+}
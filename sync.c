@@ -0,0 +1,863 @@
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <openssl/evp.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* Directory (in the current directory) where the manifests of the trees
+ * synchronized are cached. It is left out of the trees themselves. */
+#define SYNC_CACHE_DIR      ".sync_cache"
+/* Largest manifest accepted from a peer */
+#define SYNC_MAX_MANIFEST   (256 << 20)
+/* Largest number of entries in a manifest */
+#define SYNC_MAX_ENTRIES    (1 << 20)
+/* Bytes of files hashed per round of the event loop */
+#define SYNC_HASH_CHUNK     (8 << 20)
+
+/* An entry of a manifest sent to a peer, followed by the length of its
+ * path (uint16_t), and the path relative to the root of the tree
+ * terminated by '\0' */
+struct sync_wire_entry {
+    uint64_t size;
+    int64_t mtime;
+    unsigned char digest[FILE_DIGEST_SIZE]; /* SHA-256 of the contents, 0 for a directory */
+    uint32_t mtime_nsec;
+    uint32_t mode;               /* file type and permission bits */
+};
+
+/* An entry of a manifest received from a peer */
+struct sync_peer_entry {
+    char *path;                  /* points in the message received */
+    struct sync_wire_entry e;
+};
+
+/* Hash of a file cached on disk, valid as long as the file has the same
+ * metadata */
+struct sync_cached {
+    char *path;                  /* relative to the root of the tree */
+    uint64_t size;
+    uint64_t ino;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    unsigned char digest[FILE_DIGEST_SIZE];
+};
+
+/* Manifest of a tree on this side: the tree as listed by tree_walk(),
+ * with the digests of its files known so far (computed when needed) */
+struct sync_manifest {
+    char real[PATH_MAX];         /* real path of the root */
+    int rel;                     /* start of the relative path in the paths of entries */
+    struct walk_entry *entries;
+    int count;
+    unsigned char (*digest)[FILE_DIGEST_SIZE];
+    char *hashed;                /* digest of the entry known */
+    struct sync_cached *cache;   /* loaded from the disk, sorted by path */
+    int ncache;
+    int reused;                  /* cached hashes still valid */
+    int dirty;                   /* the cache on disk has to be written again */
+    char cache_file[PATH_MAX];   /* "" if the manifest can't be cached */
+};
+
+/* Sync being prepared with a peer: the files of the tree are hashed a
+ * part at a time from the event loop (see sync_periodic()), before the
+ * request is sent, or answered */
+struct sync_job {
+    struct sync_manifest m;
+    int loaded;                  /* the tree here was listed */
+    int answer;                  /* answering a request of the peer */
+    char dir[256];               /* directory synchronized */
+    char *local;                 /* requesting: where it is received here */
+    int next;                    /* next entry to hash */
+    int fd;                      /* file being hashed, -1 if none */
+    EVP_MD_CTX *md;              /* its digest so far */
+    int hashed;                  /* files hashed (their digest was not cached) */
+    struct timeval start;
+    uint32_t flags;              /* answering: flags of the request */
+    char *manifest;              /* answering: manifest of the peer, as received */
+    struct sync_peer_entry *peer; /* its entries, sorted by path */
+    uint32_t npeer;
+};
+
+/******* Global values *******/
+static int sync_jobs = 0;        /* connections with files being hashed */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to get the path of entry i of a manifest, relative to the
+ * root of the tree ("" for the root itself)
+ */
+static char *sync_rel(struct sync_manifest *m, int i)
+{
+    char *path = m->entries[i].path;
+
+    return strlen(path) < m->rel ? "" : path + m->rel;
+}
+
+static int sync_cached_cmp(const void *a, const void *b)
+{
+    return strcmp(((struct sync_cached *)a)->path, ((struct sync_cached *)b)->path);
+}
+
+static int sync_peer_cmp(const void *a, const void *b)
+{
+    return strcmp(((struct sync_peer_entry *)a)->path, ((struct sync_peer_entry *)b)->path);
+}
+
+/*
+ * Function to read a digest written in hexadecimal
+ *
+ * returns 0 on success, -1 if hex is not a digest
+ */
+static int sync_digest_parse(char *hex, unsigned char *digest)
+{
+    int i;
+
+    if (strlen(hex) != 2 * FILE_DIGEST_SIZE)
+        return -1;
+
+    for (i = 0; i < FILE_DIGEST_SIZE; i++) {
+        if (sscanf(hex + 2 * i, "%2hhx", &digest[i]) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to load the manifest of a tree cached by a previous sync. The
+ * cache is named after the hash of the real path of the tree, and starts
+ * with that path.
+ * Line format:
+ * size ino mtime mtime_nsec ctime ctime_nsec digest path
+ */
+static void sync_cache_load(struct sync_manifest *m)
+{
+    unsigned long long size, ino;
+    long long mtime, ctime;
+    unsigned int mtime_nsec, ctime_nsec;
+    unsigned char digest[FILE_DIGEST_SIZE];
+    char line[PATH_MAX + 192], hex[2 * FILE_DIGEST_SIZE + 2];
+    struct sync_cached *c = NULL;
+    int max = 0, n;
+    FILE *fp;
+
+    snprintf(m->cache_file, sizeof(m->cache_file), SYNC_CACHE_DIR "/%016" PRIx64,
+            fnv1a_hash(m->real, strlen(m->real), FNV_OFFSET_BASIS));
+
+    fp = fopen(m->cache_file, "r");
+    if (!fp)
+        return;
+
+    /* another tree with the same hash */
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, "# ", 2) != 0 ||
+            strlen(line) != strlen(m->real) + 3 || strncmp(line + 2, m->real, strlen(m->real))) {
+        fclose(fp);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        n = 0;
+        /* lines of an older format are left out, their files hashed again */
+        if (sscanf(line, "%llu %llu %lld %u %lld %u %65s %n", &size, &ino, &mtime,
+                    &mtime_nsec, &ctime, &ctime_nsec, hex, &n) < 7 || !n ||
+                sync_digest_parse(hex, digest) < 0)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+
+        if (m->ncache == max) {
+            max = max ? max * 2 : 256;
+            m->cache = (struct sync_cached *) realloc(m->cache, max * sizeof(struct sync_cached));
+            if (!m->cache) {
+                printf("\nError in malloc\n");
+                exit(1);
+            }
+        }
+
+        c = &m->cache[m->ncache++];
+        c->path = strdup(line + n);
+        c->size = size;
+        c->ino = ino;
+        c->mtime = mtime;
+        c->mtime_nsec = mtime_nsec;
+        c->ctime = ctime;
+        c->ctime_nsec = ctime_nsec;
+        memcpy(c->digest, digest, FILE_DIGEST_SIZE);
+    }
+    fclose(fp);
+
+    qsort(m->cache, m->ncache, sizeof(struct sync_cached), sync_cached_cmp);
+}
+
+/*
+ * Function to write the manifest of a tree back to the disk, once digests
+ * were computed or dropped. It is written aside, then renamed, so an
+ * interrupted write leaves the previous one.
+ */
+static void sync_cache_save(struct sync_manifest *m)
+{
+    char tmp[PATH_MAX + 8];
+    struct stat *st;
+    FILE *fp;
+    int i, j;
+
+    if (!m->dirty || !m->cache_file[0])
+        return;
+
+    if (mkdir(SYNC_CACHE_DIR, 0700) < 0 && errno != EEXIST) {
+        printf("Error saving the manifest of '%s': %s\n", m->real, strerror(errno));
+        return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m->cache_file);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        printf("Error saving the manifest of '%s': %s\n", m->real, strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "# %s\n", m->real);
+    for (i = 0; i < m->count; i++) {
+        st = &m->entries[i].st;
+        if (!m->hashed[i] || strchr(sync_rel(m, i), '\n'))
+            continue;
+
+        fprintf(fp, "%llu %llu %lld %u %lld %u ", (unsigned long long)st->st_size,
+                (unsigned long long)st->st_ino, (long long)st->st_mtim.tv_sec,
+                (unsigned int)st->st_mtim.tv_nsec, (long long)st->st_ctim.tv_sec,
+                (unsigned int)st->st_ctim.tv_nsec);
+        for (j = 0; j < FILE_DIGEST_SIZE; j++)
+            fprintf(fp, "%02x", m->digest[i][j]);
+        fprintf(fp, " %s\n", sync_rel(m, i));
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, m->cache_file) < 0) {
+        printf("Error saving the manifest of '%s': %s\n", m->real, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    m->dirty = 0;
+}
+
+/*
+ * Function to get the manifest of the tree root: it is listed by the
+ * workers of tree_walk(), and the digests of the files which did not
+ * change since they were cached are taken from the cache. The other
+ * digests are computed when needed (see sync_hash_step()).
+ *
+ * returns the number of entries, -1 if root is not a directory
+ */
+static int sync_manifest_load(struct sync_manifest *m, char *root)
+{
+    struct sync_cached key, *c;
+    struct stat *st;
+    int i, n, errors = 0;
+
+    bzero(m, sizeof(struct sync_manifest));
+    m->rel = strlen(root) + 1;
+
+    n = tree_walk(root, batch_workers, &m->entries, &errors);
+    if (n < 0)
+        return -1;
+    if (errors)
+        printf("Could not read %d director%s under '%s'\n", errors,
+                errors > 1 ? "ies" : "y", root);
+
+    /* the cached manifests are not part of the tree */
+    for (i = 0; i < n; i++) {
+        if (strcmp(sync_rel(m, i), SYNC_CACHE_DIR) == 0 ||
+                strncmp(sync_rel(m, i), SYNC_CACHE_DIR "/", strlen(SYNC_CACHE_DIR) + 1) == 0) {
+            FREE(m->entries[i].path);
+            continue;
+        }
+        m->entries[m->count++] = m->entries[i];
+    }
+
+    m->digest = calloc(m->count + 1, FILE_DIGEST_SIZE);
+    m->hashed = (char *) calloc(m->count + 1, sizeof(char));
+    if (!m->digest || !m->hashed) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    if (realpath(root, m->real))
+        sync_cache_load(m);
+
+    for (i = 0; i < m->count && m->ncache; i++) {
+        st = &m->entries[i].st;
+        if (!S_ISREG(st->st_mode))
+            continue;
+
+        key.path = sync_rel(m, i);
+        c = bsearch(&key, m->cache, m->ncache, sizeof(struct sync_cached), sync_cached_cmp);
+        if (!c || c->size != st->st_size || c->ino != st->st_ino ||
+                c->mtime != st->st_mtim.tv_sec || c->mtime_nsec != st->st_mtim.tv_nsec ||
+                c->ctime != st->st_ctim.tv_sec || c->ctime_nsec != st->st_ctim.tv_nsec)
+            continue;
+
+        memcpy(m->digest[i], c->digest, FILE_DIGEST_SIZE);
+        m->hashed[i] = 1;
+        m->reused++;
+    }
+
+    /* files gone, or changed */
+    if (m->reused != m->ncache)
+        m->dirty = 1;
+
+    return m->count;
+}
+
+/*
+ * Function to tell if the digest of entry i of the manifest of a sync is
+ * needed: to request a sync, the digests of all the files are sent. To
+ * answer it, only those of the files which the peer has with the same
+ * size, but another modification time, are compared.
+ */
+static int sync_wanted(struct sync_job *j, int i)
+{
+    struct stat *st = &j->m.entries[i].st;
+    struct sync_peer_entry key, *p;
+
+    if (!S_ISREG(st->st_mode) || j->m.hashed[i])
+        return 0;
+    if (!j->answer)
+        return 1;
+
+    key.path = sync_rel(&j->m, i);
+    p = j->npeer ? bsearch(&key, j->peer, j->npeer, sizeof(*p), sync_peer_cmp) : NULL;
+    return p && S_ISREG(p->e.mode) && p->e.size == st->st_size &&
+        (p->e.mtime != st->st_mtim.tv_sec || p->e.mtime_nsec != st->st_mtim.tv_nsec);
+}
+
+/*
+ * Function to hash the next part of the files of a sync: at most
+ * SYNC_HASH_CHUNK bytes are read per call (a file counts for a block at
+ * least). A file which can't be read is left without a digest.
+ *
+ * returns 1 once all the digests needed are known, 0 otherwise
+ */
+static int sync_hash_step(struct sync_job *j)
+{
+    static char buff[XFER_BLOCK_SIZE];
+    struct sync_manifest *m = &j->m;
+    uint64_t left = SYNC_HASH_CHUNK;
+    ssize_t len = 0;
+
+    while (j->next < m->count) {
+        if (j->fd < 0) {
+            if (!sync_wanted(j, j->next)) {
+                j->next++;
+                continue;
+            }
+            if (!left)
+                return 0;
+
+            j->fd = open(m->entries[j->next].path, O_RDONLY);
+            if (j->fd < 0) {
+                j->next++;
+                continue;
+            }
+            EVP_DigestInit_ex(j->md, EVP_sha256(), NULL);
+            left = left > XFER_BLOCK_SIZE ? left - XFER_BLOCK_SIZE : 0;
+        }
+
+        while (left && (len = read(j->fd, buff, sizeof(buff))) > 0) {
+            EVP_DigestUpdate(j->md, buff, len);
+            left = left > len ? left - len : 0;
+        }
+        if (!left)
+            return 0;
+
+        if (len == 0) {
+            EVP_DigestFinal_ex(j->md, m->digest[j->next], NULL);
+            m->hashed[j->next] = 1;
+            m->dirty = 1;
+            j->hashed++;
+        }
+        close(j->fd);
+        j->fd = -1;
+        j->next++;
+    }
+    return 1;
+}
+
+/*
+ * Function to free a manifest
+ */
+static void sync_manifest_free(struct sync_manifest *m)
+{
+    int i;
+
+    tree_walk_free(m->entries, m->count);
+    FREE(m->digest);
+    FREE(m->hashed);
+    for (i = 0; i < m->ncache; i++)
+        FREE(m->cache[i].path);
+    FREE(m->cache);
+}
+
+/*
+ * Function to strip the trailing '/' of a directory name ('dir/' is
+ * synchronized as 'dir')
+ */
+static void sync_strip(char *dir)
+{
+    int i;
+
+    for (i = strlen(dir) - 1; i > 0 && dir[i] == '/'; i--)
+        dir[i] = '\0';
+}
+
+/*
+ * Function to start preparing a sync of the directory dir with a peer:
+ * the connection is taken until the files are hashed
+ */
+static struct sync_job *sync_job_new(struct connected_peer_node *node, char *dir, int answer)
+{
+    struct sync_job *j = (struct sync_job *) malloc(sizeof(struct sync_job));
+
+    if (!j) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    bzero(j, sizeof(struct sync_job));
+    strcpy(j->dir, dir);
+    j->answer = answer;
+    j->fd = -1;
+    j->md = EVP_MD_CTX_new();
+    if (!j->md) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    gettimeofday(&j->start, NULL);
+
+    node->ctx.sync = j;
+    node->ctx.status = hashing;
+    node->ctx.file_name = strdup(dir);
+    peer_timer_restart(node);
+    sync_jobs++;
+    return j;
+}
+
+/*
+ * Function to send the sync request prepared for a peer, once the files
+ * of the directory here are hashed (see sync_request())
+ * Message format:
+ * MSG_SYNC_REQUEST | flags | name size | name | count | manifest size | manifest
+ * where the manifest is count struct sync_wire_entry | path size | path | '\0'
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int sync_send_request(struct connected_peer_node *node)
+{
+    struct sync_job *j = node->ctx.sync;
+    struct sync_manifest *m = &j->m;
+    struct sync_wire_entry e;
+    struct timeval end, diff;
+    char *msg = NULL, *ptr = NULL;
+    uint64_t manifest_size = 0;
+    uint32_t count = 0;
+    int i, len;
+
+    for (i = 0; i < m->count; i++) {
+        /* a file which can't be read is left out, the peer sends it */
+        if (S_ISREG(m->entries[i].st.st_mode) && !m->hashed[i])
+            continue;
+        manifest_size += sizeof(e) + sizeof(uint16_t) + strlen(sync_rel(m, i)) + 1;
+    }
+
+    msg = (char *) malloc(sizeof(uint16_t) + 2 * sizeof(uint32_t) + sizeof(uint16_t) +
+            strlen(j->dir) + sizeof(uint64_t) + manifest_size);
+    if (!msg) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    ptr = msg;
+    *(uint16_t *)ptr = (uint16_t) MSG_SYNC_REQUEST;
+    ptr += sizeof(uint16_t);
+    *(uint32_t *)ptr = local_xfer_caps();
+    ptr += sizeof(uint32_t);
+    *(uint16_t *)ptr = strlen(j->dir);
+    ptr += sizeof(uint16_t);
+    memcpy(ptr, j->dir, strlen(j->dir));
+    ptr += strlen(j->dir);
+    /* the count is filled in once the entries are in */
+    ptr += sizeof(uint32_t);
+    *(uint64_t *)ptr = manifest_size;
+    ptr += sizeof(uint64_t);
+
+    for (i = 0; i < m->count; i++) {
+        if (S_ISREG(m->entries[i].st.st_mode) && !m->hashed[i])
+            continue;
+
+        bzero(&e, sizeof(e));
+        e.size = S_ISDIR(m->entries[i].st.st_mode) ? 0 : m->entries[i].st.st_size;
+        e.mtime = m->entries[i].st.st_mtim.tv_sec;
+        e.mtime_nsec = m->entries[i].st.st_mtim.tv_nsec;
+        e.mode = m->entries[i].st.st_mode & (S_IFMT | 0777);
+        if (m->hashed[i])
+            memcpy(e.digest, m->digest[i], FILE_DIGEST_SIZE);
+        memcpy(ptr, &e, sizeof(e));
+        ptr += sizeof(e);
+
+        len = strlen(sync_rel(m, i));
+        *(uint16_t *)ptr = len;
+        ptr += sizeof(uint16_t);
+        memcpy(ptr, sync_rel(m, i), len + 1);
+        ptr += len + 1;
+        count++;
+    }
+    memcpy(msg + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t) + strlen(j->dir),
+            &count, sizeof(count));
+
+    sync_cache_save(m);
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &j->start, &diff);
+    printf("Manifest of '%s': %u entries, %d file(s) hashed, in %ld.%06ld seconds\n",
+            j->local, count, j->hashed, diff.tv_sec, diff.tv_usec);
+    sync_stop(node);
+
+    if (send(node->fd, msg, ptr - msg, MSG_NOSIGNAL) < 0) {
+        printf("\nSYNC: error sending message to peer: %s\n", strerror(errno));
+        FREE(msg);
+        reset_transfer(node);
+        return -1;
+    }
+    FREE(msg);
+
+    node->ctx.status = requesting;
+    peer_timer_restart(node);
+    batch_expect(&node->ctx, 1);
+    return 0;
+}
+
+/*
+ * Function to request the new and changed files of the directory
+ * dir_name of a peer (called as a result of the SYNC command). They are
+ * received, as a batch, in the directory of the same name here.
+ * The manifest of that directory is sent along, so the peer only sends
+ * what differs. The files whose digest is not cached are hashed first,
+ * from the event loop (see sync_periodic()).
+ *
+ * returns 0 on success, -1 on failure
+ */
+int sync_request(int conn_id, char *dir_name)
+{
+    struct connected_peer_node *node = NULL;
+    struct sync_job *j;
+    char dir[256];
+    int n;
+
+    node = lookup_peer_by_id(connected_peer_list_head, conn_id);
+    if (!node || conn_id == 1) {
+        printf("SYNC: Invalid connection ID %d\n", conn_id);
+        return -1;
+    }
+
+    if (node->ctx.status != idle) {
+        printf("SYNC: A transfer with %s is in progress, try again later\n",
+                node->hostname);
+        return -1;
+    }
+
+    if (strlen(dir_name) >= 255) {
+        printf("SYNC: directory name too long\n");
+        return -1;
+    }
+    strcpy(dir, dir_name);
+    sync_strip(dir);
+
+    j = sync_job_new(node, dir, 0);
+
+    /* the tree is received under the last component of its name, or as
+     * it is for '.', '..' or '/' (see batch_name_base()) */
+    n = batch_name_base(j->dir);
+    j->local = n > strlen(j->dir) ? "." : j->dir + n;
+
+    /* a directory not here yet is requested with an empty manifest */
+    j->loaded = sync_manifest_load(&j->m, j->local) >= 0;
+
+    /* sent at once if the digests are all cached */
+    if (sync_hash_step(j))
+        return sync_send_request(node);
+
+    printf("Hashing the files of '%s'\n", j->local);
+    return 0;
+}
+
+/*
+ * Function to pick the entries of the tree of manifest m which the peer
+ * lacks, given its manifest: the files it does not have, or whose size,
+ * modification time and contents differ, and the directories it does not
+ * have, or whose mode or modification time differ.
+ * The indexes of the entries picked are set in picked, in the order of m.
+ *
+ * returns the number of entries picked
+ */
+static int sync_compare(struct sync_manifest *m, struct sync_peer_entry *peer, int npeer,
+        int *picked)
+{
+    struct sync_peer_entry key, *p;
+    struct stat *st;
+    int i, n = 0;
+
+    for (i = 0; i < m->count; i++) {
+        st = &m->entries[i].st;
+        key.path = sync_rel(m, i);
+        p = npeer ? bsearch(&key, peer, npeer, sizeof(*peer), sync_peer_cmp) : NULL;
+
+        if (p && S_ISDIR(st->st_mode) != S_ISDIR(p->e.mode)) {
+            printf("SYNC: Skipping '%s', not a %s on the peer\n", m->entries[i].path,
+                    S_ISDIR(st->st_mode) ? "directory" : "file");
+            continue;
+        }
+
+        if (p && p->e.mtime == st->st_mtim.tv_sec && p->e.mtime_nsec == st->st_mtim.tv_nsec) {
+            if (S_ISDIR(st->st_mode) ? (p->e.mode & 0777) == (st->st_mode & 0777) :
+                    p->e.size == st->st_size)
+                continue;
+        } else if (p && S_ISREG(st->st_mode) && p->e.size == st->st_size && m->hashed[i] &&
+                memcmp(m->digest[i], p->e.digest, FILE_DIGEST_SIZE) == 0) {
+            /* touched, but the same contents */
+            continue;
+        }
+
+        picked[n++] = i;
+    }
+    return n;
+}
+
+/*
+ * Function to answer the sync request of a peer, once the files which
+ * may differ from its own are hashed (see handle_sync_request()): what
+ * differs is sent as a batch (see batch_send_entries()). An empty batch
+ * tells the peer it is up to date.
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int sync_answer(struct connected_peer_node *node)
+{
+    struct sync_job *j = node->ctx.sync;
+    struct walk_entry *send_list = NULL;
+    int *picked = NULL;
+    uint32_t flags = j->flags;
+    char dir[256];
+    int i, n, rc;
+
+    picked = (int *) malloc((j->m.count + 1) * sizeof(int));
+    send_list = (struct walk_entry *) malloc((j->m.count + 1) * sizeof(struct walk_entry));
+    if (!picked || !send_list) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    n = sync_compare(&j->m, j->peer, j->npeer, picked);
+    sync_cache_save(&j->m);
+
+    /* the entries picked are handed over to the batch */
+    for (i = 0; i < n; i++) {
+        send_list[i] = j->m.entries[picked[i]];
+        j->m.entries[picked[i]].path = NULL;
+    }
+    FREE(picked);
+    strcpy(dir, j->dir);
+
+    /* the batch takes the connection over */
+    reset_transfer(node);
+
+    rc = batch_send_entries(node, dir, flags, send_list, n);
+    tree_walk_free(send_list, n);
+    return rc;
+}
+
+/*
+ * Function to reject the sync request of a peer
+ * Response format:
+ * MSG_BATCH_REJECT
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int sync_reject(struct connected_peer_node *node)
+{
+    uint16_t msg_type = (uint16_t) MSG_BATCH_REJECT;
+
+    if (send(node->fd, &msg_type, sizeof(msg_type), MSG_NOSIGNAL) < 0) {
+        printf("\nError sending message to peer: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to handle a sync request from a peer (the message type has
+ * already been read): the manifest of the peer is compared with the one
+ * of the directory here, once the files which may differ are hashed,
+ * from the event loop (see sync_periodic()).
+ * Response format:
+ * MSG_BATCH_ACCEPT | count | flags (see sync_answer())
+ * or, if the directory does not exist
+ * MSG_BATCH_REJECT
+ *
+ * returns 0 on success, -2 if the connection is closed (or the request
+ * is invalid), -1 on other failures
+ */
+int handle_sync_request(struct connected_peer_node *node)
+{
+    struct sync_job *j;
+    struct sync_peer_entry *peer = NULL;
+    char dir[256], *manifest = NULL, *ptr = NULL, *end = NULL;
+    uint64_t manifest_size = 0;
+    uint32_t flags = 0, count = 0;
+    uint16_t len = 0;
+    int i;
+
+    if (read_full(node->fd, &flags, sizeof(flags)) <= 0 ||
+            read_full(node->fd, &len, sizeof(len)) <= 0 || !len || len >= sizeof(dir) ||
+            read_full(node->fd, dir, len) <= 0 ||
+            read_full(node->fd, &count, sizeof(count)) <= 0 ||
+            read_full(node->fd, &manifest_size, sizeof(manifest_size)) <= 0 ||
+            count > SYNC_MAX_ENTRIES || manifest_size > SYNC_MAX_MANIFEST) {
+        printf("\nInvalid sync request received from peer\n");
+        return -2;
+    }
+    dir[len] = '\0';
+    sync_strip(dir);
+
+    manifest = (char *) malloc(manifest_size + 1);
+    peer = (struct sync_peer_entry *) malloc((count + 1) * sizeof(struct sync_peer_entry));
+    if (!manifest || !peer) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+
+    if (manifest_size && read_full(node->fd, manifest, manifest_size) <= 0) {
+        printf("\nInvalid sync request received from peer\n");
+        FREE(manifest);
+        FREE(peer);
+        return -2;
+    }
+
+    /* the paths are used where they are in the manifest */
+    ptr = manifest;
+    end = manifest + manifest_size;
+    for (i = 0; i < count; i++) {
+        if (end - ptr < sizeof(struct sync_wire_entry) + sizeof(uint16_t))
+            break;
+        memcpy(&peer[i].e, ptr, sizeof(struct sync_wire_entry));
+        ptr += sizeof(struct sync_wire_entry);
+        memcpy(&len, ptr, sizeof(len));
+        ptr += sizeof(uint16_t);
+
+        if (end - ptr < len + 1 || ptr[len] != '\0' || strlen(ptr) != len)
+            break;
+        peer[i].path = ptr;
+        ptr += len + 1;
+    }
+
+    if (i < count) {
+        printf("\nInvalid sync request received from peer\n");
+        FREE(manifest);
+        FREE(peer);
+        return -2;
+    }
+    qsort(peer, count, sizeof(struct sync_peer_entry), sync_peer_cmp);
+
+    /* the peer can't have sent it while we were busy with it */
+    if (node->ctx.status != idle) {
+        printf("\nSync request of %s  :  %d while a transfer with it is in progress\n",
+                node->hostname, node->port);
+        FREE(manifest);
+        FREE(peer);
+        return sync_reject(node);
+    }
+
+    j = sync_job_new(node, dir, 1);
+    j->flags = flags;
+    j->manifest = manifest;
+    j->peer = peer;
+    j->npeer = count;
+
+    /* only single shared files are served with sharedonly */
+    j->loaded = !shared_only && sync_manifest_load(&j->m, dir) >= 0;
+    if (!j->loaded) {
+        printf("No directory '%s' to sync with %s  :  %d\n", dir, node->hostname, node->port);
+        reset_transfer(node);
+        return sync_reject(node);
+    }
+
+    /* answered at once if the digests needed are all cached */
+    if (sync_hash_step(j))
+        return sync_answer(node);
+    return 0;
+}
+
+/*
+ * Function to drop the sync being prepared with a peer, if any (once
+ * the files are hashed, or when the connection is going away)
+ */
+void sync_stop(struct connected_peer_node *node)
+{
+    struct sync_job *j = node->ctx.sync;
+
+    if (!j)
+        return;
+
+    if (j->fd >= 0)
+        close(j->fd);
+    EVP_MD_CTX_free(j->md);
+    if (j->loaded)
+        sync_manifest_free(&j->m);
+    FREE(j->manifest);
+    FREE(j->peer);
+    FREE(j);
+    node->ctx.sync = NULL;
+    sync_jobs--;
+}
+
+/*
+ * Function to get select() to return at once while the files of a sync
+ * are being hashed
+ */
+void sync_next_timeout(struct timeval *tv)
+{
+    if (sync_jobs)
+        timerclear(tv);
+}
+
+/*
+ * Function called from the event loop to hash the next part of the files
+ * of the syncs being prepared, and to send the requests, or the answers,
+ * whose files are hashed
+ */
+void sync_periodic()
+{
+    struct list_node *cur, *next;
+    struct connected_peer_node *node;
+
+    if (!sync_jobs)
+        return;
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = next) {
+        next = cur->next;
+        node = (struct connected_peer_node *)(cur->container);
+        if (!node->ctx.sync || !sync_hash_step(node->ctx.sync))
+            continue;
+
+        /* errors already printed */
+        if (node->ctx.sync->answer) {
+            sync_answer(node);
+        } else {
+            sync_send_request(node);
+            print_prompt();
+        }
+    }
+}
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <netinet/tcp.h>
+
+#include "proj1.h"
+
+/* Table of the socket tuning profiles (see struct tcp_profile) */
+static struct tcp_profile tcp_profiles[] = {
+    { "auto",   0,          0,          0,          1,
+        "kernel autotuned buffers" },
+    { "bulk",   4 << 20,    4 << 20,    256 << 10,  1,
+        "large buffers for long transfers on fast links" },
+    { "lowmem", 64 << 10,   64 << 10,   32 << 10,   1,
+        "small buffers, bounds the memory of each connection" },
+};
+
+#define NUM_TCP_PROFILES (sizeof(tcp_profiles) / sizeof(tcp_profiles[0]))
+
+/******* Global values *******/
+static int tcp_cur_profile = 0;             /* profile applied to new connections */
+static char tcp_cc[TCP_CC_NAME_MAX] = "";   /* congestion control, empty for the system default */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to get a profile by its number (NULL if out of range)
+ */
+struct tcp_profile *tcp_profile_get(int i)
+{
+    if (i < 0 || i >= NUM_TCP_PROFILES)
+        return NULL;
+    return &tcp_profiles[i];
+}
+
+/*
+ * Function to apply a profile, and a congestion control algorithm if cc
+ * is not empty, to a socket.
+ * The buffer sizes have to be set before connect()/listen() to be taken
+ * into account in the TCP window scale.
+ *
+ * returns 0 on success, -1 if an option could not be set (the error is
+ * printed, the socket can still be used)
+ */
+int tcp_apply_profile(int fd, struct tcp_profile *p, const char *cc)
+{
+    int rc = 0;
+
+    if (p->sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &p->sndbuf, sizeof(p->sndbuf)) < 0) {
+        printf("Error setting SO_SNDBUF: %s\n", strerror(errno));
+        rc = -1;
+    }
+
+    if (p->rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &p->rcvbuf, sizeof(p->rcvbuf)) < 0) {
+        printf("Error setting SO_RCVBUF: %s\n", strerror(errno));
+        rc = -1;
+    }
+
+    /* the socket is reported writable only when few bytes are waiting
+     * to be sent, so frames are queued in the kernel just in time */
+    if (p->notsent_lowat && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                &p->notsent_lowat, sizeof(p->notsent_lowat)) < 0) {
+        printf("Error setting TCP_NOTSENT_LOWAT: %s\n", strerror(errno));
+        rc = -1;
+    }
+
+    /* the control messages are small and must not wait for more data,
+     * the file data is sent in whole frames anyway */
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &p->nodelay, sizeof(p->nodelay)) < 0) {
+        printf("Error setting TCP_NODELAY: %s\n", strerror(errno));
+        rc = -1;
+    }
+
+    if (cc && *cc && setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, cc, strlen(cc)) < 0) {
+        printf("Error setting congestion control '%s': %s\n", cc, strerror(errno));
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/*
+ * Function to apply the current profile to a socket to a peer
+ *
+ * returns 0 on success, -1 if an option could not be set
+ */
+int tcp_tune_socket(int fd)
+{
+    return tcp_apply_profile(fd, &tcp_profiles[tcp_cur_profile], tcp_cc);
+}
+
+/*
+ * Function to display the profiles and the congestion control in use
+ */
+void print_tcp_profiles()
+{
+    struct tcp_profile *p;
+    char avail[256];
+    FILE *f;
+    int i;
+
+    printf("Profile\tSndbuf\t\tRcvbuf\t\tNotsent lowat\tDescription\n");
+    printf("-----------------------------------------------------------------------\n");
+    for (i = 0; i < NUM_TCP_PROFILES; i++) {
+        p = &tcp_profiles[i];
+        printf("%s%s\t%d\t\t%d\t\t%d\t\t%s\n", i == tcp_cur_profile ? "*" : "",
+                p->name, p->sndbuf, p->rcvbuf, p->notsent_lowat, p->help);
+    }
+
+    printf("Congestion control: %s\n", *tcp_cc ? tcp_cc : "system default");
+
+    f = fopen("/proc/sys/net/ipv4/tcp_available_congestion_control", "r");
+    if (f) {
+        if (fgets(avail, sizeof(avail), f))
+            printf("Available: %s", avail);
+        fclose(f);
+    }
+}
+
+/*
+ * Function to change the profile (TCP <profile>) or the congestion
+ * control (TCP cc <algorithm>|default) used for the new connections.
+ * The listening socket is updated too, as the accepted connections get
+ * their receive buffer from it. Once set, the kernel does not autotune
+ * its buffers any more, so going back to "auto" only affects the
+ * connections we open.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int set_tcp_profile(char *name, char *cc)
+{
+    char old_cc[TCP_CC_NAME_MAX], sys_cc[TCP_CC_NAME_MAX];
+    FILE *f;
+    int i;
+
+    if (cc) {
+        if (strlen(cc) >= TCP_CC_NAME_MAX) {
+            printf("TCP: invalid congestion control '%s'\n", cc);
+            return -1;
+        }
+
+        strcpy(old_cc, tcp_cc);
+        if (strcasecmp(cc, "default") == 0) {
+            tcp_cc[0] = '\0';
+            /* put the system default back on the listening socket */
+            f = fopen("/proc/sys/net/ipv4/tcp_congestion_control", "r");
+            if (f) {
+                if (fgets(sys_cc, sizeof(sys_cc), f)) {
+                    sys_cc[strcspn(sys_cc, "\n")] = '\0';
+                    setsockopt(listen_fd, IPPROTO_TCP, TCP_CONGESTION, sys_cc, strlen(sys_cc));
+                }
+                fclose(f);
+            }
+        } else {
+            strcpy(tcp_cc, cc);
+        }
+
+        /* the accepted connections inherit it from the listening socket,
+         * which also checks that the kernel knows it */
+        if (*tcp_cc && tcp_apply_profile(listen_fd, &tcp_profiles[tcp_cur_profile], tcp_cc) < 0) {
+            strcpy(tcp_cc, old_cc);
+            return -1;
+        }
+        printf("Congestion control of new connections: %s\n", *tcp_cc ? tcp_cc : "system default");
+        return 0;
+    }
+
+    for (i = 0; i < NUM_TCP_PROFILES; i++) {
+        if (strcasecmp(tcp_profiles[i].name, name) == 0)
+            break;
+    }
+
+    if (i == NUM_TCP_PROFILES) {
+        printf("TCP: Unknown profile '%s'\n", name);
+        return -1;
+    }
+
+    tcp_cur_profile = i;
+    tcp_tune_socket(listen_fd);
+    printf("Profile of new connections: %s\n", tcp_profiles[i].name);
+    return 0;
+}
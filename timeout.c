@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <inttypes.h>
+
+#include "proj1.h"
+#include "list.h"
+
+/* Number of keepalive intervals without hearing from an idle peer,
+ * before it is considered gone */
+#define KEEPALIVE_MISSES    3
+
+/******* Global values *******/
+int transfer_timeout = 60;      /* seconds without progress before a transfer is reaped */
+int handshake_timeout = 30;     /* seconds to wait for the answer to a request */
+int keepalive_interval = 15;    /* seconds between probes on an idle connection (0: none) */
+
+static struct timer heartbeat_timer;  /* sends the heartbeats to the server */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to send a keepalive probe to an idle peer
+ * Message format:
+ * MSG_KEEPALIVE
+ *
+ * The probe is only sent when we are idle with the peer, so it can never
+ * end up in the middle of the data stream of a transfer.
+ */
+static void send_keepalive(struct connected_peer_node *node)
+{
+    uint16_t msg_type = MSG_KEEPALIVE;
+
+    if (send(node->fd, &msg_type, sizeof(msg_type), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+            errno != EAGAIN && errno != EWOULDBLOCK) {
+        printf("\nError sending keepalive to %s  :  %d: %s\n", node->hostname,
+                node->port, strerror(errno));
+        return;
+    }
+    node->last_tx = timer_now_ms();
+}
+
+/*
+ * Function called when the timer of a connection expires.
+ * Depending on the state of the connection it
+ *  - reaps a transfer which made no progress for transfer_timeout seconds,
+ *  - gives up on a request not answered within handshake_timeout seconds,
+ *  - sends keepalive probes on an idle connection, and closes it if
+ *    nothing was heard from the peer for KEEPALIVE_MISSES intervals.
+ * The connection is closed in the first two cases, as there is no way to
+ * know where the peer is in the protocol. The transfer is requeued (if it
+ * was a queued download) and its slot goes back to the download queue.
+ * The timer is then armed for the next deadline.
+ */
+static void peer_timeout(void *arg)
+{
+    struct connected_peer_node *node = arg;
+    uint64_t now = timer_now_ms(), last, limit, next;
+
+    switch (node->ctx.status) {
+        case idle:
+            if (!keepalive_interval)
+                return;
+
+            limit = keepalive_interval * 1000ULL;
+            if (now - node->last_rx >= KEEPALIVE_MISSES * limit) {
+                printf("\nPeer %s  :  %d not responding, closing connection\n",
+                        node->hostname, node->port);
+                close_peer(node);
+                print_prompt();
+                return;
+            }
+
+            if (now - node->last_tx >= limit)
+                send_keepalive(node);
+
+            next = node->last_tx + limit;
+            if (node->last_rx + KEEPALIVE_MISSES * limit < next)
+                next = node->last_rx + KEEPALIVE_MISSES * limit;
+            timer_add(&node->timer, next > now ? next - now : 0);
+            return;
+
+        case sending:
+        case relaying:
+            /* held back by our own rate limits or by the slowest peer
+             * of a fan-out: not a stall of this peer */
+            if (node->ctx.throttled || node->ctx.fan_waiting)
+                node->last_tx = now;
+            last = node->last_tx;
+            limit = transfer_timeout * 1000ULL;
+            break;
+
+        case receiving:
+        case cancelling:
+            last = node->last_rx;
+            limit = transfer_timeout * 1000ULL;
+            /* a file handed over by a peer on the same host comes at
+             * once after the answer */
+            if ((node->ctx.flags & XFER_CAP_FDPASS) && !node->ctx.copy)
+                limit = handshake_timeout * 1000ULL;
+            break;
+
+        case striping:
+            /* waiting for the other parts of a striped download, which
+             * have their own timeouts */
+            timer_add(&node->timer, transfer_timeout * 1000ULL);
+            return;
+
+        case hashing:
+            /* nothing is sent until the files of the sync are hashed (see
+             * sync_periodic()): probes tell the peer, idle or waiting for
+             * the answer, that we are still there */
+            limit = handshake_timeout * 1000ULL / 3;
+            if (keepalive_interval && keepalive_interval * 1000ULL < limit)
+                limit = keepalive_interval * 1000ULL;
+            if (now - node->last_tx >= limit)
+                send_keepalive(node);
+            timer_add(&node->timer, limit);
+            return;
+
+        case requesting:
+            /* a peer hashing the files of a sync before answering sends
+             * probes meanwhile */
+            last = node->last_tx > node->last_rx ? node->last_tx : node->last_rx;
+            limit = handshake_timeout * 1000ULL;
+            break;
+
+        default:
+            /* offering */
+            last = node->last_tx;
+            limit = handshake_timeout * 1000ULL;
+            break;
+    }
+
+    if (now - last >= limit) {
+        if (node->ctx.status == requesting || node->ctx.status == offering)
+            printf("\nNo answer from %s  :  %d for %" PRIu64 " seconds, closing connection\n",
+                    node->hostname, node->port, limit / 1000);
+        else
+            printf("\nTransfer of '%s' with %s  :  %d stalled for %" PRIu64
+                    " seconds, closing connection\n", node->ctx.file_name,
+                    node->hostname, node->port, limit / 1000);
+        close_peer(node);
+        print_prompt();
+        return;
+    }
+
+    timer_add(&node->timer, last + limit - now);
+}
+
+/*
+ * Function to (re)start the timeouts of a connection: called when the
+ * connection is set up and when a transfer or a request starts, so the
+ * time spent idle before does not count against it
+ */
+void peer_timer_restart(struct connected_peer_node *node)
+{
+    if (!node->timer.fn)
+        timer_init(&node->timer, peer_timeout, node);
+
+    node->last_rx = node->last_tx = timer_now_ms();
+    timer_add(&node->timer, 0);
+}
+
+/*
+ * Function to restart the timeouts of all the connections to peers
+ * (a timeout setting was changed)
+ */
+void peer_timer_restart_all()
+{
+    struct list_node *cur;
+    struct connected_peer_node *node;
+
+    for (cur = connected_peer_list_head; cur != NULL; cur = cur->next) {
+        node = (struct connected_peer_node *)(cur->container);
+        if (node->fd != server_fd)
+            peer_timer_restart(node);
+    }
+}
+
+/*
+ * Function to send a heartbeat to the server, so that it keeps
+ * advertising us to the other clients
+ * Message format:
+ * MSG_HEARTBEAT
+ */
+static void send_heartbeat(void *arg)
+{
+    uint16_t msg_type = MSG_HEARTBEAT;
+
+    /* stop once the connection to the server is gone */
+    if (!registered)
+        return;
+
+    if (send(server_fd, &msg_type, sizeof(msg_type), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+            errno != EAGAIN && errno != EWOULDBLOCK) {
+        printf("\nError sending heartbeat to server: %s\n", strerror(errno));
+    }
+
+    timer_add(&heartbeat_timer, HEARTBEAT_INTERVAL * 1000);
+}
+
+/*
+ * Function to start sending heartbeats to the server (once registered)
+ */
+void heartbeat_start()
+{
+    if (!heartbeat_timer.fn)
+        timer_init(&heartbeat_timer, send_heartbeat, NULL);
+
+    timer_add(&heartbeat_timer, HEARTBEAT_INTERVAL * 1000);
+}
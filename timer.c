@@ -0,0 +1,178 @@
+#include <time.h>
+
+#include "proj1.h"
+
+/* Resolution of the timers, in milliseconds */
+#define TIMER_TICK_MS       100
+/* Number of slots of the wheel (one revolution is ~51 seconds).
+ * Timers further away stay in their slot for more than one revolution */
+#define TIMER_WHEEL_SLOTS   512
+
+/******* Global values *******/
+static struct timer *wheel[TIMER_WHEEL_SLOTS];
+static uint64_t wheel_tick = 0;     /* last tick whose timers have been run */
+static int wheel_count = 0;         /* number of timers armed */
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to get the current time in milliseconds (monotonic clock,
+ * so the timers are not affected by changes of the wall clock)
+ */
+uint64_t timer_now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Function to get the current tick of the wheel
+ */
+static uint64_t timer_now_tick()
+{
+    return timer_now_ms() / TIMER_TICK_MS;
+}
+
+/*
+ * Function to insert a timer in a list (a slot of the wheel, or the
+ * list of expired timers)
+ */
+static void timer_link(struct timer **head, struct timer *t)
+{
+    t->next = *head;
+    if (*head)
+        (*head)->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+/*
+ * Function to initialise a timer, which calls fn(arg) when it expires
+ */
+void timer_init(struct timer *t, void (*fn)(void *arg), void *arg)
+{
+    bzero(t, sizeof(struct timer));
+    t->fn = fn;
+    t->arg = arg;
+}
+
+/*
+ * Function to check if a timer is armed
+ */
+int timer_pending(struct timer *t)
+{
+    return t->pprev != NULL;
+}
+
+/*
+ * Function to disarm a timer (nothing is done if it is not armed)
+ */
+void timer_del(struct timer *t)
+{
+    if (!timer_pending(t))
+        return;
+
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    wheel_count--;
+}
+
+/*
+ * Function to arm a timer to expire in ms milliseconds
+ * (a timer already armed is moved)
+ */
+void timer_add(struct timer *t, uint64_t ms)
+{
+    if (!wheel_tick)
+        wheel_tick = timer_now_tick();
+
+    timer_del(t);
+
+    /* round up, so that a timer never expires early */
+    t->expires = timer_now_tick() + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (t->expires <= wheel_tick)
+        t->expires = wheel_tick + 1;
+
+    timer_link(&wheel[t->expires % TIMER_WHEEL_SLOTS], t);
+    wheel_count++;
+}
+
+/*
+ * Function called from the event loop to run the timers which expired.
+ * The expired timers are moved to a separate list first, so that a
+ * callback can add or delete any timer (including the other expired ones)
+ */
+void timer_run()
+{
+    struct timer *expired = NULL, *t, *next;
+    uint64_t now = timer_now_tick();
+
+    if (!wheel_count) {
+        wheel_tick = now;
+        return;
+    }
+
+    /* no need to look at a slot more than once */
+    if (now - wheel_tick > TIMER_WHEEL_SLOTS)
+        wheel_tick = now - TIMER_WHEEL_SLOTS;
+
+    while (wheel_tick < now) {
+        wheel_tick++;
+        for (t = wheel[wheel_tick % TIMER_WHEEL_SLOTS]; t != NULL; t = next) {
+            next = t->next;
+            if (t->expires > now)
+                continue;
+            timer_del(t);
+            timer_link(&expired, t);
+            wheel_count++;
+        }
+    }
+
+    while ((t = expired) != NULL) {
+        timer_del(t);
+        t->fn(t->arg);
+    }
+}
+
+/*
+ * Function to shorten the select timeout tv to the expiry of the
+ * first timer
+ */
+void timer_next_timeout(struct timeval *tv)
+{
+    struct timer *t;
+    uint64_t tick, ms;
+    int i;
+
+    if (!wheel_count)
+        return;
+
+    /* the first slot holding a timer due in this revolution */
+    for (i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+        tick = wheel_tick + i;
+        for (t = wheel[tick % TIMER_WHEEL_SLOTS]; t != NULL; t = t->next) {
+            if (t->expires <= tick)
+                break;
+        }
+        if (t)
+            break;
+    }
+
+    /* time until that tick */
+    ms = tick * TIMER_TICK_MS;
+    if (ms <= timer_now_ms())
+        ms = 0;
+    else
+        ms -= timer_now_ms();
+
+    if (ms < tv->tv_sec * 1000L + tv->tv_usec / 1000) {
+        tv->tv_sec = ms / 1000;
+        tv->tv_usec = (ms % 1000) * 1000;
+    }
+}
@@ -0,0 +1,699 @@
+#define _GNU_SOURCE    /* for fallocate(), sync_file_range() and SEEK_DATA */
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "proj1.h"
+
+/* Number of blocks sent uncompressed after a block turned out to be
+ * incompressible, before the entropy is sampled again */
+#define ZSKIP_BLOCKS 16
+
+/* Bytes sent between two drops of the sent data from the page cache */
+#define DROP_BATCH (4 << 20)
+
+/******* Global values *******/
+int write_behind_mb = 8;    /* MB written to a received file between two flushes (0: none) */
+int readahead_mb = 4;       /* MB of a file being sent read ahead of the send cursor (0: none) */
+int drop_behind_mb = 256;   /* size from which a sent file is dropped from the cache (0: never) */
+int sparse_enabled = 1;     /* send and receive the holes of sparse files as such */
+
+/************ Function definitions **************/
+
+/*
+ * Function to get the transfer capabilities (XFER_CAP_*) supported
+ * by this process with the current settings
+ */
+uint32_t local_xfer_caps()
+{
+    uint32_t caps = 0;
+
+    if (compress_enabled)
+        caps |= XFER_CAP_COMPRESS;
+
+    if (sparse_enabled)
+        caps |= XFER_CAP_SPARSE;
+
+    return caps;
+}
+
+/*
+ * Function to allocate the buffer of the frames sent in a transfer
+ * context, if not done yet
+ */
+static void xfer_tx_alloc(struct file_transfer_context *ctx)
+{
+    if (!ctx->tx_buf) {
+        ctx->tx_buf = (char *) malloc(sizeof(struct xfer_frame_hdr) +
+                compress_bound(XFER_BLOCK_SIZE));
+        if (!ctx->tx_buf) {
+            printf("\nError in malloc\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Function to prepare a frame for a block of file data in the transfer
+ * context. If compression was negotiated for the transfer, the block is
+ * compressed unless it looks incompressible.
+ * The frame is sent with xfer_flush()
+ */
+void xfer_queue_block(struct connected_peer_node *node, char *data, int len)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    struct xfer_frame_hdr *hdr;
+    char *payload;
+    int zlen = -1;
+
+    xfer_tx_alloc(ctx);
+    hdr = (struct xfer_frame_hdr *)ctx->tx_buf;
+    payload = ctx->tx_buf + sizeof(struct xfer_frame_hdr);
+
+    if ((ctx->flags & XFER_CAP_COMPRESS) && len > 0) {
+        if (ctx->zskip > 0) {
+            /* recent blocks were incompressible, don't waste CPU */
+            ctx->zskip--;
+        } else if (!block_is_compressible((unsigned char *)data, len)) {
+            ctx->zskip = ZSKIP_BLOCKS;
+        } else {
+            zlen = compress_block(data, len, payload, compress_bound(XFER_BLOCK_SIZE));
+            if (zlen < 0)
+                ctx->zskip = ZSKIP_BLOCKS;
+        }
+    }
+
+    bzero(hdr, sizeof(*hdr));
+    hdr->raw_len = len;
+
+    if (zlen > 0) {
+        hdr->type = XFER_FRAME_ZDATA;
+        hdr->wire_len = zlen;
+    } else {
+        hdr->type = XFER_FRAME_DATA;
+        hdr->wire_len = len;
+        memcpy(payload, data, len);
+    }
+
+    ctx->tx_data = payload;
+    ctx->tx_len = sizeof(*hdr) + hdr->wire_len;
+    ctx->tx_off = 0;
+
+    /* the frame counts against the rate limits */
+    rate_charge(node, ctx->tx_len);
+}
+
+/*
+ * Function to prepare a frame for a block of file data which stays in
+ * memory until the frame is sent (a window of the mapped file): only
+ * the header is built, the payload is sent from where it is.
+ * A block to be compressed is framed by xfer_queue_block().
+ */
+void xfer_queue_mapped(struct connected_peer_node *node, char *data, int len)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    struct xfer_frame_hdr *hdr;
+
+    if (ctx->flags & XFER_CAP_COMPRESS) {
+        xfer_queue_block(node, data, len);
+        return;
+    }
+
+    xfer_tx_alloc(ctx);
+    hdr = (struct xfer_frame_hdr *)ctx->tx_buf;
+    bzero(hdr, sizeof(*hdr));
+    hdr->type = XFER_FRAME_DATA;
+    hdr->raw_len = len;
+    hdr->wire_len = len;
+
+    ctx->tx_data = data;
+    ctx->tx_len = sizeof(*hdr) + len;
+    ctx->tx_off = 0;
+
+    rate_charge(node, ctx->tx_len);
+}
+
+/*
+ * Function to prepare a frame received from another peer, to be sent on
+ * as is (relay chain): only the header is copied, the payload is sent
+ * from where it is.
+ */
+void xfer_queue_wire(struct connected_peer_node *node, struct xfer_frame_hdr *hdr,
+        char *payload)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+
+    xfer_tx_alloc(ctx);
+    memcpy(ctx->tx_buf, hdr, sizeof(*hdr));
+
+    ctx->tx_data = payload;
+    ctx->tx_len = sizeof(*hdr) + hdr->wire_len;
+    ctx->tx_off = 0;
+
+    rate_charge(node, ctx->tx_len);
+}
+
+/*
+ * Function to prepare a frame telling the peer that the next len bytes
+ * of the file are a hole (nothing is sent for them)
+ */
+void xfer_queue_hole(struct connected_peer_node *node, int len)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    struct xfer_frame_hdr *hdr;
+
+    xfer_tx_alloc(ctx);
+    hdr = (struct xfer_frame_hdr *)ctx->tx_buf;
+    bzero(hdr, sizeof(*hdr));
+    hdr->type = XFER_FRAME_HOLE;
+    hdr->raw_len = len;
+
+    ctx->tx_data = NULL;
+    ctx->tx_len = sizeof(*hdr);
+    ctx->tx_off = 0;
+
+    rate_charge(node, ctx->tx_len);
+}
+
+/*
+ * Function to prepare a frame carrying len bytes of payload which are
+ * not file data (e.g. the start of the next file of a batch)
+ */
+void xfer_queue_frame(struct connected_peer_node *node, int type, char *payload, int len,
+        uint64_t raw_len)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    struct xfer_frame_hdr *hdr;
+
+    xfer_tx_alloc(ctx);
+    hdr = (struct xfer_frame_hdr *)ctx->tx_buf;
+    bzero(hdr, sizeof(*hdr));
+    hdr->type = type;
+    hdr->wire_len = len;
+    hdr->raw_len = raw_len;
+
+    ctx->tx_data = ctx->tx_buf + sizeof(*hdr);
+    memcpy(ctx->tx_data, payload, len);
+    ctx->tx_len = sizeof(*hdr) + len;
+    ctx->tx_off = 0;
+
+    rate_charge(node, ctx->tx_len);
+}
+
+/*
+ * Function to find the holes of a sparse file being sent, with
+ * SEEK_DATA/SEEK_HOLE. Only whole blocks of XFER_BLOCK_SIZE are sent as
+ * holes, the blocks partly in a hole are sent as data, so the data is
+ * still sent in whole blocks. The end of the data extent found is kept
+ * in ctx->data_end, to look again only after it.
+ * len is the size of the next block, reduced if the data extent ends
+ * before.
+ *
+ * returns the size of the hole at ctx->offset, 0 if there is data
+ */
+int xfer_find_hole(struct file_transfer_context *ctx, int *len)
+{
+    uint64_t end = ctx->offset + ctx->bytes_remaining;
+    off_t data, hole;
+
+    if (ctx->offset >= ctx->data_end) {
+        data = lseek(ctx->file_fd, ctx->offset, SEEK_DATA);
+        if (data < 0) {
+            /* ENXIO: a hole up to the end of the file, otherwise the
+             * filesystem can't tell: all data */
+            data = (errno == ENXIO) ? end : ctx->offset;
+        }
+
+        if (data > end)
+            data = end;
+
+        /* the hole, up to the block where the data starts */
+        hole = data - data % XFER_BLOCK_SIZE;
+        if (hole > ctx->offset)
+            return (hole - ctx->offset < XFER_HOLE_MAX) ? hole - ctx->offset : XFER_HOLE_MAX;
+
+        /* the data starts in this block: find where it ends */
+        hole = lseek(ctx->file_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > end)
+            hole = end;
+        hole += (XFER_BLOCK_SIZE - hole % XFER_BLOCK_SIZE) % XFER_BLOCK_SIZE;
+        ctx->data_end = hole > ctx->offset ? hole : ctx->offset + XFER_BLOCK_SIZE;
+    }
+
+    if (*len > ctx->data_end - ctx->offset)
+        *len = ctx->data_end - ctx->offset;
+    return 0;
+}
+
+/*
+ * Function to send the rest of the queued frame, its header from tx_buf
+ * and its payload from tx_data, in a single call
+ *
+ * returns the number of bytes sent, -1 on failure (errno is set)
+ */
+static int xfer_send_frame(struct connected_peer_node *node, int flags)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    int hdr_len = sizeof(struct xfer_frame_hdr);
+    struct iovec iov[2];
+    struct msghdr msg;
+    int n = 0;
+
+    if (ctx->tx_off < hdr_len) {
+        iov[n].iov_base = ctx->tx_buf + ctx->tx_off;
+        iov[n++].iov_len = hdr_len - ctx->tx_off;
+    }
+    if (ctx->tx_len > hdr_len) {
+        iov[n].iov_base = ctx->tx_data + (ctx->tx_off > hdr_len ? ctx->tx_off - hdr_len : 0);
+        iov[n++].iov_len = ctx->tx_len - (ctx->tx_off > hdr_len ? ctx->tx_off : hdr_len);
+    }
+
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    return sendmsg(node->fd, &msg, flags | MSG_NOSIGNAL);
+}
+
+/*
+ * Function to send (as much as possible of) the queued frame without
+ * blocking
+ *
+ * returns 1 if the frame has been completely sent,
+ *         0 if the socket is full and the rest has to be sent later,
+ *        -1 on failure
+ */
+int xfer_flush(struct connected_peer_node *node)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    int len = 0;
+
+    while (ctx->tx_off < ctx->tx_len) {
+        len = xfer_send_frame(node, MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            printf("Error sending data to peer: %s\n", strerror(errno));
+            return -1;
+        }
+        ctx->tx_off += len;
+    }
+
+    return 1;
+}
+
+/*
+ * Function to check if the frame queued in the transfer context still
+ * has bytes to be sent
+ */
+int xfer_tx_pending(struct file_transfer_context *ctx)
+{
+    return ctx->tx_off < ctx->tx_len;
+}
+
+/*
+ * Function to send the rest of the queued frame, blocking until it is sent
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int xfer_send_queued(struct connected_peer_node *node)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    int sent = 0;
+
+    while (ctx->tx_off < ctx->tx_len) {
+        sent = xfer_send_frame(node, 0);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("Error sending data to peer: %s\n", strerror(errno));
+            return -1;
+        }
+        ctx->tx_off += sent;
+    }
+
+    return 0;
+}
+
+/*
+ * Function to tell the receiver that the transfer is stopped, so that
+ * the connection can be used for the next one.
+ * The frame partly sent (if any) is completed first, as the receiver
+ * can only find the cancel frame on a frame boundary.
+ *
+ * returns 0 on success, -1 on failure
+ */
+int xfer_send_cancel(struct connected_peer_node *node)
+{
+    struct xfer_frame_hdr hdr;
+
+    if (xfer_send_queued(node) < 0)
+        return -1;
+
+    bzero(&hdr, sizeof(hdr));
+    hdr.type = XFER_FRAME_CANCEL;
+
+    if (send(node->fd, &hdr, sizeof(hdr), MSG_NOSIGNAL) < 0) {
+        printf("Error sending data to peer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Function to receive (a part of) a frame from a peer.
+ * The partially received frame is kept in the transfer context, so this
+ * can be called every time the socket becomes readable.
+ *
+ * returns 1 if a complete frame has been received,
+ *         0 if more data is needed,
+ *        -2 if the connection is closed,
+ *        -1 on other failures
+ */
+int xfer_recv_frame(struct connected_peer_node *node)
+{
+    struct file_transfer_context *ctx = &node->ctx;
+    int len = 0;
+
+    /* First get the complete header */
+    if (ctx->rx_hdr_len < sizeof(ctx->rx_hdr)) {
+        len = recv(node->fd, (char *)&ctx->rx_hdr + ctx->rx_hdr_len,
+                sizeof(ctx->rx_hdr) - ctx->rx_hdr_len, MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            printf("Error receiving data from peer: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (len == 0)
+            return -2;
+
+        ctx->rx_hdr_len += len;
+        if (ctx->rx_hdr_len < sizeof(ctx->rx_hdr))
+            return 0;
+
+        /* Validate the header before trusting the lengths */
+        if ((ctx->rx_hdr.type != XFER_FRAME_DATA &&
+                    ctx->rx_hdr.type != XFER_FRAME_ZDATA &&
+                    ctx->rx_hdr.type != XFER_FRAME_CANCEL &&
+                    ctx->rx_hdr.type != XFER_FRAME_HOLE &&
+                    ((ctx->rx_hdr.type != XFER_FRAME_FILE &&
+                      ctx->rx_hdr.type != XFER_FRAME_END) || !ctx->batch)) ||
+                ((ctx->rx_hdr.type == XFER_FRAME_CANCEL ||
+                  ctx->rx_hdr.type == XFER_FRAME_END) && ctx->rx_hdr.wire_len) ||
+                (ctx->rx_hdr.type == XFER_FRAME_FILE && (ctx->rx_hdr.wire_len !=
+                    ctx->rx_hdr.raw_len || ctx->rx_hdr.wire_len <= sizeof(struct xfer_file_hdr))) ||
+                (ctx->rx_hdr.type == XFER_FRAME_HOLE && (ctx->rx_hdr.wire_len ||
+                    !ctx->rx_hdr.raw_len || ctx->rx_hdr.raw_len > XFER_HOLE_MAX)) ||
+                ctx->rx_hdr.wire_len > compress_bound(XFER_BLOCK_SIZE) ||
+                (ctx->rx_hdr.type != XFER_FRAME_HOLE && ctx->rx_hdr.type != XFER_FRAME_END &&
+                    ctx->rx_hdr.raw_len > XFER_BLOCK_SIZE)) {
+            printf("Invalid frame received from peer\n");
+            return -1;
+        }
+
+        /* nothing is written past the range being received, not even
+         * into the mapped file before the frame is complete */
+        if ((ctx->rx_hdr.type == XFER_FRAME_DATA || ctx->rx_hdr.type == XFER_FRAME_ZDATA) &&
+                ctx->status != cancelling && ctx->rx_hdr.raw_len > ctx->bytes_remaining) {
+            printf("Corrupt frame received from peer\n");
+            return -1;
+        }
+        ctx->rx_len = 0;
+
+        if (!ctx->rx_buf) {
+            ctx->rx_buf = (char *) malloc(compress_bound(XFER_BLOCK_SIZE));
+            if (!ctx->rx_buf) {
+                printf("\nError in malloc\n");
+                exit(1);
+            }
+        }
+
+        /* raw data goes straight into the mapped file, unless it is
+         * dropped or forwarded from rx_buf to the next hop of a relay */
+        ctx->rx_dst = NULL;
+        if (ctx->map.write && ctx->rx_hdr.type == XFER_FRAME_DATA &&
+                ctx->status == receiving && !ctx->relay_id)
+            ctx->rx_dst = map_window(ctx, ctx->offset, ctx->rx_hdr.wire_len);
+        if (!ctx->rx_dst)
+            ctx->rx_dst = ctx->rx_buf;
+    }
+
+    if (ctx->rx_len == ctx->rx_hdr.wire_len)
+        return 1;
+
+    /* Now the payload, as much of it as is available */
+    len = recv(node->fd, ctx->rx_dst + ctx->rx_len,
+            ctx->rx_hdr.wire_len - ctx->rx_len, MSG_DONTWAIT);
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        printf("Error receiving data from peer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (len == 0)
+        return -2;
+
+    ctx->rx_len += len;
+    return (ctx->rx_len == ctx->rx_hdr.wire_len);
+}
+
+/*
+ * Function to leave a hole of len bytes at ctx->offset of a file being
+ * received: the file is extended over the hole, and the space reserved
+ * there (see xfer_prealloc()) is given back. The receive buffers of an
+ * O_DIRECT transfer are written out first if this is the end of the
+ * file.
+ *
+ * returns 0 on success, -1 on failure
+ */
+static int xfer_write_hole(struct file_transfer_context *ctx, uint64_t len)
+{
+    uint64_t end = ctx->offset + len;
+    struct stat st;
+
+    if (len >= ctx->bytes_remaining && ctx->dio && direct_finish(ctx) < 0)
+        return -1;
+
+    /* nothing is freed past the end of the file */
+    if (fstat(ctx->file_fd, &st) < 0 ||
+            (st.st_size < end && ftruncate(ctx->file_fd, end) < 0)) {
+        printf("Error writing to file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* if the filesystem can't, the hole is only not sparse */
+    fallocate(ctx->file_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ctx->offset, len);
+    return 0;
+}
+
+/*
+ * Function to write the completely received frame to the file,
+ * decompressing it if needed
+ *
+ * returns the number of bytes of file data written, -1 on failure
+ */
+int xfer_write_frame(struct connected_peer_node *node)
+{
+    static char *zbuf = NULL;   /* buffer for the decompressed block */
+    struct file_transfer_context *ctx = &node->ctx;
+    char *data = ctx->rx_buf;
+    char *dst = NULL;
+    int len = ctx->rx_hdr.wire_len;
+
+    if (ctx->status == cancelling) {
+        /* the download was aborted: the data still in flight is dropped */
+        len = ctx->rx_hdr.raw_len;
+        goto done;
+    }
+
+    if (ctx->rx_hdr.type == XFER_FRAME_HOLE) {
+        if (!(ctx->flags & XFER_CAP_SPARSE)) {
+            printf("Hole received without negotiation\n");
+            return -1;
+        }
+
+        len = ctx->rx_hdr.raw_len;
+        if (len > ctx->bytes_remaining || xfer_write_hole(ctx, len) < 0) {
+            printf("Corrupt frame received from peer\n");
+            return -1;
+        }
+        ctx->offset += len;
+        goto done;
+    }
+
+    if (ctx->rx_hdr.type == XFER_FRAME_ZDATA) {
+        if (!(ctx->flags & XFER_CAP_COMPRESS)) {
+            printf("Compressed frame received without negotiation\n");
+            return -1;
+        }
+
+        /* decompressed straight into the mapped file if possible */
+        if (ctx->map.write)
+            dst = map_window(ctx, ctx->offset, ctx->rx_hdr.raw_len);
+
+        if (!dst && !zbuf) {
+            zbuf = (char *) malloc(XFER_BLOCK_SIZE);
+            if (!zbuf) {
+                printf("\nError in malloc\n");
+                exit(1);
+            }
+        }
+
+        data = dst ? dst : zbuf;
+        len = decompress_block(ctx->rx_buf, ctx->rx_hdr.wire_len,
+                data, dst ? ctx->rx_hdr.raw_len : XFER_BLOCK_SIZE);
+    } else if (ctx->rx_dst != ctx->rx_buf) {
+        /* received in the mapped file already */
+        data = dst = ctx->rx_dst;
+    }
+
+    if (len < 0 || len != ctx->rx_hdr.raw_len) {
+        printf("Corrupt frame received from peer\n");
+        return -1;
+    }
+
+    /* written in place: the parts of a striped download arrive in any order */
+    if (ctx->dio) {
+        /* bypassing the page cache, the last frame completes the file */
+        if (direct_write(ctx, data, len) < 0 ||
+                (len >= ctx->bytes_remaining && direct_finish(ctx) < 0))
+            return -1;
+    } else if (!dst && pwrite(ctx->file_fd, data, len, ctx->offset) < len) {
+        printf("Error writing to file: %s\n", strerror(errno));
+        return -1;
+    }
+    ctx->offset += len;
+    ctx->wb_pending += len;
+    xfer_write_behind(ctx);
+
+    /* pass the block on, if we are part of a relay chain */
+    if (ctx->relay_id)
+        relay_forward_frame(node, data, len);
+
+done:
+    /* get ready for the next frame */
+    ctx->rx_hdr_len = 0;
+    ctx->rx_len = 0;
+
+    return len;
+}
+
+/*
+ * Function to reserve the disk space of a file being received, so it is
+ * allocated in large extents instead of growing block by block. The
+ * file size is not changed, it still shows how much has been received.
+ *
+ * returns 0 on success (or if the filesystem can't preallocate),
+ * -1 if there is not enough space for the file
+ */
+int xfer_prealloc(int file_fd, uint64_t file_size)
+{
+    if (!file_size || fallocate(file_fd, FALLOC_FL_KEEP_SIZE, 0, file_size) == 0)
+        return 0;
+
+    if (errno == ENOSPC || errno == EFBIG) {
+        printf("Not enough space for the file: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to push the data of a file being received to the disk in
+ * batches of write_behind_mb: the writeback of a batch is started when
+ * it is complete, and the previous batch is waited for. A transfer has
+ * then at most two batches of dirty pages in the page cache, instead of
+ * leaving the kernel to flush gigabytes at once.
+ */
+void xfer_write_behind(struct file_transfer_context *ctx)
+{
+    uint64_t batch = (uint64_t)write_behind_mb << 20;
+
+    if (!batch || ctx->wb_pending < batch)
+        return;
+
+    sync_file_range(ctx->file_fd, ctx->offset - ctx->wb_pending, ctx->wb_pending,
+            SYNC_FILE_RANGE_WRITE);
+
+    if (ctx->wb_prev_len)
+        sync_file_range(ctx->file_fd, ctx->wb_prev_off, ctx->wb_prev_len,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                SYNC_FILE_RANGE_WAIT_AFTER);
+
+    ctx->wb_prev_off = ctx->offset - ctx->wb_pending;
+    ctx->wb_prev_len = ctx->wb_pending;
+    ctx->wb_pending = 0;
+}
+
+/*
+ * Function to tell the kernel how a file being sent is read, called
+ * after each block of len bytes is read (ctx->offset is past it):
+ *  - the range to send is read sequentially,
+ *  - the next readahead_mb are read ahead, in batches of half of it,
+ *  - for a transfer of drop_behind_mb or more, the data already sent is
+ *    dropped from the page cache every DROP_BATCH bytes, so a file much
+ *    larger than the memory does not evict the files which are sent
+ *    often. Smaller files stay cached.
+ */
+void xfer_read_advice(struct file_transfer_context *ctx, int len)
+{
+    uint64_t ahead = (uint64_t)readahead_mb << 20;
+    uint64_t end = ctx->offset + ctx->bytes_remaining;
+
+    if (!ctx->ra_started) {
+        /* the block just read is the first one */
+        posix_fadvise(ctx->file_fd, ctx->offset - len, end - ctx->offset + len,
+                POSIX_FADV_SEQUENTIAL);
+        ctx->ra_started = 1;
+        ctx->ra_end = ctx->offset;
+        ctx->drop_off = ctx->offset - len;
+    }
+
+    if (ahead && ctx->ra_end < end && ctx->ra_end - ctx->offset < ahead / 2) {
+        if (ctx->ra_end < ctx->offset)
+            ctx->ra_end = ctx->offset;
+        ahead = end - ctx->ra_end < ahead ? end - ctx->ra_end : ahead;
+        posix_fadvise(ctx->file_fd, ctx->ra_end, ahead, POSIX_FADV_WILLNEED);
+        ctx->ra_end += ahead;
+    }
+
+    if (drop_behind_mb && ctx->file_size >= ((uint64_t)drop_behind_mb << 20) &&
+            (ctx->offset - ctx->drop_off >= DROP_BATCH || !ctx->bytes_remaining)) {
+        posix_fadvise(ctx->file_fd, ctx->drop_off, ctx->offset - ctx->drop_off,
+                POSIX_FADV_DONTNEED);
+        ctx->drop_off = ctx->offset;
+    }
+}
+
+/*
+ * Function to release the framing state of a transfer context
+ */
+void xfer_reset(struct file_transfer_context *ctx)
+{
+    FREE(ctx->rx_buf);
+    FREE(ctx->tx_buf);
+    ctx->rx_dst = NULL;
+    ctx->tx_data = NULL;
+    ctx->tx_len = 0;
+    ctx->tx_off = 0;
+    ctx->rx_hdr_len = 0;
+    ctx->rx_len = 0;
+    ctx->zskip = 0;
+    ctx->flags = 0;
+    ctx->wb_pending = 0;
+    ctx->wb_prev_off = 0;
+    ctx->wb_prev_len = 0;
+    ctx->ra_started = 0;
+    ctx->ra_end = 0;
+    ctx->drop_off = 0;
+    ctx->data_end = 0;
+    map_release(ctx);
+    direct_release(ctx);
+    hot_put(ctx->hot);
+    ctx->hot = NULL;
+    batch_release(ctx);
+}
@@ -0,0 +1,313 @@
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "proj1.h"
+
+/* Directories waiting to be read by a worker of a tree walk. The worker
+ * takes the last one it queued (depth first), the idle workers steal the
+ * oldest one (the top of a large subtree). */
+struct walk_queue {
+    char **dirs;
+    int head;                    /* oldest directory, taken by thieves */
+    int tail;                    /* next free slot, the owner takes tail - 1 */
+    int size;
+};
+
+/* State of a tree walk shared by its workers */
+struct walk {
+    struct walk_queue q[MAX_BATCH_WORKERS];
+    int nworkers;
+    pthread_mutex_t lock;        /* protects everything in here */
+    pthread_cond_t cond;         /* a directory was queued, or the walk is over */
+    int queued;                  /* directories in the queues */
+    int busy;                    /* directories being read */
+    int errors;                  /* directories which could not be read */
+};
+
+/* A worker of a tree walk, and what it found */
+struct walk_worker {
+    struct walk *w;
+    int id;
+    pthread_t thread;
+    struct walk_entry *entries;
+    int count;
+    int size;
+};
+
+
+/************ Function definitions **************/
+
+/*
+ * Function to add an entry found by a worker
+ */
+static struct walk_entry *walk_add_entry(struct walk_worker *ww, char *path, struct stat *st)
+{
+    if (ww->count == ww->size) {
+        ww->size = ww->size ? 2 * ww->size : 256;
+        ww->entries = (struct walk_entry *) realloc(ww->entries,
+                ww->size * sizeof(struct walk_entry));
+        if (!ww->entries) {
+            printf("\nError in malloc\n");
+            exit(1);
+        }
+    }
+
+    ww->entries[ww->count].path = path;
+    ww->entries[ww->count].st = *st;
+    return &ww->entries[ww->count++];
+}
+
+/*
+ * Function to queue a directory to be read, on the queue of worker id
+ * (called with the lock held)
+ */
+static void walk_push(struct walk *w, int id, char *path)
+{
+    struct walk_queue *q = &w->q[id];
+
+    /* make room at the end, moving the directories left or growing */
+    if (q->tail == q->size) {
+        if (q->head > q->size / 2) {
+            memmove(q->dirs, q->dirs + q->head, (q->tail - q->head) * sizeof(char *));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            q->size = q->size ? 2 * q->size : 64;
+            q->dirs = (char **) realloc(q->dirs, q->size * sizeof(char *));
+            if (!q->dirs) {
+                printf("\nError in malloc\n");
+                exit(1);
+            }
+        }
+    }
+
+    q->dirs[q->tail++] = path;
+    w->queued++;
+    pthread_cond_signal(&w->cond);
+}
+
+/*
+ * Function to get the next directory for worker id to read: the last
+ * one of its own queue, or else the oldest one of another worker
+ * (called with the lock held)
+ *
+ * returns the directory, NULL if all the queues are empty
+ */
+static char *walk_take(struct walk *w, int id)
+{
+    struct walk_queue *q = &w->q[id];
+    int i;
+
+    if (!w->queued)
+        return NULL;
+
+    if (q->tail > q->head) {
+        w->queued--;
+        return q->dirs[--q->tail];
+    }
+
+    for (i = 1; i < w->nworkers; i++) {
+        q = &w->q[(id + i) % w->nworkers];
+        if (q->tail > q->head) {
+            w->queued--;
+            return q->dirs[q->head++];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function to read a directory: its regular files and subdirectories are
+ * added to the entries of the worker, and the subdirectories are queued
+ * to be read in turn. Other kinds of files (symbolic links, devices...)
+ * are left out.
+ */
+static void walk_read_dir(struct walk_worker *ww, char *path)
+{
+    struct walk *w = ww->w;
+    struct dirent *de;
+    struct stat st;
+    char *child = NULL;
+    DIR *dir = NULL;
+
+    dir = opendir(path);
+    if (!dir) {
+        pthread_mutex_lock(&w->lock);
+        w->errors++;
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+                (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)))
+            continue;
+
+        child = (char *) malloc(strlen(path) + strlen(de->d_name) + 2);
+        if (!child) {
+            printf("\nError in malloc\n");
+            exit(1);
+        }
+        sprintf(child, "%s/%s", path, de->d_name);
+        walk_add_entry(ww, child, &st);
+
+        if (S_ISDIR(st.st_mode)) {
+            pthread_mutex_lock(&w->lock);
+            walk_push(w, ww->id, child);
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Function run by a worker of a tree walk, until all the directories
+ * are read
+ */
+static void *walk_worker(void *arg)
+{
+    struct walk_worker *ww = arg;
+    struct walk *w = ww->w;
+    char *path = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        path = walk_take(w, ww->id);
+        if (path) {
+            w->busy++;
+            pthread_mutex_unlock(&w->lock);
+
+            walk_read_dir(ww, path);
+
+            pthread_mutex_lock(&w->lock);
+            w->busy--;
+            continue;
+        }
+
+        /* nothing queued, and nobody may queue more */
+        if (!w->busy)
+            break;
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/*
+ * Function to order the entries of a tree: the directories first, each
+ * one before what it contains, then the files in the order of their
+ * inodes, which is close to their order on the disk for most
+ * filesystems
+ */
+static int walk_entry_cmp(const void *a, const void *b)
+{
+    const struct walk_entry *ea = a, *eb = b;
+
+    if (S_ISDIR(ea->st.st_mode) != S_ISDIR(eb->st.st_mode))
+        return S_ISDIR(ea->st.st_mode) ? -1 : 1;
+
+    if (S_ISDIR(ea->st.st_mode))
+        return strcmp(ea->path, eb->path);
+
+    return (ea->st.st_ino > eb->st.st_ino) - (ea->st.st_ino < eb->st.st_ino);
+}
+
+/*
+ * Function to list the directory root and everything below it, with
+ * threads workers reading the directories in parallel. Each worker reads
+ * the subdirectories it finds itself, and takes work from the others
+ * when it runs out.
+ * entries is set to the directories (root included) and regular files
+ * found, in the order they should be sent (see walk_entry_cmp()), to be
+ * freed with tree_walk_free().
+ *
+ * returns the number of entries, -1 if root can't be read
+ */
+int tree_walk(char *root, int threads, struct walk_entry **entries, int *errors)
+{
+    struct walk w;
+    struct walk_worker ww[MAX_BATCH_WORKERS];
+    struct walk_entry *all = NULL;
+    struct stat st;
+    int i, count = 0, started, rc;
+
+    if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode))
+        return -1;
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_BATCH_WORKERS)
+        threads = MAX_BATCH_WORKERS;
+
+    bzero(&w, sizeof(w));
+    bzero(ww, sizeof(ww));
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.nworkers = threads;
+
+    for (i = 0; i < threads; i++) {
+        ww[i].w = &w;
+        ww[i].id = i;
+    }
+
+    /* the root is the first entry of the first worker */
+    walk_push(&w, 0, walk_add_entry(&ww[0], strdup(root), &st)->path);
+
+    for (i = 0; i < threads; i++) {
+        rc = pthread_create(&ww[i].thread, NULL, walk_worker, &ww[i]);
+        if (rc != 0) {
+            printf("Error starting tree walk worker: %s\n", strerror(rc));
+            break;
+        }
+    }
+    started = i;
+
+    /* the workers started do the whole walk, at worst this thread does */
+    if (!started)
+        walk_worker(&ww[0]);
+
+    for (i = 0; i < started; i++)
+        pthread_join(ww[i].thread, NULL);
+    for (i = 0; i < threads; i++)
+        count += ww[i].count;
+
+    /* gather the entries of all the workers */
+    all = (struct walk_entry *) malloc(count * sizeof(struct walk_entry));
+    if (!all) {
+        printf("\nError in malloc\n");
+        exit(1);
+    }
+    for (count = 0, i = 0; i < threads; i++) {
+        memcpy(all + count, ww[i].entries, ww[i].count * sizeof(struct walk_entry));
+        count += ww[i].count;
+        FREE(ww[i].entries);
+        FREE(w.q[i].dirs);
+    }
+    qsort(all, count, sizeof(struct walk_entry), walk_entry_cmp);
+
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.cond);
+
+    *entries = all;
+    *errors = w.errors;
+    return count;
+}
+
+/*
+ * Function to free the entries of a tree walk
+ */
+void tree_walk_free(struct walk_entry *entries, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        FREE(entries[i].path);
+    FREE(entries);
+}